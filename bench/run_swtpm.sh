@@ -0,0 +1,45 @@
+#!/bin/bash
+# Runs tpm_encrypt_bench against a throwaway swtpm instance, so the host TPM is never touched.
+# Usage: bench/run_swtpm.sh <path to tpm_encrypt_bench> [bench arguments...]
+set -euo pipefail
+
+BENCH=$(realpath "$1")
+shift
+
+WORK=$(mktemp -d)
+SWTPM_PID=""
+cleanup() {
+    if [ -n "$SWTPM_PID" ]; then
+        kill "$SWTPM_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+mkdir -p "$WORK/tpm" "$WORK/system" "$WORK/user" "$WORK/log" "$WORK/scratch"
+
+swtpm socket --tpm2 \
+    --server type=tcp,port=2321 \
+    --ctrl type=tcp,port=2322 \
+    --tpmstate dir="$WORK/tpm" \
+    --flags not-need-init,startup-clear &
+SWTPM_PID=$!
+sleep 1
+
+cat > "$WORK/fapi-config.json" <<CONFIG
+{
+    "profile_name": "P_ECCP256SHA256",
+    "profile_dir": "/etc/tpm2-tss/fapi-profiles/",
+    "user_dir": "$WORK/user",
+    "system_dir": "$WORK/system",
+    "tcti": "swtpm:host=127.0.0.1,port=2321",
+    "system_pcrs": [],
+    "log_dir": "$WORK/log",
+    "ek_cert_less": "yes"
+}
+CONFIG
+export TSS2_FAPICONF="$WORK/fapi-config.json"
+
+# The library keeps its provisioning marker in the working directory, keep that with the throwaway TPM too
+cd "$WORK"
+"$BENCH" --dir "$WORK/scratch" "$@"
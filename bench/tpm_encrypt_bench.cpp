@@ -0,0 +1,452 @@
+/**
+ * Benchmarks the library against whichever TPM FAPI is configured for (normally a local swtpm, see run_swtpm.sh)
+ *
+ * Reports, per payload size, the latency of the cipher on its own (key already cached) and of whole file
+ * operations, with the file I/O share derived from the two. TPM command latency (FAPI init, seal, unseal) is
+ * measured separately since it does not depend on the payload. Results are written as JSON so runs can be
+ * compared between commits.
+ */
+#include "tpm_encrypt/cipher_suite.hpp"
+#include "tpm_encrypt/common.hpp"
+#include "tpm_encrypt/compression.hpp"
+#include "tpm_encrypt/data_decrypt.hpp"
+#include "tpm_encrypt/data_encrypt.hpp"
+#include "tpm_encrypt/key_cache.hpp"
+#include "tpm_encrypt/tpm_session.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace
+{
+    // Command line settings
+    struct BenchOptions
+    {
+        std::vector<uint64_t> sizes{64, 4096, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024};
+        size_t iterations = 0;
+        size_t tpm_iterations = 10;
+        uint64_t max_memory_size = 256 * 1024 * 1024;
+        std::string directory = ".";
+        std::string json_path{};
+        std::string key_reference = "tpm_encrypt_bench";
+        KeyMode key_mode = KeyMode::Envelope;
+        CipherId cipher = CipherId::Auto;
+        CompressionId compression = CompressionId::None;
+        int compression_level = 0;
+        bool esys_unseal = false;
+    };
+
+    // Latency samples of one measurement, in milliseconds
+    struct Samples
+    {
+        std::vector<double> values;
+
+        double Percentile(double fraction) const
+        {
+            if (values.empty())
+            {
+                return 0.0;
+            }
+            std::vector<double> sorted(values);
+            std::sort(sorted.begin(), sorted.end());
+            size_t index = static_cast<size_t>(fraction * static_cast<double>(sorted.size() - 1) + 0.5);
+            return sorted[index];
+        }
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @brief TimeMs Runs an operation and returns how long it took
+     * @returns Milliseconds, negative if the operation failed
+     */
+    template <typename Operation>
+    double TimeMs(Operation &&operation)
+    {
+        Clock::time_point start = Clock::now();
+        bool success = operation();
+        std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+        return success ? elapsed.count() : -1.0;
+    }
+
+    /**
+     * @brief PeakRssKb Largest resident set of the process so far
+     */
+    long PeakRssKb()
+    {
+        struct rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    /**
+     * @brief FillPayload Deterministic, incompressible looking payload
+     */
+    void FillPayload(uint8_t *data, size_t length, uint64_t seed)
+    {
+        uint64_t state = seed * 0x9e3779b97f4a7c15ull + 1;
+        for (size_t i = 0; i < length; i++)
+        {
+            // xorshift64
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            data[i] = static_cast<uint8_t>(state);
+        }
+    }
+
+    /**
+     * @brief WritePayloadFile Creates a payload file of the given size without holding it in memory
+     */
+    bool WritePayloadFile(const std::string &path, uint64_t size)
+    {
+        std::vector<uint8_t> block(std::min<uint64_t>(size, 4 * 1024 * 1024));
+        FillPayload(block.data(), block.size(), size);
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        for (uint64_t written = 0; written < size && file; written += block.size())
+        {
+            file.write(reinterpret_cast<const char *>(block.data()), std::min<uint64_t>(block.size(), size - written));
+        }
+        return static_cast<bool>(file);
+    }
+
+    /**
+     * @brief ParseSize Reads sizes such as 64, 4K, 16M or 2G
+     */
+    bool ParseSize(const std::string &text, uint64_t &size)
+    {
+        char *end = nullptr;
+        unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+        if (end == text.c_str())
+        {
+            return false;
+        }
+
+        switch (*end)
+        {
+        case '\0':
+            break;
+        case 'K':
+        case 'k':
+            value <<= 10;
+            break;
+        case 'M':
+        case 'm':
+            value <<= 20;
+            break;
+        case 'G':
+        case 'g':
+            value <<= 30;
+            break;
+        default:
+            return false;
+        }
+
+        size = value;
+        return true;
+    }
+
+    /**
+     * @brief ParseOptions Reads the command line
+     * @returns False (after printing usage) if it is invalid
+     */
+    bool ParseOptions(int argc, char *argv[], BenchOptions &options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string argument = argv[i];
+            std::string value = i + 1 < argc ? argv[i + 1] : "";
+            bool has_value = i + 1 < argc;
+
+            if (argument == "--sizes" && has_value)
+            {
+                options.sizes.clear();
+                std::stringstream list(value);
+                std::string item;
+                while (std::getline(list, item, ','))
+                {
+                    uint64_t size = 0;
+                    if (!ParseSize(item, size))
+                    {
+                        std::cerr << "Invalid size: " << item << std::endl;
+                        return false;
+                    }
+                    options.sizes.push_back(size);
+                }
+                i++;
+            }
+            else if (argument == "--iterations" && has_value)
+            {
+                options.iterations = std::stoul(value);
+                i++;
+            }
+            else if (argument == "--tpm-iterations" && has_value)
+            {
+                options.tpm_iterations = std::stoul(value);
+                i++;
+            }
+            else if (argument == "--max-memory-size" && has_value && ParseSize(value, options.max_memory_size))
+            {
+                i++;
+            }
+            else if (argument == "--dir" && has_value)
+            {
+                options.directory = value;
+                i++;
+            }
+            else if (argument == "--json" && has_value)
+            {
+                options.json_path = value;
+                i++;
+            }
+            else if (argument == "--reference" && has_value)
+            {
+                options.key_reference = value;
+                i++;
+            }
+            else if (argument == "--key-mode" && (value == "sealed" || value == "envelope"))
+            {
+                options.key_mode = value == "sealed" ? KeyMode::Sealed : KeyMode::Envelope;
+                i++;
+            }
+            else if (argument == "--cipher" && has_value && CipherSuite::Parse(value, options.cipher))
+            {
+                i++;
+            }
+            else if (argument == "--compression" && has_value && Compression::Parse(value, options.compression))
+            {
+                i++;
+            }
+            else if (argument == "--compression-level" && has_value)
+            {
+                options.compression_level = std::stoi(value);
+                i++;
+            }
+            else if (argument == "--esys-unseal")
+            {
+                options.esys_unseal = true;
+            }
+            else
+            {
+                std::cerr << "Usage: " << argv[0] << " [--sizes 64,4K,1M,4G] [--iterations N] [--tpm-iterations N]\n"
+                          << "       [--max-memory-size 256M] [--dir scratch_dir] [--json results.json]\n"
+                          << "       [--reference name] [--key-mode sealed|envelope]\n"
+                          << "       [--cipher auto|aes-256-gcm|aes-128-gcm|aes-256-ctr-hmac-sha256|chacha20-poly1305]\n"
+                          << "       [--compression none|zstd|lz4] [--compression-level N] [--esys-unseal]" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief IterationsFor Enough runs for stable percentiles on small payloads without taking hours on large ones
+     */
+    size_t IterationsFor(const BenchOptions &options, uint64_t size)
+    {
+        if (options.iterations != 0)
+        {
+            return options.iterations;
+        }
+        if (size <= 64 * 1024)
+        {
+            return 200;
+        }
+        if (size <= 16 * 1024 * 1024)
+        {
+            return 20;
+        }
+        return 3;
+    }
+
+    /**
+     * @brief AppendSamples Writes one measurement as a JSON object member
+     */
+    void AppendSamples(std::ostream &json, const std::string &name, const Samples &samples, uint64_t bytes, bool last)
+    {
+        double p50 = samples.Percentile(0.5);
+        double throughput = p50 > 0.0 ? static_cast<double>(bytes) / (1024.0 * 1024.0) / (p50 / 1000.0) : 0.0;
+        json << "      \"" << name << "\": {\"runs\": " << samples.values.size()
+             << ", \"p50_ms\": " << p50
+             << ", \"p99_ms\": " << samples.Percentile(0.99)
+             << ", \"throughput_mib_s\": " << throughput << "}" << (last ? "\n" : ",\n");
+    }
+}
+
+// Entrypoint into the benchmark
+int main(int argc, char *argv[])
+{
+    BenchOptions options{};
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    EncryptOptions encrypt_options{};
+    encrypt_options.key_mode = options.key_mode;
+    encrypt_options.cipher = options.cipher;
+    encrypt_options.compression = options.compression;
+    encrypt_options.compression_level = options.compression_level;
+
+    // The library reports progress on stdout, which is where the results go, so it is muted until then
+    std::streambuf *stdout_buffer = std::cout.rdbuf(nullptr);
+
+    std::ostringstream json{};
+    CipherId cipher = options.cipher == CipherId::Auto ? CipherSuite::Preferred() : options.cipher;
+    json << "{\n  \"key_mode\": \"" << (options.key_mode == KeyMode::Sealed ? "sealed" : "envelope") << "\",\n";
+    json << "  \"cipher\": \"" << CipherSuite::Name(cipher) << "\",\n";
+    json << "  \"compression\": \"" << Compression::Name(options.compression) << "\",\n";
+    json << "  \"esys_unseal\": " << (options.esys_unseal ? "true" : "false") << ",\n";
+
+    // TPM commands, independent of the payload
+    Samples init_samples{};
+    Samples seal_samples{};
+    Samples unseal_samples{};
+    Samples unseal_repeat_samples{};
+    std::string sealed_path = "/HS/SRK/" + options.key_reference + "_bench";
+    try
+    {
+        TpmSession &session = TpmSession::Instance();
+        session.SetEsysUnseal(options.esys_unseal);
+        for (size_t i = 0; i < options.tpm_iterations; i++)
+        {
+            session.Close();
+            init_samples.values.push_back(TimeMs([&session]()
+                                                 { session.Connect(); return true; }));
+
+            std::vector<uint8_t> secret(32);
+            Common::GetRandomData(secret.data(), secret.size());
+            session.Delete(sealed_path);
+            seal_samples.values.push_back(TimeMs([&]()
+                                                 { return session.CreateSeal(sealed_path, secret.data(), secret.size()); }));
+
+            SecureBytes unsealed{};
+            unseal_samples.values.push_back(TimeMs([&]()
+                                                   { return session.Unseal(sealed_path, unsealed); }));
+
+            // The same object again, what the ESYS fast path keeps loaded
+            unseal_repeat_samples.values.push_back(TimeMs([&]()
+                                                          { return session.Unseal(sealed_path, unsealed); }));
+        }
+        session.Delete(sealed_path);
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cout.rdbuf(stdout_buffer);
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    json << "  \"tpm\": {\n";
+    AppendSamples(json, "fapi_init", init_samples, 0, false);
+    AppendSamples(json, "seal", seal_samples, 0, false);
+    AppendSamples(json, "unseal", unseal_samples, 0, false);
+    AppendSamples(json, "unseal_repeat", unseal_repeat_samples, 0, true);
+    json << "  },\n  \"payloads\": [\n";
+
+    std::filesystem::create_directories(options.directory);
+    std::string plain_path = options.directory + "/bench_plain.bin";
+    std::string encrypted_path = options.directory + "/bench_encrypted.bin";
+    std::string decrypted_path = options.directory + "/bench_decrypted.bin";
+
+    // One untimed operation puts the key in the cache, so the payload runs measure the cipher and I/O only
+    std::string warm_plaintext(16, 'w');
+    std::string warm_ciphertext{};
+    if (!DataEncrypt::EncryptData(warm_plaintext, warm_ciphertext, options.key_reference, encrypt_options))
+    {
+        std::cout.rdbuf(stdout_buffer);
+        std::cerr << "Unable to encrypt with key reference: " << options.key_reference << std::endl;
+        return 1;
+    }
+
+    bool success = true;
+    for (size_t size_index = 0; size_index < options.sizes.size() && success; size_index++)
+    {
+        uint64_t size = options.sizes[size_index];
+        size_t iterations = IterationsFor(options, size);
+        std::cerr << "Payload " << size << " bytes, " << iterations << " runs" << std::endl;
+
+        Samples encrypt_data{};
+        Samples decrypt_data{};
+        if (size <= options.max_memory_size)
+        {
+            std::string plaintext(size, '\0');
+            FillPayload(reinterpret_cast<uint8_t *>(&plaintext[0]), plaintext.size(), size);
+            std::string ciphertext{};
+            std::string decrypted{};
+
+            for (size_t i = 0; i < iterations && success; i++)
+            {
+                double encrypt_ms = TimeMs([&]()
+                                           { return DataEncrypt::EncryptData(plaintext, ciphertext, options.key_reference, encrypt_options); });
+                double decrypt_ms = TimeMs([&]()
+                                           { return DataDecrypt::DecryptData(ciphertext, decrypted, options.key_reference); });
+                success = encrypt_ms >= 0.0 && decrypt_ms >= 0.0 && decrypted == plaintext;
+                encrypt_data.values.push_back(encrypt_ms);
+                decrypt_data.values.push_back(decrypt_ms);
+            }
+        }
+
+        Samples encrypt_file{};
+        Samples decrypt_file{};
+        success = success && WritePayloadFile(plain_path, size);
+        for (size_t i = 0; i < iterations && success; i++)
+        {
+            double encrypt_ms = TimeMs([&]()
+                                       { return DataEncrypt::EncryptFile(plain_path, encrypted_path, options.key_reference, encrypt_options); });
+            double decrypt_ms = TimeMs([&]()
+                                       { return DataDecrypt::DecryptFile(encrypted_path, decrypted_path, options.key_reference); });
+            success = encrypt_ms >= 0.0 && decrypt_ms >= 0.0;
+            encrypt_file.values.push_back(encrypt_ms);
+            decrypt_file.values.push_back(decrypt_ms);
+        }
+
+        // File operations are the cipher plus file I/O, what the in-memory runs did not spend is I/O
+        double file_io_ms = std::max(0.0, encrypt_file.Percentile(0.5) - encrypt_data.Percentile(0.5)) +
+                            std::max(0.0, decrypt_file.Percentile(0.5) - decrypt_data.Percentile(0.5));
+        if (encrypt_data.values.empty())
+        {
+            file_io_ms = -1.0;
+        }
+
+        json << "    {\n      \"bytes\": " << size << ",\n";
+        AppendSamples(json, "encrypt_data", encrypt_data, size, false);
+        AppendSamples(json, "decrypt_data", decrypt_data, size, false);
+        AppendSamples(json, "encrypt_file", encrypt_file, size, false);
+        AppendSamples(json, "decrypt_file", decrypt_file, size, false);
+        json << "      \"file_io_p50_ms\": " << file_io_ms << ",\n";
+        json << "      \"peak_rss_kb\": " << PeakRssKb() << "\n";
+        json << "    }" << (size_index + 1 < options.sizes.size() ? ",\n" : "\n");
+    }
+
+    json << "  ],\n  \"success\": " << (success ? "true" : "false") << "\n}\n";
+
+    std::error_code error{};
+    std::filesystem::remove(plain_path, error);
+    std::filesystem::remove(encrypted_path, error);
+    std::filesystem::remove(decrypted_path, error);
+
+    std::cout.rdbuf(stdout_buffer);
+    if (options.json_path.empty())
+    {
+        std::cout << json.str();
+    }
+    else
+    {
+        std::ofstream json_file(options.json_path, std::ios::trunc);
+        json_file << json.str();
+    }
+
+    return success ? 0 : 1;
+}
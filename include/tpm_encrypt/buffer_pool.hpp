@@ -0,0 +1,168 @@
+/**
+ * Process wide pool of chunk, record and window buffers for the file and stream paths
+ *
+ * Buffers come in fixed size classes, four per power of two from kMinBufferLength, so a request is rounded up
+ * by at most a quarter. Classes below kBlockLength are carved out of kBlockLength blocks, larger ones are mapped
+ * one at a time; either way the memory is page (and where possible huge page) aligned and faulted in when it is
+ * mapped. Returned buffers are kept for the next request, nothing is unmapped, so once a workload has warmed the
+ * pool it neither allocates nor takes page faults. Memory beyond the cap is allocated per request and freed when
+ * it is returned.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Where the pool's memory comes from
+enum class HugePages : uint8_t
+{
+    None,        // Normal pages
+    Transparent, // Normal pages, 2 MB aligned and marked for transparent huge pages
+    Explicit     // Reserved huge pages (vm.nr_hugepages), normal ones when none are free
+};
+
+class BufferPool;
+
+// A buffer borrowed from the pool, given back when destroyed. Its contents are not initialised
+class PooledBuffer
+{
+public:
+    PooledBuffer() = default;
+
+    /**
+     * @brief ~PooledBuffer Returns the buffer to the pool
+     */
+    ~PooledBuffer();
+
+    PooledBuffer(PooledBuffer &&other) noexcept;
+    PooledBuffer &operator=(PooledBuffer &&other) noexcept;
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+
+    /**
+     * @brief Data Start of the buffer, null if none is held
+     */
+    uint8_t *Data() const { return data_; }
+
+    /**
+     * @brief Length Bytes requested, the buffer may be larger
+     */
+    size_t Length() const { return length_; }
+
+    /**
+     * @brief Reset Returns the buffer to the pool early
+     */
+    void Reset();
+
+private:
+    friend class BufferPool;
+
+    uint8_t *data_ = nullptr;
+    size_t length_ = 0;
+
+    // Size class it came from, kUnpooled if it was allocated on its own
+    size_t size_class_ = 0;
+};
+
+class BufferPool
+{
+public:
+    // Memory is mapped in blocks of this size, the usual huge page size
+    static constexpr size_t kBlockLength = 2 * 1024 * 1024;
+
+    // Smallest buffer handed out, the default chunk size
+    static constexpr size_t kMinBufferLength = 64 * 1024;
+
+    // Size classes, the largest holds a window of the largest chunks
+    static constexpr size_t kClassCount = 48;
+
+    // Memory the pool keeps unless Configure says otherwise
+    static constexpr size_t kDefaultMaxBytes = 1024ull * 1024 * 1024;
+
+    // Counters describing how the pool is used
+    struct Stats
+    {
+        size_t reserved_bytes;
+        size_t in_use_bytes;
+        size_t buffers_in_use;
+        uint64_t acquires;
+        uint64_t overflows;
+
+        // Part of reserved_bytes in explicit huge pages, transparent ones are up to the kernel
+        size_t huge_page_bytes;
+    };
+
+    /**
+     * @brief Shared Returns the process wide pool
+     */
+    static BufferPool &Shared();
+
+    /**
+     * @brief Configure Sets how much memory the pool keeps and where it comes from
+     * @details Applies to memory mapped from now on, what the pool already holds is kept
+     * @param[in] max_bytes Most memory reserved, requests beyond it are allocated on their own
+     * @param[in] huge_pages Page size to back the pool with
+     */
+    void Configure(size_t max_bytes, HugePages huge_pages);
+
+    /**
+     * @brief Acquire Borrows a buffer of at least a given length
+     * @param[in] length Bytes needed
+     * @returns The buffer, std::bad_alloc is thrown if there is no memory
+     */
+    PooledBuffer Acquire(size_t length);
+
+    /**
+     * @brief GetStats Returns how much memory is reserved and borrowed
+     */
+    Stats GetStats() const;
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+private:
+    friend class PooledBuffer;
+
+    // Size class of buffers allocated on their own
+    static constexpr size_t kUnpooled = kClassCount;
+
+    BufferPool() = default;
+
+    /**
+     * @brief ClassLength Bytes in a buffer of a size class
+     */
+    static size_t ClassLength(size_t size_class);
+
+    /**
+     * @brief Grow Maps memory for more buffers of a size class
+     * @note The caller must hold mutex_
+     * @returns False if the cap leaves no room or mapping failed
+     */
+    bool Grow(size_t size_class);
+
+    /**
+     * @brief Map Maps, aligns and faults in memory for the pool
+     * @note The caller must hold mutex_
+     * @returns The memory, null on failure
+     */
+    uint8_t *Map(size_t length);
+
+    /**
+     * @brief Return Takes a buffer back
+     */
+    void Return(uint8_t *data, size_t size_class);
+
+    mutable std::mutex mutex_;
+    std::vector<uint8_t *> free_[kClassCount];
+
+    size_t max_bytes_ = kDefaultMaxBytes;
+    HugePages huge_pages_ = HugePages::Transparent;
+    size_t reserved_bytes_ = 0;
+    size_t in_use_bytes_ = 0;
+    size_t buffers_in_use_ = 0;
+    size_t huge_page_bytes_ = 0;
+    uint64_t acquires_ = 0;
+    uint64_t overflows_ = 0;
+};
@@ -0,0 +1,176 @@
+/**
+ * Authenticated encryption of individual container chunks
+ *
+ * Record layout (integers little endian):
+ *   payload length u32 | flags u32 | ciphertext (payload length bytes) | tag (16 bytes)
+ *
+ * Chunk i is encrypted under the header nonce XOR i (big endian, low 8 bytes) with the header AAD and the
+ * record header as additional data, by the suite the header names (see CipherSuite). The last chunk carries kChunkFinal, so dropping, reordering or splicing
+ * chunks between files all fail authentication.
+ *
+ * Containers with ContainerFormat::kFlagRecordNonces instead give every record its own random nonce, stored behind
+ * the record header, and bind it to its place by authenticating the chunk index (u64) after the record header:
+ *   payload length u32 | flags u32 | nonce (12 bytes) | ciphertext | tag
+ * Any one record can then be replaced under the same key without a nonce ever repeating, see IncrementalEncrypt.
+ *
+ * In containers with compression, a record carrying kChunkCompressed holds the compressed chunk, which is shorter
+ * than the chunk it restores to. Records of incompressible chunks hold the chunk as is.
+ */
+#pragma once
+
+#include "tpm_encrypt/container_format.hpp"
+#include "tpm_encrypt/secure_arena.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class ChunkCipher
+{
+public:
+    static constexpr size_t kNonceLength = 12;
+    static constexpr size_t kTagLength = 16;
+    static constexpr size_t kRecordHeaderLength = 8;
+
+    // Record flags
+    static constexpr uint32_t kChunkFinal = 0x1;
+    static constexpr uint32_t kChunkCompressed = 0x2;
+
+    /**
+     * @brief RecordLength Size of the record holding a chunk of the given plaintext length
+     */
+    static size_t RecordLength(size_t plaintext_length)
+    {
+        return kRecordHeaderLength + plaintext_length + kTagLength;
+    }
+
+    /**
+     * @brief RecordLength Size of the record holding a payload of the given length in a container
+     * @details Records of containers with ContainerFormat::kFlagRecordNonces also carry their nonce
+     */
+    static size_t RecordLength(const ContainerHeader &header, size_t payload_length)
+    {
+        return RecordLength(payload_length) + ((header.flags & ContainerFormat::kFlagRecordNonces) != 0 ? kNonceLength : 0);
+    }
+
+    /**
+     * @brief ChunkCount Number of chunks holding some plaintext, empty plaintext still takes one (final, empty) chunk
+     */
+    static uint64_t ChunkCount(uint64_t plaintext_length, uint32_t chunk_size)
+    {
+        return plaintext_length == 0 ? 1 : (plaintext_length + chunk_size - 1) / chunk_size;
+    }
+
+    /**
+     * @brief SealChunk Encrypts and authenticates one chunk
+     * @param[in] header Container header, supplies the cipher and base nonce
+     * @param[in] key The chunk key, see CipherSuite::DeriveChunkKey
+     * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+     * @param[in] index Position of the chunk in the container
+     * @param[in] final Whether this is the last chunk
+     * @param[in] plaintext The chunk plaintext
+     * @param[in] plaintext_length Length of plaintext, at most header.chunk_size
+     * @param[out] record_out Receives RecordLength(header, plaintext_length) bytes
+     * @returns Success
+     */
+    static bool SealChunk(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                          uint64_t index, bool final, const uint8_t *plaintext, size_t plaintext_length, uint8_t *record_out);
+
+    /**
+     * @brief SealChunk Compresses (if the header asks for it and it pays off), encrypts and authenticates one chunk
+     * @param[in] header Container header, supplies the cipher, compression and base nonce
+     * @param[in] key The chunk key, see CipherSuite::DeriveChunkKey
+     * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+     * @param[in] index Position of the chunk in the container
+     * @param[in] final Whether this is the last chunk
+     * @param[in] plaintext The chunk plaintext
+     * @param[in] plaintext_length Length of plaintext, at most header.chunk_size
+     * @param[in] compression_level Level for the header's compression, see Compression::Compress
+     * @param[out] record_out Receives the record, at most RecordLength(header, plaintext_length) bytes
+     * @param[out] record_length Bytes the record occupies
+     * @returns Success
+     */
+    static bool SealChunk(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                          uint64_t index, bool final, const uint8_t *plaintext, size_t plaintext_length, int compression_level,
+                          uint8_t *record_out, size_t &record_length);
+
+    /**
+     * @brief OpenChunk Authenticates and decrypts one chunk
+     * @param[in] header Container header, supplies the cipher and base nonce
+     * @param[in] key The chunk key, see CipherSuite::DeriveChunkKey
+     * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+     * @param[in] index Position of the chunk in the container
+     * @param[in] record The record, starting at its record header
+     * @param[in] available Bytes readable at record
+     * @param[out] plaintext_out Receives the plaintext
+     * @param[in] plaintext_capacity Bytes available at plaintext_out, header.chunk_size is always enough
+     * @param[out] plaintext_length Length of the plaintext
+     * @param[out] final Whether this was the last chunk
+     * @param[out] record_length Bytes the record occupied
+     * @returns False if the record is malformed or fails authentication
+     */
+    static bool OpenChunk(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                          uint64_t index, const uint8_t *record, size_t available,
+                          uint8_t *plaintext_out, size_t plaintext_capacity, size_t &plaintext_length, bool &final, size_t &record_length);
+
+    /**
+     * @brief VerifyChunk Authenticates one chunk without handing out its plaintext
+     * @details HMAC suites only check the tag. AEAD suites can only check it by decrypting, that is done a slice at a
+     *          time through a small stack buffer that is wiped afterwards, so nothing the size of a chunk is written.
+     *          Compressed payloads are decrypted and restored into per thread scratch, wiped afterwards, and must
+     *          restore to a full chunk unless final, as OpenChunk requires
+     * @param[in] header Container header, supplies the cipher and base nonce
+     * @param[in] key The chunk key, see CipherSuite::DeriveChunkKey
+     * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+     * @param[in] index Position of the chunk in the container
+     * @param[in] record The record, starting at its record header
+     * @param[in] available Bytes readable at record
+     * @param[out] plaintext_length Length the chunk restores to
+     * @param[out] final Whether this was the last chunk
+     * @param[out] record_length Bytes the record occupied
+     * @returns False if the record is malformed, fails authentication or does not restore to a whole chunk
+     */
+    static bool VerifyChunk(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                            uint64_t index, const uint8_t *record, size_t available, size_t &plaintext_length, bool &final, size_t &record_length);
+
+    /**
+     * @brief ReadRecordHeader Decodes the record header, so callers can find the end of the record
+     * @param[in] header Container header
+     * @param[in] record The record
+     * @param[in] available Bytes readable at record, at least kRecordHeaderLength
+     * @param[out] payload_length Ciphertext bytes in the record
+     * @param[out] flags Record flags
+     * @returns False if the record header is invalid for this container
+     */
+    static bool ReadRecordHeader(const ContainerHeader &header, const uint8_t *record, size_t available,
+                                 uint32_t &payload_length, uint32_t &flags);
+
+private:
+    /**
+     * @brief SealPayload Writes the record header and encrypts a payload (the chunk, or the compressed chunk) behind it
+     * @returns Success
+     */
+    static bool SealPayload(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                            uint64_t index, uint32_t flags, const uint8_t *payload, size_t payload_length, uint8_t *record_out);
+
+    /**
+     * @brief LocatePayload Checks a record against the container and finds its nonce and ciphertext
+     * @returns False if the record is malformed or the key does not suit the header
+     */
+    static bool LocatePayload(const ContainerHeader &header, const SecureBytes &key, uint64_t index, const uint8_t *record, size_t available,
+                              uint32_t &payload_length, uint32_t &flags, size_t &record_length, uint8_t nonce_out[kNonceLength], const uint8_t *&ciphertext);
+
+    // Record header and chunk index, the most RecordAad writes
+    static constexpr size_t kMaxRecordAadLength = kRecordHeaderLength + 8;
+
+    /**
+     * @brief RecordAad Record part of the additional data: the record header, then with record nonces the chunk index
+     * @returns Bytes written to record_aad_out
+     */
+    static size_t RecordAad(const ContainerHeader &header, uint64_t index, const uint8_t *record, uint8_t record_aad_out[kMaxRecordAadLength]);
+
+    /**
+     * @brief ChunkNonce Derives the nonce of a chunk from the header nonce and the chunk index
+     */
+    static void ChunkNonce(const ContainerHeader &header, uint64_t index, uint8_t nonce_out[kNonceLength]);
+};
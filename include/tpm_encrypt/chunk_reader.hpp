@@ -0,0 +1,208 @@
+/**
+ * Random access to the plaintext of an encrypted file
+ *
+ * Records of a container sit at fixed strides (compressed containers are indexed once, from their record headers),
+ * so a read only authenticates and decrypts the chunks covering it: reading 4 KB from the middle of a 20 GB file
+ * costs one chunk, not the file. The file is mapped, only the records read are faulted in.
+ */
+#pragma once
+
+#include "tpm_encrypt/container_format.hpp"
+#include "tpm_encrypt/file_io.hpp"
+#include "tpm_encrypt/secure_arena.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// Reads ranges of the plaintext of an encrypted file, not thread safe (use one per thread)
+class ChunkReader
+{
+public:
+    ChunkReader() = default;
+
+    /**
+     * @brief ~ChunkReader Wipes the key and any cached plaintext
+     */
+    ~ChunkReader();
+
+    /**
+     * @brief Open Maps an encrypted file, recovers its key and locates its records, nothing is decrypted yet
+     * @details Compressed containers whose length was never patched into the header (streamed to a pipe) have
+     *          their final chunk decrypted here, to learn the length
+     * @param[in] path_in Encrypted file, a chunked container (legacy ciphertext has no chunks to seek to)
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @returns Success
+     */
+    bool Open(const std::string &path_in, const std::string &key_reference);
+
+    /**
+     * @brief Read Authenticates and decrypts the chunks covering a range of the plaintext
+     * @details Ranges reaching the end of the plaintext always authenticate the final chunk, so a truncated file
+     *          fails rather than reading short. On failure data_out holds no plaintext
+     * @param[in] offset Start of the range in the plaintext
+     * @param[out] data_out Receives the plaintext of the range
+     * @param[in] length Length of the range, clipped to the end of the plaintext
+     * @param[out] read_length Bytes written to data_out, less than length only at the end of the plaintext
+     * @returns False if the reader is not open or a chunk fails authentication
+     */
+    bool Read(uint64_t offset, uint8_t *data_out, size_t length, size_t &read_length);
+
+    /**
+     * @brief Size Length of the plaintext
+     */
+    uint64_t Size() const;
+
+    /**
+     * @brief ChunkSize Plaintext bytes per chunk, reads aligned to it decrypt whole chunks
+     */
+    uint32_t ChunkSize() const;
+
+    /**
+     * @brief IsOpen Whether Open succeeded
+     */
+    bool IsOpen() const;
+
+    /**
+     * @brief Close Unmaps the file and wipes the key and cached plaintext
+     */
+    void Close();
+
+    ChunkReader(const ChunkReader &) = delete;
+    ChunkReader &operator=(const ChunkReader &) = delete;
+
+private:
+    // Marks the chunk cache empty
+    static constexpr size_t kNoChunk = SIZE_MAX;
+
+    /**
+     * @brief LoadChunk Decrypts one chunk into the cache, unless it is cached already
+     * @returns False if the chunk fails authentication
+     */
+    bool LoadChunk(size_t index);
+
+    /**
+     * @brief OpenFinal Authenticates the final chunk, which confirms the length of the plaintext
+     * @returns False if the final chunk fails authentication or disagrees with the length
+     */
+    bool OpenFinal();
+
+    /**
+     * @brief RecordOffset Position of a record (or, for chunk_count_, of the end of the records)
+     */
+    size_t RecordOffset(size_t index) const;
+
+    std::unique_ptr<MappedFile> file_;
+    ContainerHeader header_{};
+    size_t header_length_ = 0;
+    SecureBytes key_;
+    std::string header_aad_;
+
+    // Located records, offsets only for compressed containers (others have fixed strides)
+    const uint8_t *records_ = nullptr;
+    size_t records_length_ = 0;
+    size_t chunk_count_ = 0;
+    std::vector<size_t> record_offsets_;
+
+    // Plaintext length, only an upper bound until the final chunk is opened if size_known_ is false
+    uint64_t size_ = 0;
+    bool size_known_ = false;
+    bool final_opened_ = false;
+
+    // Most recently decrypted partial read, so small sequential reads decrypt each chunk once
+    PooledBuffer chunk_;
+    size_t chunk_index_ = kNoChunk;
+    size_t chunk_length_ = 0;
+};
+
+// Read only, seekable stream buffer over the plaintext of an encrypted file
+class DecryptedStreambuf : public std::streambuf
+{
+public:
+    DecryptedStreambuf() = default;
+
+    /**
+     * @brief ~DecryptedStreambuf Wipes the buffered plaintext
+     */
+    ~DecryptedStreambuf() override;
+
+    /**
+     * @brief Open Opens an encrypted file for reading, see ChunkReader::Open
+     * @returns Success
+     */
+    bool Open(const std::string &path_in, const std::string &key_reference);
+
+    /**
+     * @brief Size Length of the plaintext
+     */
+    uint64_t Size() const;
+
+protected:
+    /**
+     * @brief underflow Decrypts the chunk at the read position
+     * @throws std::runtime_error if the chunk fails authentication, which an istream turns into badbit
+     */
+    int_type underflow() override;
+
+    /**
+     * @brief xsgetn Reads large requests straight into the caller's buffer, several chunks in parallel
+     * @throws std::runtime_error if a chunk fails authentication, which an istream turns into badbit
+     */
+    std::streamsize xsgetn(char_type *data_out, std::streamsize length) override;
+
+    /**
+     * @brief seekoff Moves the read position, within the buffered chunk nothing is decrypted again
+     */
+    pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) override;
+
+    /**
+     * @brief seekpos Moves the read position to an absolute offset
+     */
+    pos_type seekpos(pos_type position, std::ios_base::openmode which) override;
+
+    /**
+     * @brief showmanyc Bytes left before the end of the plaintext
+     */
+    std::streamsize showmanyc() override;
+
+private:
+    /**
+     * @brief Position Offset in the plaintext of the next byte to be read
+     */
+    uint64_t Position() const;
+
+    /**
+     * @brief Buffer Replaces the buffered chunk with an empty one starting at an offset
+     */
+    void Buffer(uint64_t position);
+
+    ChunkReader reader_;
+
+    // One chunk of plaintext, the get area, ending at buffer_end_ in the plaintext
+    PooledBuffer buffer_;
+    uint64_t buffer_end_ = 0;
+};
+
+// std::istream over the plaintext of an encrypted file, failbit is set if it cannot be opened
+class DecryptedIstream : public std::istream
+{
+public:
+    /**
+     * @brief DecryptedIstream Opens an encrypted file for reading
+     * @param[in] path_in Encrypted file, a chunked container
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     */
+    DecryptedIstream(const std::string &path_in, const std::string &key_reference);
+
+    /**
+     * @brief Size Length of the plaintext
+     */
+    uint64_t Size() const;
+
+private:
+    DecryptedStreambuf buffer_;
+};
@@ -0,0 +1,91 @@
+/**
+ * Cipher setup shared by every encryption and decryption: cipher implementations are fetched once per process and
+ * each thread keeps a few keyed contexts, so a message under a recently used key only needs its new iv
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+
+#include <openssl/evp.h>
+
+class CipherEngine
+{
+public:
+    // Keyed contexts each thread keeps, one per recently used cipher, direction and key
+    static constexpr size_t kContextsPerThread = 4;
+
+    // Longest key a context can be keyed with (AES-256, ChaCha20)
+    static constexpr size_t kMaxKeyLength = 32;
+
+    // Output of HmacSha256
+    static constexpr size_t kHmacSha256Length = 32;
+
+    // Output of Sha256
+    static constexpr size_t kSha256Length = 32;
+
+    // One piece of a message passed to HmacSha256
+    struct MacPart
+    {
+        const uint8_t *data;
+        size_t length;
+    };
+
+    /**
+     * @brief Aes256Gcm AES-256-GCM, fetched from the provider on first use
+     */
+    static const EVP_CIPHER *Aes256Gcm();
+
+    /**
+     * @brief Aes128Gcm AES-128-GCM, fetched from the provider on first use
+     */
+    static const EVP_CIPHER *Aes128Gcm();
+
+    /**
+     * @brief Aes256Ctr AES-256-CTR, fetched from the provider on first use
+     */
+    static const EVP_CIPHER *Aes256Ctr();
+
+    /**
+     * @brief ChaCha20Poly1305 ChaCha20-Poly1305, fetched from the provider on first use
+     * @returns Null if the provider lacks it (e.g. FIPS only builds)
+     */
+    static const EVP_CIPHER *ChaCha20Poly1305();
+
+    /**
+     * @brief Aes256Cbc AES-256-CBC (legacy data only), fetched from the provider on first use
+     */
+    static const EVP_CIPHER *Aes256Cbc();
+
+    /**
+     * @brief Context A context of the calling thread, ready to process a new message
+     * @details Contexts are reset rather than reallocated, and one already keyed with this key keeps its key schedule.
+     *          The engine owns every context, callers never free them
+     * @param[in] cipher Cipher from Aes256Gcm or Aes256Cbc
+     * @param[in] encrypt True to encrypt, false to decrypt
+     * @param[in] key The key, of the cipher's key length
+     * @param[in] iv The iv/nonce of the message, of the cipher's iv length
+     * @returns The context, valid until the calling thread's next call to Context. Null on failure
+     */
+    static EVP_CIPHER_CTX *Context(const EVP_CIPHER *cipher, bool encrypt, const uint8_t *key, const uint8_t *iv);
+
+    /**
+     * @brief HmacSha256 HMAC-SHA256 of a message given in pieces, using a context kept by the calling thread
+     * @param[in] key The MAC key
+     * @param[in] key_length Length of key
+     * @param[in] parts The message, authenticated as the concatenation of the parts
+     * @param[out] mac_out Receives kHmacSha256Length bytes
+     * @returns Success
+     */
+    static bool HmacSha256(const uint8_t *key, size_t key_length, std::initializer_list<MacPart> parts, uint8_t *mac_out);
+
+    /**
+     * @brief Sha256 SHA-256 of a message, the digest is fetched once and each thread keeps its own context
+     * @param[in] data The message
+     * @param[in] length Length of data
+     * @param[out] digest_out Receives kSha256Length bytes
+     * @returns Success
+     */
+    static bool Sha256(const uint8_t *data, size_t length, uint8_t *digest_out);
+};
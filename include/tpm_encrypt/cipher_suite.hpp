@@ -0,0 +1,98 @@
+/**
+ * Cipher suites a container can be encrypted with, and the choice of a default for the host
+ *
+ * The data key (sealed or wrapped, always 32 bytes) is used as is by Aes256Gcm, so containers written before
+ * suites could be chosen still decrypt. Every other suite runs on a chunk key derived from the data key with
+ * HKDF-SHA256, labelled with the suite, so one sealed key never feeds two different ciphers.
+ */
+#pragma once
+
+#include "tpm_encrypt/container_format.hpp"
+#include "tpm_encrypt/secure_arena.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+
+// Crypto instructions of the host that decide which suite is fastest
+struct CpuFeatures
+{
+    // AES rounds in hardware (AES-NI, ARMv8 AES)
+    bool aes = false;
+    // Carry-less multiply for GHASH (PCLMULQDQ, ARMv8 PMULL)
+    bool clmul = false;
+    // Wide vector forms of the above (VAES, VPCLMULQDQ)
+    bool vaes = false;
+    bool vclmul = false;
+};
+
+class CipherSuite
+{
+public:
+    // Length of the data key every suite starts from
+    static constexpr size_t kDataKeyLength = 32;
+
+    // Longest chunk key of any suite (Aes256CtrHmacSha256: cipher key then MAC key)
+    static constexpr size_t kMaxChunkKeyLength = 64;
+
+    /**
+     * @brief DetectCpu Reads the host's crypto instructions, once per process
+     */
+    static const CpuFeatures &DetectCpu();
+
+    /**
+     * @brief Preferred Fastest secure suite on this host, what CipherId::Auto resolves to
+     * @details AES-256-GCM where AES and carry-less multiply are in hardware, otherwise ChaCha20-Poly1305
+     *          (several times faster than table driven AES, and constant time)
+     */
+    static CipherId Preferred();
+
+    /**
+     * @brief Resolve Turns a requested suite into the one to write, CipherId::Auto becomes Preferred()
+     * @returns False (with a message) if the suite is unknown or this build of OpenSSL lacks it
+     */
+    static bool Resolve(CipherId requested, CipherId &cipher);
+
+    /**
+     * @brief Available Whether this build of OpenSSL can run a suite
+     */
+    static bool Available(CipherId cipher);
+
+    /**
+     * @brief Cipher The OpenSSL cipher behind a suite, for AEAD suites the whole construction
+     * @returns Null for unknown suites or ones this build lacks
+     */
+    static const EVP_CIPHER *Cipher(CipherId cipher);
+
+    /**
+     * @brief IsAead Whether the suite's cipher authenticates on its own, otherwise a separate HMAC does
+     */
+    static bool IsAead(CipherId cipher);
+
+    /**
+     * @brief ChunkKeyLength Length of the chunk key of a suite, 0 for unknown suites
+     */
+    static size_t ChunkKeyLength(CipherId cipher);
+
+    /**
+     * @brief DeriveChunkKey Replaces a data key with the chunk key of a suite
+     * @param[in] cipher Suite the chunks are encrypted with
+     * @param[in,out] key The data key in, the chunk key out (wiped before being replaced)
+     * @returns Success
+     */
+    static bool DeriveChunkKey(CipherId cipher, SecureBytes &key);
+
+    /**
+     * @brief Name Stable lower case name of a suite, e.g. "aes-256-gcm"
+     */
+    static const char *Name(CipherId cipher);
+
+    /**
+     * @brief Parse Looks a suite up by Name, "auto" gives CipherId::Auto
+     * @returns False if the name is unknown
+     */
+    static bool Parse(const std::string &name, CipherId &cipher);
+};
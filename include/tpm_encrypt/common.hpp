@@ -6,16 +6,42 @@
 #include <memory>
 #include <vector>
 
+#include "tpm_encrypt/secure_arena.hpp"
+
 class Common
 {
 public:
+    /**
+     * @brief CheckKeyReference Rejects references that would name TPM data of another reference
+     * @details A reference is one FAPI path component that must not end in "_iv" or "_kek", the names of a legacy
+     *          iv and of an envelope key-encryption key stored next to a reference's sealed key
+     * @param[in] key_reference The key reference
+     * @returns False (after reporting it) if the reference cannot be used
+     */
+    static bool CheckKeyReference(const std::string &key_reference);
+
     /**
      * @brief UnsealKey Reads an encryption key from the TPM
      * @param[in] key_reference A name/refernece for this key, used to access it
      * @param[out] unsealed_key_data The unsealed encryption key/data
+     */
+    static bool UnsealKey(const std::string &key_reference, SecureBytes &unsealed_key_data);
+
+    /**
+     * @brief UnsealKey Reads an encryption key from the TPM, quietly failing if none is sealed at the reference
+     * @param[in] key_reference A name/refernece for this key, used to access it
+     * @param[out] unsealed_key_data The unsealed encryption key/data
+     * @param[out] missing Set if no key is sealed at the reference, other failures are reported
+     */
+    static bool UnsealKey(const std::string &key_reference, SecureBytes &unsealed_key_data, bool &missing);
+
+    /**
+     * @brief UnsealKey Reads an encryption key and its iv from the TPM, as stored for legacy (headerless) data
+     * @param[in] key_reference A name/refernece for this key, used to access it
+     * @param[out] unsealed_key_data The unsealed encryption key/data
      * @param[out] unsealed_key_data The unsealed encryption iv/data
      */
-    static bool UnsealKey(const std::string &key_reference, std::vector<uint8_t> &unsealed_key_data, std::vector<uint8_t> &unsealed_iv_data);
+    static bool UnsealKey(const std::string &key_reference, SecureBytes &unsealed_key_data, SecureBytes &unsealed_iv_data);
 
     /**
      * @brief GenerateSealedKey Creates and seals a symmetric key at the reference provided
@@ -61,9 +87,18 @@ public:
     static void ResetTpm();
 
     /**
-     * @brief GetRandomData Fetches random data from the system's entropy source
+     * @brief DeleteKey Removes the TPM data of one key reference, its sealed key and iv and envelope key-encryption key
+     * @details Everything encrypted with the reference can no longer be decrypted
+     * @param[in] key_reference The key reference
+     * @returns True if anything was stored for the reference
+     */
+    static bool DeleteKey(const std::string &key_reference);
+
+    /**
+     * @brief GetRandomData Fetches cryptographically secure random data, see Entropy
      * @param[out] data_buffer The buffer to populate
      * @param[in] length The amount of random data to fetch
+     * @returns Success, the buffer must not be used otherwise
      */
-    static void GetRandomData(unsigned char data_buffer[], const size_t &length);
+    static bool GetRandomData(unsigned char data_buffer[], const size_t &length);
 };
\ No newline at end of file
@@ -0,0 +1,63 @@
+/**
+ * Optional compression of chunks before they are encrypted
+ *
+ * Each chunk is compressed on its own, so compressed containers still stream and seal in parallel. A chunk that
+ * does not shrink by at least 1/kMinSavingFraction (already compressed media, archives, ciphertext) is stored as is,
+ * and the record flags say which chunks were compressed. The algorithms are only built in when their library is
+ * found (TPM_ENCRYPT_WITH_ZSTD, TPM_ENCRYPT_WITH_LZ4).
+ */
+#pragma once
+
+#include "tpm_encrypt/container_format.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class Compression
+{
+public:
+    // A compressed chunk is only kept if it saves at least 1/kMinSavingFraction of the chunk
+    static constexpr size_t kMinSavingFraction = 16;
+
+    /**
+     * @brief Available Whether this build can compress and decompress with an algorithm, None always is
+     */
+    static bool Available(CompressionId compression);
+
+    /**
+     * @brief Compress Compresses a chunk, provided that saves enough to be worth it
+     * @param[in] compression Algorithm to use, not None
+     * @param[in] level Algorithm specific level, 0 for its default. zstd: 1 to 19 (negative for faster modes),
+     *                  lz4: up to 2 is the fast compressor (negative for faster still), 3 and above its HC mode
+     * @param[in] data_in The chunk
+     * @param[in] length_in Length of data_in
+     * @param[out] data_out Receives the compressed chunk, must hold length_in bytes
+     * @param[out] length_out Length of the compressed chunk
+     * @returns False if the chunk should be stored as is (incompressible, or the algorithm failed)
+     */
+    static bool Compress(CompressionId compression, int level, const uint8_t *data_in, size_t length_in, uint8_t *data_out, size_t &length_out);
+
+    /**
+     * @brief Decompress Restores a chunk
+     * @param[in] compression Algorithm it was compressed with
+     * @param[in] data_in The compressed chunk
+     * @param[in] length_in Length of data_in
+     * @param[out] data_out Receives the chunk
+     * @param[in] capacity Bytes available at data_out, more output is an error
+     * @param[out] length_out Length of the chunk
+     * @returns False if the data is corrupt or does not fit
+     */
+    static bool Decompress(CompressionId compression, const uint8_t *data_in, size_t length_in, uint8_t *data_out, size_t capacity, size_t &length_out);
+
+    /**
+     * @brief Name Stable lower case name of an algorithm, e.g. "zstd"
+     */
+    static const char *Name(CompressionId compression);
+
+    /**
+     * @brief Parse Looks an algorithm up by Name
+     * @returns False if the name is unknown
+     */
+    static bool Parse(const std::string &name, CompressionId &compression);
+};
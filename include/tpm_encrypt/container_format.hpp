@@ -0,0 +1,145 @@
+/**
+ * Self-describing container for encrypted data
+ *
+ * Layout (integers little endian):
+ *   header:  magic "TPME" | version u8 | cipher u8 | key mode u8 | flags u8 | chunk size u32 |
+ *            plaintext length u64 | nonce length u8 | nonce | wrapped key length u16 | wrapped key
+ *   chunks:  one record per chunk_size bytes of plaintext, see ChunkCipher
+ *
+ * The cipher byte picks the chunk cipher and how its key is derived from the data key, see CipherSuite. The low
+ * bits of the flags name the algorithm chunks were compressed with before encryption, see Compression, and
+ * kFlagRecordNonces says records carry their own nonces. Headers with any other flag set are rejected.
+ *
+ * Data without the magic is legacy output: raw AES-256-CBC with the key and iv sealed on the TPM.
+ */
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+// How the symmetric key protecting the data is stored
+enum class KeyMode : uint8_t
+{
+    // Key is sealed on the TPM at the key reference
+    Sealed = 0,
+    // A per-file data key wrapped by the key-encryption key sealed at the key reference
+    Envelope = 1,
+};
+
+// Cipher protecting the chunks, see CipherSuite
+enum class CipherId : uint8_t
+{
+    // Only ever requested, never written: resolves to CipherSuite::Preferred() for this host
+    Auto = 0,
+    Aes256Gcm = 1,
+    Aes128Gcm = 2,
+    // AES-256-CTR then HMAC-SHA256 over the record, truncated to the tag length
+    Aes256CtrHmacSha256 = 3,
+    ChaCha20Poly1305 = 4,
+};
+
+// Algorithm chunks are compressed with before they are encrypted, see Compression
+enum class CompressionId : uint8_t
+{
+    None = 0,
+    Zstd = 1,
+    Lz4 = 2,
+};
+
+// Decoded container header
+struct ContainerHeader
+{
+    uint8_t version = 0;
+    CipherId cipher = CipherId::Aes256Gcm;
+    KeyMode key_mode = KeyMode::Sealed;
+    CompressionId compression = CompressionId::None;
+    // Flag bits other than the compression
+    uint8_t flags = 0;
+    uint32_t chunk_size = 0;
+    uint64_t plaintext_length = 0;
+    std::vector<uint8_t> nonce;
+    std::vector<uint8_t> wrapped_key;
+};
+
+class ContainerFormat
+{
+public:
+    // Current header version
+    static constexpr uint8_t kVersion = 1;
+
+    // Plaintext bytes per chunk unless the caller asks otherwise
+    static constexpr uint32_t kDefaultChunkSize = 64 * 1024;
+
+    // Largest chunk we accept, bounds the memory a (possibly hostile) header can make us allocate
+    static constexpr uint32_t kMaxChunkSize = 64 * 1024 * 1024;
+
+    // Written when the plaintext length is not known up front (e.g. streamed output)
+    static constexpr uint64_t kUnknownLength = UINT64_MAX;
+
+    // Position of the plaintext length, so streamed output can patch it in once known
+    static constexpr size_t kPlaintextLengthOffset = 12;
+
+    // Bits of the flags holding the compression
+    static constexpr uint8_t kCompressionMask = 0x03;
+
+    // Flag: every record carries its own random nonce rather than deriving it from the header nonce, see ChunkCipher
+    static constexpr uint8_t kFlagRecordNonces = 0x04;
+
+    /**
+     * @brief WriteHeader Serialises a header, appending it to the output
+     * @param[in] header Header to serialise
+     * @param[out] data_out Output the header is appended to
+     */
+    static void WriteHeader(const ContainerHeader &header, std::string &data_out);
+
+    /**
+     * @brief WriteHeader Serialises a header into a caller provided buffer
+     * @param[in] header Header to serialise
+     * @param[out] data_out Receives HeaderLength of the header's nonce and wrapped key bytes
+     */
+    static void WriteHeader(const ContainerHeader &header, uint8_t *data_out);
+
+    /**
+     * @brief HeaderLength Bytes a header occupies once serialised
+     * @param[in] nonce_length Length of the header's nonce
+     * @param[in] wrapped_key_length Length of the header's wrapped key, 0 for sealed keys
+     */
+    static size_t HeaderLength(size_t nonce_length, size_t wrapped_key_length);
+
+    /**
+     * @brief ReadHeader Parses a header from the start of some data
+     * @param[in] data_in Data which may start with a header
+     * @param[in] length_in Length of data_in
+     * @param[out] header The decoded header
+     * @param[out] header_length Number of bytes the header occupies
+     * @returns False if the data does not start with a valid header (e.g. legacy headerless ciphertext)
+     */
+    static bool ReadHeader(const uint8_t *data_in, size_t length_in, ContainerHeader &header, size_t &header_length);
+
+    /**
+     * @brief ReadHeader Reads a header from the start of a stream, consuming only the header bytes
+     * @param[in] stream_in Stream which may start with a header
+     * @param[out] header The decoded header
+     * @param[out] consumed Every byte read from the stream, so a caller can fall back to legacy decoding
+     * @returns False if the stream does not start with a valid header
+     */
+    static bool ReadHeader(std::istream &stream_in, ContainerHeader &header, std::string &consumed);
+
+    /**
+     * @brief HasMagic Checks whether some data starts with the container magic
+     * @param[in] data_in Data to check
+     * @param[in] length_in Length of data_in
+     */
+    static bool HasMagic(const uint8_t *data_in, size_t length_in);
+
+    /**
+     * @brief HeaderAad Additional authenticated data binding every chunk to its header
+     * @details The plaintext length is left out so it can be patched in after a streamed write,
+     *          truncation is instead caught by the final chunk flag
+     * @param[in] header The header
+     * @param[out] aad_out The serialised authenticated fields
+     */
+    static void HeaderAad(const ContainerHeader &header, std::string &aad_out);
+};
@@ -0,0 +1,150 @@
+/**
+ * Thin client for tpm-encryptd, with the signatures of DataEncrypt and DataDecrypt
+ *
+ * Nothing here touches the TPM: requests go to the daemon, which keeps the session and keys warm. Each thread keeps
+ * one connection, reconnecting once if the daemon was restarted. Data up to kInlineLimit travels in the request,
+ * larger data and files are handed over as descriptors (memfds, or files opened here with this process's
+ * permissions) and never pass through the socket.
+ *
+ * The daemon's socket is SetSocketPath, else $TPM_ENCRYPTD_SOCKET, else DaemonProtocol::kDefaultSocketPath.
+ */
+#pragma once
+
+#include "tpm_encrypt/daemon_protocol.hpp"
+#include "tpm_encrypt/data_encrypt.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class DaemonClient
+{
+public:
+    // Default constructor for static class
+    DaemonClient() = default;
+
+    // Largest data sent inside a request, more goes through a memfd
+    static constexpr size_t kInlineLimit = 1024 * 1024;
+
+    /**
+     * @brief SetSocketPath Connects to the daemon at this path from now on
+     * @param[in] socket_path The daemon's socket, empty to go back to the default
+     */
+    static void SetSocketPath(const std::string &socket_path);
+
+    /**
+     * @brief SocketPath The socket requests are sent to
+     */
+    static std::string SocketPath();
+
+    /**
+     * @brief Ping Checks that the daemon is up and answering
+     * @returns Success
+     */
+    static bool Ping();
+
+    /**
+     * @brief EncryptFile Has the daemon encrypt a file
+     * @param[in] path_in File to be encrypted
+     * @param[in] path_out Path where the encrypted file shall be saved
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @returns Success
+     */
+    static bool EncryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference);
+
+    /**
+     * @brief EncryptFile Has the daemon encrypt a file
+     * @param[in] path_in File to be encrypted
+     * @param[in] path_out Path where the encrypted file shall be saved
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @returns Success
+     */
+    static bool EncryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference, const EncryptOptions &options);
+
+    /**
+     * @brief DecryptFile Has the daemon decrypt a file
+     * @param[in] path_in File to be decrypted
+     * @param[in] path_out Path where the decrypted file shall be saved, left as it was on failure
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @returns Success
+     */
+    static bool DecryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference);
+
+    /**
+     * @brief EncryptData Has the daemon encrypt data
+     * @param[in] data_in Data to be encrypted
+     * @param[out] data_out Encrypted data output
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @returns Success
+     */
+    static bool EncryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference);
+
+    /**
+     * @brief EncryptData Has the daemon encrypt data
+     * @param[in] data_in Data to be encrypted
+     * @param[out] data_out Encrypted data output
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @returns Success
+     */
+    static bool EncryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference, const EncryptOptions &options);
+
+    /**
+     * @brief DecryptData Has the daemon decrypt data
+     * @param[in] data_in Data to be decrypted
+     * @param[out] data_out Decrypted data output
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @returns Success
+     */
+    static bool DecryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference);
+
+    /**
+     * @brief EncryptDescriptor Has the daemon encrypt everything read from one descriptor into another
+     * @param[in] fd_in Plaintext input, read until EOF
+     * @param[in] fd_out Encrypted output, seekable ones get the plaintext length patched into the header
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @returns Success
+     */
+    static bool EncryptDescriptor(int fd_in, int fd_out, const std::string &key_reference, const EncryptOptions &options);
+
+    /**
+     * @brief DecryptDescriptor Has the daemon decrypt everything read from one descriptor into another
+     * @param[in] fd_in Encrypted input, read until EOF
+     * @param[in] fd_out Plaintext output
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @returns Success
+     */
+    static bool DecryptDescriptor(int fd_in, int fd_out, const std::string &key_reference);
+
+private:
+    /**
+     * @brief Call Sends a request on this thread's connection and waits for the response
+     * @param[in] request The request, its payload is sent from payload instead
+     * @param[in] payload Data sent with the request
+     * @param[in] payload_length Length of payload
+     * @param[in] descriptors Descriptors to hand over
+     * @param[in] descriptor_count Number of descriptors
+     * @param[out] status Outcome reported by the daemon
+     * @param[out] response Output of the request, or an error message
+     * @returns False if the daemon could not be reached
+     */
+    static bool Call(const DaemonRequest &request, const uint8_t *payload, size_t payload_length,
+                     const int *descriptors, size_t descriptor_count, DaemonStatus &status, std::string &response);
+
+    /**
+     * @brief CallData Sends data inline, or through memfds if it is large or its output turns out to be
+     * @param[in] request The request, with an inline op
+     * @param[in] data_in Data to be processed
+     * @param[out] data_out The output
+     * @returns Success
+     */
+    static bool CallData(const DaemonRequest &request, const std::string &data_in, std::string &data_out);
+
+    /**
+     * @brief CallDescriptors Sends a descriptor request
+     * @returns Success
+     */
+    static bool CallDescriptors(DaemonOp op, int fd_in, int fd_out, const std::string &key_reference, const EncryptOptions &options);
+};
@@ -0,0 +1,119 @@
+/**
+ * Wire format between tpm-encryptd and its clients
+ *
+ * Messages travel over a Unix stream socket, framed as (integers little endian):
+ *   length u32 | version u8 | kind u8 | descriptor count u8 | reserved u8 | body (length bytes)
+ * Descriptors ride along with the frame header as SCM_RIGHTS. A request's kind is a DaemonOp, a response's a
+ * DaemonStatus, and every request gets exactly one response on the same connection.
+ *
+ *   request body:  key mode u8 | cipher u8 | compression u8 | compression level i32 | chunk size u32 |
+ *                  key reference length u16 | key reference | payload
+ *   response body: the output of inline requests, an error message otherwise
+ *
+ * Inline requests carry their data in the payload. Descriptor requests carry none: the client hands over an
+ * input and an output descriptor and the daemon streams from one to the other, so large payloads never pass
+ * through the socket and files are opened with the client's permissions, not the daemon's.
+ */
+#pragma once
+
+#include "tpm_encrypt/data_encrypt.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What a request asks for
+enum class DaemonOp : uint8_t
+{
+    // Answers Ok, nothing else
+    Ping = 0,
+    // Encrypts the payload, the ciphertext is the response
+    EncryptData = 1,
+    // Decrypts the payload, the plaintext is the response
+    DecryptData = 2,
+    // Encrypts everything read from the first descriptor into the second
+    EncryptDescriptor = 3,
+    // Decrypts everything read from the first descriptor into the second
+    DecryptDescriptor = 4,
+};
+
+// Outcome of a request
+enum class DaemonStatus : uint8_t
+{
+    Ok = 0,
+    // The operation failed (wrong key, failed authentication, TPM error)
+    Failed = 1,
+    // The request could not be parsed or is missing its descriptors
+    BadRequest = 2,
+    // The output does not fit a message, send the request again with descriptors
+    TooLarge = 3,
+};
+
+// A decoded request
+struct DaemonRequest
+{
+    DaemonOp op = DaemonOp::Ping;
+    EncryptOptions options{};
+    std::string key_reference;
+    std::string payload;
+};
+
+class DaemonProtocol
+{
+public:
+    // Frame version, a daemon drops connections speaking another
+    static constexpr uint8_t kVersion = 1;
+
+    // Bytes ahead of every body
+    static constexpr size_t kFrameHeaderLength = 8;
+
+    // Largest body either side accepts, bigger data goes through descriptors
+    static constexpr size_t kMaxMessageLength = 64 * 1024 * 1024;
+
+    // Most descriptors one message carries
+    static constexpr size_t kMaxDescriptors = 2;
+
+    // Where the daemon listens unless told otherwise, clients also look at TPM_ENCRYPTD_SOCKET
+    static constexpr const char *kDefaultSocketPath = "/run/tpm-encryptd/tpm-encryptd.sock";
+
+    /**
+     * @brief Send Writes one message, retrying short writes
+     * @param[in] socket Connected socket
+     * @param[in] kind DaemonOp of a request or DaemonStatus of a response
+     * @param[in] body First part of the body
+     * @param[in] payload Rest of the body, sent without being copied into it
+     * @param[in] payload_length Length of payload
+     * @param[in] descriptors Descriptors to hand over, they stay open on this side
+     * @param[in] descriptor_count Number of descriptors, at most kMaxDescriptors
+     * @returns False if the peer is gone or the message is too long
+     */
+    static bool Send(int socket, uint8_t kind, const std::string &body, const uint8_t *payload, size_t payload_length,
+                     const int *descriptors, size_t descriptor_count);
+
+    /**
+     * @brief Receive Reads one message
+     * @param[in] socket Connected socket
+     * @param[out] kind DaemonOp of a request or DaemonStatus of a response
+     * @param[out] body The body
+     * @param[out] descriptors Descriptors handed over, owned (and to be closed) by the caller
+     * @returns False if the peer is gone or sent a malformed frame, any descriptors received are closed
+     */
+    static bool Receive(int socket, uint8_t &kind, std::string &body, std::vector<int> &descriptors);
+
+    /**
+     * @brief EncodeRequest Serialises everything of a request ahead of its payload
+     * @param[in] request The request, its payload is left out
+     * @param[out] body_out Receives the start of the body
+     */
+    static void EncodeRequest(const DaemonRequest &request, std::string &body_out);
+
+    /**
+     * @brief DecodeRequest Parses a request body
+     * @param[in] op Kind of the message
+     * @param[in] body The body, its payload is moved out
+     * @param[out] request The decoded request
+     * @returns False if the body is malformed or names unknown options
+     */
+    static bool DecodeRequest(uint8_t op, std::string &body, DaemonRequest &request);
+};
@@ -0,0 +1,89 @@
+/**
+ * Serves encrypt and decrypt requests from local clients, see DaemonProtocol
+ *
+ * One process owns the TPM session, the key cache and the worker pools, so clients pay a socket round trip plus
+ * the cipher instead of initialising FAPI and unsealing keys themselves. Each connection is served by its own
+ * thread, requests on it one at a time, while the chunk work of all of them shares the pool.
+ *
+ * Anyone who can connect can use every key reference the daemon can, access is controlled through the socket's
+ * permissions (owner and group, see Listen).
+ */
+#pragma once
+
+#include "tpm_encrypt/daemon_protocol.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+class DaemonServer
+{
+public:
+    // Connections served at once unless the caller asks otherwise, further ones wait to be accepted
+    static constexpr size_t kDefaultMaxConnections = 64;
+
+    DaemonServer() = default;
+
+    /**
+     * @brief ~DaemonServer Stops serving and removes the socket
+     */
+    ~DaemonServer();
+
+    /**
+     * @brief Listen Creates the socket, readable and writable by its owner and group only
+     * @details A stale socket left by a daemon that died is replaced, a live one is an error
+     * @param[in] socket_path Where to listen
+     * @param[in] max_connections Connections served at once, at least one
+     * @returns Success
+     */
+    bool Listen(const std::string &socket_path, size_t max_connections = kDefaultMaxConnections);
+
+    /**
+     * @brief Run Accepts and serves connections until Stop is called
+     */
+    void Run();
+
+    /**
+     * @brief Stop Makes Run return once the open connections are closed, safe to call from a signal handler
+     */
+    void Stop();
+
+    DaemonServer(const DaemonServer &) = delete;
+    DaemonServer &operator=(const DaemonServer &) = delete;
+
+private:
+    /**
+     * @brief Serve Answers the requests of one connection until the client hangs up, then closes it
+     * @param[in] connection The accepted socket
+     */
+    void Serve(int connection);
+
+    /**
+     * @brief Handle Carries out one request
+     * @param[in] request The request
+     * @param[in] descriptors Descriptors handed over with it
+     * @param[out] response Output of inline requests, or an error message
+     * @returns Outcome of the request
+     */
+    static DaemonStatus Handle(const DaemonRequest &request, const std::vector<int> &descriptors, std::string &response);
+
+    /**
+     * @brief Close Closes the listening socket and removes its path
+     */
+    void Close();
+
+    std::string socket_path_;
+    int listen_fd_ = -1;
+    size_t max_connections_ = kDefaultMaxConnections;
+
+    // Written to by Stop, wakes Run
+    int wake_fds_[2] = {-1, -1};
+
+    // Connections being served, shut down on Stop so their threads finish
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    std::set<int> connections_;
+};
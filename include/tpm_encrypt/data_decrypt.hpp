@@ -1,11 +1,21 @@
 /**
  * Handles TPM-backed file decryption
  */
+#pragma once
+
+#include <future>
+#include <istream>
+#include <ostream>
 #include <string>
 #include <tss2/tss2_fapi.h>
 #include <memory>
 #include <vector>
 
+#include "tpm_encrypt/container_format.hpp"
+#include "tpm_encrypt/file_batch.hpp"
+#include "tpm_encrypt/file_io.hpp"
+#include "tpm_encrypt/secure_arena.hpp"
+
 class DataDecrypt
 {
 public:
@@ -21,6 +31,84 @@ public:
      */
     static bool DecryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference);
 
+    /**
+     * @brief DecryptFiles Decrypts many files, several at once, using one TPM sealed key
+     * @details The key is fetched from the TPM once for the whole batch
+     * @param[in] jobs Files to decrypt and where to save each
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @param[in] worker_count Files decrypted at once, 0 uses one per hardware thread
+     * @param[out] results Outcome of each job, in job order
+     * @returns True if every file was decrypted
+     */
+    static bool DecryptFiles(const std::vector<FileJob> &jobs, const std::string &key_reference, size_t worker_count, std::vector<FileResult> &results);
+
+    /**
+     * @brief DecryptDirectory Decrypts every file below a directory into the same layout below another
+     * @param[in] root_in Directory to decrypt
+     * @param[in] root_out Directory where the decrypted tree shall be saved
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @param[in] worker_count Files decrypted at once, 0 uses one per hardware thread
+     * @param[out] results Outcome of each file
+     * @returns True if every file was decrypted
+     */
+    static bool DecryptDirectory(const std::string &root_in, const std::string &root_out, const std::string &key_reference, size_t worker_count, std::vector<FileResult> &results);
+
+    /**
+     * @brief VerifyFile Checks that an encrypted file is intact without decrypting it anywhere
+     * @details Authenticates every chunk and checks the container structure (chunk order, the final chunk, the
+     *          length in the header) in parallel, straight from the page cache. Nothing is written, no plaintext is
+     *          kept, so a scan costs about what reading the file does. Compressed chunks are restored into scratch
+     *          that is wiped afterwards, to check the lengths they restore to. Legacy data carries no tags and always fails
+     * @param[in] path_in File to be checked, a chunked container
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @returns True if the file would decrypt
+     */
+    static bool VerifyFile(const std::string &path_in, const std::string &key_reference);
+
+    /**
+     * @brief VerifyFiles Checks many encrypted files, several at once, using one TPM sealed key
+     * @param[in] paths Files to be checked
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @param[in] worker_count Files checked at once, 0 uses one per hardware thread
+     * @param[out] results Outcome of each file, in the order given, path_out is left empty
+     * @returns True if every file is intact
+     */
+    static bool VerifyFiles(const std::vector<std::string> &paths, const std::string &key_reference, size_t worker_count, std::vector<FileResult> &results);
+
+    /**
+     * @brief VerifyDirectory Checks every file below a directory
+     * @param[in] root_in Directory to check
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @param[in] worker_count Files checked at once, 0 uses one per hardware thread
+     * @param[out] results Outcome of each file, path_out is left empty
+     * @returns True if every file is intact
+     */
+    static bool VerifyDirectory(const std::string &root_in, const std::string &key_reference, size_t worker_count, std::vector<FileResult> &results);
+
+    /**
+     * @brief DecryptRange Decrypts part of an encrypted file, authenticating only the chunks covering it
+     * @details Costs the chunks of the range rather than the whole file. Each call opens the file and looks its key
+     *          up, keep a ChunkReader or DecryptedIstream open for repeated reads
+     * @param[in] path_in File to be decrypted, a chunked container
+     * @param[in] offset Start of the range in the plaintext
+     * @param[in] length Length of the range, clipped to the end of the plaintext
+     * @param[out] data_out The plaintext of the range, shorter than length only at the end of the plaintext
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @returns Success
+     */
+    static bool DecryptRange(const std::string &path_in, uint64_t offset, size_t length, std::string &data_out, const std::string &key_reference);
+
+    /**
+     * @brief DecryptStream Decrypts everything read from a stream until EOF using a TPM sealed key
+     * @details Works a chunk at a time so memory use is constant. Each chunk is authenticated before it is written,
+     *          but on failure the output holds a prefix of the plaintext and should be discarded
+     * @param[in] stream_in Encrypted input
+     * @param[out] stream_out Decrypted output
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @returns Success
+     */
+    static bool DecryptStream(std::istream &stream_in, std::ostream &stream_out, const std::string &key_reference);
+
     /**
      * @brief DecryptData Decrypts data using a TPM sealed key
      * @param[in] data_in Data to be decrypted
@@ -30,6 +118,57 @@ public:
      */
     static bool DecryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference);
 
+    /**
+     * @brief DecryptData Decrypts data using a TPM sealed key into a caller provided buffer
+     * @details Binary safe, nothing is allocated per call once the calling thread has made its first one (legacy
+     *          headerless ciphertext still goes through a scratch buffer). On failure data_out holds no plaintext
+     * @param[in] data_in Data to be decrypted
+     * @param[in] data_in_length Length of data_in
+     * @param[out] data_out Decrypted data output, MaxDecryptedSize(data_in, data_in_length) bytes are enough
+     * @param[in] data_out_capacity Bytes available at data_out
+     * @param[out] data_out_length Bytes written to data_out
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @returns Success
+     */
+    static bool DecryptData(const uint8_t *data_in, size_t data_in_length, uint8_t *data_out, size_t data_out_capacity, size_t &data_out_length, const std::string &key_reference);
+
+    /**
+     * @brief VerifyData Checks that encrypted data is intact without producing its plaintext
+     * @details See VerifyFile
+     * @param[in] data_in Data to be checked
+     * @param[in] data_in_length Length of data_in
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @returns True if the data would decrypt
+     */
+    static bool VerifyData(const uint8_t *data_in, size_t data_in_length, const std::string &key_reference);
+
+    /**
+     * @brief VerifyData Checks that encrypted data is intact without producing its plaintext
+     * @param[in] data_in Data to be checked
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @returns True if the data would decrypt
+     */
+    static bool VerifyData(const std::string &data_in, const std::string &key_reference);
+
+    /**
+     * @brief MaxDecryptedSize Output space DecryptData needs for some encrypted data
+     * @details Exact for intact containers, legacy ciphertext gets its own length (padding is only known after decrypting)
+     * @param[in] data_in Data to be decrypted
+     * @param[in] data_in_length Length of data_in
+     * @returns Bytes to provide for the plaintext
+     */
+    static size_t MaxDecryptedSize(const uint8_t *data_in, size_t data_in_length);
+
+    /**
+     * @brief DecryptDataAsync Decrypts data using a TPM sealed key without blocking the caller
+     * @details TPM commands are queued to the session's scheduler thread, the cipher runs on the shared pool
+     * @param[in] data_in Data to be decrypted, must stay valid until the future is ready
+     * @param[out] data_out Decrypted data output, must stay valid until the future is ready
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @returns Future for the success of the operation
+     */
+    static std::future<bool> DecryptDataAsync(const std::string &data_in, std::string &data_out, const std::string &key_reference);
+
     /**
      * Decrypt some ciphertext using a symmetric key
      * @param symmetric_key_reference Used to unseal the symmetric key from the TPM
@@ -38,4 +177,144 @@ public:
      */
     static int DecryptCiphertext(const std::string &ciphertext, const std::string &symmetric_key_reference, unsigned char *plaintext);
 
-    };
\ No newline at end of file
+    /**
+     * Decrypt some legacy (headerless AES-256-CBC) ciphertext using a symmetric key already in memory
+     * @param key The symmetric key
+     * @param iv The iv
+     * @param ciphertext The ciphertext to decrypt
+     * @param ciphertext_length Length of ciphertext
+     * @param plaintext The decrypted plaintext, must hold at least ciphertext_length bytes
+     * @return int Length of the plaintext, -1 on failure
+     */
+    static int DecryptLegacy(const SecureBytes &key, const SecureBytes &iv, const unsigned char *ciphertext, size_t ciphertext_length, unsigned char *plaintext);
+
+private:
+    // Random access reuses the key recovery and record location below
+    friend class ChunkReader;
+    // Incremental encryption recovers the key of a previous output to patch it
+    friend class IncrementalEncrypt;
+
+    /**
+     * @brief DecryptLegacyStream Decrypts legacy (headerless AES-256-CBC) ciphertext from a stream
+     * @param[in] prefix Bytes already read from the stream while looking for a header
+     * @param[in] stream_in The rest of the ciphertext
+     * @param[out] stream_out Decrypted output
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @returns Success
+     */
+    static bool DecryptLegacyStream(const std::string &prefix, std::istream &stream_in, std::ostream &stream_out, const std::string &key_reference);
+
+    /**
+     * @brief RecoverKey Fetches the data key of a container, from the TPM or by unwrapping it
+     * @param[in] header The container header
+     * @param[in] key_reference The key reference the data was encrypted with
+     * @param[out] key The chunk key of the header's cipher suite
+     * @returns Success
+     */
+    static bool RecoverKey(const ContainerHeader &header, const std::string &key_reference, SecureBytes &key);
+
+    /**
+     * @brief DecryptContainer Authenticates and decrypts the chunks of a container
+     * @param[in] header The container header
+     * @param[in] key The data key
+     * @param[in] records The chunk records following the header
+     * @param[in] records_length Length of records
+     * @param[out] data_out Decrypted data output
+     * @returns False if any chunk fails authentication or the container is truncated/extended
+     */
+    static bool DecryptContainer(const ContainerHeader &header, const SecureBytes &key, const uint8_t *records, size_t records_length, std::string &data_out);
+
+    /**
+     * @brief DecryptContainer Authenticates and decrypts the chunks of a container into a caller provided buffer
+     * @param[in] header The container header
+     * @param[in] key The data key
+     * @param[in] records The chunk records following the header
+     * @param[in] records_length Length of records
+     * @param[out] data_out Decrypted data output, wiped on failure
+     * @param[in] data_out_capacity Bytes available at data_out
+     * @param[out] data_out_length Bytes written to data_out
+     * @returns False if data_out is too small, any chunk fails authentication or the container is truncated/extended
+     */
+    static bool DecryptContainer(const ContainerHeader &header, const SecureBytes &key, const uint8_t *records, size_t records_length,
+                                 uint8_t *data_out, size_t data_out_capacity, size_t &data_out_length);
+
+    /**
+     * @brief DecryptMappedFile Decrypts a memory mapped container chunk by chunk straight into a preallocated output
+     * @param[in] file_in The mapped container
+     * @param[in] header The container header
+     * @param[in] header_length Bytes the header occupies
+     * @param[in] path_out Path where the decrypted file shall be saved
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @returns Success, the output is removed on failure
+     */
+    static bool DecryptMappedFile(MappedFile &file_in, const ContainerHeader &header, size_t header_length, const std::string &path_out, const std::string &key_reference);
+
+    /**
+     * @brief VerifyMappedFile Authenticates a memory mapped container a window of chunks at a time
+     * @param[in] file_in The mapped container
+     * @param[in] header The container header
+     * @param[in] header_length Bytes the header occupies
+     * @param[in] key_reference The symmetric key reference used to seal this data
+     * @returns True if every chunk is authentic and in place
+     */
+    static bool VerifyMappedFile(MappedFile &file_in, const ContainerHeader &header, size_t header_length, const std::string &key_reference);
+
+    /**
+     * @brief ScanRecords Locates the records of a container without decrypting anything
+     * @details Every record but the last is full, so the layout follows from the length alone and only the final
+     *          record header is read, a large mapped input is not faulted in up front. Records of compressed
+     *          containers vary in length, there every record header is read
+     * @param[in] header The container header
+     * @param[in] records The chunk records following the header
+     * @param[in] records_length Length of records
+     * @param[out] chunk_count Number of records
+     * @param[out] plaintext_length Total payload of the records. For compressed containers the header's length, or
+     *                              if that is unknown room for a full final chunk
+     * @param[out] record_offsets Offset of each record of a compressed container, empty otherwise
+     * @returns False if a record header is invalid or the records are truncated/extended
+     */
+    static bool ScanRecords(const ContainerHeader &header, const uint8_t *records, size_t records_length, size_t &chunk_count, size_t &plaintext_length,
+                            std::vector<size_t> &record_offsets);
+
+    /**
+     * @brief ScanCompressedRecords Locates the records of a compressed container by walking their headers
+     * @returns False if a record header is invalid or the records are truncated/extended
+     */
+    static bool ScanCompressedRecords(const ContainerHeader &header, const uint8_t *records, size_t records_length, size_t &chunk_count, size_t &plaintext_length,
+                                      std::vector<size_t> &record_offsets);
+
+    /**
+     * @brief OpenChunks Authenticates and decrypts a run of consecutive chunks in parallel
+     * @param[in] header The container header
+     * @param[in] key The data key
+     * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+     * @param[in] records The chunk records following the header, as located by ScanRecords
+     * @param[in] records_length Length of records
+     * @param[in] record_offsets Record offsets from ScanRecords, empty unless the container is compressed
+     * @param[in] first_chunk Index of the first chunk to decrypt
+     * @param[in] chunk_count Number of chunks to decrypt
+     * @param[out] plaintext_out Receives the plaintext, starting with the plaintext of first_chunk
+     * @param[in] plaintext_capacity Bytes available at plaintext_out
+     * @param[out] plaintext_length Bytes of plaintext the chunks restored to
+     * @returns False if any chunk fails authentication, is out of place or does not fit
+     */
+    static bool OpenChunks(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                           const uint8_t *records, size_t records_length, const std::vector<size_t> &record_offsets,
+                           size_t first_chunk, size_t chunk_count, uint8_t *plaintext_out, size_t plaintext_capacity, size_t &plaintext_length);
+
+    /**
+     * @brief VerifyChunks Authenticates a run of consecutive chunks in parallel, without producing their plaintext
+     * @param[in] header The container header
+     * @param[in] key The data key
+     * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+     * @param[in] records The chunk records following the header, as located by ScanRecords
+     * @param[in] records_length Length of records
+     * @param[in] record_offsets Record offsets from ScanRecords, empty unless the container is compressed
+     * @param[in] first_chunk Index of the first chunk to check
+     * @param[in] chunk_count Number of chunks to check
+     * @returns False if any chunk fails authentication, is out of place or does not restore to the length the header gives
+     */
+    static bool VerifyChunks(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                             const uint8_t *records, size_t records_length, const std::vector<size_t> &record_offsets,
+                             size_t first_chunk, size_t chunk_count);
+};
\ No newline at end of file
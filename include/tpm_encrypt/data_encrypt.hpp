@@ -1,7 +1,39 @@
 /**
  * Handles TPM-backed file encryption
  */
+#pragma once
+
+#include <future>
+#include <istream>
+#include <ostream>
 #include <string>
+#include <vector>
+
+#include "tpm_encrypt/container_format.hpp"
+#include "tpm_encrypt/file_batch.hpp"
+#include "tpm_encrypt/file_io.hpp"
+#include "tpm_encrypt/secure_arena.hpp"
+
+// Options controlling how data is encrypted
+struct EncryptOptions
+{
+    // Sealed: a key and iv are sealed at the key reference
+    // Envelope: a fresh data key per call, wrapped by the key-encryption key sealed at the key reference
+    KeyMode key_mode = KeyMode::Sealed;
+
+    // Plaintext bytes per authenticated chunk
+    uint32_t chunk_size = ContainerFormat::kDefaultChunkSize;
+
+    // Cipher suite, recorded in the header so decryption needs no option. Auto picks the fastest for this host
+    CipherId cipher = CipherId::Auto;
+
+    // Compress each chunk before encrypting it, recorded in the header so decryption needs no option. Chunks that do
+    // not compress are stored as is. Only algorithms this build has (Compression::Available) can be chosen
+    CompressionId compression = CompressionId::None;
+
+    // Level for the compression, 0 for its default, see Compression::Compress
+    int compression_level = 0;
+};
 
 class DataEncrypt
 {
@@ -18,6 +50,60 @@ public:
      */
     static bool EncryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference);
 
+    /**
+     * @brief EncryptFile Encrypts a given file using a TPM sealed key
+     * @param[in] path_in File to be encrypted
+     * @param[in] path_out Path where the encrypted file shall be saved
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @returns Success
+     */
+    static bool EncryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference, const EncryptOptions &options);
+
+    /**
+     * @brief EncryptFiles Encrypts many files, several at once, using one TPM sealed key
+     * @details The key is fetched from the TPM once for the whole batch
+     * @param[in] jobs Files to encrypt and where to save each
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @param[in] worker_count Files encrypted at once, 0 uses one per hardware thread
+     * @param[out] results Outcome of each job, in job order
+     * @returns True if every file was encrypted
+     */
+    static bool EncryptFiles(const std::vector<FileJob> &jobs, const std::string &key_reference, const EncryptOptions &options, size_t worker_count, std::vector<FileResult> &results);
+
+    /**
+     * @brief EncryptDirectory Encrypts every file below a directory into the same layout below another
+     * @param[in] root_in Directory to encrypt
+     * @param[in] root_out Directory where the encrypted tree shall be saved
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @param[in] worker_count Files encrypted at once, 0 uses one per hardware thread
+     * @param[out] results Outcome of each file
+     * @returns True if every file was encrypted
+     */
+    static bool EncryptDirectory(const std::string &root_in, const std::string &root_out, const std::string &key_reference, const EncryptOptions &options, size_t worker_count, std::vector<FileResult> &results);
+
+    /**
+     * @brief EncryptStream Encrypts everything read from a stream until EOF using a TPM sealed key
+     * @details Works a chunk at a time so memory use is constant, seekable outputs get the plaintext length patched into the header
+     * @param[in] stream_in Plaintext input
+     * @param[out] stream_out Encrypted output
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @returns Success
+     */
+    static bool EncryptStream(std::istream &stream_in, std::ostream &stream_out, const std::string &key_reference);
+
+    /**
+     * @brief EncryptStream Encrypts everything read from a stream until EOF using a TPM sealed key
+     * @param[in] stream_in Plaintext input
+     * @param[out] stream_out Encrypted output
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @returns Success
+     */
+    static bool EncryptStream(std::istream &stream_in, std::ostream &stream_out, const std::string &key_reference, const EncryptOptions &options);
+
     /**
      * @brief EncryptData Encrypts data using a TPM sealed key
      * @param[in] data_in Data to be encrypted
@@ -27,13 +113,144 @@ public:
      */
     static bool EncryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference);
 
+    /**
+     * @brief EncryptData Encrypts data using a TPM sealed key
+     * @param[in] data_in Data to be encrypted
+     * @param[out] data_out Encrypted data output
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @returns Success
+     */
+    static bool EncryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference, const EncryptOptions &options);
+
+    /**
+     * @brief EncryptData Encrypts data using a TPM sealed key into a caller provided buffer
+     * @details Binary safe, nothing is allocated per call once the calling thread has made its first one
+     * @param[in] data_in Data to be encrypted
+     * @param[in] data_in_length Length of data_in
+     * @param[out] data_out Encrypted data output, EncryptedSize(data_in_length) bytes are needed
+     * @param[in] data_out_capacity Bytes available at data_out
+     * @param[out] data_out_length Bytes written to data_out
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @returns Success, false without touching the TPM if data_out is too small
+     */
+    static bool EncryptData(const uint8_t *data_in, size_t data_in_length, uint8_t *data_out, size_t data_out_capacity, size_t &data_out_length, const std::string &key_reference);
+
+    /**
+     * @brief EncryptData Encrypts data using a TPM sealed key into a caller provided buffer
+     * @param[in] data_in Data to be encrypted
+     * @param[in] data_in_length Length of data_in
+     * @param[out] data_out Encrypted data output, EncryptedSize(data_in_length, options) bytes are needed
+     * @param[in] data_out_capacity Bytes available at data_out
+     * @param[out] data_out_length Bytes written to data_out
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @returns Success, false without touching the TPM if data_out is too small
+     */
+    static bool EncryptData(const uint8_t *data_in, size_t data_in_length, uint8_t *data_out, size_t data_out_capacity, size_t &data_out_length, const std::string &key_reference, const EncryptOptions &options);
+
+    /**
+     * @brief EncryptedSize Exact length of the encrypted output for a plaintext
+     * @param[in] plaintext_length Length of the plaintext
+     * @returns Bytes EncryptData produces
+     */
+    static size_t EncryptedSize(size_t plaintext_length);
+
+    /**
+     * @brief EncryptedSize Exact length of the encrypted output for a plaintext, with compression an upper bound
+     * @param[in] plaintext_length Length of the plaintext
+     * @param[in] options How the data is encrypted
+     * @returns Bytes EncryptData produces (at most), 0 if the options are invalid
+     */
+    static size_t EncryptedSize(size_t plaintext_length, const EncryptOptions &options);
+
+    /**
+     * @brief EncryptDataAsync Encrypts data using a TPM sealed key without blocking the caller
+     * @details TPM commands are queued to the session's scheduler thread, the cipher runs on the shared pool
+     * @param[in] data_in Data to be encrypted, must stay valid until the future is ready
+     * @param[out] data_out Encrypted data output, must stay valid until the future is ready
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @returns Future for the success of the operation
+     */
+    static std::future<bool> EncryptDataAsync(const std::string &data_in, std::string &data_out, const std::string &key_reference);
+
+    /**
+     * @brief EncryptDataAsync Encrypts data using a TPM sealed key without blocking the caller
+     * @param[in] data_in Data to be encrypted, must stay valid until the future is ready
+     * @param[out] data_out Encrypted data output, must stay valid until the future is ready
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @returns Future for the success of the operation
+     */
+    static std::future<bool> EncryptDataAsync(const std::string &data_in, std::string &data_out, const std::string &key_reference, const EncryptOptions &options);
+
 private:
+    // Incremental encryption starts its containers the same way
+    friend class IncrementalEncrypt;
+
+    /**
+     * @brief PrepareKey Obtains the data key for a new container and fills in its header
+     * @param[in] options How the data is encrypted
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] plaintext_length Plaintext length to record, ContainerFormat::kUnknownLength if not known yet
+     * @param[out] header Header for the new container
+     * @param[out] key The chunk key of the header's cipher suite
+     * @returns Success
+     */
+    static bool PrepareKey(const EncryptOptions &options, const std::string &key_reference, uint64_t plaintext_length, ContainerHeader &header, SecureBytes &key);
+
+    /**
+     * @brief EncryptPlaintext Encrypt some plaintext into a container using a symmetric key
+     * @param[in] header Header describing the container, written ahead of the chunks
+     * @param[in] key The symmetric key
+     * @param[in] plaintext The text to encrypt
+     * @param[in] compression_level Level for the header's compression
+     * @param[out] ciphertext The encrypted container
+     */
+    static bool EncryptPlaintext(const ContainerHeader &header, const SecureBytes &key, const std::string &plaintext, int compression_level, std::string &ciphertext_string);
 
     /**
-     * @brief EncryptPlaintext Encrypt some plaintext using a symmetric key
-     * @param[in] symmetric_key_reference Used to unseal the symmetric key from the TPM
+     * @brief EncryptPlaintext Encrypt some plaintext into a container in a caller provided buffer
+     * @param[in] header Header describing the container, written ahead of the chunks
+     * @param[in] key The symmetric key
+     * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
      * @param[in] plaintext The text to encrypt
-     * @param[out] ciphertext The encrypted ciphertext
+     * @param[in] plaintext_length Length of plaintext
+     * @param[in] compression_level Level for the header's compression
+     * @param[out] ciphertext_out Receives the container, which must fit its uncompressed length
+     * @param[out] ciphertext_length Length of the container
+     * @returns Success
+     */
+    static bool EncryptPlaintext(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                                 const uint8_t *plaintext, size_t plaintext_length, int compression_level,
+                                 uint8_t *ciphertext_out, size_t &ciphertext_length);
+
+    /**
+     * @brief EncryptMappedFile Encrypts a memory mapped file chunk by chunk straight into a preallocated output
+     * @param[in] file_in The mapped plaintext
+     * @param[in] path_out Path where the encrypted file shall be saved
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted
+     * @returns Success, the output is removed on failure
+     */
+    static bool EncryptMappedFile(MappedFile &file_in, const std::string &path_out, const std::string &key_reference, const EncryptOptions &options);
+
+    /**
+     * @brief SealChunks Encrypts a run of consecutive chunks in parallel
+     * @param[in] header Header describing the container
+     * @param[in] key The symmetric key
+     * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+     * @param[in] plaintext The whole plaintext
+     * @param[in] plaintext_length Length of the whole plaintext
+     * @param[in] first_chunk Index of the first chunk to encrypt
+     * @param[in] chunk_count Number of chunks to encrypt
+     * @param[in] compression_level Level for the header's compression
+     * @param[out] records_out Receives the records, starting with the record of first_chunk. Must fit them
+     *                         uncompressed, compressed records are moved up behind each other afterwards
+     * @param[out] records_length Length of the records
+     * @returns Success
      */
-    static bool EncryptPlaintext(const std::string &symmetric_key_reference, const std::string &plaintext, std::string &ciphertext_string);
+    static bool SealChunks(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                           const uint8_t *plaintext, size_t plaintext_length, size_t first_chunk, size_t chunk_count,
+                           int compression_level, uint8_t *records_out, size_t &records_length);
 };
\ No newline at end of file
@@ -0,0 +1,52 @@
+/**
+ * Random bytes for keys, nonces and ivs
+ *
+ * OpenSSL's private DRBG is the generator: it is seeded from getrandom() and reseeds (including after fork) on
+ * its own. On first use it is additionally seeded here from getrandom(), so a kernel that cannot supply entropy is
+ * reported rather than discovered later, and TPM randomness can be mixed in. Each thread serves small requests
+ * from its own pool of generator output, so a nonce costs a copy rather than a generator call.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class Entropy
+{
+public:
+    // Generator output each thread keeps ready
+    static constexpr size_t kPoolLength = 4096;
+
+    // Requests above this go straight to the generator rather than draining the pool
+    static constexpr size_t kMaxPooledRequest = 256;
+
+    /**
+     * @brief Fill Fills a buffer with cryptographically secure random bytes
+     * @param[out] data_out Buffer to fill
+     * @param[in] length Bytes to fill
+     * @returns False if no secure randomness is available, data_out must not be used then
+     */
+    static bool Fill(uint8_t *data_out, size_t length);
+
+    /**
+     * @brief MixTpm Mixes random bytes from the TPM into the generator
+     * @details Optional, for hosts that want key material to depend on the TPM's generator as well as the kernel's.
+     *          Pooled bytes drawn before the call are discarded
+     * @param[in] length Bytes to draw from the TPM
+     * @returns Success
+     */
+    static bool MixTpm(size_t length = 32);
+
+private:
+    /**
+     * @brief Seed Seeds the generator from getrandom() on first use, again after a failed attempt
+     * @returns False if the kernel cannot supply entropy
+     */
+    static bool Seed();
+
+    /**
+     * @brief ReadSystem Reads from the kernel's generator, resuming after short reads and signals
+     * @returns Success
+     */
+    static bool ReadSystem(uint8_t *data_out, size_t length);
+};
@@ -0,0 +1,54 @@
+/**
+ * Envelope encryption, per-file data keys wrapped by a single TPM sealed key-encryption key
+ */
+#pragma once
+
+#include "tpm_encrypt/secure_arena.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class Envelope
+{
+public:
+    // Length of a wrapped data key as stored in the container header (nonce, encrypted key, tag)
+    static constexpr size_t kWrappedKeyLength = 60;
+
+    /**
+     * @brief GenerateDataKey Creates a random data key, wrapped by the key-encryption key
+     * @param[in] kek_reference Reference of the key-encryption key, it is created on the TPM if missing
+     * @param[out] data_key The generated data key
+     * @param[out] wrapped_key Data key encrypted under the key-encryption key, stored in the container header
+     * @returns Success
+     */
+    static bool GenerateDataKey(const std::string &kek_reference, SecureBytes &data_key, std::vector<uint8_t> &wrapped_key);
+
+    /**
+     * @brief UnwrapDataKey Recovers a data key previously produced by GenerateDataKey
+     * @param[in] kek_reference Reference of the key-encryption key
+     * @param[in] wrapped_key The wrapped data key
+     * @param[out] data_key The data key
+     * @returns Success
+     */
+    static bool UnwrapDataKey(const std::string &kek_reference, const std::vector<uint8_t> &wrapped_key, SecureBytes &data_key);
+
+    /**
+     * @brief DeleteKeyEncryptionKey Removes the key-encryption key from the TPM and the key cache
+     * @details Everything encrypted under it can no longer be decrypted
+     * @param[in] kek_reference Reference of the key-encryption key
+     * @returns True if a key-encryption key was stored for the reference
+     */
+    static bool DeleteKeyEncryptionKey(const std::string &kek_reference);
+
+private:
+    /**
+     * @brief LoadKeyEncryptionKey Fetches the key-encryption key from the key cache or the TPM
+     * @param[in] kek_reference Reference of the key-encryption key
+     * @param[in] create Generate and seal a new key-encryption key if none exists yet
+     * @param[out] kek The key-encryption key
+     * @returns Success
+     */
+    static bool LoadKeyEncryptionKey(const std::string &kek_reference, bool create, SecureBytes &kek);
+};
@@ -0,0 +1,102 @@
+/**
+ * Unseals FAPI created objects through ESYS, without FAPI's per-command keystore work
+ *
+ * Fapi_Unseal parses the object's JSON from the keystore, loads the SRK and the object, starts a session and
+ * flushes it all again for every call. Here the SRK handle, one salted HMAC session and the most recently used
+ * objects stay loaded, so unsealing a known object is a single Esys_Unseal. Objects are still created by FAPI and
+ * read from its keystore (Fapi_GetTpmBlobs), so both paths see the same objects.
+ *
+ * Not thread safe, TpmSession only uses it from its scheduler thread.
+ */
+#pragma once
+
+#include "tpm_encrypt/secure_arena.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <tss2/tss2_esys.h>
+#include <tss2/tss2_fapi.h>
+
+class EsysUnsealer
+{
+public:
+    // Objects kept loaded, small enough to leave FAPI transient slots on a TPM without a resource manager
+    static constexpr size_t kMaxLoadedObjects = 2;
+
+    EsysUnsealer() = default;
+
+    /**
+     * @brief ~EsysUnsealer Flushes everything still loaded, must run before the FAPI context it was opened on goes
+     */
+    ~EsysUnsealer();
+
+    EsysUnsealer(const EsysUnsealer &) = delete;
+    EsysUnsealer &operator=(const EsysUnsealer &) = delete;
+
+    /**
+     * @brief Unseal Reads a sealed object back through ESYS
+     * @param[in] fapi FAPI context whose TPM connection and keystore are used
+     * @param[in] path FAPI path of the sealed object
+     * @param[in] auth Authorisation value of the sealed object
+     * @param[out] data_out The unsealed data
+     * @returns False if the fast path could not be used (e.g. the object has a policy), callers fall back to FAPI
+     */
+    bool Unseal(FAPI_CONTEXT *fapi, const std::string &path, const std::string &auth, SecureBytes &data_out);
+
+    /**
+     * @brief Forget Flushes loaded objects at or below a path (whole components), for objects that were deleted or replaced
+     * @param[in] path FAPI path, "/" forgets everything
+     */
+    void Forget(const std::string &path);
+
+    /**
+     * @brief Close Flushes every handle and finalises the ESYS context, the next Unseal opens them again
+     */
+    void Close();
+
+    /**
+     * @brief Abandon Forgets the ESYS context and handles without touching the TPM
+     * @details For a forked child, the parent still uses them on the connection both share
+     */
+    void Abandon();
+
+private:
+    // A sealed object loaded under the SRK
+    struct LoadedObject
+    {
+        std::string path;
+        ESYS_TR handle;
+        uint64_t last_used;
+    };
+
+    /**
+     * @brief Open Creates the ESYS context on FAPI's connection, resolves the SRK and starts the session
+     * @returns Success
+     */
+    bool Open(FAPI_CONTEXT *fapi);
+
+    /**
+     * @brief Load Loads a sealed object from the FAPI keystore, evicting the least recently used one if needed
+     * @returns Success
+     */
+    bool Load(FAPI_CONTEXT *fapi, const std::string &path, const std::string &auth, ESYS_TR &handle);
+
+    // Context sharing FAPI's TCTI, null until opened
+    ESYS_CONTEXT *esys_ = nullptr;
+
+    ESYS_TR srk_ = ESYS_TR_NONE;
+
+    // Persistent SRKs are only closed, transient ones (context loaded) are flushed
+    bool srk_persistent_ = true;
+
+    // Salted HMAC session reused by every command, it also encrypts the unsealed data on its way back
+    ESYS_TR session_ = ESYS_TR_NONE;
+
+    std::vector<LoadedObject> objects_;
+
+    // Orders uses of loaded objects
+    uint64_t use_count_ = 0;
+};
@@ -0,0 +1,49 @@
+/**
+ * Runs many file jobs across a worker pool, used by the batch and directory APIs
+ */
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// One file to process
+struct FileJob
+{
+    std::string path_in;
+    std::string path_out;
+};
+
+// Outcome of one job, reported in the order the jobs were given
+struct FileResult
+{
+    std::string path_in;
+    std::string path_out;
+    bool success = false;
+};
+
+class FileBatch
+{
+public:
+    /**
+     * @brief Run Processes every job, several at once
+     * @details The first job runs on its own so it can pull the key into the key cache, the rest then find it there
+     *          instead of each going to the TPM
+     * @param[in] jobs Files to process
+     * @param[in] worker_count Files processed at once, 0 uses one per hardware thread
+     * @param[in] work Processes one file, returns success
+     * @param[out] results One result per job
+     * @returns True if every job succeeded
+     */
+    static bool Run(const std::vector<FileJob> &jobs, size_t worker_count, const std::function<bool(const FileJob &)> &work, std::vector<FileResult> &results);
+
+    /**
+     * @brief ListTree Finds every regular file below a directory and maps it to the same place below another
+     * @details Output directories are created as needed
+     * @param[in] root_in Directory to walk
+     * @param[in] root_out Directory mirroring root_in, empty to only list the files (path_out is left empty)
+     * @param[out] jobs One job per file found
+     * @returns Success
+     */
+    static bool ListTree(const std::string &root_in, const std::string &root_out, std::vector<FileJob> &jobs);
+};
@@ -0,0 +1,301 @@
+/**
+ * File access for the cipher engine: inputs are read straight from page cache mappings, outputs are
+ * written asynchronously from a few buffers so disk writes overlap with encrypting the next window.
+ * Descriptors handed over by another process are streamed through DescriptorStreambuf
+ */
+#pragma once
+
+#include "tpm_encrypt/buffer_pool.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+class IoRing;
+class ThreadPool;
+
+// A file written next to its destination and renamed over it once complete. Until then the destination is left
+// as it was, so an output path that is also the input (encrypting in place) is read intact and a failed run does
+// not destroy an earlier output
+class StagedFile
+{
+public:
+    StagedFile() = default;
+
+    /**
+     * @brief ~StagedFile Removes the staged file unless it was committed
+     */
+    ~StagedFile();
+
+    /**
+     * @brief Create Creates the staged file in the destination's directory
+     * @details An existing destination's permissions are carried over, a new one gets the usual 0666 less umask
+     * @param[in] path_out The destination
+     * @returns Descriptor open for writing, owned by the caller and closed before Commit. -1 on failure
+     */
+    int Create(const std::string &path_out);
+
+    /**
+     * @brief Commit Renames the staged file over the destination
+     * @returns Success, the staged file is removed on failure
+     */
+    bool Commit();
+
+    /**
+     * @brief Discard Removes the staged file
+     */
+    void Discard();
+
+    StagedFile(const StagedFile &) = delete;
+    StagedFile &operator=(const StagedFile &) = delete;
+
+private:
+    std::string path_out_;
+    std::string path_staged_;
+};
+
+// A regular file mapped read only
+class MappedFile
+{
+public:
+    // Bytes handled per pass over a file, bounds how much of it is resident at once
+    static constexpr size_t kWindowLength = 8 * 1024 * 1024;
+
+    MappedFile() = default;
+
+    /**
+     * @brief ~MappedFile Unmaps and closes the file
+     */
+    ~MappedFile();
+
+    /**
+     * @brief Open Maps a file read only
+     * @param[in] path_in File to map
+     * @returns False if the file cannot be opened or is not a regular file (e.g. a pipe), callers fall back to buffered reads
+     */
+    bool Open(const std::string &path_in);
+
+    /**
+     * @brief Data Start of the mapped bytes, null for an empty file
+     */
+    const uint8_t *Data() const;
+
+    /**
+     * @brief Size Length of the file
+     */
+    size_t Size() const;
+
+    /**
+     * @brief Release Drops a processed range from memory, it is read back from the file if touched again
+     * @param[in] offset Start of the range
+     * @param[in] length Length of the range
+     */
+    void Release(size_t offset, size_t length);
+
+    /**
+     * @brief Prefetch Starts reading a range ahead of its use, without waiting for it
+     * @param[in] offset Start of the range
+     * @param[in] length Length of the range
+     */
+    void Prefetch(size_t offset, size_t length);
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+private:
+    int fd_ = -1;
+    uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// A file written at known offsets through a few rotating buffers, each written asynchronously (io_uring where
+// the kernel allows it, a writer thread otherwise) while the next one is being filled
+class OutputFile
+{
+public:
+    // Buffers in rotation, so up to this many less one writes are in flight while a buffer is filled
+    static constexpr size_t kWriteDepth = 3;
+
+    OutputFile();
+
+    /**
+     * @brief ~OutputFile Waits for outstanding writes and closes the file, Finish must be called to keep the contents
+     */
+    ~OutputFile();
+
+    /**
+     * @brief Open Creates a file and reserves its space up front
+     * @details It is staged (see StagedFile) and only replaces path_out in Finish
+     * @param[in] path_out File to write
+     * @param[in] length Final length of the file
+     * @returns Success
+     */
+    bool Open(const std::string &path_out, size_t length);
+
+    /**
+     * @brief Window Buffer to produce a range of the file in, waits if every buffer is still being written
+     * @param[in] offset Start of the range
+     * @param[in] length Length of the range
+     * @returns Where to write the range, hand it to Commit once filled. Null if the range is invalid or an earlier write failed
+     */
+    uint8_t *Window(size_t offset, size_t length);
+
+    /**
+     * @brief Commit Starts writing the range filled through the last Window call
+     * @param[in] offset Start of the range
+     * @param[in] length Length of the range
+     * @returns Success
+     */
+    bool Commit(size_t offset, size_t length);
+
+    /**
+     * @brief Finish Waits for every write, closes the file and puts it in place, keeping its contents
+     * @returns Success
+     */
+    bool Finish();
+
+    /**
+     * @brief Discard Closes and removes the file, path_out is left as it was
+     */
+    void Discard();
+
+    OutputFile(const OutputFile &) = delete;
+    OutputFile &operator=(const OutputFile &) = delete;
+
+private:
+    // One buffer and the write using it
+    struct WriteSlot
+    {
+        PooledBuffer buffer;
+        uint64_t offset = 0;
+        size_t length = 0;
+        size_t written = 0;
+        bool pending = false;
+        std::future<bool> done;
+        std::chrono::steady_clock::time_point submitted;
+    };
+
+    /**
+     * @brief Submit Starts writing the unwritten part of a slot
+     * @returns Success
+     */
+    bool Submit(size_t slot_index);
+
+    /**
+     * @brief Wait Waits until a slot's write has completed
+     * @returns False if the write failed
+     */
+    bool Wait(size_t slot_index);
+
+    /**
+     * @brief Close Waits for outstanding writes and closes the file
+     * @returns Success
+     */
+    bool Close();
+
+    std::string path_;
+    StagedFile staged_;
+    int fd_ = -1;
+    size_t size_ = 0;
+    bool failed_ = false;
+
+    std::vector<WriteSlot> slots_;
+    size_t next_slot_ = 0;
+
+    // Whichever of these carries the writes, the ring when the kernel allows it
+    std::unique_ptr<IoRing> ring_;
+    std::unique_ptr<ThreadPool> writer_;
+};
+
+// Buffered stream buffer over a descriptor owned by someone else (e.g. one received over a socket). Seekable
+// descriptors (files, memfds) can be repositioned, so encrypted output gets its length patched in; pipes cannot
+class DescriptorStreambuf : public std::streambuf
+{
+public:
+    // Bytes buffered each way
+    static constexpr size_t kBufferLength = 256 * 1024;
+
+    // Reads and writes at least this long (a whole chunk or record) skip the buffer, so they are copied only once
+    static constexpr size_t kDirectLength = 64 * 1024;
+
+    /**
+     * @brief DescriptorStreambuf Streams through a descriptor, which must outlive this buffer
+     * @param[in] fd Descriptor to read or write
+     */
+    explicit DescriptorStreambuf(int fd);
+
+    /**
+     * @brief ~DescriptorStreambuf Writes out anything still buffered, the descriptor stays open
+     */
+    ~DescriptorStreambuf() override;
+
+    DescriptorStreambuf(const DescriptorStreambuf &) = delete;
+    DescriptorStreambuf &operator=(const DescriptorStreambuf &) = delete;
+
+protected:
+    /**
+     * @brief underflow Reads the next buffer full
+     */
+    int_type underflow() override;
+
+    /**
+     * @brief xsgetn Reads large requests straight into the caller's buffer
+     */
+    std::streamsize xsgetn(char_type *data_out, std::streamsize length) override;
+
+    /**
+     * @brief overflow Writes out the buffer to make room for one more character
+     */
+    int_type overflow(int_type character) override;
+
+    /**
+     * @brief xsputn Writes large requests straight from the caller's buffer
+     */
+    std::streamsize xsputn(const char_type *data_in, std::streamsize length) override;
+
+    /**
+     * @brief sync Writes out the buffer
+     */
+    int sync() override;
+
+    /**
+     * @brief seekoff Moves the position of a seekable descriptor, fails on pipes and sockets
+     * @details Output positions of descriptors opened with O_APPEND fail as well, writes there always append
+     */
+    pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) override;
+
+    /**
+     * @brief seekpos Moves the position of a seekable descriptor to an absolute offset
+     */
+    pos_type seekpos(pos_type position, std::ios_base::openmode which) override;
+
+private:
+    /**
+     * @brief Reserve Makes room for some bytes in the output buffer, writing it out if needed
+     * @returns Success
+     */
+    bool Reserve(size_t length);
+
+    /**
+     * @brief Flush Writes out the buffered output
+     * @returns Success
+     */
+    bool Flush();
+
+    /**
+     * @brief WriteAll Writes all of a buffer to the descriptor
+     * @returns Success
+     */
+    bool WriteAll(const char *data_in, size_t length);
+
+    int fd_ = -1;
+
+    // Borrowed from the pool when first needed
+    PooledBuffer get_buffer_;
+    PooledBuffer put_buffer_;
+};
@@ -0,0 +1,170 @@
+/**
+ * Incremental encryption of a tree that mostly stays the same between runs
+ *
+ * A manifest, stored encrypted next to the output, remembers for every file its size and times, a truncated SHA-256
+ * of each chunk and a SHA-256 over those. Files whose size and times still match are skipped without being read.
+ * Others are hashed, and if their previous output is untouched only the records of chunks whose hash changed are
+ * encrypted again and written over the old ones.
+ *
+ * Outputs are containers with ContainerFormat::kFlagRecordNonces: every record carries its own random nonce and is
+ * bound to its index by the AAD, so rewriting a record under the file's existing key never reuses a nonce, not even
+ * when the manifest or the output has been restored from a backup. Whenever the previous output cannot be trusted
+ * to match the manifest (it was changed, other options are asked for, its key cannot be recovered) the file is
+ * encrypted from scratch under a new header.
+ */
+#pragma once
+
+#include "tpm_encrypt/data_encrypt.hpp"
+#include "tpm_encrypt/file_batch.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Size and times of a file, a change in any of them means it has to be looked at again
+struct FileState
+{
+    uint64_t size = 0;
+    // Modification and status change times, nanoseconds since the epoch
+    int64_t modified = 0;
+    int64_t changed = 0;
+
+    bool operator==(const FileState &other) const
+    {
+        return size == other.size && modified == other.modified && changed == other.changed;
+    }
+};
+
+// What the manifest remembers about one file
+struct FileManifest
+{
+    // The input as last encrypted
+    FileState input{};
+
+    // The output as last written, any other writer means its records may no longer match the digests
+    FileState output{};
+
+    // Chunk size the digests were taken at, 0 if the entry must not be trusted
+    uint32_t chunk_size = 0;
+
+    // SHA-256 over the chunk digests, identifies the content as a whole
+    std::array<uint8_t, 32> digest{};
+
+    // Truncated SHA-256 of every chunk, IncrementalEncrypt::kChunkDigestLength bytes each
+    std::vector<uint8_t> chunk_digests;
+};
+
+// What an incremental run did
+struct IncrementalStats
+{
+    // Size and times matched, the file was not read
+    uint64_t files_skipped = 0;
+    // Read and hashed, the content had not changed
+    uint64_t files_unchanged = 0;
+    // Changed chunks rewritten in the existing output
+    uint64_t files_updated = 0;
+    // Encrypted from scratch
+    uint64_t files_encrypted = 0;
+    uint64_t chunks_reused = 0;
+    uint64_t chunks_written = 0;
+
+    /**
+     * @brief Add Accumulates the stats of another run
+     */
+    void Add(const IncrementalStats &other);
+};
+
+class IncrementalEncrypt
+{
+public:
+    // Default constructor for static class
+    IncrementalEncrypt() = default;
+
+    // Bytes of SHA-256 kept per chunk, collisions need 2^64 work even when hunted for
+    static constexpr size_t kChunkDigestLength = 16;
+
+    /**
+     * @brief EncryptFile Encrypts a file, reusing what is still valid of its previous output
+     * @param[in] path_in File to be encrypted
+     * @param[in] path_out Path where the encrypted file shall be saved, possibly holding the previous output
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the data is encrypted, compressed files are encrypted from scratch whenever they change
+     * @param[in,out] manifest What was recorded for this file last time, updated on return
+     * @param[in,out] stats Counts of what was done are added here
+     * @returns Success, on failure the manifest entry is invalidated so the next run starts from scratch
+     */
+    static bool EncryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference,
+                            const EncryptOptions &options, FileManifest &manifest, IncrementalStats &stats);
+
+    /**
+     * @brief EncryptDirectory Encrypts every file below a directory into the same layout below another, skipping or
+     *                         patching the outputs of files that did not change (much) since the last run
+     * @param[in] root_in Directory to encrypt
+     * @param[in] root_out Directory where the encrypted tree shall be saved
+     * @param[in] key_reference Used to save the symmetric key against the TPM, and to protect the manifest
+     * @param[in] options How the data is encrypted
+     * @param[in] manifest_path Manifest of the previous run, created if missing and rewritten afterwards
+     * @param[in] worker_count Files encrypted at once, 0 uses one per hardware thread
+     * @param[out] results Outcome of each file
+     * @param[out] stats Counts of what was done
+     * @returns True if every file was encrypted and the manifest saved
+     */
+    static bool EncryptDirectory(const std::string &root_in, const std::string &root_out, const std::string &key_reference,
+                                 const EncryptOptions &options, const std::string &manifest_path, size_t worker_count,
+                                 std::vector<FileResult> &results, IncrementalStats &stats);
+
+    /**
+     * @brief LoadManifest Reads and decrypts a manifest
+     * @param[in] manifest_path Manifest to read, a missing file is an empty manifest
+     * @param[in] key_reference The symmetric key reference the manifest was saved with
+     * @param[out] files Entries keyed by path relative to the encrypted directory
+     * @returns False if the manifest exists but cannot be decrypted or parsed
+     */
+    static bool LoadManifest(const std::string &manifest_path, const std::string &key_reference, std::map<std::string, FileManifest> &files);
+
+    /**
+     * @brief SaveManifest Encrypts and writes a manifest, replacing the previous one only once it is complete
+     * @param[in] manifest_path Where to save the manifest
+     * @param[in] key_reference Used to save the symmetric key against the TPM
+     * @param[in] options How the manifest is encrypted
+     * @param[in] files Entries keyed by path relative to the encrypted directory
+     * @returns Success
+     */
+    static bool SaveManifest(const std::string &manifest_path, const std::string &key_reference, const EncryptOptions &options,
+                             const std::map<std::string, FileManifest> &files);
+
+    /**
+     * @brief Stat Reads the size and times of a file
+     * @returns False if the file does not exist or cannot be read
+     */
+    static bool Stat(const std::string &path, FileState &state);
+
+private:
+    /**
+     * @brief OpenPrevious Checks that the previous output can be patched and reads its header
+     * @param[in] path_out The previous output
+     * @param[in] options How the data is to be encrypted now
+     * @param[in] manifest What was recorded for the file, its length must match the output's
+     * @param[out] header Header of the previous output
+     * @param[out] header_length Bytes the header occupies
+     * @returns False if the file has to be encrypted from scratch
+     */
+    static bool OpenPrevious(const std::string &path_out, const EncryptOptions &options, const FileManifest &manifest,
+                             ContainerHeader &header, size_t &header_length);
+
+    /**
+     * @brief HashChunks Takes the digests of a run of chunks in parallel
+     * @param[in] plaintext The whole plaintext
+     * @param[in] plaintext_length Length of the whole plaintext
+     * @param[in] chunk_size Plaintext bytes per chunk
+     * @param[in] first_chunk Index of the first chunk to hash
+     * @param[in] chunk_count Number of chunks to hash
+     * @param[out] digests_out Receives kChunkDigestLength bytes per chunk
+     * @returns Success
+     */
+    static bool HashChunks(const uint8_t *plaintext, size_t plaintext_length, uint32_t chunk_size, size_t first_chunk,
+                           size_t chunk_count, uint8_t *digests_out);
+};
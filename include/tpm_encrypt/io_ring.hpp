@@ -0,0 +1,68 @@
+/**
+ * Minimal io_uring submission/completion ring, talking to the kernel interface directly
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class IoRing
+{
+public:
+    IoRing() = default;
+
+    /**
+     * @brief ~IoRing Unmaps the rings and closes the ring descriptor, requests still in flight are abandoned
+     */
+    ~IoRing();
+
+    /**
+     * @brief Open Creates the ring
+     * @param[in] entries Most requests that will be in flight at once
+     * @returns False if io_uring is unavailable (old kernel, disabled, filtered by seccomp), callers fall back to blocking I/O
+     */
+    bool Open(unsigned entries);
+
+    /**
+     * @brief SubmitWrite Queues a positioned write and hands it to the kernel
+     * @param[in] fd File to write
+     * @param[in] data Bytes to write, must stay valid until the write completes
+     * @param[in] length Length of data
+     * @param[in] offset Position in the file
+     * @param[in] tag Returned with the completion
+     * @returns Success
+     */
+    bool SubmitWrite(int fd, const uint8_t *data, size_t length, uint64_t offset, uint64_t tag);
+
+    /**
+     * @brief WaitCompletion Waits for any submitted request to complete
+     * @param[out] tag Tag of the completed request
+     * @param[out] result Bytes transferred, or a negative errno
+     * @returns False if the ring itself failed
+     */
+    bool WaitCompletion(uint64_t &tag, int64_t &result);
+
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
+
+private:
+    int fd_ = -1;
+    unsigned entries_ = 0;
+
+    // Shared with the kernel
+    void *sq_ring_ = nullptr;
+    size_t sq_ring_length_ = 0;
+    void *cq_ring_ = nullptr;
+    size_t cq_ring_length_ = 0;
+    void *sqes_ = nullptr;
+    size_t sqes_length_ = 0;
+
+    unsigned *sq_head_ = nullptr;
+    unsigned *sq_tail_ = nullptr;
+    unsigned *sq_mask_ = nullptr;
+    unsigned *sq_array_ = nullptr;
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    unsigned *cq_mask_ = nullptr;
+    void *cqes_ = nullptr;
+};
@@ -0,0 +1,132 @@
+/**
+ * In-memory cache of unsealed key material, saves a TPM round trip for repeated use of a key reference
+ */
+#pragma once
+
+#include "tpm_encrypt/secure_arena.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class KeyCache
+{
+public:
+    // Counters describing how the cache is performing
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t entries;
+    };
+
+    /**
+     * @brief Instance Returns the process wide key cache
+     */
+    static KeyCache &Instance();
+
+    /**
+     * @brief Configure Sets the cache limits, existing entries exceeding them are evicted
+     * @param[in] ttl How long an entry may be served after it was unsealed
+     * @param[in] max_entries Maximum number of key references held, 0 disables the cache
+     */
+    void Configure(std::chrono::seconds ttl, size_t max_entries);
+
+    /**
+     * @brief Lookup Fetches the key material for a reference if it is cached and not expired
+     * @param[in] key_reference The key reference
+     * @param[out] key_data The cached key
+     * @param[out] iv_data The cached iv
+     * @returns True on a cache hit
+     */
+    bool Lookup(const std::string &key_reference, SecureBytes &key_data, SecureBytes &iv_data);
+
+    /**
+     * @brief Generation Returns the current generation, taken before unsealing and handed to Insert
+     */
+    uint64_t Generation() const;
+
+    /**
+     * @brief Insert Stores freshly unsealed key material, evicting the least recently used entry when full
+     * @details Material unsealed before a later Invalidate or Clear (an older generation) is dropped, it may belong to
+     *          an object deleted since
+     * @param[in] key_reference The key reference
+     * @param[in] key_data The unsealed key
+     * @param[in] iv_data The unsealed iv
+     * @param[in] generation Generation() taken before the key was unsealed
+     */
+    void Insert(const std::string &key_reference, const SecureBytes &key_data, const SecureBytes &iv_data, uint64_t generation);
+
+    /**
+     * @brief Invalidate Drops (and wipes) the entry for a reference, and any unsealed before but inserted after
+     * @param[in] key_reference The key reference
+     */
+    void Invalidate(const std::string &key_reference);
+
+    /**
+     * @brief Clear Drops (and wipes) every entry, and any unsealed before but inserted after
+     */
+    void Clear();
+
+    /**
+     * @brief GetStats Returns the hit/miss counters and current size
+     */
+    Stats GetStats() const;
+
+private:
+    /**
+     * @brief KeyCache Registers the fork handlers
+     */
+    KeyCache();
+
+    /**
+     * @brief PrepareFork Holds the lock across fork, so the child never inherits it taken by a thread it lacks
+     */
+    static void PrepareFork();
+
+    /**
+     * @brief ParentAfterFork Releases the lock taken by PrepareFork
+     */
+    static void ParentAfterFork();
+
+    /**
+     * @brief ChildAfterFork Releases the lock and drops every entry, the arena wiped their keys in the child
+     */
+    static void ChildAfterFork();
+
+    struct Entry
+    {
+        SecureBytes key;
+        SecureBytes iv;
+        std::chrono::steady_clock::time_point expiry;
+        std::list<std::string>::iterator lru_position;
+    };
+
+    /**
+     * @brief EvictOldest Removes the least recently used entry
+     * @note The caller must hold mutex_
+     */
+    void EvictOldest();
+
+    mutable std::mutex mutex_;
+
+    // Cached entries, plus their usage order (front is most recently used)
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> lru_;
+
+    // Bumped by Invalidate and Clear, older inserts are stale
+    uint64_t generation_ = 0;
+
+    std::chrono::seconds ttl_{300};
+    size_t max_entries_ = 64;
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> evictions_{0};
+};
@@ -0,0 +1,66 @@
+/**
+ * Level gated diagnostics for the library, messages below the level are never formatted
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+// How much the library reports, each level includes those above it
+enum class LogLevel : uint8_t
+{
+    Debug = 0,
+    Info = 1,
+    Warning = 2,
+    Error = 3,
+    Off = 4,
+};
+
+class Logger
+{
+public:
+    /**
+     * @brief SetLevel Sets the least severe level written, Warning by default
+     * @param[in] level New level, Off silences the library
+     */
+    static void SetLevel(LogLevel level);
+
+    /**
+     * @brief SetOutput Sets where messages are written, std::clog by default
+     * @param[in] output Stream to write to, must outlive its use by the library
+     */
+    static void SetOutput(std::ostream &output);
+
+    /**
+     * @brief Enabled Whether messages at a level are written
+     */
+    static bool Enabled(LogLevel level)
+    {
+        return level >= level_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Write Writes one message without flushing, use TPM_ENCRYPT_LOG so disabled messages are never formatted
+     * @param[in] level Severity of the message
+     * @param[in] message The message, without a trailing newline
+     */
+    static void Write(LogLevel level, const std::string &message);
+
+private:
+    static inline std::atomic<LogLevel> level_{LogLevel::Warning};
+};
+
+// Formats and writes a message only if its level is enabled, e.g. TPM_ENCRYPT_LOG(LogLevel::Info, "Read " << n << " bytes")
+#define TPM_ENCRYPT_LOG(level, message)                         \
+    do                                                          \
+    {                                                           \
+        if (Logger::Enabled(level))                             \
+        {                                                       \
+            std::ostringstream tpm_encrypt_log_stream;          \
+            tpm_encrypt_log_stream << message;                  \
+            Logger::Write(level, tpm_encrypt_log_stream.str()); \
+        }                                                       \
+    } while (false)
@@ -0,0 +1,119 @@
+/**
+ * Process wide counters and latency histograms for the TPM, cipher and file I/O work done by the library
+ */
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What a measurement is of
+enum class Operation : uint8_t
+{
+    // Creating (and if needed provisioning) the FAPI context
+    FapiInit = 0,
+    // Sealing an object on the TPM
+    Seal = 1,
+    // Unsealing an object from the TPM
+    Unseal = 2,
+    // Encrypting one chunk (or a whole legacy payload)
+    Encrypt = 3,
+    // Decrypting one chunk (or a whole legacy payload)
+    Decrypt = 4,
+    // Reading input that is not mapped (streams, pipes)
+    Read = 5,
+    // Writing output
+    Write = 6,
+    // Compressing one chunk before it is encrypted, incompressible chunks included
+    Compress = 7,
+    // Decompressing one chunk after it was decrypted
+    Decompress = 8,
+    // Authenticating one chunk without keeping its plaintext
+    Verify = 9,
+};
+
+// Totals for one kind of operation since the process started (or the last Reset)
+struct OperationStats
+{
+    std::string name;
+    uint64_t count = 0;
+    uint64_t failures = 0;
+    uint64_t bytes = 0;
+    uint64_t total_microseconds = 0;
+    // Operations per latency bucket, bucket i counts those up to Metrics::kBucketBounds[i], the last one the rest
+    std::vector<uint64_t> buckets;
+};
+
+// A snapshot of every operation's totals
+struct Stats
+{
+    std::vector<OperationStats> operations;
+};
+
+class Metrics
+{
+public:
+    // Number of operation kinds
+    static constexpr size_t kOperationCount = 10;
+
+    // Upper bounds of the latency buckets in microseconds, one more bucket holds anything slower
+    static constexpr size_t kBucketCount = 12;
+    static constexpr std::array<uint64_t, kBucketCount> kBucketBounds{
+        10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000};
+
+    // Times one operation, recorded as a failure unless Stop reports otherwise (so exceptions count as failures)
+    class Timer
+    {
+    public:
+        explicit Timer(Operation operation);
+
+        /**
+         * @brief ~Timer Records the operation as failed if Stop was not called
+         */
+        ~Timer();
+
+        /**
+         * @brief Stop Records the operation
+         * @param[in] bytes Bytes the operation handled
+         * @param[in] success Whether it succeeded
+         */
+        void Stop(uint64_t bytes, bool success);
+
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+    private:
+        Operation operation_;
+        std::chrono::steady_clock::time_point start_;
+        bool stopped_ = false;
+    };
+
+    /**
+     * @brief Record Adds one operation to the totals
+     * @param[in] operation What was done
+     * @param[in] elapsed How long it took
+     * @param[in] bytes Bytes it handled
+     * @param[in] success Whether it succeeded
+     */
+    static void Record(Operation operation, std::chrono::steady_clock::duration elapsed, uint64_t bytes, bool success);
+
+    /**
+     * @brief GetStats Current totals of every operation
+     * @returns A snapshot, operations are listed in Operation order
+     */
+    static Stats GetStats();
+
+    /**
+     * @brief PrometheusText Current totals in the Prometheus text exposition format
+     * @returns Counters and a latency histogram per operation, ready to serve from a /metrics endpoint
+     */
+    static std::string PrometheusText();
+
+    /**
+     * @brief Reset Sets every total back to zero
+     */
+    static void Reset();
+};
@@ -0,0 +1,118 @@
+/**
+ * Locked memory for key material
+ *
+ * One region is reserved on first use: locked into RAM (never swapped), left out of core dumps, zeroed in forked
+ * children and fenced by inaccessible guard pages. It is cut into fixed size slots, each key or iv takes one, so
+ * taking and returning keys costs no system calls. Slots are wiped when they are returned.
+ *
+ * A forked child finds every slot zeroed. Keys held across fork (e.g. by an open ChunkReader) no longer work
+ * there, the key cache is emptied instead so the child unseals again.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class SecureArena
+{
+public:
+    // Bytes per slot, enough for the longest key used (the 64 byte AES-256-CTR + HMAC chunk key)
+    static constexpr size_t kSlotLength = 64;
+
+    // Slots reserved, a few per worker thread plus the key cache fit in one 64 KB region
+    static constexpr size_t kSlotCount = 1024;
+
+    // Counters describing how the arena is used
+    struct Stats
+    {
+        size_t slots_in_use;
+        uint64_t overflows;
+        uint64_t lock_failures; // Overflow buffers that could not be locked into RAM
+        bool locked;            // Whether the slots are locked into RAM
+    };
+
+    /**
+     * @brief Instance Returns the process wide arena, reserving it on first use
+     * @details Call it at startup so the reservation is not paid by the first request
+     */
+    static SecureArena &Instance();
+
+    /**
+     * @brief Allocate Takes memory for key material
+     * @details Requests up to kSlotLength take a slot. Longer ones, or any once every slot is taken, get locked
+     *          pages of their own, which costs system calls
+     * @param[in] length Bytes needed
+     * @returns The memory, std::bad_alloc is thrown if there is none
+     */
+    void *Allocate(size_t length);
+
+    /**
+     * @brief Release Wipes and returns memory from Allocate
+     * @param[in] pointer The memory
+     * @param[in] length Bytes requested for it
+     */
+    void Release(void *pointer, size_t length);
+
+    /**
+     * @brief GetStats Returns how many slots are taken, how often requests did not fit and whether memory was locked
+     */
+    Stats GetStats() const;
+
+    SecureArena(const SecureArena &) = delete;
+    SecureArena &operator=(const SecureArena &) = delete;
+
+private:
+    /**
+     * @brief SecureArena Maps, guards and locks the slots
+     */
+    SecureArena();
+
+    // Guard page, slots, guard page
+    uint8_t *mapping_ = nullptr;
+    size_t mapping_length_ = 0;
+    uint8_t *slots_ = nullptr;
+    bool locked_ = false;
+
+    // Free slots as a lock free stack: the top is (generation << 32 | slot + 1), 0 when empty. The generation
+    // changes on every pop so a slot popped and pushed back in between cannot be mistaken for the old top
+    std::atomic<uint64_t> free_top_{0};
+    std::unique_ptr<std::atomic<uint32_t>[]> next_free_;
+
+    std::atomic<size_t> slots_in_use_{0};
+    std::atomic<uint64_t> overflows_{0};
+    std::atomic<uint64_t> lock_failures_{0};
+};
+
+/**
+ * Allocator placing containers in the SecureArena
+ */
+template <typename T>
+struct SecureAllocator
+{
+    using value_type = T;
+
+    SecureAllocator() = default;
+    template <typename U>
+    SecureAllocator(const SecureAllocator<U> &) {}
+
+    T *allocate(size_t count)
+    {
+        return static_cast<T *>(SecureArena::Instance().Allocate(count * sizeof(T)));
+    }
+
+    void deallocate(T *pointer, size_t count)
+    {
+        SecureArena::Instance().Release(pointer, count * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const SecureAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const SecureAllocator<U> &) const { return false; }
+};
+
+// Keys, ivs and anything else unsealed from the TPM or derived from it
+using SecureBytes = std::vector<uint8_t, SecureAllocator<uint8_t>>;
@@ -0,0 +1,102 @@
+/**
+ * Fixed size pool of worker threads
+ *
+ * A forked child inherits none of the workers, pools created before the fork run their tasks on the calling thread there
+ */
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    /**
+     * @brief ThreadPool Starts the worker threads
+     * @param[in] thread_count Number of workers, 0 uses one per hardware thread
+     */
+    explicit ThreadPool(size_t thread_count);
+
+    /**
+     * @brief ~ThreadPool Finishes the queued tasks and joins the workers
+     */
+    ~ThreadPool();
+
+    /**
+     * @brief Shared Returns the process wide pool used for chunk level cipher work
+     */
+    static ThreadPool &Shared();
+
+    /**
+     * @brief Requests Returns the process wide pool running whole asynchronous requests
+     * @details Kept apart from Shared, so a request waiting on the TPM or on its own chunks never holds a chunk worker
+     */
+    static ThreadPool &Requests();
+
+    /**
+     * @brief Size Number of worker threads
+     */
+    size_t Size() const;
+
+    /**
+     * @brief Submit Queues a task
+     * @param[in] task Callable run on a worker
+     * @returns Future for the task's result
+     */
+    template <typename Task>
+    auto Submit(Task &&task) -> std::future<decltype(task())>
+    {
+        using Result = decltype(task());
+
+        // std::function needs a copyable target, the packaged task is shared instead
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<Task>(task));
+        std::future<Result> result = packaged->get_future();
+        Enqueue([packaged]()
+                { (*packaged)(); });
+        return result;
+    }
+
+    /**
+     * @brief ParallelFor Runs body(i) for every i in [0, count) across the pool
+     * @details Indices are handed out in contiguous ranges, remaining work is skipped once any call fails
+     * @param[in] count Number of iterations
+     * @param[in] body Work for one index, returns success
+     * @returns True if every call succeeded
+     */
+    bool ParallelFor(size_t count, const std::function<bool(size_t)> &body);
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+private:
+    /**
+     * @brief Enqueue Adds a task to the queue and wakes a worker
+     */
+    void Enqueue(std::function<void()> task);
+
+    /**
+     * @brief WorkerLoop Runs queued tasks until the pool is destroyed
+     */
+    void WorkerLoop();
+
+    /**
+     * @brief Forked Whether this is a forked child of the process that started the workers
+     */
+    bool Forked() const;
+
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool stopping_ = false;
+
+    // Fork generation the workers were started in, see Forked
+    uint64_t generation_ = 0;
+};
@@ -0,0 +1,146 @@
+/**
+ * Long-lived connection to the TPM shared by every operation in this process
+ *
+ * FAPI contexts are not thread safe and the TPM runs one command at a time, so the context is owned by a
+ * dedicated scheduler thread and every command is queued to it. Any thread may call in, callers block only
+ * until their own command has run.
+ */
+#pragma once
+
+#include "tpm_encrypt/esys_unsealer.hpp"
+#include "tpm_encrypt/secure_arena.hpp"
+#include "tpm_encrypt/thread_pool.hpp"
+
+#include <string>
+#include <tss2/tss2_fapi.h>
+#include <memory>
+#include <vector>
+
+class TpmSession
+{
+public:
+    /**
+     * @brief Instance Returns the process wide session, the FAPI context is created on first use
+     * @returns The shared session
+     */
+    static TpmSession &Instance();
+
+    /**
+     * @brief Connect Initialises (and if needed provisions) the FAPI context now rather than on first use
+     * @throws std::runtime_error if the TPM cannot be initialised
+     */
+    void Connect();
+
+    /**
+     * @brief CreateSeal Seals some data against the TPM
+     * @param[in] path FAPI path where the sealed object is stored
+     * @param[in] data Data to seal
+     * @param[in] length Length of data
+     * @returns Success
+     */
+    bool CreateSeal(const std::string &path, const uint8_t *data, size_t length);
+
+    /**
+     * @brief Unseal Reads sealed data back from the TPM
+     * @param[in] path FAPI path of the sealed object
+     * @param[out] data_out The unsealed data
+     * @returns Success
+     */
+    bool Unseal(const std::string &path, SecureBytes &data_out);
+
+    /**
+     * @brief Unseal Reads sealed data back from the TPM, quietly failing if nothing is sealed at the path
+     * @details For probing whether something needs creating first
+     * @param[in] path FAPI path of the sealed object
+     * @param[out] data_out The unsealed data
+     * @param[out] missing Set if nothing is sealed at path, other failures are reported
+     * @returns Success
+     */
+    bool Unseal(const std::string &path, SecureBytes &data_out, bool &missing);
+
+    /**
+     * @brief GetRandom Draws random bytes from the TPM's generator
+     * @param[out] data_out Buffer to fill
+     * @param[in] length Bytes to fill
+     * @returns Success
+     */
+    bool GetRandom(uint8_t *data_out, size_t length);
+
+    /**
+     * @brief Delete Removes an object (or a whole subtree) from the FAPI keystore
+     * @param[in] path FAPI path to delete
+     * @returns Success, false without an error message if nothing is stored at the path
+     */
+    bool Delete(const std::string &path);
+
+    /**
+     * @brief SetEsysUnseal Unseals through ESYS with the SRK, a session and recent objects kept loaded
+     * @details Off by default. Objects are still created by and read from FAPI, anything the fast path cannot
+     *          handle (objects with a policy, TPM errors) falls back to Fapi_Unseal
+     * @param[in] enabled Whether to use the fast path
+     */
+    void SetEsysUnseal(bool enabled);
+
+    /**
+     * @brief Reset Deletes all user generated data from the TPM and forgets that it was provisioned
+     */
+    void Reset();
+
+    /**
+     * @brief Close Finalises the FAPI context, the next operation will initialise (and provision) again
+     */
+    void Close();
+
+    /**
+     * @brief AuthCallback Presents authentication to the TPM when requested
+     */
+    static TSS2_RC AuthCallback(
+        char const *objectPath,
+        char const *description,
+        const char **auth,
+        void *userData);
+
+    TpmSession(const TpmSession &) = delete;
+    TpmSession &operator=(const TpmSession &) = delete;
+
+private:
+    TpmSession();
+
+    /**
+     * @brief ~TpmSession Finalises the context on the scheduler thread and stops it
+     */
+    ~TpmSession();
+
+    /**
+     * @brief ChildAfterFork Drops the connection inherited from the parent, the child opens its own on first use
+     */
+    static void ChildAfterFork();
+
+    /**
+     * @brief Schedule Queues a command behind every earlier one and waits for it
+     * @note Must not be called from a command, the scheduler would wait on itself
+     * @returns Whatever the command returns, exceptions it throws are rethrown here
+     */
+    template <typename Command>
+    auto Schedule(Command &&command) -> decltype(command())
+    {
+        return scheduler_.Submit(std::forward<Command>(command)).get();
+    }
+
+    /**
+     * @brief Context Returns the FAPI context, initialising and provisioning it if required
+     * @note Only called from commands running on the scheduler thread
+     * @throws std::runtime_error if the TPM cannot be initialised
+     */
+    FAPI_CONTEXT *Context();
+
+    // Connection to the TPM, nullptr until first use, only touched by the scheduler thread
+    std::unique_ptr<FAPI_CONTEXT, void (*)(FAPI_CONTEXT *)> context_;
+
+    // ESYS fast path for Unseal on the same connection, only touched by the scheduler thread
+    EsysUnsealer esys_unsealer_;
+    bool esys_unseal_ = false;
+
+    // The one thread running TPM commands, in the order they were queued
+    ThreadPool scheduler_;
+};
@@ -0,0 +1,261 @@
+#include "tpm_encrypt/buffer_pool.hpp"
+#include "tpm_encrypt/logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * @brief PageSize Size of a memory page
+ */
+static size_t PageSize()
+{
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return page_size;
+}
+
+/**
+ * @brief RoundUp Rounds a length up to a multiple of a power of two
+ */
+static size_t RoundUp(size_t length, size_t multiple)
+{
+    return (length + multiple - 1) & ~(multiple - 1);
+}
+
+/**
+ * @brief ~PooledBuffer Returns the buffer to the pool
+ */
+PooledBuffer::~PooledBuffer()
+{
+    Reset();
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer &&other) noexcept
+    : data_(other.data_), length_(other.length_), size_class_(other.size_class_)
+{
+    other.data_ = nullptr;
+    other.length_ = 0;
+}
+
+PooledBuffer &PooledBuffer::operator=(PooledBuffer &&other) noexcept
+{
+    if (this != &other)
+    {
+        Reset();
+        data_ = other.data_;
+        length_ = other.length_;
+        size_class_ = other.size_class_;
+        other.data_ = nullptr;
+        other.length_ = 0;
+    }
+    return *this;
+}
+
+/**
+ * @brief Reset Returns the buffer to the pool early
+ */
+void PooledBuffer::Reset()
+{
+    if (data_ != nullptr)
+    {
+        BufferPool::Shared().Return(data_, size_class_);
+        data_ = nullptr;
+        length_ = 0;
+    }
+}
+
+/**
+ * @brief Shared Returns the process wide pool
+ */
+BufferPool &BufferPool::Shared()
+{
+    // Never destroyed, buffers held by static and thread local objects may be returned during exit
+    static BufferPool *pool = new BufferPool();
+    return *pool;
+}
+
+/**
+ * @brief Configure Sets how much memory the pool keeps and where it comes from
+ * @param[in] max_bytes Most memory reserved, requests beyond it are allocated on their own
+ * @param[in] huge_pages Page size to back the pool with
+ */
+void BufferPool::Configure(size_t max_bytes, HugePages huge_pages)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_bytes_ = max_bytes;
+    huge_pages_ = huge_pages;
+}
+
+/**
+ * @brief Acquire Borrows a buffer of at least a given length
+ * @param[in] length Bytes needed
+ * @returns The buffer, std::bad_alloc is thrown if there is no memory
+ */
+PooledBuffer BufferPool::Acquire(size_t length)
+{
+    size_t size_class = 0;
+    while (size_class < kClassCount && ClassLength(size_class) < length)
+    {
+        size_class++;
+    }
+
+    PooledBuffer buffer{};
+    buffer.length_ = length;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        acquires_++;
+        if (size_class < kClassCount && (!free_[size_class].empty() || Grow(size_class)))
+        {
+            buffer.data_ = free_[size_class].back();
+            buffer.size_class_ = size_class;
+            free_[size_class].pop_back();
+            in_use_bytes_ += ClassLength(size_class);
+            buffers_in_use_++;
+            return buffer;
+        }
+        overflows_++;
+    }
+
+    // Over the cap (or larger than any class): memory of its own, freed again when it is returned
+    void *data = std::aligned_alloc(PageSize(), RoundUp(std::max<size_t>(length, 1), PageSize()));
+    if (data == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    buffer.data_ = static_cast<uint8_t *>(data);
+    buffer.size_class_ = kUnpooled;
+    return buffer;
+}
+
+/**
+ * @brief GetStats Returns how much memory is reserved and borrowed
+ */
+BufferPool::Stats BufferPool::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Stats{reserved_bytes_, in_use_bytes_, buffers_in_use_, acquires_, overflows_, huge_page_bytes_};
+}
+
+/**
+ * @brief ClassLength Bytes in a buffer of a size class
+ */
+size_t BufferPool::ClassLength(size_t size_class)
+{
+    // 64K, 80K, 96K, 112K, 128K, 160K, ...
+    size_t base = kMinBufferLength << (size_class / 4);
+    return base + base / 4 * (size_class % 4);
+}
+
+/**
+ * @brief Grow Maps memory for more buffers of a size class
+ * @note The caller must hold mutex_
+ * @returns False if the cap leaves no room or mapping failed
+ */
+bool BufferPool::Grow(size_t size_class)
+{
+    // Small classes share a block, large ones get a mapping each, both in whole blocks
+    size_t class_length = ClassLength(size_class);
+    size_t mapping_length = RoundUp(class_length, kBlockLength);
+    if (reserved_bytes_ + mapping_length > max_bytes_)
+    {
+        return false;
+    }
+
+    uint8_t *mapping = Map(mapping_length);
+    if (mapping == nullptr)
+    {
+        return false;
+    }
+
+    for (size_t offset = 0; offset + class_length <= mapping_length; offset += class_length)
+    {
+        free_[size_class].push_back(mapping + offset);
+    }
+    return true;
+}
+
+/**
+ * @brief Map Maps, aligns and faults in memory for the pool
+ * @note The caller must hold mutex_
+ * @returns The memory, null on failure
+ */
+uint8_t *BufferPool::Map(size_t length)
+{
+    void *mapping = MAP_FAILED;
+    if (huge_pages_ == HugePages::Explicit)
+    {
+        mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (mapping != MAP_FAILED)
+        {
+            huge_page_bytes_ += length;
+        }
+        else
+        {
+            TPM_ENCRYPT_LOG(LogLevel::Debug, "No huge pages free for the buffer pool, using normal pages");
+        }
+    }
+
+    if (mapping == MAP_FAILED)
+    {
+        // Over-allocated by a block and trimmed, so transparent huge pages can back the whole range
+        size_t padded_length = length + kBlockLength;
+        void *padded = mmap(nullptr, padded_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (padded == MAP_FAILED)
+        {
+            TPM_ENCRYPT_LOG(LogLevel::Warning, "Unable to map memory for the buffer pool: " << std::strerror(errno));
+            return nullptr;
+        }
+
+        uintptr_t start = reinterpret_cast<uintptr_t>(padded);
+        uintptr_t aligned = RoundUp(start, kBlockLength);
+        if (aligned > start)
+        {
+            munmap(padded, aligned - start);
+        }
+        if (aligned + length < start + padded_length)
+        {
+            munmap(reinterpret_cast<void *>(aligned + length), start + padded_length - aligned - length);
+        }
+        mapping = reinterpret_cast<void *>(aligned);
+
+        if (huge_pages_ == HugePages::Transparent)
+        {
+            madvise(mapping, length, MADV_HUGEPAGE);
+        }
+
+        // Faulted in now rather than by the first request to use each page
+        uint8_t *bytes = static_cast<uint8_t *>(mapping);
+        for (size_t offset = 0; offset < length; offset += PageSize())
+        {
+            bytes[offset] = 0;
+        }
+    }
+
+    // Buffers hold plaintext, which has no place in a core dump
+    madvise(mapping, length, MADV_DONTDUMP);
+
+    reserved_bytes_ += length;
+    return static_cast<uint8_t *>(mapping);
+}
+
+/**
+ * @brief Return Takes a buffer back
+ */
+void BufferPool::Return(uint8_t *data, size_t size_class)
+{
+    if (size_class == kUnpooled)
+    {
+        std::free(data);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_[size_class].push_back(data);
+    in_use_bytes_ -= ClassLength(size_class);
+    buffers_in_use_--;
+}
@@ -0,0 +1,562 @@
+#include "tpm_encrypt/chunk_cipher.hpp"
+#include "tpm_encrypt/cipher_engine.hpp"
+#include "tpm_encrypt/cipher_suite.hpp"
+#include "tpm_encrypt/compression.hpp"
+#include "tpm_encrypt/entropy.hpp"
+#include "tpm_encrypt/metrics.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+// Counter block of a CTR chunk: the chunk nonce, then a 32 bit block counter starting at zero
+static const size_t kCounterBlockLength = 16;
+
+// A CTR chunk key is the cipher key followed by the MAC key
+static const size_t kCtrKeyLength = 32;
+
+// Plaintext an AEAD chunk is verified through at a time, small enough to stay in the L1/L2 cache
+static const size_t kVerifySliceLength = 16 * 1024;
+
+/**
+ * @brief WriteUint32 Stores a little endian u32
+ */
+static void WriteUint32(uint8_t *data_out, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++)
+    {
+        data_out[i] = static_cast<uint8_t>((value >> (8 * i)) & 0xff);
+    }
+}
+
+/**
+ * @brief ReadUint32 Loads a little endian u32
+ */
+static uint32_t ReadUint32(const uint8_t *data_in)
+{
+    return static_cast<uint32_t>(data_in[0]) | (static_cast<uint32_t>(data_in[1]) << 8) |
+           (static_cast<uint32_t>(data_in[2]) << 16) | (static_cast<uint32_t>(data_in[3]) << 24);
+}
+
+/**
+ * @brief CounterBlock Initial counter block of a CTR chunk, chunk nonces differ within their first 12 bytes so the
+ *        keystreams of two chunks (at most kMaxChunkSize, well below 2^32 blocks) never overlap
+ */
+static void CounterBlock(const uint8_t *nonce, uint8_t block_out[kCounterBlockLength])
+{
+    std::memset(block_out, 0, kCounterBlockLength);
+    std::memcpy(block_out, nonce, ChunkCipher::kNonceLength);
+}
+
+/**
+ * @brief ChunkMac HMAC-SHA256 of a CTR chunk, truncated to the tag length
+ * @details Covers the nonce, record AAD, header AAD and ciphertext. The first two have fixed lengths (for a given
+ *          header) and the record header gives the ciphertext length, so the split between the parts is unambiguous
+ */
+static bool ChunkMac(const SecureBytes &key, const std::string &header_aad, const uint8_t *nonce,
+                     const uint8_t *record_aad, size_t record_aad_length, const uint8_t *ciphertext, size_t ciphertext_length, uint8_t *tag_out)
+{
+    uint8_t mac[CipherEngine::kHmacSha256Length];
+    bool computed = CipherEngine::HmacSha256(key.data() + kCtrKeyLength, key.size() - kCtrKeyLength,
+                                             {{nonce, ChunkCipher::kNonceLength},
+                                              {record_aad, record_aad_length},
+                                              {reinterpret_cast<const uint8_t *>(header_aad.data()), header_aad.size()},
+                                              {ciphertext, ciphertext_length}},
+                                             mac);
+    std::memcpy(tag_out, mac, ChunkCipher::kTagLength);
+    return computed;
+}
+
+/**
+ * @brief SealRecord Encrypts a chunk payload and produces its tag, with the suite named in the header
+ * @returns Success
+ */
+static bool SealRecord(CipherId cipher, const SecureBytes &key, const std::string &header_aad, const uint8_t *nonce,
+                       const uint8_t *record_aad, size_t record_aad_length, const uint8_t *plaintext, size_t plaintext_length,
+                       uint8_t *ciphertext, uint8_t *tag)
+{
+    int len = 0;
+    if (!CipherSuite::IsAead(cipher))
+    {
+        // Encrypt then MAC
+        uint8_t counter_block[kCounterBlockLength];
+        CounterBlock(nonce, counter_block);
+        EVP_CIPHER_CTX *ctx = CipherEngine::Context(CipherSuite::Cipher(cipher), true, key.data(), counter_block);
+        return ctx != nullptr &&
+               1 == EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_length) &&
+               1 == EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) &&
+               ChunkMac(key, header_aad, nonce, record_aad, record_aad_length, ciphertext, plaintext_length, tag);
+    }
+
+    // Chunks after the first on a thread reuse its keyed context, only the nonce is set
+    EVP_CIPHER_CTX *ctx = CipherEngine::Context(CipherSuite::Cipher(cipher), true, key.data(), nonce);
+    return ctx != nullptr &&
+           1 == EVP_EncryptUpdate(ctx, nullptr, &len, reinterpret_cast<const uint8_t *>(header_aad.data()), header_aad.size()) &&
+           1 == EVP_EncryptUpdate(ctx, nullptr, &len, record_aad, record_aad_length) &&
+           1 == EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_length) &&
+           1 == EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) &&
+           1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, ChunkCipher::kTagLength, tag);
+}
+
+/**
+ * @brief OpenRecord Authenticates and decrypts a chunk payload, with the suite named in the header
+ * @returns False if the chunk fails authentication
+ */
+static bool OpenRecord(CipherId cipher, const SecureBytes &key, const std::string &header_aad, const uint8_t *nonce,
+                       const uint8_t *record_aad, size_t record_aad_length, const uint8_t *ciphertext, size_t ciphertext_length, const uint8_t *tag,
+                       uint8_t *plaintext_out, size_t &plaintext_length)
+{
+    int len = 0;
+    int final_len = 0;
+    if (!CipherSuite::IsAead(cipher))
+    {
+        // Nothing is decrypted before the MAC checks out
+        uint8_t expected_tag[ChunkCipher::kTagLength];
+        if (!ChunkMac(key, header_aad, nonce, record_aad, record_aad_length, ciphertext, ciphertext_length, expected_tag) ||
+            CRYPTO_memcmp(expected_tag, tag, ChunkCipher::kTagLength) != 0)
+        {
+            return false;
+        }
+
+        uint8_t counter_block[kCounterBlockLength];
+        CounterBlock(nonce, counter_block);
+        EVP_CIPHER_CTX *ctx = CipherEngine::Context(CipherSuite::Cipher(cipher), false, key.data(), counter_block);
+        if (ctx == nullptr ||
+            1 != EVP_DecryptUpdate(ctx, plaintext_out, &len, ciphertext, ciphertext_length) ||
+            1 != EVP_DecryptFinal_ex(ctx, plaintext_out + len, &final_len))
+        {
+            return false;
+        }
+        plaintext_length = static_cast<size_t>(len) + final_len;
+        return true;
+    }
+
+    EVP_CIPHER_CTX *ctx = CipherEngine::Context(CipherSuite::Cipher(cipher), false, key.data(), nonce);
+    if (ctx == nullptr ||
+        1 != EVP_DecryptUpdate(ctx, nullptr, &len, reinterpret_cast<const uint8_t *>(header_aad.data()), header_aad.size()) ||
+        1 != EVP_DecryptUpdate(ctx, nullptr, &len, record_aad, record_aad_length) ||
+        1 != EVP_DecryptUpdate(ctx, plaintext_out, &len, ciphertext, ciphertext_length) ||
+        1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, ChunkCipher::kTagLength, const_cast<uint8_t *>(tag)) ||
+        1 != EVP_DecryptFinal_ex(ctx, plaintext_out + len, &final_len))
+    {
+        return false;
+    }
+    plaintext_length = static_cast<size_t>(len) + final_len;
+    return true;
+}
+
+/**
+ * @brief AuthenticateRecord Checks the tag of a chunk payload without keeping its plaintext
+ * @returns False if the chunk fails authentication
+ */
+static bool AuthenticateRecord(CipherId cipher, const SecureBytes &key, const std::string &header_aad, const uint8_t *nonce,
+                               const uint8_t *record_aad, size_t record_aad_length, const uint8_t *ciphertext, size_t ciphertext_length, const uint8_t *tag)
+{
+    if (!CipherSuite::IsAead(cipher))
+    {
+        // The MAC covers the ciphertext, nothing needs decrypting
+        uint8_t expected_tag[ChunkCipher::kTagLength];
+        return ChunkMac(key, header_aad, nonce, record_aad, record_aad_length, ciphertext, ciphertext_length, expected_tag) &&
+               CRYPTO_memcmp(expected_tag, tag, ChunkCipher::kTagLength) == 0;
+    }
+
+    // The tag is only checked by decrypting, each slice overwrites the last and never leaves the cache
+    uint8_t slice[kVerifySliceLength];
+    int len = 0;
+    EVP_CIPHER_CTX *ctx = CipherEngine::Context(CipherSuite::Cipher(cipher), false, key.data(), nonce);
+    bool authentic = ctx != nullptr &&
+                     1 == EVP_DecryptUpdate(ctx, nullptr, &len, reinterpret_cast<const uint8_t *>(header_aad.data()), header_aad.size()) &&
+                     1 == EVP_DecryptUpdate(ctx, nullptr, &len, record_aad, record_aad_length);
+    for (size_t offset = 0; authentic && offset < ciphertext_length; offset += kVerifySliceLength)
+    {
+        size_t slice_length = std::min(kVerifySliceLength, ciphertext_length - offset);
+        authentic = 1 == EVP_DecryptUpdate(ctx, slice, &len, ciphertext + offset, static_cast<int>(slice_length));
+    }
+    authentic = authentic &&
+                1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, ChunkCipher::kTagLength, const_cast<uint8_t *>(tag)) &&
+                1 == EVP_DecryptFinal_ex(ctx, slice, &len);
+
+    OPENSSL_cleanse(slice, sizeof(slice));
+    return authentic;
+}
+
+/**
+ * @brief ChunkNonce Derives the nonce of a chunk from the header nonce and the chunk index
+ */
+void ChunkCipher::ChunkNonce(const ContainerHeader &header, uint64_t index, uint8_t nonce_out[kNonceLength])
+{
+    std::memcpy(nonce_out, header.nonce.data(), kNonceLength);
+    for (size_t i = 0; i < 8; i++)
+    {
+        nonce_out[kNonceLength - 1 - i] ^= static_cast<uint8_t>((index >> (8 * i)) & 0xff);
+    }
+}
+
+/**
+ * @brief RecordAad Record part of the additional data: the record header, then with record nonces the chunk index
+ * @returns Bytes written to record_aad_out
+ */
+size_t ChunkCipher::RecordAad(const ContainerHeader &header, uint64_t index, const uint8_t *record, uint8_t record_aad_out[kMaxRecordAadLength])
+{
+    std::memcpy(record_aad_out, record, kRecordHeaderLength);
+    if ((header.flags & ContainerFormat::kFlagRecordNonces) == 0)
+    {
+        return kRecordHeaderLength;
+    }
+
+    // A nonce no longer says where its record belongs, the index does instead
+    WriteUint32(record_aad_out + kRecordHeaderLength, static_cast<uint32_t>(index & 0xffffffff));
+    WriteUint32(record_aad_out + kRecordHeaderLength + 4, static_cast<uint32_t>(index >> 32));
+    return kMaxRecordAadLength;
+}
+
+/**
+ * @brief SealChunk Encrypts and authenticates one chunk
+ * @param[in] header Container header, supplies the cipher and base nonce
+ * @param[in] key The chunk key, see CipherSuite::DeriveChunkKey
+ * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+ * @param[in] index Position of the chunk in the container
+ * @param[in] final Whether this is the last chunk
+ * @param[in] plaintext The chunk plaintext
+ * @param[in] plaintext_length Length of plaintext, at most header.chunk_size
+ * @param[out] record_out Receives RecordLength(header, plaintext_length) bytes
+ * @returns Success
+ */
+bool ChunkCipher::SealChunk(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                            uint64_t index, bool final, const uint8_t *plaintext, size_t plaintext_length, uint8_t *record_out)
+{
+    return SealPayload(header, key, header_aad, index, final ? kChunkFinal : 0, plaintext, plaintext_length, record_out);
+}
+
+/**
+ * @brief SealChunk Compresses (if the header asks for it and it pays off), encrypts and authenticates one chunk
+ * @param[in] header Container header, supplies the cipher, compression and base nonce
+ * @param[in] key The chunk key, see CipherSuite::DeriveChunkKey
+ * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+ * @param[in] index Position of the chunk in the container
+ * @param[in] final Whether this is the last chunk
+ * @param[in] plaintext The chunk plaintext
+ * @param[in] plaintext_length Length of plaintext, at most header.chunk_size
+ * @param[in] compression_level Level for the header's compression, see Compression::Compress
+ * @param[out] record_out Receives the record, at most RecordLength(header, plaintext_length) bytes
+ * @param[out] record_length Bytes the record occupies
+ * @returns Success
+ */
+bool ChunkCipher::SealChunk(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                            uint64_t index, bool final, const uint8_t *plaintext, size_t plaintext_length, int compression_level,
+                            uint8_t *record_out, size_t &record_length)
+{
+    uint32_t flags = final ? kChunkFinal : 0;
+    if (header.compression == CompressionId::None)
+    {
+        record_length = RecordLength(header, plaintext_length);
+        return SealPayload(header, key, header_aad, index, flags, plaintext, plaintext_length, record_out);
+    }
+
+    // Per thread, so chunks compressed on the pool do not allocate
+    thread_local std::vector<uint8_t> compressed{};
+    if (compressed.size() < plaintext_length)
+    {
+        compressed.resize(plaintext_length);
+    }
+
+    Metrics::Timer timer(Operation::Compress);
+    size_t compressed_length = 0;
+    bool shrunk = Compression::Compress(header.compression, compression_level, plaintext, plaintext_length, compressed.data(), compressed_length);
+    timer.Stop(plaintext_length, true);
+    if (!shrunk)
+    {
+        record_length = RecordLength(header, plaintext_length);
+        return SealPayload(header, key, header_aad, index, flags, plaintext, plaintext_length, record_out);
+    }
+
+    record_length = RecordLength(header, compressed_length);
+    bool sealed = SealPayload(header, key, header_aad, index, flags | kChunkCompressed, compressed.data(), compressed_length, record_out);
+    OPENSSL_cleanse(compressed.data(), compressed_length);
+    return sealed;
+}
+
+/**
+ * @brief SealPayload Writes the record header and encrypts a payload (the chunk, or the compressed chunk) behind it
+ * @returns Success
+ */
+bool ChunkCipher::SealPayload(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                              uint64_t index, uint32_t flags, const uint8_t *payload, size_t payload_length, uint8_t *record_out)
+{
+    if (key.size() != CipherSuite::ChunkKeyLength(header.cipher) || header.nonce.size() != kNonceLength || payload_length > header.chunk_size)
+    {
+        std::cerr << "Invalid chunk parameters" << std::endl;
+        return false;
+    }
+
+    // Record header, authenticated along with the header AAD
+    WriteUint32(record_out, static_cast<uint32_t>(payload_length));
+    WriteUint32(record_out + 4, flags);
+
+    uint8_t nonce[kNonceLength];
+    uint8_t *ciphertext = record_out + kRecordHeaderLength;
+    if ((header.flags & ContainerFormat::kFlagRecordNonces) != 0)
+    {
+        // Random rather than derived from the index, so the record can be replaced later without a nonce repeating
+        if (!Entropy::Fill(nonce, kNonceLength))
+        {
+            std::cerr << "Unable to generate a chunk nonce" << std::endl;
+            return false;
+        }
+        std::memcpy(ciphertext, nonce, kNonceLength);
+        ciphertext += kNonceLength;
+    }
+    else
+    {
+        ChunkNonce(header, index, nonce);
+    }
+    uint8_t *tag = ciphertext + payload_length;
+
+    uint8_t record_aad[kMaxRecordAadLength];
+    size_t record_aad_length = RecordAad(header, index, record_out, record_aad);
+
+    Metrics::Timer timer(Operation::Encrypt);
+    if (!SealRecord(header.cipher, key, header_aad, nonce, record_aad, record_aad_length, payload, payload_length, ciphertext, tag))
+    {
+        std::cerr << "Chunk " << index << " encryption failed" << std::endl;
+        return false;
+    }
+    timer.Stop(payload_length, true);
+
+    return true;
+}
+
+/**
+ * @brief OpenChunk Authenticates and decrypts one chunk
+ * @param[in] header Container header, supplies the cipher and base nonce
+ * @param[in] key The chunk key, see CipherSuite::DeriveChunkKey
+ * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+ * @param[in] index Position of the chunk in the container
+ * @param[in] record The record, starting at its record header
+ * @param[in] available Bytes readable at record
+ * @param[out] plaintext_out Receives the plaintext
+ * @param[in] plaintext_capacity Bytes available at plaintext_out, header.chunk_size is always enough
+ * @param[out] plaintext_length Length of the plaintext
+ * @param[out] final Whether this was the last chunk
+ * @param[out] record_length Bytes the record occupied
+ * @returns False if the record is malformed or fails authentication
+ */
+bool ChunkCipher::OpenChunk(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                            uint64_t index, const uint8_t *record, size_t available,
+                            uint8_t *plaintext_out, size_t plaintext_capacity, size_t &plaintext_length, bool &final, size_t &record_length)
+{
+    uint32_t payload_length = 0;
+    uint32_t flags = 0;
+    uint8_t nonce[kNonceLength];
+    const uint8_t *ciphertext = nullptr;
+    if (!LocatePayload(header, key, index, record, available, payload_length, flags, record_length, nonce, ciphertext))
+    {
+        return false;
+    }
+    const uint8_t *tag = ciphertext + payload_length;
+
+    uint8_t record_aad[kMaxRecordAadLength];
+    size_t record_aad_length = RecordAad(header, index, record, record_aad);
+    final = (flags & kChunkFinal) != 0;
+
+    // Compressed payloads are decrypted aside (per thread, so the pool does not allocate) and restored from there
+    bool compressed = (flags & kChunkCompressed) != 0;
+    thread_local std::vector<uint8_t> payload{};
+    if (compressed && payload.size() < payload_length)
+    {
+        payload.resize(payload_length);
+    }
+    else if (!compressed && plaintext_capacity < payload_length)
+    {
+        std::cerr << "Chunk " << index << " does not fit the output" << std::endl;
+        return false;
+    }
+
+    uint8_t *payload_out = compressed ? payload.data() : plaintext_out;
+    size_t opened_length = 0;
+    Metrics::Timer timer(Operation::Decrypt);
+    if (!OpenRecord(header.cipher, key, header_aad, nonce, record_aad, record_aad_length, ciphertext, payload_length, tag, payload_out, opened_length))
+    {
+        std::cerr << "Chunk " << index << " failed authentication" << std::endl;
+        return false;
+    }
+    timer.Stop(payload_length, true);
+
+    if (!compressed)
+    {
+        plaintext_length = opened_length;
+        return true;
+    }
+
+    Metrics::Timer decompress_timer(Operation::Decompress);
+    bool restored = Compression::Decompress(header.compression, payload.data(), opened_length, plaintext_out,
+                                            std::min<size_t>(plaintext_capacity, header.chunk_size), plaintext_length);
+    OPENSSL_cleanse(payload.data(), opened_length);
+
+    // Authenticated, so a bad payload here means a broken compressor rather than tampering, but it is rejected all the same
+    if (!restored || (!final && plaintext_length != header.chunk_size))
+    {
+        std::cerr << "Chunk " << index << " failed to decompress" << std::endl;
+        return false;
+    }
+    decompress_timer.Stop(plaintext_length, true);
+
+    return true;
+}
+
+/**
+ * @brief VerifyChunk Authenticates one chunk without producing its plaintext
+ * @param[in] header Container header, supplies the cipher and base nonce
+ * @param[in] key The chunk key, see CipherSuite::DeriveChunkKey
+ * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+ * @param[in] index Position of the chunk in the container
+ * @param[in] record The record, starting at its record header
+ * @param[in] available Bytes readable at record
+ * @param[out] plaintext_length Length the chunk restores to
+ * @param[out] final Whether this was the last chunk
+ * @param[out] record_length Bytes the record occupied
+ * @returns False if the record is malformed, fails authentication or does not restore to a whole chunk
+ */
+bool ChunkCipher::VerifyChunk(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                              uint64_t index, const uint8_t *record, size_t available, size_t &plaintext_length, bool &final, size_t &record_length)
+{
+    uint32_t payload_length = 0;
+    uint32_t flags = 0;
+    uint8_t nonce[kNonceLength];
+    const uint8_t *ciphertext = nullptr;
+    if (!LocatePayload(header, key, index, record, available, payload_length, flags, record_length, nonce, ciphertext))
+    {
+        return false;
+    }
+
+    uint8_t record_aad[kMaxRecordAadLength];
+    size_t record_aad_length = RecordAad(header, index, record, record_aad);
+    final = (flags & kChunkFinal) != 0;
+
+    if ((flags & kChunkCompressed) == 0)
+    {
+        Metrics::Timer timer(Operation::Verify);
+        if (!AuthenticateRecord(header.cipher, key, header_aad, nonce, record_aad, record_aad_length, ciphertext, payload_length, ciphertext + payload_length))
+        {
+            std::cerr << "Chunk " << index << " failed authentication" << std::endl;
+            return false;
+        }
+        timer.Stop(payload_length, true);
+
+        plaintext_length = payload_length;
+        return true;
+    }
+
+    // Only restoring a compressed payload shows how long it is, that goes through per thread scratch wiped afterwards
+    thread_local std::vector<uint8_t> payload{};
+    thread_local std::vector<uint8_t> restored{};
+    if (payload.size() < payload_length)
+    {
+        payload.resize(payload_length);
+    }
+    if (restored.size() < header.chunk_size)
+    {
+        restored.resize(header.chunk_size);
+    }
+
+    size_t opened_length = 0;
+    Metrics::Timer timer(Operation::Verify);
+    if (!OpenRecord(header.cipher, key, header_aad, nonce, record_aad, record_aad_length, ciphertext, payload_length, ciphertext + payload_length,
+                    payload.data(), opened_length))
+    {
+        OPENSSL_cleanse(payload.data(), payload_length);
+        std::cerr << "Chunk " << index << " failed authentication" << std::endl;
+        return false;
+    }
+    timer.Stop(payload_length, true);
+
+    plaintext_length = 0;
+    bool decompressed = Compression::Decompress(header.compression, payload.data(), opened_length, restored.data(), header.chunk_size, plaintext_length);
+    OPENSSL_cleanse(payload.data(), opened_length);
+    OPENSSL_cleanse(restored.data(), std::min<size_t>(plaintext_length, header.chunk_size));
+
+    // The same checks OpenChunk makes, so a chunk that verifies also decrypts
+    if (!decompressed || (!final && plaintext_length != header.chunk_size))
+    {
+        std::cerr << "Chunk " << index << " failed to decompress" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief LocatePayload Checks a record against the container and finds its nonce and ciphertext
+ * @returns False if the record is malformed or the key does not suit the header
+ */
+bool ChunkCipher::LocatePayload(const ContainerHeader &header, const SecureBytes &key, uint64_t index, const uint8_t *record, size_t available,
+                                uint32_t &payload_length, uint32_t &flags, size_t &record_length, uint8_t nonce_out[kNonceLength], const uint8_t *&ciphertext)
+{
+    if (!ReadRecordHeader(header, record, available, payload_length, flags))
+    {
+        return false;
+    }
+
+    record_length = RecordLength(header, payload_length);
+    if (available < record_length)
+    {
+        std::cerr << "Chunk " << index << " is truncated" << std::endl;
+        return false;
+    }
+
+    if (key.size() != CipherSuite::ChunkKeyLength(header.cipher) || header.nonce.size() != kNonceLength)
+    {
+        std::cerr << "Invalid chunk parameters" << std::endl;
+        return false;
+    }
+
+    ciphertext = record + kRecordHeaderLength;
+    if ((header.flags & ContainerFormat::kFlagRecordNonces) != 0)
+    {
+        std::memcpy(nonce_out, ciphertext, kNonceLength);
+        ciphertext += kNonceLength;
+    }
+    else
+    {
+        ChunkNonce(header, index, nonce_out);
+    }
+
+    return true;
+}
+
+/**
+ * @brief ReadRecordHeader Decodes the record header, so callers can find the end of the record
+ * @param[in] header Container header
+ * @param[in] record The record
+ * @param[in] available Bytes readable at record, at least kRecordHeaderLength
+ * @param[out] payload_length Ciphertext bytes in the record
+ * @param[out] flags Record flags
+ * @returns False if the record header is invalid for this container
+ */
+bool ChunkCipher::ReadRecordHeader(const ContainerHeader &header, const uint8_t *record, size_t available,
+                                   uint32_t &payload_length, uint32_t &flags)
+{
+    if (available < kRecordHeaderLength)
+    {
+        std::cerr << "Chunk record is truncated" << std::endl;
+        return false;
+    }
+
+    payload_length = ReadUint32(record);
+    flags = ReadUint32(record + 4);
+
+    // Only the last chunk may be short, compressed ones aside
+    bool final = (flags & kChunkFinal) != 0;
+    bool compressed = (flags & kChunkCompressed) != 0;
+    uint32_t known_flags = header.compression == CompressionId::None ? kChunkFinal : kChunkFinal | kChunkCompressed;
+    if (payload_length > header.chunk_size || (!final && !compressed && payload_length != header.chunk_size) || (flags & ~known_flags) != 0)
+    {
+        std::cerr << "Chunk record header is invalid" << std::endl;
+        return false;
+    }
+
+    return true;
+}
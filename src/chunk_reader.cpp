@@ -0,0 +1,468 @@
+#include "tpm_encrypt/chunk_reader.hpp"
+#include "tpm_encrypt/buffer_pool.hpp"
+#include "tpm_encrypt/chunk_cipher.hpp"
+#include "tpm_encrypt/data_decrypt.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+
+/**
+ * @brief ~ChunkReader Wipes the key and any cached plaintext
+ */
+ChunkReader::~ChunkReader()
+{
+    Close();
+}
+
+/**
+ * @brief Open Maps an encrypted file, recovers its key and locates its records, nothing is decrypted yet
+ * @param[in] path_in Encrypted file, a chunked container (legacy ciphertext has no chunks to seek to)
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @returns Success
+ */
+bool ChunkReader::Open(const std::string &path_in, const std::string &key_reference)
+{
+    Close();
+
+    auto file = std::make_unique<MappedFile>();
+    if (!file->Open(path_in))
+    {
+        std::cerr << "Unable to map the encrypted file: " << path_in << std::endl;
+        return false;
+    }
+
+    if (!ContainerFormat::ReadHeader(file->Data(), file->Size(), header_, header_length_))
+    {
+        std::cerr << "Random access needs a chunked container: " << path_in << std::endl;
+        return false;
+    }
+
+    if (!DataDecrypt::RecoverKey(header_, key_reference, key_))
+    {
+        Close();
+        return false;
+    }
+
+    ContainerFormat::HeaderAad(header_, header_aad_);
+
+    // Only record headers are read, for uncompressed containers just the final one
+    records_ = file->Data() + header_length_;
+    records_length_ = file->Size() - header_length_;
+    size_t plaintext_length = 0;
+    if (!DataDecrypt::ScanRecords(header_, records_, records_length_, chunk_count_, plaintext_length, record_offsets_))
+    {
+        Close();
+        return false;
+    }
+
+    file_ = std::move(file);
+    size_ = plaintext_length;
+    size_known_ = header_.compression == CompressionId::None || header_.plaintext_length != ContainerFormat::kUnknownLength;
+    chunk_ = BufferPool::Shared().Acquire(header_.chunk_size);
+
+    if (!size_known_ && !OpenFinal())
+    {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Read Authenticates and decrypts the chunks covering a range of the plaintext
+ * @param[in] offset Start of the range in the plaintext
+ * @param[out] data_out Receives the plaintext of the range
+ * @param[in] length Length of the range, clipped to the end of the plaintext
+ * @param[out] read_length Bytes written to data_out, less than length only at the end of the plaintext
+ * @returns False if the reader is not open or a chunk fails authentication
+ */
+bool ChunkReader::Read(uint64_t offset, uint8_t *data_out, size_t length, size_t &read_length)
+{
+    read_length = 0;
+    if (!file_)
+    {
+        std::cerr << "Encrypted file is not open" << std::endl;
+        return false;
+    }
+
+    // The end is only reported once the final chunk has confirmed where it is
+    if (offset >= size_ || length >= size_ - offset)
+    {
+        if (!OpenFinal())
+        {
+            return false;
+        }
+        if (offset >= size_)
+        {
+            return true;
+        }
+        length = static_cast<size_t>(std::min<uint64_t>(length, size_ - offset));
+    }
+
+    size_t chunk_size = header_.chunk_size;
+    size_t window_chunks = std::max<size_t>(1, MappedFile::kWindowLength / chunk_size);
+    size_t position = 0;
+    while (position < length)
+    {
+        uint64_t plaintext_offset = offset + position;
+        size_t index = static_cast<size_t>(plaintext_offset / chunk_size);
+        size_t within = static_cast<size_t>(plaintext_offset % chunk_size);
+
+        // Whole chunks before the final one decrypt straight into the output, a window at a time in parallel
+        size_t whole = within == 0 ? std::min((length - position) / chunk_size, chunk_count_ - 1 - index) : 0;
+        if (whole > 0)
+        {
+            size_t count = std::min(whole, window_chunks);
+            size_t run_length = count * chunk_size;
+            size_t opened_length = 0;
+            file_->Prefetch(header_length_ + RecordOffset(index + count), MappedFile::kWindowLength);
+            if (!DataDecrypt::OpenChunks(header_, key_, header_aad_, records_, records_length_, record_offsets_, index, count,
+                                         data_out + position, run_length, opened_length) ||
+                opened_length != run_length)
+            {
+                OPENSSL_cleanse(data_out, position + run_length);
+                return false;
+            }
+            file_->Release(header_length_ + RecordOffset(index), RecordOffset(index + count) - RecordOffset(index));
+            position += run_length;
+            continue;
+        }
+
+        // Partial chunks and the final one go through the cache
+        if (!LoadChunk(index) || within >= chunk_length_)
+        {
+            OPENSSL_cleanse(data_out, position);
+            return false;
+        }
+        size_t copy_length = std::min(chunk_length_ - within, length - position);
+        std::memcpy(data_out + position, chunk_.Data() + within, copy_length);
+        position += copy_length;
+    }
+
+    read_length = length;
+    return true;
+}
+
+/**
+ * @brief Size Length of the plaintext
+ */
+uint64_t ChunkReader::Size() const
+{
+    return size_;
+}
+
+/**
+ * @brief ChunkSize Plaintext bytes per chunk, reads aligned to it decrypt whole chunks
+ */
+uint32_t ChunkReader::ChunkSize() const
+{
+    return header_.chunk_size;
+}
+
+/**
+ * @brief IsOpen Whether Open succeeded
+ */
+bool ChunkReader::IsOpen() const
+{
+    return file_ != nullptr;
+}
+
+/**
+ * @brief Close Unmaps the file and wipes the key and cached plaintext
+ */
+void ChunkReader::Close()
+{
+    file_.reset();
+    OPENSSL_cleanse(key_.data(), key_.size());
+    key_.clear();
+    OPENSSL_cleanse(chunk_.Data(), chunk_.Length());
+    chunk_.Reset();
+    chunk_index_ = kNoChunk;
+    chunk_length_ = 0;
+    records_ = nullptr;
+    records_length_ = 0;
+    chunk_count_ = 0;
+    record_offsets_.clear();
+    size_ = 0;
+    size_known_ = false;
+    final_opened_ = false;
+}
+
+/**
+ * @brief LoadChunk Decrypts one chunk into the cache, unless it is cached already
+ * @returns False if the chunk fails authentication
+ */
+bool ChunkReader::LoadChunk(size_t index)
+{
+    if (index == chunk_index_)
+    {
+        return true;
+    }
+
+    chunk_index_ = kNoChunk;
+    size_t opened_length = 0;
+    if (!DataDecrypt::OpenChunks(header_, key_, header_aad_, records_, records_length_, record_offsets_, index, 1,
+                                 chunk_.Data(), chunk_.Length(), opened_length))
+    {
+        OPENSSL_cleanse(chunk_.Data(), chunk_.Length());
+        return false;
+    }
+
+    // The final chunk is where the length gets authenticated
+    if (index + 1 == chunk_count_)
+    {
+        uint64_t plaintext_length = static_cast<uint64_t>(index) * header_.chunk_size + opened_length;
+        if (size_known_ && plaintext_length != size_)
+        {
+            std::cerr << "Decrypted length does not match the header" << std::endl;
+            OPENSSL_cleanse(chunk_.Data(), chunk_.Length());
+            return false;
+        }
+        size_ = plaintext_length;
+        size_known_ = true;
+        final_opened_ = true;
+    }
+
+    chunk_index_ = index;
+    chunk_length_ = opened_length;
+    return true;
+}
+
+/**
+ * @brief OpenFinal Authenticates the final chunk, which confirms the length of the plaintext
+ * @returns False if the final chunk fails authentication or disagrees with the length
+ */
+bool ChunkReader::OpenFinal()
+{
+    return final_opened_ || LoadChunk(chunk_count_ - 1);
+}
+
+/**
+ * @brief RecordOffset Position of a record (or, for chunk_count_, of the end of the records)
+ */
+size_t ChunkReader::RecordOffset(size_t index) const
+{
+    if (index >= chunk_count_)
+    {
+        return records_length_;
+    }
+    return record_offsets_.empty() ? index * ChunkCipher::RecordLength(header_, header_.chunk_size) : record_offsets_[index];
+}
+
+/**
+ * @brief ~DecryptedStreambuf Wipes the buffered plaintext
+ */
+DecryptedStreambuf::~DecryptedStreambuf()
+{
+    OPENSSL_cleanse(buffer_.Data(), buffer_.Length());
+}
+
+/**
+ * @brief Open Opens an encrypted file for reading, see ChunkReader::Open
+ * @returns Success
+ */
+bool DecryptedStreambuf::Open(const std::string &path_in, const std::string &key_reference)
+{
+    OPENSSL_cleanse(buffer_.Data(), buffer_.Length());
+    buffer_.Reset();
+    Buffer(0);
+    if (!reader_.Open(path_in, key_reference))
+    {
+        return false;
+    }
+
+    buffer_ = BufferPool::Shared().Acquire(reader_.ChunkSize());
+    Buffer(0);
+    return true;
+}
+
+/**
+ * @brief Size Length of the plaintext
+ */
+uint64_t DecryptedStreambuf::Size() const
+{
+    return reader_.Size();
+}
+
+/**
+ * @brief underflow Decrypts the chunk at the read position
+ * @throws std::runtime_error if the chunk fails authentication, which an istream turns into badbit
+ */
+DecryptedStreambuf::int_type DecryptedStreambuf::underflow()
+{
+    if (gptr() < egptr())
+    {
+        return traits_type::to_int_type(*gptr());
+    }
+    if (!reader_.IsOpen())
+    {
+        return traits_type::eof();
+    }
+
+    // Whole chunks, so reads aligned to them skip the reader's cache
+    uint64_t position = Position();
+    uint64_t chunk_start = position - position % buffer_.Length();
+    size_t read_length = 0;
+    if (!reader_.Read(chunk_start, buffer_.Data(), buffer_.Length(), read_length))
+    {
+        Buffer(position);
+        throw std::runtime_error("Unable to decrypt the requested range");
+    }
+
+    if (chunk_start + read_length <= position)
+    {
+        Buffer(position);
+        return traits_type::eof();
+    }
+
+    char *buffer = reinterpret_cast<char *>(buffer_.Data());
+    setg(buffer, buffer + (position - chunk_start), buffer + read_length);
+    buffer_end_ = chunk_start + read_length;
+    return traits_type::to_int_type(*gptr());
+}
+
+/**
+ * @brief xsgetn Reads large requests straight into the caller's buffer, several chunks in parallel
+ * @throws std::runtime_error if a chunk fails authentication, which an istream turns into badbit
+ */
+std::streamsize DecryptedStreambuf::xsgetn(char_type *data_out, std::streamsize length)
+{
+    std::streamsize copied = 0;
+    while (copied < length)
+    {
+        std::streamsize buffered = egptr() - gptr();
+        if (buffered > 0)
+        {
+            std::streamsize copy_length = std::min(buffered, length - copied);
+            std::memcpy(data_out + copied, gptr(), static_cast<size_t>(copy_length));
+            gbump(static_cast<int>(copy_length));
+            copied += copy_length;
+            continue;
+        }
+
+        // A chunk or more skips the buffer, the reader only goes through its cache for the partial ends
+        if (reader_.IsOpen() && length - copied >= static_cast<std::streamsize>(buffer_.Length()))
+        {
+            uint64_t position = Position();
+            size_t read_length = 0;
+            if (!reader_.Read(position, reinterpret_cast<uint8_t *>(data_out + copied), static_cast<size_t>(length - copied), read_length))
+            {
+                Buffer(position);
+                throw std::runtime_error("Unable to decrypt the requested range");
+            }
+            Buffer(position + read_length);
+            copied += static_cast<std::streamsize>(read_length);
+            break;
+        }
+
+        if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+        {
+            break;
+        }
+    }
+    return copied;
+}
+
+/**
+ * @brief seekoff Moves the read position, within the buffered chunk nothing is decrypted again
+ */
+DecryptedStreambuf::pos_type DecryptedStreambuf::seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which)
+{
+    if ((which & std::ios_base::in) == 0 || !reader_.IsOpen())
+    {
+        return pos_type(off_type(-1));
+    }
+
+    off_type base = 0;
+    if (direction == std::ios_base::cur)
+    {
+        base = static_cast<off_type>(Position());
+    }
+    else if (direction == std::ios_base::end)
+    {
+        base = static_cast<off_type>(reader_.Size());
+    }
+
+    off_type target = base + offset;
+    if (target < 0)
+    {
+        return pos_type(off_type(-1));
+    }
+
+    uint64_t buffer_start = buffer_end_ - static_cast<uint64_t>(egptr() - eback());
+    if (static_cast<uint64_t>(target) >= buffer_start && static_cast<uint64_t>(target) <= buffer_end_)
+    {
+        setg(eback(), eback() + (static_cast<uint64_t>(target) - buffer_start), egptr());
+    }
+    else
+    {
+        Buffer(static_cast<uint64_t>(target));
+    }
+    return pos_type(target);
+}
+
+/**
+ * @brief seekpos Moves the read position to an absolute offset
+ */
+DecryptedStreambuf::pos_type DecryptedStreambuf::seekpos(pos_type position, std::ios_base::openmode which)
+{
+    return seekoff(off_type(position), std::ios_base::beg, which);
+}
+
+/**
+ * @brief showmanyc Bytes left before the end of the plaintext
+ */
+std::streamsize DecryptedStreambuf::showmanyc()
+{
+    uint64_t position = Position();
+    if (!reader_.IsOpen() || position >= reader_.Size())
+    {
+        return -1;
+    }
+    return static_cast<std::streamsize>(reader_.Size() - position);
+}
+
+/**
+ * @brief Position Offset in the plaintext of the next byte to be read
+ */
+uint64_t DecryptedStreambuf::Position() const
+{
+    return buffer_end_ - static_cast<uint64_t>(egptr() - gptr());
+}
+
+/**
+ * @brief Buffer Replaces the buffered chunk with an empty one starting at an offset
+ */
+void DecryptedStreambuf::Buffer(uint64_t position)
+{
+    char *buffer = reinterpret_cast<char *>(buffer_.Data());
+    setg(buffer, buffer, buffer);
+    buffer_end_ = position;
+}
+
+/**
+ * @brief DecryptedIstream Opens an encrypted file for reading
+ * @param[in] path_in Encrypted file, a chunked container
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ */
+DecryptedIstream::DecryptedIstream(const std::string &path_in, const std::string &key_reference) : std::istream(nullptr)
+{
+    rdbuf(&buffer_);
+    if (!buffer_.Open(path_in, key_reference))
+    {
+        setstate(std::ios_base::failbit);
+    }
+}
+
+/**
+ * @brief Size Length of the plaintext
+ */
+uint64_t DecryptedIstream::Size() const
+{
+    return buffer_.Size();
+}
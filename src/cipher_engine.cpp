@@ -0,0 +1,284 @@
+#include "tpm_encrypt/cipher_engine.hpp"
+
+#include "tpm_encrypt/secure_arena.hpp"
+
+#include <atomic>
+#include <memory>
+
+#include <pthread.h>
+
+#include <openssl/crypto.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+namespace
+{
+    // A context and the key it currently holds the schedule of
+    struct KeyedContext
+    {
+        std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> context{nullptr, &EVP_CIPHER_CTX_free};
+        const EVP_CIPHER *cipher = nullptr;
+        bool encrypt = false;
+        bool keyed = false;
+
+        // Copy kept for comparison, in the arena like any other key. EVP_CIPHER_CTX_free wipes the schedule
+        SecureBytes key;
+    };
+
+    // Every context of one thread, replaced in turn once all are keyed
+    struct ThreadContexts
+    {
+        KeyedContext slots[CipherEngine::kContextsPerThread];
+        size_t next_slot = 0;
+
+        // context_generation when the slots were last checked
+        uint64_t generation = 0;
+    };
+
+    // Changed in a forked child, every thread then drops its keyed contexts before using them again
+    std::atomic<uint64_t> context_generation{0};
+}
+
+/**
+ * @brief OnFork Runs in a forked child, whose keys the arena has wiped, so no schedule of them may be reused
+ */
+static void OnFork()
+{
+    context_generation++;
+}
+
+/**
+ * @brief FetchCipher Looks up a cipher implementation once, through the provider where OpenSSL has them
+ * @note The result is kept for the life of the process, it is never freed
+ */
+static const EVP_CIPHER *FetchCipher(const char *name, const EVP_CIPHER *(*builtin)())
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_CIPHER *cipher = EVP_CIPHER_fetch(nullptr, name, nullptr);
+    if (cipher != nullptr)
+    {
+        return cipher;
+    }
+#else
+    (void)name;
+#endif
+    return builtin();
+}
+
+/**
+ * @brief Aes256Gcm AES-256-GCM, fetched from the provider on first use
+ */
+const EVP_CIPHER *CipherEngine::Aes256Gcm()
+{
+    static const EVP_CIPHER *cipher = FetchCipher("AES-256-GCM", &EVP_aes_256_gcm);
+    return cipher;
+}
+
+/**
+ * @brief Aes128Gcm AES-128-GCM, fetched from the provider on first use
+ */
+const EVP_CIPHER *CipherEngine::Aes128Gcm()
+{
+    static const EVP_CIPHER *cipher = FetchCipher("AES-128-GCM", &EVP_aes_128_gcm);
+    return cipher;
+}
+
+/**
+ * @brief Aes256Ctr AES-256-CTR, fetched from the provider on first use
+ */
+const EVP_CIPHER *CipherEngine::Aes256Ctr()
+{
+    static const EVP_CIPHER *cipher = FetchCipher("AES-256-CTR", &EVP_aes_256_ctr);
+    return cipher;
+}
+
+/**
+ * @brief ChaCha20Poly1305 ChaCha20-Poly1305, fetched from the provider on first use
+ * @returns Null if the provider lacks it (e.g. FIPS only builds)
+ */
+const EVP_CIPHER *CipherEngine::ChaCha20Poly1305()
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static const EVP_CIPHER *cipher = EVP_CIPHER_fetch(nullptr, "ChaCha20-Poly1305", nullptr);
+    return cipher;
+#elif !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+    return EVP_chacha20_poly1305();
+#else
+    return nullptr;
+#endif
+}
+
+/**
+ * @brief Aes256Cbc AES-256-CBC (legacy data only), fetched from the provider on first use
+ */
+const EVP_CIPHER *CipherEngine::Aes256Cbc()
+{
+    static const EVP_CIPHER *cipher = FetchCipher("AES-256-CBC", &EVP_aes_256_cbc);
+    return cipher;
+}
+
+/**
+ * @brief Context A context of the calling thread, ready to process a new message
+ * @param[in] cipher Cipher from Aes256Gcm or Aes256Cbc
+ * @param[in] encrypt True to encrypt, false to decrypt
+ * @param[in] key The key, of the cipher's key length
+ * @param[in] iv The iv/nonce of the message, of the cipher's iv length
+ * @returns The context, valid until the calling thread's next call to Context. Null on failure
+ */
+EVP_CIPHER_CTX *CipherEngine::Context(const EVP_CIPHER *cipher, bool encrypt, const uint8_t *key, const uint8_t *iv)
+{
+    if (cipher == nullptr)
+    {
+        return nullptr;
+    }
+
+    size_t key_length = static_cast<size_t>(EVP_CIPHER_key_length(cipher));
+    if (key_length > kMaxKeyLength)
+    {
+        return nullptr;
+    }
+
+    // Registered before any context exists
+    static const int fork_handler = pthread_atfork(nullptr, nullptr, &OnFork);
+    (void)fork_handler;
+
+    thread_local ThreadContexts contexts{};
+
+    uint64_t generation = context_generation.load(std::memory_order_relaxed);
+    if (contexts.generation != generation)
+    {
+        for (KeyedContext &slot : contexts.slots)
+        {
+            slot.keyed = false;
+            if (slot.context)
+            {
+                EVP_CIPHER_CTX_reset(slot.context.get());
+            }
+            OPENSSL_cleanse(slot.key.data(), slot.key.size());
+        }
+        contexts.generation = generation;
+    }
+
+    // Same key again (every chunk of a container, or the next record under a cached key), only the iv changes
+    for (KeyedContext &slot : contexts.slots)
+    {
+        if (slot.keyed && slot.cipher == cipher && slot.encrypt == encrypt && slot.key.size() == key_length &&
+            CRYPTO_memcmp(slot.key.data(), key, key_length) == 0)
+        {
+            if (1 != EVP_CipherInit_ex(slot.context.get(), nullptr, nullptr, nullptr, iv, encrypt ? 1 : 0))
+            {
+                slot.keyed = false;
+                return nullptr;
+            }
+            return slot.context.get();
+        }
+    }
+
+    // A new key takes over the next slot in turn, its context is reset rather than reallocated
+    KeyedContext &slot = contexts.slots[contexts.next_slot];
+    contexts.next_slot = (contexts.next_slot + 1) % kContextsPerThread;
+
+    slot.keyed = false;
+    if (!slot.context)
+    {
+        slot.context.reset(EVP_CIPHER_CTX_new());
+    }
+    if (!slot.context ||
+        1 != EVP_CIPHER_CTX_reset(slot.context.get()) ||
+        1 != EVP_CipherInit_ex(slot.context.get(), cipher, nullptr, key, iv, encrypt ? 1 : 0))
+    {
+        return nullptr;
+    }
+
+    slot.key.assign(key, key + key_length);
+    slot.cipher = cipher;
+    slot.encrypt = encrypt;
+    slot.keyed = true;
+    return slot.context.get();
+}
+
+/**
+ * @brief HmacSha256 HMAC-SHA256 of a message given in pieces, using a context kept by the calling thread
+ * @param[in] key The MAC key
+ * @param[in] key_length Length of key
+ * @param[in] parts The message, authenticated as the concatenation of the parts
+ * @param[out] mac_out Receives kHmacSha256Length bytes
+ * @returns Success
+ */
+bool CipherEngine::HmacSha256(const uint8_t *key, size_t key_length, std::initializer_list<MacPart> parts, uint8_t *mac_out)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // The digest is chosen once per context, each message then only sets the key
+    static EVP_MAC *mac = EVP_MAC_fetch(nullptr, "HMAC", nullptr);
+    thread_local std::unique_ptr<EVP_MAC_CTX, void (*)(EVP_MAC_CTX *)> context{nullptr, &EVP_MAC_CTX_free};
+    if (!context && mac != nullptr)
+    {
+        context.reset(EVP_MAC_CTX_new(mac));
+        char digest[] = "SHA256";
+        OSSL_PARAM params[] = {OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0), OSSL_PARAM_construct_end()};
+        if (context && 1 != EVP_MAC_CTX_set_params(context.get(), params))
+        {
+            context.reset();
+        }
+    }
+    if (!context || 1 != EVP_MAC_init(context.get(), key, key_length, nullptr))
+    {
+        return false;
+    }
+
+    for (const MacPart &part : parts)
+    {
+        if (1 != EVP_MAC_update(context.get(), part.data, part.length))
+        {
+            return false;
+        }
+    }
+
+    size_t mac_length = 0;
+    return 1 == EVP_MAC_final(context.get(), mac_out, &mac_length, kHmacSha256Length) && mac_length == kHmacSha256Length;
+#else
+    thread_local std::unique_ptr<HMAC_CTX, void (*)(HMAC_CTX *)> context{HMAC_CTX_new(), &HMAC_CTX_free};
+    if (!context || 1 != HMAC_Init_ex(context.get(), key, static_cast<int>(key_length), EVP_sha256(), nullptr))
+    {
+        return false;
+    }
+
+    for (const MacPart &part : parts)
+    {
+        if (1 != HMAC_Update(context.get(), part.data, part.length))
+        {
+            return false;
+        }
+    }
+
+    unsigned int mac_length = 0;
+    return 1 == HMAC_Final(context.get(), mac_out, &mac_length) && mac_length == kHmacSha256Length;
+#endif
+}
+
+/**
+ * @brief Sha256 SHA-256 of a message, the digest is fetched once and each thread keeps its own context
+ * @param[in] data The message
+ * @param[in] length Length of data
+ * @param[out] digest_out Receives kSha256Length bytes
+ * @returns Success
+ */
+bool CipherEngine::Sha256(const uint8_t *data, size_t length, uint8_t *digest_out)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static const EVP_MD *digest = EVP_MD_fetch(nullptr, "SHA256", nullptr);
+#else
+    static const EVP_MD *digest = EVP_sha256();
+#endif
+    thread_local std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX *)> context{EVP_MD_CTX_new(), &EVP_MD_CTX_free};
+    unsigned int digest_length = 0;
+    return digest != nullptr && context &&
+           1 == EVP_DigestInit_ex(context.get(), digest, nullptr) &&
+           1 == EVP_DigestUpdate(context.get(), data, length) &&
+           1 == EVP_DigestFinal_ex(context.get(), digest_out, &digest_length) &&
+           digest_length == kSha256Length;
+}
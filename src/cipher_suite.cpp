@@ -0,0 +1,247 @@
+#include "tpm_encrypt/cipher_suite.hpp"
+#include "tpm_encrypt/cipher_engine.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+#include <openssl/crypto.h>
+#include <openssl/kdf.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+// Suites in the order Parse and Name know them
+static const struct
+{
+    CipherId cipher;
+    const char *name;
+} kSuiteNames[] = {
+    {CipherId::Auto, "auto"},
+    {CipherId::Aes256Gcm, "aes-256-gcm"},
+    {CipherId::Aes128Gcm, "aes-128-gcm"},
+    {CipherId::Aes256CtrHmacSha256, "aes-256-ctr-hmac-sha256"},
+    {CipherId::ChaCha20Poly1305, "chacha20-poly1305"},
+};
+
+// Labels a derived chunk key with its purpose, the suite id is appended
+static const unsigned char kChunkKeyLabel[] = {'T', 'P', 'M', 'E', '-', 'C', 'H', 'U', 'N', 'K', '-', 'K', 'E', 'Y'};
+
+/**
+ * @brief ReadCpu Queries the processor for the instructions CpuFeatures covers
+ */
+static CpuFeatures ReadCpu()
+{
+    CpuFeatures features{};
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax = 0;
+    unsigned int ebx = 0;
+    unsigned int ecx = 0;
+    unsigned int edx = 0;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        features.aes = (ecx & bit_AES) != 0;
+        features.clmul = (ecx & bit_PCLMUL) != 0;
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+        features.vaes = (ecx & (1u << 9)) != 0;
+        features.vclmul = (ecx & (1u << 10)) != 0;
+    }
+#elif defined(__aarch64__) && defined(__linux__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    features.aes = (hwcap & HWCAP_AES) != 0;
+    features.clmul = (hwcap & HWCAP_PMULL) != 0;
+#endif
+    return features;
+}
+
+/**
+ * @brief DetectCpu Reads the host's crypto instructions, once per process
+ */
+const CpuFeatures &CipherSuite::DetectCpu()
+{
+    static const CpuFeatures features = ReadCpu();
+    return features;
+}
+
+/**
+ * @brief Preferred Fastest secure suite on this host, what CipherId::Auto resolves to
+ */
+CipherId CipherSuite::Preferred()
+{
+    static const CipherId preferred = []()
+    {
+        // GCM is only fast with both AES and GHASH in hardware, the wide forms merely make it faster still
+        const CpuFeatures &features = DetectCpu();
+        if ((!features.aes || !features.clmul) && Available(CipherId::ChaCha20Poly1305))
+        {
+            return CipherId::ChaCha20Poly1305;
+        }
+        return CipherId::Aes256Gcm;
+    }();
+    return preferred;
+}
+
+/**
+ * @brief Resolve Turns a requested suite into the one to write, CipherId::Auto becomes Preferred()
+ * @returns False (with a message) if the suite is unknown or this build of OpenSSL lacks it
+ */
+bool CipherSuite::Resolve(CipherId requested, CipherId &cipher)
+{
+    cipher = requested == CipherId::Auto ? Preferred() : requested;
+    if (!Available(cipher))
+    {
+        std::cerr << "Cipher " << Name(cipher) << " is not available" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Available Whether this build of OpenSSL can run a suite
+ */
+bool CipherSuite::Available(CipherId cipher)
+{
+    return Cipher(cipher) != nullptr;
+}
+
+/**
+ * @brief Cipher The OpenSSL cipher behind a suite, for AEAD suites the whole construction
+ * @returns Null for unknown suites or ones this build lacks
+ */
+const EVP_CIPHER *CipherSuite::Cipher(CipherId cipher)
+{
+    switch (cipher)
+    {
+    case CipherId::Aes256Gcm:
+        return CipherEngine::Aes256Gcm();
+    case CipherId::Aes128Gcm:
+        return CipherEngine::Aes128Gcm();
+    case CipherId::Aes256CtrHmacSha256:
+        return CipherEngine::Aes256Ctr();
+    case CipherId::ChaCha20Poly1305:
+        return CipherEngine::ChaCha20Poly1305();
+    default:
+        return nullptr;
+    }
+}
+
+/**
+ * @brief IsAead Whether the suite's cipher authenticates on its own, otherwise a separate HMAC does
+ */
+bool CipherSuite::IsAead(CipherId cipher)
+{
+    return cipher != CipherId::Aes256CtrHmacSha256;
+}
+
+/**
+ * @brief ChunkKeyLength Length of the chunk key of a suite, 0 for unknown suites
+ */
+size_t CipherSuite::ChunkKeyLength(CipherId cipher)
+{
+    switch (cipher)
+    {
+    case CipherId::Aes256Gcm:
+    case CipherId::ChaCha20Poly1305:
+        return 32;
+    case CipherId::Aes128Gcm:
+        return 16;
+    case CipherId::Aes256CtrHmacSha256:
+        return 64;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief DeriveChunkKey Replaces a data key with the chunk key of a suite
+ * @param[in] cipher Suite the chunks are encrypted with
+ * @param[in,out] key The data key in, the chunk key out (wiped before being replaced)
+ * @returns Success
+ */
+bool CipherSuite::DeriveChunkKey(CipherId cipher, SecureBytes &key)
+{
+    size_t chunk_key_length = ChunkKeyLength(cipher);
+    if (chunk_key_length == 0 || !Available(cipher))
+    {
+        std::cerr << "Cipher " << Name(cipher) << " is not available" << std::endl;
+        return false;
+    }
+
+    if (key.size() != kDataKeyLength)
+    {
+        std::cerr << "Key has an unexpected length (" << key.size() << " bytes), was it sealed by an older version?" << std::endl;
+        return false;
+    }
+
+    // The original suite, kept as is so existing containers still decrypt
+    if (cipher == CipherId::Aes256Gcm)
+    {
+        return true;
+    }
+
+    unsigned char info[sizeof(kChunkKeyLabel) + 1];
+    std::copy(kChunkKeyLabel, kChunkKeyLabel + sizeof(kChunkKeyLabel), info);
+    info[sizeof(kChunkKeyLabel)] = static_cast<unsigned char>(cipher);
+
+    uint8_t chunk_key[kMaxChunkKeyLength];
+    size_t derived_length = chunk_key_length;
+    std::unique_ptr<EVP_PKEY_CTX, void (*)(EVP_PKEY_CTX *)> ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr), &EVP_PKEY_CTX_free);
+    bool derived = ctx &&
+                   EVP_PKEY_derive_init(ctx.get()) > 0 &&
+                   EVP_PKEY_CTX_set_hkdf_md(ctx.get(), EVP_sha256()) > 0 &&
+                   EVP_PKEY_CTX_set1_hkdf_key(ctx.get(), key.data(), static_cast<int>(key.size())) > 0 &&
+                   EVP_PKEY_CTX_add1_hkdf_info(ctx.get(), info, static_cast<int>(sizeof(info))) > 0 &&
+                   EVP_PKEY_derive(ctx.get(), chunk_key, &derived_length) > 0 &&
+                   derived_length == chunk_key_length;
+
+    // Growing the vector frees its old buffer, which must not still hold the data key
+    OPENSSL_cleanse(key.data(), key.size());
+    key.assign(chunk_key, chunk_key + (derived ? chunk_key_length : 0));
+    OPENSSL_cleanse(chunk_key, sizeof(chunk_key));
+
+    if (!derived)
+    {
+        std::cerr << "Unable to derive chunk key" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Name Stable lower case name of a suite, e.g. "aes-256-gcm"
+ */
+const char *CipherSuite::Name(CipherId cipher)
+{
+    for (const auto &suite : kSuiteNames)
+    {
+        if (suite.cipher == cipher)
+        {
+            return suite.name;
+        }
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Parse Looks a suite up by Name, "auto" gives CipherId::Auto
+ * @returns False if the name is unknown
+ */
+bool CipherSuite::Parse(const std::string &name, CipherId &cipher)
+{
+    for (const auto &suite : kSuiteNames)
+    {
+        if (name == suite.name)
+        {
+            cipher = suite.cipher;
+            return true;
+        }
+    }
+    return false;
+}
@@ -1,116 +1,137 @@
 #include "tpm_encrypt/common.hpp"
+#include "tpm_encrypt/entropy.hpp"
+#include "tpm_encrypt/envelope.hpp"
+#include "tpm_encrypt/file_io.hpp"
+#include "tpm_encrypt/key_cache.hpp"
+#include "tpm_encrypt/logger.hpp"
+#include "tpm_encrypt/tpm_session.hpp"
 
-#include <filesystem>
 #include <fstream>
-#include <fcntl.h>
-#include <unistd.h>
 #include <iostream>
 #include <cstring>
 
 #include <openssl/evp.h>
 
-static const std::string kAuthenticationString = "default_auth_key";
-static const std::string kIsProvisionedIdentifier = "fapi_provisioned";
+/**
+ * @brief CheckKeyReference Rejects references that would name TPM data of another reference
+ * @param[in] key_reference The key reference
+ * @returns False (after reporting it) if the reference cannot be used
+ */
+bool Common::CheckKeyReference(const std::string &key_reference)
+{
+    auto ends_with = [&key_reference](const std::string &suffix)
+    {
+        return key_reference.size() >= suffix.size() &&
+               key_reference.compare(key_reference.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+
+    // "foo_kek" would be the key-encryption key of "foo", deleting it would destroy every file wrapped under "foo"
+    if (key_reference.empty() || key_reference.find('/') != std::string::npos || ends_with("_iv") || ends_with("_kek"))
+    {
+        std::cerr << "Invalid key reference (no '/', and no \"_iv\" or \"_kek\" ending): " << key_reference << std::endl;
+        return false;
+    }
+
+    return true;
+}
 
 /**
  * @brief UnsealKey Reads an encryption key from the TPM
  * @param[in] key_reference A name/refernece for this key, used to access it
  * @param[out] unsealed_key_data The unsealed encryption key/data
- * @param[out] unsealed_key_data The unsealed encryption iv/data
  */
-bool Common::UnsealKey(const std::string &key_reference, std::vector<uint8_t> &unsealed_key_data, std::vector<uint8_t> &unsealed_iv_data)
+bool Common::UnsealKey(const std::string &key_reference, SecureBytes &unsealed_key_data)
 {
-
-    std::cout << "Unsealing key..." << std::endl;
-
-    // Where are we storing our sealed data on the TPM
-    std::string sealed_data_path = "/HS/SRK/" + key_reference;
-
-    // Estlabish a connection to the TPM and store within the context
-    std::unique_ptr<FAPI_CONTEXT, void (*)(FAPI_CONTEXT *)> context(nullptr, &Common::FapiContextDeleteWrapper);
-    auto context_pointer = context.get();
-
-    // Initalise the connection object
-    TSS2_RC tpm_result = Fapi_Initialize(&context_pointer, nullptr);
-    if (tpm_result != TSS2_RC_SUCCESS)
+    bool missing = false;
+    if (UnsealKey(key_reference, unsealed_key_data, missing))
+    {
+        return true;
+    }
+    if (missing)
     {
-        std::cerr << "Fapi_Initialize failed with error code " << tpm_result << std::endl;
-        std::cout << "[Suggestion] Does the user running this program have read/write permissions to the TPM device?" << std::endl;
-        throw std::runtime_error("TPM init failed");
+        std::cerr << "No key is sealed at reference: " << key_reference << std::endl;
     }
+    return false;
+}
 
-    // Set callback presenting authentication to the TPM when required
-    tpm_result = Fapi_SetAuthCB(context_pointer, AuthCallback, nullptr);
-    if (tpm_result != TSS2_RC_SUCCESS)
+/**
+ * @brief UnsealKey Reads an encryption key from the TPM, quietly failing if none is sealed at the reference
+ * @param[in] key_reference A name/refernece for this key, used to access it
+ * @param[out] unsealed_key_data The unsealed encryption key/data
+ * @param[out] missing Set if no key is sealed at the reference, other failures are reported
+ */
+bool Common::UnsealKey(const std::string &key_reference, SecureBytes &unsealed_key_data, bool &missing)
+{
+    missing = false;
+    if (!CheckKeyReference(key_reference))
     {
-        std::cerr << "Fapi_SetAuthCB failed with error code " << tpm_result << std::endl;
-        throw std::runtime_error("TPM init failed");
+        return false;
     }
 
-    // Have we already provisioned this TPM? If not lets do so...
-    if (!std::filesystem::exists(kIsProvisionedIdentifier))
+    // Repeated use of a reference is served from memory without touching the TPM
+    uint64_t generation = KeyCache::Instance().Generation();
+    SecureBytes unused_iv_data{};
+    if (KeyCache::Instance().Lookup(key_reference, unsealed_key_data, unused_iv_data))
     {
+        return true;
+    }
 
-        // Provisions the TSS with its TPM (we should only do this once)
-        tpm_result = Fapi_Provision(context_pointer, nullptr, nullptr, nullptr);
-        if (tpm_result != TSS2_RC_SUCCESS)
-        {
-            std::cerr << "Error: Fapi_Provision failed with error code " << tpm_result << std::endl;
-            std::cout << "[Suggestion] Is this TPM already (or not) provisioned? Make sure the 'fapi_provisioned' file exists if it does" << std::endl;
-            std::cout << "[Suggestion] Does this TPM have an auth key? Make sure your configuration is setup correctly..." << std::endl;
-            std::cout << "[Suggestion] Change or set the TPM key using 'tpm2_changeauth'" << std::endl;
-            throw std::runtime_error("TPM init failed");
-        }
-
-        // If the call was successful, save a file to mark this
-        std::ofstream out_file(kIsProvisionedIdentifier);
-        if (out_file.is_open())
-        {
-            out_file << "provisioned" << std::endl;
-            out_file.close();
-        }
-        else
-        {
-            std::cerr << "TPM provisioned but unable to save status. Application may fail unless a file is created at " << kIsProvisionedIdentifier << std::endl;
-            std::cout << "[Suggestion] Does the user running this application have read/write permissions at " << kIsProvisionedIdentifier << "?" << std::endl;
-            throw std::runtime_error("TPM init failed");
-        }
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Unsealing key...");
+
+    // Where are we storing our sealed data on the TPM
+    std::string sealed_data_path = "/HS/SRK/" + key_reference;
+
+    if (!TpmSession::Instance().Unseal(sealed_data_path, unsealed_key_data, missing))
+    {
+        return false;
     }
 
-    // End of initalisation
+    KeyCache::Instance().Insert(key_reference, unsealed_key_data, unused_iv_data, generation);
 
-    // Temp store for our key data
-    size_t key_size = 0;
-    uint8_t *raw_key_bytes = nullptr;
+    return true;
+}
 
-    tpm_result = Fapi_Unseal(context_pointer, sealed_data_path.c_str(), &raw_key_bytes,
-                             &key_size);
-    if (tpm_result != TSS2_RC_SUCCESS)
+/**
+ * @brief UnsealKey Reads an encryption key and its iv from the TPM, as stored for legacy (headerless) data
+ * @param[in] key_reference A name/refernece for this key, used to access it
+ * @param[out] unsealed_key_data The unsealed encryption key/data
+ * @param[out] unsealed_key_data The unsealed encryption iv/data
+ */
+bool Common::UnsealKey(const std::string &key_reference, SecureBytes &unsealed_key_data, SecureBytes &unsealed_iv_data)
+{
+    if (!CheckKeyReference(key_reference))
     {
-        std::cerr << "Error: Fapi_Unseal (key) failed with error code " << tpm_result << std::endl;
         return false;
     }
 
-    // Temp store for iv data
-    size_t iv_size = 0;
-    uint8_t *raw_iv_bytes = nullptr;
+    // Repeated use of a reference is served from memory without touching the TPM, entries
+    // cached without an iv came from a container key and do not satisfy a legacy lookup
+    uint64_t generation = KeyCache::Instance().Generation();
+    if (KeyCache::Instance().Lookup(key_reference, unsealed_key_data, unsealed_iv_data) && !unsealed_iv_data.empty())
+    {
+        return true;
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Unsealing key...");
 
+    // Where are we storing our sealed data on the TPM
+    std::string sealed_data_path = "/HS/SRK/" + key_reference;
     std::string sealed_iv_path = sealed_data_path + "_iv";
 
-    tpm_result = Fapi_Unseal(context_pointer, sealed_iv_path.c_str(), &raw_iv_bytes,
-                             &iv_size);
-    if (tpm_result != TSS2_RC_SUCCESS)
+    // Both objects are read through the shared session, it is initialised on first use
+    TpmSession &session = TpmSession::Instance();
+
+    if (!session.Unseal(sealed_data_path, unsealed_key_data))
     {
-        std::cerr << "Error: Fapi_Unseal (iv) failed with error code " << tpm_result << std::endl;
         return false;
     }
 
-    // Move the data into our vector
-    unsealed_key_data = std::vector(raw_key_bytes, raw_key_bytes + key_size);
-    unsealed_iv_data = std::vector(raw_iv_bytes, raw_iv_bytes + iv_size);
+    if (!session.Unseal(sealed_iv_path, unsealed_iv_data))
+    {
+        return false;
+    }
 
-    Fapi_Free(raw_key_bytes);
-    Fapi_Free(raw_iv_bytes);
+    KeyCache::Instance().Insert(key_reference, unsealed_key_data, unsealed_iv_data, generation);
 
     return true;
 }
@@ -122,87 +143,33 @@ bool Common::UnsealKey(const std::string &key_reference, std::vector<uint8_t> &u
  */
 bool Common::GenerateSealedKey(const std::string &key_reference)
 {
+    if (!CheckKeyReference(key_reference))
+    {
+        return false;
+    }
 
-    std::cout << "Sealing key..." << std::endl;
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Sealing key...");
 
     // Where are we storing our sealed data on the TPM
     std::string sealed_data_path = "/HS/SRK/" + key_reference;
 
-    // Estlabish a connection to the TPM and store within the context
-    std::unique_ptr<FAPI_CONTEXT, void (*)(FAPI_CONTEXT *)> context(nullptr, &Common::FapiContextDeleteWrapper);
-    auto context_pointer = context.get();
-
-    // Initalise the connection object
-    TSS2_RC tpm_result = Fapi_Initialize(&context_pointer, nullptr);
-    if (tpm_result != TSS2_RC_SUCCESS)
-    {
-        std::cerr << "Fapi_Initialize failed with error code " << tpm_result << std::endl;
-        std::cout << "[Suggestion] Does the user running this program have read/write permissions to the TPM device?" << std::endl;
-        throw std::runtime_error("TPM init failed");
-    }
-
-    // Set callback presenting authentication to the TPM when required
-    tpm_result = Fapi_SetAuthCB(context_pointer, AuthCallback, nullptr);
-    if (tpm_result != TSS2_RC_SUCCESS)
+    // Generate a 256 bit symmetric key, the iv/nonce is per encryption and stored with the data
+    SecureBytes symmetric_key(32);
+    if (!GetRandomData(symmetric_key.data(), symmetric_key.size()))
     {
-        std::cerr << "Fapi_SetAuthCB failed with error code " << tpm_result << std::endl;
-        throw std::runtime_error("TPM init failed");
+        return false;
     }
 
-    // Have we already provisioned this TPM? If not lets do so...
-    if (!std::filesystem::exists(kIsProvisionedIdentifier))
+    // Seal our bytes against the TPM
+    if (!TpmSession::Instance().CreateSeal(sealed_data_path, symmetric_key.data(), symmetric_key.size()))
     {
-
-        // Provisions the TSS with its TPM (we should only do this once)
-        tpm_result = Fapi_Provision(context_pointer, nullptr, nullptr, nullptr);
-        if (tpm_result != TSS2_RC_SUCCESS)
-        {
-            std::cerr << "Error: Fapi_Provision failed with error code " << tpm_result << std::endl;
-            std::cout << "[Suggestion] Is this TPM already (or not) provisioned? Make sure the 'fapi_provisioned' file exists if it does" << std::endl;
-            std::cout << "[Suggestion] Does this TPM have an auth key? Make sure your configuration is setup correctly..." << std::endl;
-            std::cout << "[Suggestion] Change or set the TPM key using 'tpm2_changeauth'" << std::endl;
-            throw std::runtime_error("TPM init failed");
-        }
-
-        // If the call was successful, save a file to mark this
-        std::ofstream out_file(kIsProvisionedIdentifier);
-        if (out_file.is_open())
-        {
-            out_file << "provisioned" << std::endl;
-            out_file.close();
-        }
-        else
-        {
-            std::cerr << "TPM provisioned but unable to save status. Application may fail unless a file is created at " << kIsProvisionedIdentifier << std::endl;
-            std::cout << "[Suggestion] Does the user running this application have read/write permissions at " << kIsProvisionedIdentifier << "?" << std::endl;
-            throw std::runtime_error("TPM init failed");
-        }
+        return false;
     }
 
-    // End of initalisation
-
-    // Generate a 128 bit symmetric key
-    std::vector<unsigned char> symmetric_key(16);
-    GetRandomData(symmetric_key.data(), symmetric_key.size());
+    // Anything cached under this reference may predate the objects now stored there
+    KeyCache::Instance().Invalidate(key_reference);
 
-    // Seal our bytes against the TPM
-    tpm_result = Fapi_CreateSeal(context_pointer, sealed_data_path.c_str(), "noDa",
-                                 symmetric_key.size(),
-                                 "", kAuthenticationString.c_str(), symmetric_key.data());
-
-    // Generate a 128 bit IV (random seed data)
-    std::vector<unsigned char> iv(16);
-    GetRandomData(iv.data(), iv.size());
-
-    std::string sealed_iv_path = sealed_data_path + "_iv";
-
-    // Seal our iv bytes against the TPM
-    tpm_result = Fapi_CreateSeal(context_pointer, sealed_iv_path.c_str(), "noDa",
-                                 iv.size(),
-                                 "", kAuthenticationString.c_str(), iv.data());
-
-    std::cout << "Symmetric encryption key generated and sealed at: " << sealed_data_path << std::endl;
-    std::cout << "IV generated and sealed at: " << sealed_iv_path << std::endl;
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Symmetric encryption key generated and sealed at: " << sealed_data_path);
 
     return true;
 }
@@ -216,12 +183,7 @@ TSS2_RC Common::AuthCallback(
     const char **auth,
     void *userData)
 {
-    if (!objectPath)
-    {
-        return TSS2_FAPI_RC_BAD_VALUE;
-    }
-    *auth = kAuthenticationString.c_str();
-    return TSS2_RC_SUCCESS;
+    return TpmSession::AuthCallback(objectPath, description, auth, userData);
 }
 
 /**
@@ -238,51 +200,61 @@ void Common::FapiContextDeleteWrapper(FAPI_CONTEXT *pointer)
  */
 void Common::ResetTpm()
 {
+    // None of the cached keys exist on the TPM any more. Cleared again afterwards, unseals queued ahead of the reset
+    // may have cached keys meanwhile
+    KeyCache::Instance().Clear();
 
-    // Store result of a TPM operation
-    TSS2_RC tpm_result;
-
-    // Represents a connection to the TPM via the FAPI library
-    FAPI_CONTEXT *context;
-
-    // Initalise the connection object
-    tpm_result = Fapi_Initialize(&context, nullptr);
-    if (tpm_result != TSS2_RC_SUCCESS)
+    try
+    {
+        TpmSession::Instance().Reset();
+        KeyCache::Instance().Clear();
+    }
+    catch (const std::runtime_error &e)
     {
-        std::cerr << "Error: Fapi_Initialize failed with error code " << tpm_result << std::endl;
-        Fapi_Finalize(&context);
-        return;
+        std::cerr << "Error: " << e.what() << std::endl;
     }
+}
 
-    // Set callback presenting authentication to the TPM when required
-    tpm_result = Fapi_SetAuthCB(context, AuthCallback, nullptr);
-    if (tpm_result != TSS2_RC_SUCCESS)
+/**
+ * @brief DeleteKey Removes the TPM data of one key reference, its sealed key and iv and envelope key-encryption key
+ * @param[in] key_reference The key reference
+ * @returns True if anything was stored for the reference
+ */
+bool Common::DeleteKey(const std::string &key_reference)
+{
+    if (!CheckKeyReference(key_reference))
     {
-        std::cerr << "Error: Fapi_SetAuthCB failed with error code " << tpm_result << std::endl;
-        Fapi_Finalize(&context);
-        return;
+        return false;
     }
 
-    Fapi_Delete(context, "/");
+    KeyCache::Instance().Invalidate(key_reference);
 
+    bool deleted = false;
     try
     {
-        if (std::filesystem::exists(kIsProvisionedIdentifier))
-        {
-            std::filesystem::remove(kIsProvisionedIdentifier);
-            std::cout << "File deleted successfully." << std::endl;
-        }
-        else
-        {
-            std::cout << "File does not exist." << std::endl;
-        }
+        // Any may exist, depending on the key modes the reference was used with, legacy data also sealed an iv
+        TpmSession &session = TpmSession::Instance();
+        deleted = session.Delete("/HS/SRK/" + key_reference);
+        deleted = session.Delete("/HS/SRK/" + key_reference + "_iv") || deleted;
+        deleted = Envelope::DeleteKeyEncryptionKey(key_reference) || deleted;
+
+        // Unseals queued ahead of the deletes may have cached the key meanwhile
+        KeyCache::Instance().Invalidate(key_reference);
     }
-    catch (const std::exception &e)
+    catch (const std::runtime_error &e)
     {
         std::cerr << "Error: " << e.what() << std::endl;
+        return false;
     }
 
-    Fapi_Finalize(&context);
+    if (!deleted)
+    {
+        std::cerr << "No TPM data found for key reference: " << key_reference << std::endl;
+        return false;
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Deleted TPM data for key reference: " << key_reference);
+    return true;
 }
 
 /**
@@ -293,19 +265,30 @@ void Common::ResetTpm()
  */
 bool Common::FileToString(const std::string &path_in, std::string &data_out)
 {
+    // Regular files are copied once, straight out of the page cache
+    MappedFile mapped_file{};
+    if (mapped_file.Open(path_in))
+    {
+        data_out.assign(reinterpret_cast<const char *>(mapped_file.Data()), mapped_file.Size());
+        return true;
+    }
+
     // Load our file
-    std::ifstream file_stream(path_in);
+    std::ifstream file_stream(path_in, std::ios::binary);
     if (!file_stream.is_open())
     {
         return false;
     }
 
-    // Read contents
-    std::string file_content((std::istreambuf_iterator<char>(file_stream)),
-                             std::istreambuf_iterator<char>());
-    data_out = file_content;
+    // Read contents, in large blocks since the size is not known
+    data_out.clear();
+    std::vector<char> block(64 * 1024);
+    while (file_stream.read(block.data(), block.size()) || file_stream.gcount() > 0)
+    {
+        data_out.append(block.data(), static_cast<size_t>(file_stream.gcount()));
+    }
 
-    return true;
+    return !file_stream.bad();
 }
 
 /**
@@ -331,25 +314,12 @@ bool Common::StringToFile(const std::string &path_out, std::string &data_in)
 }
 
 /**
- * @brief GetRandomData Fetches random data from the system's entropy source
+ * @brief GetRandomData Fetches cryptographically secure random data, see Entropy
  * @param[out] data_buffer The buffer to populate
  * @param[in] length The amount of random data to fetch
+ * @returns Success, the buffer must not be used otherwise
  */
-void Common::GetRandomData(unsigned char data_buffer[], const size_t &length)
+bool Common::GetRandomData(unsigned char data_buffer[], const size_t &length)
 {
-    int fd = open("/dev/random", O_RDONLY);
-    if (fd == -1)
-    {
-        perror("Error opening /dev/random");
-        exit(1);
-    }
-
-    ssize_t bytes_read = read(fd, data_buffer, length);
-    if (bytes_read < 0)
-    {
-        perror("Error reading from /dev/random");
-        exit(1);
-    }
-
-    close(fd);
-}
\ No newline at end of file
+    return Entropy::Fill(data_buffer, length);
+}
@@ -0,0 +1,212 @@
+#include "tpm_encrypt/compression.hpp"
+
+#include <memory>
+#include <vector>
+
+#ifdef TPM_ENCRYPT_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TPM_ENCRYPT_WITH_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+// Algorithms in the order Parse and Name know them
+static const struct
+{
+    CompressionId compression;
+    const char *name;
+} kCompressionNames[] = {
+    {CompressionId::None, "none"},
+    {CompressionId::Zstd, "zstd"},
+    {CompressionId::Lz4, "lz4"},
+};
+
+#ifdef TPM_ENCRYPT_WITH_LZ4
+// Levels from here on use the HC compressor, as the lz4 command line does
+static const int kLz4HcMinLevel = 3;
+#endif
+
+/**
+ * @brief Available Whether this build can compress and decompress with an algorithm, None always is
+ */
+bool Compression::Available(CompressionId compression)
+{
+    switch (compression)
+    {
+    case CompressionId::None:
+        return true;
+#ifdef TPM_ENCRYPT_WITH_ZSTD
+    case CompressionId::Zstd:
+        return true;
+#endif
+#ifdef TPM_ENCRYPT_WITH_LZ4
+    case CompressionId::Lz4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Compress Compresses a chunk, provided that saves enough to be worth it
+ * @param[in] compression Algorithm to use, not None
+ * @param[in] level Algorithm specific level, 0 for its default
+ * @param[in] data_in The chunk
+ * @param[in] length_in Length of data_in
+ * @param[out] data_out Receives the compressed chunk, must hold length_in bytes
+ * @param[out] length_out Length of the compressed chunk
+ * @returns False if the chunk should be stored as is (incompressible, or the algorithm failed)
+ */
+bool Compression::Compress(CompressionId compression, int level, const uint8_t *data_in, size_t length_in, uint8_t *data_out, size_t &length_out)
+{
+    // Output that would not save enough does not fit, so the compressors give up on it early
+    size_t max_length = length_in - length_in / kMinSavingFraction;
+    if (length_in == 0 || max_length == length_in)
+    {
+        return false;
+    }
+
+    // Contexts are kept per thread (chunks are compressed on the pool), so no chunk allocates
+    switch (compression)
+    {
+#ifdef TPM_ENCRYPT_WITH_ZSTD
+    case CompressionId::Zstd:
+    {
+        thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> context(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+        if (!context)
+        {
+            return false;
+        }
+        size_t result = ZSTD_compressCCtx(context.get(), data_out, max_length, data_in, length_in, level);
+        if (ZSTD_isError(result))
+        {
+            return false;
+        }
+        length_out = result;
+        return true;
+    }
+#endif
+#ifdef TPM_ENCRYPT_WITH_LZ4
+    case CompressionId::Lz4:
+    {
+        int result = 0;
+        if (level >= kLz4HcMinLevel)
+        {
+            thread_local std::vector<char> hc_state(LZ4_sizeofStateHC());
+            result = LZ4_compress_HC_extStateHC(hc_state.data(), reinterpret_cast<const char *>(data_in), reinterpret_cast<char *>(data_out),
+                                                static_cast<int>(length_in), static_cast<int>(max_length), level);
+        }
+        else
+        {
+            thread_local std::vector<char> state(LZ4_sizeofState());
+            result = LZ4_compress_fast_extState(state.data(), reinterpret_cast<const char *>(data_in), reinterpret_cast<char *>(data_out),
+                                                static_cast<int>(length_in), static_cast<int>(max_length), level < 0 ? -level : 1);
+        }
+        if (result <= 0)
+        {
+            return false;
+        }
+        length_out = static_cast<size_t>(result);
+        return true;
+    }
+#endif
+    default:
+#if !defined(TPM_ENCRYPT_WITH_ZSTD) && !defined(TPM_ENCRYPT_WITH_LZ4)
+        (void)level;
+        (void)data_in;
+        (void)data_out;
+        (void)length_out;
+#endif
+        return false;
+    }
+}
+
+/**
+ * @brief Decompress Restores a chunk
+ * @param[in] compression Algorithm it was compressed with
+ * @param[in] data_in The compressed chunk
+ * @param[in] length_in Length of data_in
+ * @param[out] data_out Receives the chunk
+ * @param[in] capacity Bytes available at data_out, more output is an error
+ * @param[out] length_out Length of the chunk
+ * @returns False if the data is corrupt or does not fit
+ */
+bool Compression::Decompress(CompressionId compression, const uint8_t *data_in, size_t length_in, uint8_t *data_out, size_t capacity, size_t &length_out)
+{
+    switch (compression)
+    {
+#ifdef TPM_ENCRYPT_WITH_ZSTD
+    case CompressionId::Zstd:
+    {
+        thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> context(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+        if (!context)
+        {
+            return false;
+        }
+        size_t result = ZSTD_decompressDCtx(context.get(), data_out, capacity, data_in, length_in);
+        if (ZSTD_isError(result))
+        {
+            return false;
+        }
+        length_out = result;
+        return true;
+    }
+#endif
+#ifdef TPM_ENCRYPT_WITH_LZ4
+    case CompressionId::Lz4:
+    {
+        int result = LZ4_decompress_safe(reinterpret_cast<const char *>(data_in), reinterpret_cast<char *>(data_out),
+                                         static_cast<int>(length_in), static_cast<int>(capacity));
+        if (result < 0)
+        {
+            return false;
+        }
+        length_out = static_cast<size_t>(result);
+        return true;
+    }
+#endif
+    default:
+#if !defined(TPM_ENCRYPT_WITH_ZSTD) && !defined(TPM_ENCRYPT_WITH_LZ4)
+        (void)data_in;
+        (void)length_in;
+        (void)data_out;
+        (void)capacity;
+        (void)length_out;
+#endif
+        return false;
+    }
+}
+
+/**
+ * @brief Name Stable lower case name of an algorithm, e.g. "zstd"
+ */
+const char *Compression::Name(CompressionId compression)
+{
+    for (const auto &algorithm : kCompressionNames)
+    {
+        if (algorithm.compression == compression)
+        {
+            return algorithm.name;
+        }
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Parse Looks an algorithm up by Name
+ * @returns False if the name is unknown
+ */
+bool Compression::Parse(const std::string &name, CompressionId &compression)
+{
+    for (const auto &algorithm : kCompressionNames)
+    {
+        if (name == algorithm.name)
+        {
+            compression = algorithm.compression;
+            return true;
+        }
+    }
+    return false;
+}
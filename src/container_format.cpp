@@ -0,0 +1,232 @@
+#include "tpm_encrypt/container_format.hpp"
+
+#include <cstring>
+
+// Marks the start of a container, legacy ciphertext has no header at all
+static const char kMagic[4] = {'T', 'P', 'M', 'E'};
+
+// Offsets of the fixed part of the header
+static const size_t kNonceLengthOffset = 20;
+
+// Everything up to and including the nonce length
+static const size_t kFixedHeaderLength = kNonceLengthOffset + 1;
+
+/**
+ * @brief WriteLittleEndian Stores an unsigned integer of the given width
+ */
+static void WriteLittleEndian(uint8_t *data_out, uint64_t value, size_t width)
+{
+    for (size_t i = 0; i < width; i++)
+    {
+        data_out[i] = static_cast<uint8_t>((value >> (8 * i)) & 0xff);
+    }
+}
+
+/**
+ * @brief ReadLittleEndian Reads an unsigned integer of the given width
+ */
+static uint64_t ReadLittleEndian(const uint8_t *data_in, size_t width)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < width; i++)
+    {
+        value |= static_cast<uint64_t>(data_in[i]) << (8 * i);
+    }
+    return value;
+}
+
+/**
+ * @brief WriteHeader Serialises a header, appending it to the output
+ * @param[in] header Header to serialise
+ * @param[out] data_out Output the header is appended to
+ */
+void ContainerFormat::WriteHeader(const ContainerHeader &header, std::string &data_out)
+{
+    size_t offset = data_out.size();
+    data_out.resize(offset + HeaderLength(header.nonce.size(), header.wrapped_key.size()));
+    WriteHeader(header, reinterpret_cast<uint8_t *>(&data_out[offset]));
+}
+
+/**
+ * @brief WriteHeader Serialises a header into a caller provided buffer
+ * @param[in] header Header to serialise
+ * @param[out] data_out Receives HeaderLength of the header's nonce and wrapped key bytes
+ */
+void ContainerFormat::WriteHeader(const ContainerHeader &header, uint8_t *data_out)
+{
+    std::memcpy(data_out, kMagic, sizeof(kMagic));
+    data_out[4] = kVersion;
+    data_out[5] = static_cast<uint8_t>(header.cipher);
+    data_out[6] = static_cast<uint8_t>(header.key_mode);
+    data_out[7] = static_cast<uint8_t>((header.flags & ~kCompressionMask) | static_cast<uint8_t>(header.compression));
+    WriteLittleEndian(data_out + 8, header.chunk_size, 4);
+    WriteLittleEndian(data_out + kPlaintextLengthOffset, header.plaintext_length, 8);
+
+    size_t offset = kNonceLengthOffset;
+    data_out[offset++] = static_cast<uint8_t>(header.nonce.size());
+    if (!header.nonce.empty())
+    {
+        std::memcpy(data_out + offset, header.nonce.data(), header.nonce.size());
+    }
+    offset += header.nonce.size();
+
+    WriteLittleEndian(data_out + offset, header.wrapped_key.size(), 2);
+    offset += 2;
+    if (!header.wrapped_key.empty())
+    {
+        std::memcpy(data_out + offset, header.wrapped_key.data(), header.wrapped_key.size());
+    }
+}
+
+/**
+ * @brief HeaderLength Bytes a header occupies once serialised
+ * @param[in] nonce_length Length of the header's nonce
+ * @param[in] wrapped_key_length Length of the header's wrapped key, 0 for sealed keys
+ */
+size_t ContainerFormat::HeaderLength(size_t nonce_length, size_t wrapped_key_length)
+{
+    return kFixedHeaderLength + nonce_length + 2 + wrapped_key_length;
+}
+
+/**
+ * @brief ReadHeader Parses a header from the start of some data
+ * @param[in] data_in Data which may start with a header
+ * @param[in] length_in Length of data_in
+ * @param[out] header The decoded header
+ * @param[out] header_length Number of bytes the header occupies
+ * @returns False if the data does not start with a valid header (e.g. legacy headerless ciphertext)
+ */
+bool ContainerFormat::ReadHeader(const uint8_t *data_in, size_t length_in, ContainerHeader &header, size_t &header_length)
+{
+    if (length_in < kFixedHeaderLength || !HasMagic(data_in, length_in))
+    {
+        return false;
+    }
+
+    header.version = data_in[4];
+    if (header.version != kVersion)
+    {
+        return false;
+    }
+
+    if (data_in[5] < static_cast<uint8_t>(CipherId::Aes256Gcm) || data_in[5] > static_cast<uint8_t>(CipherId::ChaCha20Poly1305))
+    {
+        return false;
+    }
+    header.cipher = static_cast<CipherId>(data_in[5]);
+
+    if (data_in[6] != static_cast<uint8_t>(KeyMode::Sealed) && data_in[6] != static_cast<uint8_t>(KeyMode::Envelope))
+    {
+        return false;
+    }
+    header.key_mode = static_cast<KeyMode>(data_in[6]);
+
+    if ((data_in[7] & kCompressionMask) > static_cast<uint8_t>(CompressionId::Lz4))
+    {
+        return false;
+    }
+    header.compression = static_cast<CompressionId>(data_in[7] & kCompressionMask);
+    header.flags = data_in[7] & ~kCompressionMask;
+    if ((header.flags & ~kFlagRecordNonces) != 0)
+    {
+        return false;
+    }
+
+    header.chunk_size = static_cast<uint32_t>(ReadLittleEndian(data_in + 8, 4));
+    if (header.chunk_size == 0 || header.chunk_size > kMaxChunkSize)
+    {
+        return false;
+    }
+
+    header.plaintext_length = ReadLittleEndian(data_in + kPlaintextLengthOffset, 8);
+
+    // Variable length fields, each bounds checked against the input
+    size_t offset = kFixedHeaderLength;
+    size_t nonce_length = data_in[kNonceLengthOffset];
+    if (length_in < offset + nonce_length + 2)
+    {
+        return false;
+    }
+    header.nonce.assign(data_in + offset, data_in + offset + nonce_length);
+    offset += nonce_length;
+
+    size_t wrapped_length = static_cast<size_t>(ReadLittleEndian(data_in + offset, 2));
+    offset += 2;
+    if (length_in < offset + wrapped_length)
+    {
+        return false;
+    }
+    header.wrapped_key.assign(data_in + offset, data_in + offset + wrapped_length);
+    offset += wrapped_length;
+
+    header_length = offset;
+    return true;
+}
+
+/**
+ * @brief ReadHeader Reads a header from the start of a stream, consuming only the header bytes
+ * @param[in] stream_in Stream which may start with a header
+ * @param[out] header The decoded header
+ * @param[out] consumed Every byte read from the stream, so a caller can fall back to legacy decoding
+ * @returns False if the stream does not start with a valid header
+ */
+bool ContainerFormat::ReadHeader(std::istream &stream_in, ContainerHeader &header, std::string &consumed)
+{
+    // Reads up to count more bytes onto consumed, returning whether they were all available
+    auto read_more = [&stream_in, &consumed](size_t count)
+    {
+        size_t offset = consumed.size();
+        consumed.resize(offset + count);
+        stream_in.read(&consumed[offset], count);
+        consumed.resize(offset + static_cast<size_t>(stream_in.gcount()));
+        return consumed.size() == offset + count;
+    };
+
+    consumed.clear();
+
+    // Fixed part first, then the two length prefixed fields
+    if (!read_more(kFixedHeaderLength) ||
+        !HasMagic(reinterpret_cast<const uint8_t *>(consumed.data()), consumed.size()))
+    {
+        return false;
+    }
+
+    if (!read_more(static_cast<uint8_t>(consumed[kNonceLengthOffset]) + 2))
+    {
+        return false;
+    }
+
+    const uint8_t *wrapped_length_bytes = reinterpret_cast<const uint8_t *>(consumed.data()) + consumed.size() - 2;
+    if (!read_more(static_cast<size_t>(ReadLittleEndian(wrapped_length_bytes, 2))))
+    {
+        return false;
+    }
+
+    size_t header_length = 0;
+    return ReadHeader(reinterpret_cast<const uint8_t *>(consumed.data()), consumed.size(), header, header_length) &&
+           header_length == consumed.size();
+}
+
+/**
+ * @brief HasMagic Checks whether some data starts with the container magic
+ * @param[in] data_in Data to check
+ * @param[in] length_in Length of data_in
+ */
+bool ContainerFormat::HasMagic(const uint8_t *data_in, size_t length_in)
+{
+    return length_in >= sizeof(kMagic) && std::memcmp(data_in, kMagic, sizeof(kMagic)) == 0;
+}
+
+/**
+ * @brief HeaderAad Additional authenticated data binding every chunk to its header
+ * @details The plaintext length is left out so it can be patched in after a streamed write,
+ *          truncation is instead caught by the final chunk flag
+ * @param[in] header The header
+ * @param[out] aad_out The serialised authenticated fields
+ */
+void ContainerFormat::HeaderAad(const ContainerHeader &header, std::string &aad_out)
+{
+    aad_out.clear();
+    WriteHeader(header, aad_out);
+    std::memset(&aad_out[kPlaintextLengthOffset], 0, 8);
+}
@@ -0,0 +1,440 @@
+#include "tpm_encrypt/daemon_client.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+
+static std::mutex socket_path_mutex;
+static std::string socket_path_override;
+
+// One thread's connection to the daemon, closed with the thread
+struct DaemonConnection
+{
+    int fd = -1;
+    std::string socket_path;
+
+    void Close()
+    {
+        if (fd != -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    ~DaemonConnection()
+    {
+        Close();
+    }
+};
+
+/**
+ * @brief Connect Opens a connection to the daemon
+ * @returns The socket, -1 if the daemon cannot be reached
+ */
+static int Connect(const std::string &socket_path)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path))
+    {
+        return -1;
+    }
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief SetSocketPath Connects to the daemon at this path from now on
+ * @param[in] socket_path The daemon's socket, empty to go back to the default
+ */
+void DaemonClient::SetSocketPath(const std::string &socket_path)
+{
+    std::lock_guard<std::mutex> lock(socket_path_mutex);
+    socket_path_override = socket_path;
+}
+
+/**
+ * @brief SocketPath The socket requests are sent to
+ */
+std::string DaemonClient::SocketPath()
+{
+    {
+        std::lock_guard<std::mutex> lock(socket_path_mutex);
+        if (!socket_path_override.empty())
+        {
+            return socket_path_override;
+        }
+    }
+
+    const char *environment = std::getenv("TPM_ENCRYPTD_SOCKET");
+    if (environment != nullptr && environment[0] != '\0')
+    {
+        return environment;
+    }
+    return DaemonProtocol::kDefaultSocketPath;
+}
+
+/**
+ * @brief Ping Checks that the daemon is up and answering
+ * @returns Success
+ */
+bool DaemonClient::Ping()
+{
+    DaemonStatus status = DaemonStatus::Failed;
+    std::string response{};
+    return Call(DaemonRequest{}, nullptr, 0, nullptr, 0, status, response) && status == DaemonStatus::Ok;
+}
+
+/**
+ * @brief EncryptFile Has the daemon encrypt a file
+ * @param[in] path_in File to be encrypted
+ * @param[in] path_out Path where the encrypted file shall be saved
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @returns Success
+ */
+bool DaemonClient::EncryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference)
+{
+    return EncryptFile(path_in, path_out, key_reference, EncryptOptions{});
+}
+
+/**
+ * @brief EncryptFile Has the daemon encrypt a file
+ * @param[in] path_in File to be encrypted
+ * @param[in] path_out Path where the encrypted file shall be saved
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ * @returns Success
+ */
+bool DaemonClient::EncryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference, const EncryptOptions &options)
+{
+    int fd_in = open(path_in.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_in == -1)
+    {
+        std::cerr << "Unable to load file: " << path_in << std::endl;
+        return false;
+    }
+
+    // Staged and renamed into place once complete, path_out may be the file the daemon reads
+    StagedFile staged_out{};
+    int fd_out = staged_out.Create(path_out);
+    if (fd_out == -1)
+    {
+        std::cerr << "Unable to write encrypted data at: " << path_out << std::endl;
+        close(fd_in);
+        return false;
+    }
+
+    bool success = CallDescriptors(DaemonOp::EncryptDescriptor, fd_in, fd_out, key_reference, options);
+    close(fd_in);
+    success = close(fd_out) == 0 && success && staged_out.Commit();
+    if (!success)
+    {
+        std::cerr << "Unable to encrypt the requested file: " << path_in << std::endl;
+    }
+    return success;
+}
+
+/**
+ * @brief DecryptFile Has the daemon decrypt a file
+ * @param[in] path_in File to be decrypted
+ * @param[in] path_out Path where the decrypted file shall be saved, left as it was on failure
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @returns Success
+ */
+bool DaemonClient::DecryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference)
+{
+    int fd_in = open(path_in.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_in == -1)
+    {
+        std::cerr << "Failed to open the file." << std::endl;
+        return false;
+    }
+
+    // Staged and renamed into place once complete, path_out may be the file the daemon reads
+    StagedFile staged_out{};
+    int fd_out = staged_out.Create(path_out);
+    if (fd_out == -1)
+    {
+        std::cerr << "Unable to write plaintext data at: " << path_out << std::endl;
+        close(fd_in);
+        return false;
+    }
+
+    bool success = CallDescriptors(DaemonOp::DecryptDescriptor, fd_in, fd_out, key_reference, EncryptOptions{});
+    close(fd_in);
+    success = close(fd_out) == 0 && success && staged_out.Commit();
+    if (!success)
+    {
+        // Plaintext of a file that failed authentication is never put in place, the staged file goes with staged_out
+        std::cerr << "Unable to decrypt the requested file: " << path_in << std::endl;
+    }
+    return success;
+}
+
+/**
+ * @brief EncryptData Has the daemon encrypt data
+ * @param[in] data_in Data to be encrypted
+ * @param[out] data_out Encrypted data output
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @returns Success
+ */
+bool DaemonClient::EncryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference)
+{
+    return EncryptData(data_in, data_out, key_reference, EncryptOptions{});
+}
+
+/**
+ * @brief EncryptData Has the daemon encrypt data
+ * @param[in] data_in Data to be encrypted
+ * @param[out] data_out Encrypted data output
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ * @returns Success
+ */
+bool DaemonClient::EncryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference, const EncryptOptions &options)
+{
+    DaemonRequest request{};
+    request.op = DaemonOp::EncryptData;
+    request.key_reference = key_reference;
+    request.options = options;
+    return CallData(request, data_in, data_out);
+}
+
+/**
+ * @brief DecryptData Has the daemon decrypt data
+ * @param[in] data_in Data to be decrypted
+ * @param[out] data_out Decrypted data output
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @returns Success
+ */
+bool DaemonClient::DecryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference)
+{
+    DaemonRequest request{};
+    request.op = DaemonOp::DecryptData;
+    request.key_reference = key_reference;
+    return CallData(request, data_in, data_out);
+}
+
+/**
+ * @brief EncryptDescriptor Has the daemon encrypt everything read from one descriptor into another
+ * @param[in] fd_in Plaintext input, read until EOF
+ * @param[in] fd_out Encrypted output, seekable ones get the plaintext length patched into the header
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ * @returns Success
+ */
+bool DaemonClient::EncryptDescriptor(int fd_in, int fd_out, const std::string &key_reference, const EncryptOptions &options)
+{
+    return CallDescriptors(DaemonOp::EncryptDescriptor, fd_in, fd_out, key_reference, options);
+}
+
+/**
+ * @brief DecryptDescriptor Has the daemon decrypt everything read from one descriptor into another
+ * @param[in] fd_in Encrypted input, read until EOF
+ * @param[in] fd_out Plaintext output
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @returns Success
+ */
+bool DaemonClient::DecryptDescriptor(int fd_in, int fd_out, const std::string &key_reference)
+{
+    return CallDescriptors(DaemonOp::DecryptDescriptor, fd_in, fd_out, key_reference, EncryptOptions{});
+}
+
+/**
+ * @brief Call Sends a request on this thread's connection and waits for the response
+ * @param[in] request The request, its payload is sent from payload instead
+ * @param[in] payload Data sent with the request
+ * @param[in] payload_length Length of payload
+ * @param[in] descriptors Descriptors to hand over
+ * @param[in] descriptor_count Number of descriptors
+ * @param[out] status Outcome reported by the daemon
+ * @param[out] response Output of the request, or an error message
+ * @returns False if the daemon could not be reached
+ */
+bool DaemonClient::Call(const DaemonRequest &request, const uint8_t *payload, size_t payload_length,
+                        const int *descriptors, size_t descriptor_count, DaemonStatus &status, std::string &response)
+{
+    thread_local DaemonConnection connection;
+
+    std::string socket_path = SocketPath();
+    if (connection.socket_path != socket_path)
+    {
+        connection.Close();
+    }
+
+    std::string body{};
+    DaemonProtocol::EncodeRequest(request, body);
+
+    // A connection kept from an earlier request may have outlived the daemon, that one is retried on a new connection.
+    // Nothing has been sent to a daemon that is gone, so repeating the request is safe
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        bool reused = connection.fd != -1;
+        if (!reused)
+        {
+            connection.fd = Connect(socket_path);
+            connection.socket_path = socket_path;
+            if (connection.fd == -1)
+            {
+                std::cerr << "Unable to connect to tpm-encryptd at: " << socket_path << " (" << std::strerror(errno) << ")" << std::endl;
+                return false;
+            }
+        }
+
+        if (!DaemonProtocol::Send(connection.fd, static_cast<uint8_t>(request.op), body, payload, payload_length, descriptors, descriptor_count))
+        {
+            connection.Close();
+            if (reused)
+            {
+                continue;
+            }
+            std::cerr << "Unable to send request to tpm-encryptd" << std::endl;
+            return false;
+        }
+
+        uint8_t kind = 0;
+        std::vector<int> received{};
+        if (!DaemonProtocol::Receive(connection.fd, kind, response, received))
+        {
+            connection.Close();
+            std::cerr << "tpm-encryptd closed the connection" << std::endl;
+            return false;
+        }
+        for (int descriptor : received)
+        {
+            close(descriptor);
+        }
+
+        status = static_cast<DaemonStatus>(kind);
+        return true;
+    }
+
+    std::cerr << "Unable to send request to tpm-encryptd" << std::endl;
+    return false;
+}
+
+/**
+ * @brief CallData Sends data inline, or through memfds if it is large or its output turns out to be
+ * @param[in] request The request, with an inline op
+ * @param[in] data_in Data to be processed
+ * @param[out] data_out The output
+ * @returns Success
+ */
+bool DaemonClient::CallData(const DaemonRequest &request, const std::string &data_in, std::string &data_out)
+{
+    if (data_in.size() <= kInlineLimit)
+    {
+        DaemonStatus status = DaemonStatus::Failed;
+        if (!Call(request, reinterpret_cast<const uint8_t *>(data_in.data()), data_in.size(), nullptr, 0, status, data_out))
+        {
+            return false;
+        }
+        if (status == DaemonStatus::Ok)
+        {
+            return true;
+        }
+        if (status != DaemonStatus::TooLarge)
+        {
+            std::cerr << "tpm-encryptd: " << data_out << std::endl;
+            return false;
+        }
+    }
+
+    // The input is written once into a memfd the daemon reads, the output comes back the same way
+    int fd_in = memfd_create("tpm-encrypt-in", MFD_CLOEXEC);
+    int fd_out = memfd_create("tpm-encrypt-out", MFD_CLOEXEC);
+    bool success = fd_in != -1 && fd_out != -1;
+    size_t written = 0;
+    while (success && written < data_in.size())
+    {
+        ssize_t result = write(fd_in, data_in.data() + written, data_in.size() - written);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        success = result > 0;
+        written += success ? static_cast<size_t>(result) : 0;
+    }
+    success = success && lseek(fd_in, 0, SEEK_SET) == 0;
+
+    DaemonOp op = request.op == DaemonOp::EncryptData ? DaemonOp::EncryptDescriptor : DaemonOp::DecryptDescriptor;
+    success = success && CallDescriptors(op, fd_in, fd_out, request.key_reference, request.options);
+
+    struct stat status{};
+    success = success && fstat(fd_out, &status) == 0;
+    if (success)
+    {
+        data_out.resize(static_cast<size_t>(status.st_size));
+        size_t read_length = 0;
+        while (success && read_length < data_out.size())
+        {
+            ssize_t result = pread(fd_out, &data_out[read_length], data_out.size() - read_length, static_cast<off_t>(read_length));
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            success = result > 0;
+            read_length += success ? static_cast<size_t>(result) : 0;
+        }
+    }
+    if (!success)
+    {
+        OPENSSL_cleanse(data_out.data(), data_out.size());
+        data_out.clear();
+    }
+
+    if (fd_in != -1)
+    {
+        close(fd_in);
+    }
+    if (fd_out != -1)
+    {
+        close(fd_out);
+    }
+    return success;
+}
+
+/**
+ * @brief CallDescriptors Sends a descriptor request
+ * @returns Success
+ */
+bool DaemonClient::CallDescriptors(DaemonOp op, int fd_in, int fd_out, const std::string &key_reference, const EncryptOptions &options)
+{
+    DaemonRequest request{};
+    request.op = op;
+    request.key_reference = key_reference;
+    request.options = options;
+
+    int descriptors[2] = {fd_in, fd_out};
+    DaemonStatus status = DaemonStatus::Failed;
+    std::string response{};
+    if (!Call(request, nullptr, 0, descriptors, 2, status, response))
+    {
+        return false;
+    }
+    if (status != DaemonStatus::Ok)
+    {
+        std::cerr << "tpm-encryptd: " << response << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,268 @@
+#include "tpm_encrypt/daemon_protocol.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Fixed fields of a request body ahead of the key reference
+static const size_t kRequestFieldsLength = 13;
+
+// Appends an integer, little endian
+static void PutInteger(uint64_t value, size_t length, std::string &data_out)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        data_out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+// Reads an integer, little endian
+static uint64_t GetInteger(const uint8_t *data_in, size_t length)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        value |= static_cast<uint64_t>(data_in[i]) << (8 * i);
+    }
+    return value;
+}
+
+// Closes every descriptor in a list and empties it
+static void CloseAll(std::vector<int> &descriptors)
+{
+    for (int descriptor : descriptors)
+    {
+        close(descriptor);
+    }
+    descriptors.clear();
+}
+
+/**
+ * @brief Send Writes one message, retrying short writes
+ * @param[in] socket Connected socket
+ * @param[in] kind DaemonOp of a request or DaemonStatus of a response
+ * @param[in] body First part of the body
+ * @param[in] payload Rest of the body, sent without being copied into it
+ * @param[in] payload_length Length of payload
+ * @param[in] descriptors Descriptors to hand over, they stay open on this side
+ * @param[in] descriptor_count Number of descriptors, at most kMaxDescriptors
+ * @returns False if the peer is gone or the message is too long
+ */
+bool DaemonProtocol::Send(int socket, uint8_t kind, const std::string &body, const uint8_t *payload, size_t payload_length,
+                          const int *descriptors, size_t descriptor_count)
+{
+    size_t length = body.size() + payload_length;
+    if (length > kMaxMessageLength || descriptor_count > kMaxDescriptors)
+    {
+        return false;
+    }
+
+    std::string header{};
+    PutInteger(length, 4, header);
+    header.push_back(static_cast<char>(kVersion));
+    header.push_back(static_cast<char>(kind));
+    header.push_back(static_cast<char>(descriptor_count));
+    header.push_back(0);
+
+    iovec parts[3] = {
+        {const_cast<char *>(header.data()), header.size()},
+        {const_cast<char *>(body.data()), body.size()},
+        {const_cast<uint8_t *>(payload), payload_length},
+    };
+
+    // Descriptors go with the first write only, which always carries at least the frame header
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxDescriptors)] = {};
+    msghdr message{};
+    message.msg_iov = parts;
+    message.msg_iovlen = 3;
+    if (descriptor_count > 0)
+    {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * descriptor_count);
+        cmsghdr *rights = CMSG_FIRSTHDR(&message);
+        rights->cmsg_level = SOL_SOCKET;
+        rights->cmsg_type = SCM_RIGHTS;
+        rights->cmsg_len = CMSG_LEN(sizeof(int) * descriptor_count);
+        std::memcpy(CMSG_DATA(rights), descriptors, sizeof(int) * descriptor_count);
+    }
+
+    size_t remaining = header.size() + length;
+    while (remaining > 0)
+    {
+        // MSG_NOSIGNAL: a client that went away is an error to handle, not a reason to die
+        ssize_t result = sendmsg(socket, &message, MSG_NOSIGNAL);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        remaining -= static_cast<size_t>(result);
+        message.msg_control = nullptr;
+        message.msg_controllen = 0;
+
+        // Skip past what was written
+        size_t written = static_cast<size_t>(result);
+        while (message.msg_iovlen > 0 && written >= message.msg_iov[0].iov_len)
+        {
+            written -= message.msg_iov[0].iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0)
+        {
+            message.msg_iov[0].iov_base = static_cast<char *>(message.msg_iov[0].iov_base) + written;
+            message.msg_iov[0].iov_len -= written;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Receive Reads one message
+ * @param[in] socket Connected socket
+ * @param[out] kind DaemonOp of a request or DaemonStatus of a response
+ * @param[out] body The body
+ * @param[out] descriptors Descriptors handed over, owned (and to be closed) by the caller
+ * @returns False if the peer is gone or sent a malformed frame, any descriptors received are closed
+ */
+bool DaemonProtocol::Receive(int socket, uint8_t &kind, std::string &body, std::vector<int> &descriptors)
+{
+    descriptors.clear();
+
+    uint8_t header[kFrameHeaderLength];
+    size_t received = 0;
+    while (received < kFrameHeaderLength)
+    {
+        iovec part{header + received, kFrameHeaderLength - received};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxDescriptors)] = {};
+        msghdr message{};
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t result = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            CloseAll(descriptors);
+            return false;
+        }
+        received += static_cast<size_t>(result);
+
+        for (cmsghdr *rights = CMSG_FIRSTHDR(&message); rights != nullptr; rights = CMSG_NXTHDR(&message, rights))
+        {
+            if (rights->cmsg_level == SOL_SOCKET && rights->cmsg_type == SCM_RIGHTS)
+            {
+                size_t count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (size_t i = 0; i < count; i++)
+                {
+                    int descriptor = -1;
+                    std::memcpy(&descriptor, CMSG_DATA(rights) + i * sizeof(int), sizeof(int));
+                    descriptors.push_back(descriptor);
+                }
+            }
+        }
+        if ((message.msg_flags & MSG_CTRUNC) != 0)
+        {
+            CloseAll(descriptors);
+            return false;
+        }
+    }
+
+    size_t length = static_cast<size_t>(GetInteger(header, 4));
+    kind = header[5];
+    if (header[4] != kVersion || length > kMaxMessageLength || header[6] != descriptors.size())
+    {
+        CloseAll(descriptors);
+        return false;
+    }
+
+    body.resize(length);
+    received = 0;
+    while (received < length)
+    {
+        ssize_t result = recv(socket, &body[received], length - received, 0);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            CloseAll(descriptors);
+            return false;
+        }
+        received += static_cast<size_t>(result);
+    }
+
+    return true;
+}
+
+/**
+ * @brief EncodeRequest Serialises everything of a request ahead of its payload
+ * @param[in] request The request, its payload is left out
+ * @param[out] body_out Receives the start of the body
+ */
+void DaemonProtocol::EncodeRequest(const DaemonRequest &request, std::string &body_out)
+{
+    body_out.clear();
+    body_out.push_back(static_cast<char>(request.options.key_mode));
+    body_out.push_back(static_cast<char>(request.options.cipher));
+    body_out.push_back(static_cast<char>(request.options.compression));
+    PutInteger(static_cast<uint32_t>(request.options.compression_level), 4, body_out);
+    PutInteger(request.options.chunk_size, 4, body_out);
+    PutInteger(request.key_reference.size(), 2, body_out);
+    body_out += request.key_reference;
+}
+
+/**
+ * @brief DecodeRequest Parses a request body
+ * @param[in] op Kind of the message
+ * @param[in] body The body, its payload is moved out
+ * @param[out] request The decoded request
+ * @returns False if the body is malformed or names unknown options
+ */
+bool DaemonProtocol::DecodeRequest(uint8_t op, std::string &body, DaemonRequest &request)
+{
+    if (op > static_cast<uint8_t>(DaemonOp::DecryptDescriptor) || body.size() < kRequestFieldsLength)
+    {
+        return false;
+    }
+
+    const uint8_t *fields = reinterpret_cast<const uint8_t *>(body.data());
+    if (fields[0] > static_cast<uint8_t>(KeyMode::Envelope) ||
+        fields[1] > static_cast<uint8_t>(CipherId::ChaCha20Poly1305) ||
+        fields[2] > static_cast<uint8_t>(CompressionId::Lz4))
+    {
+        return false;
+    }
+
+    size_t key_reference_length = static_cast<size_t>(GetInteger(fields + 11, 2));
+    if (body.size() - kRequestFieldsLength < key_reference_length)
+    {
+        return false;
+    }
+
+    request.op = static_cast<DaemonOp>(op);
+    request.options.key_mode = static_cast<KeyMode>(fields[0]);
+    request.options.cipher = static_cast<CipherId>(fields[1]);
+    request.options.compression = static_cast<CompressionId>(fields[2]);
+    request.options.compression_level = static_cast<int32_t>(static_cast<uint32_t>(GetInteger(fields + 3, 4)));
+    request.options.chunk_size = static_cast<uint32_t>(GetInteger(fields + 7, 4));
+    request.key_reference.assign(body, kRequestFieldsLength, key_reference_length);
+
+    // The payload is the rest, it keeps the body's storage
+    body.erase(0, kRequestFieldsLength + key_reference_length);
+    request.payload = std::move(body);
+    return true;
+}
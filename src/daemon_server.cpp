@@ -0,0 +1,335 @@
+#include "tpm_encrypt/daemon_server.hpp"
+#include "tpm_encrypt/data_decrypt.hpp"
+#include "tpm_encrypt/file_io.hpp"
+#include "tpm_encrypt/logger.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <istream>
+#include <ostream>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+
+// Clients the kernel queues while every connection slot is taken
+static const int kListenBacklog = 128;
+
+// How often a daemon at its connection limit checks whether it was asked to stop
+static const std::chrono::milliseconds kFullPollInterval(100);
+
+/**
+ * @brief SocketAddress Fills in a Unix socket address
+ * @returns False if the path does not fit
+ */
+static bool SocketAddress(const std::string &socket_path, sockaddr_un &address)
+{
+    address = sockaddr_un{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    return true;
+}
+
+/**
+ * @brief ~DaemonServer Stops serving and removes the socket
+ */
+DaemonServer::~DaemonServer()
+{
+    Close();
+    for (int &fd : wake_fds_)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+}
+
+/**
+ * @brief Listen Creates the socket, readable and writable by its owner and group only
+ * @param[in] socket_path Where to listen
+ * @param[in] max_connections Connections served at once, at least one
+ * @returns Success
+ */
+bool DaemonServer::Listen(const std::string &socket_path, size_t max_connections)
+{
+    if (max_connections == 0)
+    {
+        std::cerr << "At least one connection must be allowed" << std::endl;
+        return false;
+    }
+
+    sockaddr_un address{};
+    if (!SocketAddress(socket_path, address))
+    {
+        std::cerr << "Invalid socket path: " << socket_path << std::endl;
+        return false;
+    }
+
+    // A socket nobody answers on is left over from a daemon that died, one that answers belongs to a running one
+    struct stat status{};
+    if (lstat(socket_path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool live = probe != -1 && connect(probe, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+        if (probe != -1)
+        {
+            close(probe);
+        }
+        if (live)
+        {
+            std::cerr << "Another daemon is listening at: " << socket_path << std::endl;
+            return false;
+        }
+        unlink(socket_path.c_str());
+    }
+
+    if (wake_fds_[0] == -1 && pipe2(wake_fds_, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+        std::cerr << "Unable to create wake pipe: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ == -1)
+    {
+        std::cerr << "Unable to create socket: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    // The socket is created with the umask applied, so restrict it before anyone can connect
+    mode_t previous_mask = umask(0117);
+    bool bound = bind(listen_fd_, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+    umask(previous_mask);
+    if (!bound || listen(listen_fd_, kListenBacklog) != 0)
+    {
+        std::cerr << "Unable to listen at: " << socket_path << " (" << std::strerror(errno) << ")" << std::endl;
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+
+    socket_path_ = socket_path;
+    max_connections_ = max_connections;
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Listening at: " << socket_path);
+    return true;
+}
+
+/**
+ * @brief Run Accepts and serves connections until Stop is called
+ */
+void DaemonServer::Run()
+{
+    while (listen_fd_ != -1)
+    {
+        // At the limit, new clients wait in the listen backlog until a connection closes
+        bool full = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            full = !idle_.wait_for(lock, kFullPollInterval, [this]()
+                                   { return connections_.size() < max_connections_; });
+        }
+
+        pollfd events[2] = {{wake_fds_[0], POLLIN, 0}, {full ? -1 : listen_fd_, POLLIN, 0}};
+        if (poll(events, 2, full ? 0 : -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cerr << "poll failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        if (events[0].revents != 0)
+        {
+            break;
+        }
+        if ((events[1].revents & POLLIN) == 0)
+        {
+            continue;
+        }
+
+        int connection = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (connection == -1)
+        {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        connections_.insert(connection);
+        std::thread(&DaemonServer::Serve, this, connection).detach();
+    }
+
+    // Clients blocked on a request get it finished, idle ones are hung up on
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (int connection : connections_)
+    {
+        shutdown(connection, SHUT_RD);
+    }
+    idle_.wait(lock, [this]()
+               { return connections_.empty(); });
+    lock.unlock();
+
+    Close();
+}
+
+/**
+ * @brief Stop Makes Run return once the open connections are closed, safe to call from a signal handler
+ */
+void DaemonServer::Stop()
+{
+    if (wake_fds_[1] != -1)
+    {
+        char wake = 0;
+        ssize_t ignored = write(wake_fds_[1], &wake, 1);
+        (void)ignored;
+    }
+}
+
+/**
+ * @brief Serve Answers the requests of one connection until the client hangs up, then closes it
+ * @param[in] connection The accepted socket
+ */
+void DaemonServer::Serve(int connection)
+{
+    ucred peer{};
+    socklen_t peer_length = sizeof(peer);
+    if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) == 0)
+    {
+        TPM_ENCRYPT_LOG(LogLevel::Debug, "Client connected, pid " << peer.pid << " uid " << peer.uid);
+    }
+
+    uint8_t kind = 0;
+    std::string body{};
+    std::vector<int> descriptors{};
+    while (DaemonProtocol::Receive(connection, kind, body, descriptors))
+    {
+        DaemonRequest request{};
+        std::string response{};
+        DaemonStatus status = DaemonStatus::BadRequest;
+        if (DaemonProtocol::DecodeRequest(kind, body, request))
+        {
+            status = Handle(request, descriptors, response);
+        }
+        for (int descriptor : descriptors)
+        {
+            close(descriptor);
+        }
+
+        // Output that does not fit a message is dropped, the client asks again with descriptors
+        if (response.size() > DaemonProtocol::kMaxMessageLength)
+        {
+            OPENSSL_cleanse(response.data(), response.size());
+            response.clear();
+            status = DaemonStatus::TooLarge;
+        }
+
+        bool sent = DaemonProtocol::Send(connection, static_cast<uint8_t>(status), response, nullptr, 0, nullptr, 0);
+        OPENSSL_cleanse(response.data(), response.size());
+        OPENSSL_cleanse(request.payload.data(), request.payload.size());
+        OPENSSL_cleanse(body.data(), body.size());
+        if (!sent)
+        {
+            break;
+        }
+    }
+
+    // Forgotten before it is closed, accept may hand the same number to the next client
+    std::lock_guard<std::mutex> lock(mutex_);
+    connections_.erase(connection);
+    close(connection);
+    idle_.notify_all();
+}
+
+/**
+ * @brief Handle Carries out one request
+ * @param[in] request The request
+ * @param[in] descriptors Descriptors handed over with it
+ * @param[out] response Output of inline requests, or an error message
+ * @returns Outcome of the request
+ */
+DaemonStatus DaemonServer::Handle(const DaemonRequest &request, const std::vector<int> &descriptors, std::string &response)
+{
+    bool descriptor_op = request.op == DaemonOp::EncryptDescriptor || request.op == DaemonOp::DecryptDescriptor;
+    if (descriptor_op != (descriptors.size() == 2))
+    {
+        response = "Expected an input and an output descriptor";
+        return DaemonStatus::BadRequest;
+    }
+
+    bool success = false;
+    try
+    {
+        switch (request.op)
+        {
+        case DaemonOp::Ping:
+            success = true;
+            break;
+        case DaemonOp::EncryptData:
+            success = DataEncrypt::EncryptData(request.payload, response, request.key_reference, request.options);
+            break;
+        case DaemonOp::DecryptData:
+            success = DataDecrypt::DecryptData(request.payload, response, request.key_reference);
+            break;
+        case DaemonOp::EncryptDescriptor:
+        case DaemonOp::DecryptDescriptor:
+        {
+            // Streamed, so memory use does not depend on the size, and seekable outputs get the length patched in
+            DescriptorStreambuf buffer_in(descriptors[0]);
+            DescriptorStreambuf buffer_out(descriptors[1]);
+            std::istream stream_in(&buffer_in);
+            std::ostream stream_out(&buffer_out);
+            if (request.op == DaemonOp::EncryptDescriptor)
+            {
+                success = DataEncrypt::EncryptStream(stream_in, stream_out, request.key_reference, request.options);
+            }
+            else
+            {
+                success = DataDecrypt::DecryptStream(stream_in, stream_out, request.key_reference);
+            }
+            success = stream_out.flush() && success;
+            break;
+        }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        success = false;
+    }
+
+    if (!success)
+    {
+        OPENSSL_cleanse(response.data(), response.size());
+        response = "Request failed, see the daemon's log";
+        return DaemonStatus::Failed;
+    }
+    return DaemonStatus::Ok;
+}
+
+/**
+ * @brief Close Closes the listening socket and removes its path
+ */
+void DaemonServer::Close()
+{
+    if (listen_fd_ != -1)
+    {
+        close(listen_fd_);
+        listen_fd_ = -1;
+        unlink(socket_path_.c_str());
+    }
+}
@@ -1,10 +1,39 @@
 #include "tpm_encrypt/data_decrypt.hpp"
+#include "tpm_encrypt/buffer_pool.hpp"
+#include "tpm_encrypt/chunk_cipher.hpp"
+#include "tpm_encrypt/chunk_reader.hpp"
+#include "tpm_encrypt/cipher_engine.hpp"
+#include "tpm_encrypt/cipher_suite.hpp"
 #include "tpm_encrypt/common.hpp"
+#include "tpm_encrypt/compression.hpp"
+#include "tpm_encrypt/container_format.hpp"
+#include "tpm_encrypt/envelope.hpp"
+#include "tpm_encrypt/logger.hpp"
+#include "tpm_encrypt/metrics.hpp"
+#include "tpm_encrypt/thread_pool.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <fstream>
-#include <filesystem>
+#include <future>
+#include <memory>
+
+#include <unistd.h>
+
+namespace
+{
+    // A record travelling through the stream pipeline
+    struct StreamSlot
+    {
+        PooledBuffer record;
+        PooledBuffer chunk;
+        size_t chunk_length = 0;
+        std::future<bool> done;
+    };
+}
 
 /**
  * @brief DecryptFile Decrypts a given file using a TPM sealed key
@@ -16,41 +45,452 @@
 bool DataDecrypt::DecryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference)
 {
 
-    std::ifstream file(path_in, std::ios::binary); // Open the file
+    // Containers in regular files are decrypted straight out of the page cache, legacy data and pipes are streamed.
+    // So are compressed containers, whose records have no place known up front
+    MappedFile mapped_in{};
+    ContainerHeader header{};
+    size_t header_length = 0;
+    if (mapped_in.Open(path_in) && ContainerFormat::ReadHeader(mapped_in.Data(), mapped_in.Size(), header, header_length) &&
+        header.compression == CompressionId::None)
+    {
+        if (!DecryptMappedFile(mapped_in, header, header_length, path_out, key_reference))
+        {
+            std::cerr << "Unable to decrypt the requested file: " << path_in << std::endl;
+            return false;
+        }
+        return true;
+    }
 
-    if (!file.is_open())
+    std::ifstream file_in(path_in, std::ios::binary);
+    if (!file_in.is_open())
     {
         std::cerr << "Failed to open the file." << std::endl;
         return false;
     }
 
-    // Use ostringstream to concatenate strings
-    std::ostringstream oss;
-    oss << file.rdbuf();                        // Read the entire file into the stringstream
-    std::string encrypted_contents = oss.str(); // Convert stringstream to string
+    // Staged and renamed into place once complete, path_out may be the file being read
+    StagedFile staged_out{};
+    int fd_out = staged_out.Create(path_out);
+    if (fd_out == -1)
+    {
+        std::cerr << "Unable to write plaintext data at: " << path_out << std::endl;
+        return false;
+    }
+
+    // Streamed a chunk at a time, memory use does not depend on the file size
+    bool decrypted = false;
+    {
+        DescriptorStreambuf buffer_out(fd_out);
+        std::ostream file_out(&buffer_out);
+        decrypted = DecryptStream(file_in, file_out, key_reference) && file_out.flush();
+    }
+    decrypted = close(fd_out) == 0 && decrypted;
+
+    // Partial (unauthenticated as a whole) plaintext is never put in place, the staged file goes with staged_out
+    if (!decrypted || !staged_out.Commit())
+    {
+        std::cerr << "Unable to decrypt the requested file: " << path_in << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief DecryptFiles Decrypts many files, several at once, using one TPM sealed key
+ * @param[in] jobs Files to decrypt and where to save each
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @param[in] worker_count Files decrypted at once, 0 uses one per hardware thread
+ * @param[out] results Outcome of each job, in job order
+ * @returns True if every file was decrypted
+ */
+bool DataDecrypt::DecryptFiles(const std::vector<FileJob> &jobs, const std::string &key_reference, size_t worker_count, std::vector<FileResult> &results)
+{
+    return FileBatch::Run(jobs, worker_count, [&key_reference](const FileJob &job)
+                          { return DecryptFile(job.path_in, job.path_out, key_reference); },
+                          results);
+}
+
+/**
+ * @brief DecryptDirectory Decrypts every file below a directory into the same layout below another
+ * @param[in] root_in Directory to decrypt
+ * @param[in] root_out Directory where the decrypted tree shall be saved
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @param[in] worker_count Files decrypted at once, 0 uses one per hardware thread
+ * @param[out] results Outcome of each file
+ * @returns True if every file was decrypted
+ */
+bool DataDecrypt::DecryptDirectory(const std::string &root_in, const std::string &root_out, const std::string &key_reference, size_t worker_count, std::vector<FileResult> &results)
+{
+    std::vector<FileJob> jobs{};
+    if (!FileBatch::ListTree(root_in, root_out, jobs))
+    {
+        results.clear();
+        return false;
+    }
+
+    return DecryptFiles(jobs, key_reference, worker_count, results);
+}
+
+/**
+ * @brief VerifyFile Checks that an encrypted file is intact without decrypting it anywhere
+ * @param[in] path_in File to be checked, a chunked container
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @returns True if the file would decrypt
+ */
+bool DataDecrypt::VerifyFile(const std::string &path_in, const std::string &key_reference)
+{
+    MappedFile mapped_in{};
+    if (!mapped_in.Open(path_in))
+    {
+        std::cerr << "Failed to open the file: " << path_in << std::endl;
+        return false;
+    }
+
+    // Only containers carry tags, legacy ciphertext could at best be checked for padding
+    ContainerHeader header{};
+    size_t header_length = 0;
+    if (!ContainerFormat::ReadHeader(mapped_in.Data(), mapped_in.Size(), header, header_length))
+    {
+        std::cerr << "Not an authenticated container: " << path_in << std::endl;
+        return false;
+    }
+
+    if (!VerifyMappedFile(mapped_in, header, header_length, key_reference))
+    {
+        std::cerr << "Integrity check failed: " << path_in << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief VerifyFiles Checks many encrypted files, several at once, using one TPM sealed key
+ * @param[in] paths Files to be checked
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @param[in] worker_count Files checked at once, 0 uses one per hardware thread
+ * @param[out] results Outcome of each file, in the order given, path_out is left empty
+ * @returns True if every file is intact
+ */
+bool DataDecrypt::VerifyFiles(const std::vector<std::string> &paths, const std::string &key_reference, size_t worker_count, std::vector<FileResult> &results)
+{
+    std::vector<FileJob> jobs{};
+    jobs.reserve(paths.size());
+    for (const std::string &path : paths)
+    {
+        jobs.push_back(FileJob{path, std::string()});
+    }
+
+    return FileBatch::Run(jobs, worker_count, [&key_reference](const FileJob &job)
+                          { return VerifyFile(job.path_in, key_reference); },
+                          results);
+}
 
-    file.close(); // Close the file
+/**
+ * @brief VerifyDirectory Checks every file below a directory
+ * @param[in] root_in Directory to check
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @param[in] worker_count Files checked at once, 0 uses one per hardware thread
+ * @param[out] results Outcome of each file, path_out is left empty
+ * @returns True if every file is intact
+ */
+bool DataDecrypt::VerifyDirectory(const std::string &root_in, const std::string &key_reference, size_t worker_count, std::vector<FileResult> &results)
+{
+    // No output tree, nothing is created
+    std::vector<FileJob> jobs{};
+    if (!FileBatch::ListTree(root_in, std::string(), jobs))
+    {
+        results.clear();
+        return false;
+    }
 
+    return FileBatch::Run(jobs, worker_count, [&key_reference](const FileJob &job)
+                          { return VerifyFile(job.path_in, key_reference); },
+                          results);
+}
 
-    // Hold our plaintext
-    std::string decrypted_contents{};
+/**
+ * @brief DecryptRange Decrypts part of an encrypted file, authenticating only the chunks covering it
+ * @param[in] path_in File to be decrypted, a chunked container
+ * @param[in] offset Start of the range in the plaintext
+ * @param[in] length Length of the range, clipped to the end of the plaintext
+ * @param[out] data_out The plaintext of the range, shorter than length only at the end of the plaintext
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @returns Success
+ */
+bool DataDecrypt::DecryptRange(const std::string &path_in, uint64_t offset, size_t length, std::string &data_out, const std::string &key_reference)
+{
+    data_out.clear();
 
-    // Decrypt the file contents
-    if (!DecryptData(oss.str(), decrypted_contents, key_reference))
+    ChunkReader reader{};
+    if (!reader.Open(path_in, key_reference))
     {
         std::cerr << "Unable to decrypt the requested file: " << path_in << std::endl;
         return false;
     }
 
-    if (!Common::StringToFile(path_out, decrypted_contents))
+    uint64_t available = offset < reader.Size() ? reader.Size() - offset : 0;
+    data_out.assign(static_cast<size_t>(std::min<uint64_t>(length, available)), '\0');
+    size_t read_length = 0;
+    if (!reader.Read(offset, reinterpret_cast<uint8_t *>(data_out.data()), data_out.size(), read_length))
     {
-        std::cerr << "Unable to write plaintext data at: " << path_out << std::endl;
+        std::cerr << "Unable to decrypt the requested range of: " << path_in << std::endl;
+        data_out.clear();
         return false;
     }
 
+    data_out.resize(read_length);
     return true;
 }
 
+/**
+ * @brief DecryptStream Decrypts everything read from a stream until EOF using a TPM sealed key
+ * @param[in] stream_in Encrypted input
+ * @param[out] stream_out Decrypted output
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @returns Success
+ */
+bool DataDecrypt::DecryptStream(std::istream &stream_in, std::ostream &stream_out, const std::string &key_reference)
+{
+    // Streams carrying a container header describe themselves, anything else is legacy ciphertext
+    ContainerHeader header{};
+    std::string consumed{};
+    if (!ContainerFormat::ReadHeader(stream_in, header, consumed))
+    {
+        if (stream_in.bad())
+        {
+            std::cerr << "Unable to read ciphertext" << std::endl;
+            return false;
+        }
+
+        stream_in.clear();
+        return DecryptLegacyStream(consumed, stream_in, stream_out, key_reference);
+    }
+
+    SecureBytes key{};
+    if (!RecoverKey(header, key_reference, key))
+    {
+        return false;
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Decoding stream...");
+
+    std::string header_aad{};
+    ContainerFormat::HeaderAad(header, header_aad);
+
+    // A window of records is in flight on the pool while the next ones are read, plaintext is written in order
+    ThreadPool &pool = ThreadPool::Shared();
+    std::vector<StreamSlot> slots(pool.Size() * 2);
+    BufferPool &buffers = BufferPool::Shared();
+    for (StreamSlot &slot : slots)
+    {
+        slot.record = buffers.Acquire(ChunkCipher::RecordLength(header, header.chunk_size));
+        slot.chunk = buffers.Acquire(header.chunk_size);
+    }
+
+    uint64_t plaintext_length = 0;
+
+    // Waits for a slot's record and writes its plaintext, the caller must do this in chunk order
+    auto write_slot = [&stream_out, &plaintext_length](StreamSlot &slot)
+    {
+        if (!slot.done.get())
+        {
+            return false;
+        }
+        plaintext_length += slot.chunk_length;
+
+        Metrics::Timer timer(Operation::Write);
+        stream_out.write(reinterpret_cast<const char *>(slot.chunk.Data()), slot.chunk_length);
+        timer.Stop(slot.chunk_length, static_cast<bool>(stream_out));
+        if (!stream_out)
+        {
+            std::cerr << "Unable to write plaintext" << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    uint64_t index = 0;
+    bool final = false;
+    bool success = true;
+
+    while (success && !final)
+    {
+        // Reusing the slot of chunk (index - window) means that chunk is written first
+        StreamSlot &slot = slots[index % slots.size()];
+        if (slot.done.valid() && !write_slot(slot))
+        {
+            success = false;
+            break;
+        }
+
+        // Record header first, it says how much more belongs to this record
+        Metrics::Timer read_timer(Operation::Read);
+        stream_in.read(reinterpret_cast<char *>(slot.record.Data()), ChunkCipher::kRecordHeaderLength);
+        uint32_t payload_length = 0;
+        uint32_t flags = 0;
+        if (static_cast<size_t>(stream_in.gcount()) != ChunkCipher::kRecordHeaderLength)
+        {
+            std::cerr << "Encrypted data is truncated" << std::endl;
+            success = false;
+            break;
+        }
+        if (!ChunkCipher::ReadRecordHeader(header, slot.record.Data(), ChunkCipher::kRecordHeaderLength, payload_length, flags))
+        {
+            success = false;
+            break;
+        }
+
+        size_t record_length = ChunkCipher::RecordLength(header, payload_length);
+        size_t remaining = record_length - ChunkCipher::kRecordHeaderLength;
+        stream_in.read(reinterpret_cast<char *>(slot.record.Data()) + ChunkCipher::kRecordHeaderLength, remaining);
+        read_timer.Stop(record_length, static_cast<size_t>(stream_in.gcount()) == remaining);
+        if (static_cast<size_t>(stream_in.gcount()) != remaining)
+        {
+            std::cerr << "Encrypted data is truncated" << std::endl;
+            success = false;
+            break;
+        }
+
+        // The flag decides when to stop reading, it is authenticated along with the record
+        final = (flags & ChunkCipher::kChunkFinal) != 0;
+
+        slot.done = pool.Submit([&header, &key, &header_aad, &slot, index, record_length]()
+                                {
+                                    bool chunk_final = false;
+                                    size_t opened_length = 0;
+                                    return ChunkCipher::OpenChunk(header, key, header_aad, index, slot.record.Data(), record_length,
+                                                                  slot.chunk.Data(), slot.chunk.Length(), slot.chunk_length, chunk_final, opened_length); });
+
+        index++;
+    }
+
+    // Remaining plaintext in order, every outstanding record is waited for even after a failure
+    for (uint64_t pending = index > slots.size() ? index - slots.size() : 0; pending < index; pending++)
+    {
+        StreamSlot &slot = slots[pending % slots.size()];
+        if (!slot.done.valid())
+        {
+            continue;
+        }
+
+        if (!success)
+        {
+            slot.done.wait();
+        }
+        else if (!write_slot(slot))
+        {
+            success = false;
+        }
+    }
+
+    if (!success)
+    {
+        return false;
+    }
+
+    if (stream_in.peek() != std::char_traits<char>::eof())
+    {
+        std::cerr << "Unexpected data after the final chunk" << std::endl;
+        return false;
+    }
+
+    if (header.plaintext_length != ContainerFormat::kUnknownLength && header.plaintext_length != plaintext_length)
+    {
+        std::cerr << "Decrypted length does not match the header" << std::endl;
+        return false;
+    }
+
+    stream_out.flush();
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Done");
+
+    return static_cast<bool>(stream_out);
+}
+
+/**
+ * @brief DecryptLegacyStream Decrypts legacy (headerless AES-256-CBC) ciphertext from a stream
+ * @param[in] prefix Bytes already read from the stream while looking for a header
+ * @param[in] stream_in The rest of the ciphertext
+ * @param[out] stream_out Decrypted output
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @returns Success
+ */
+bool DataDecrypt::DecryptLegacyStream(const std::string &prefix, std::istream &stream_in, std::ostream &stream_out, const std::string &key_reference)
+{
+    // Unseal the key and associated iv
+    SecureBytes unsealed_encrypted_key{};
+    SecureBytes unsealed_encrypted_iv{};
+    try
+    {
+        if (!Common::UnsealKey(key_reference, unsealed_encrypted_key, unsealed_encrypted_iv))
+        {
+            std::cerr << "Unable to unseal key, have you provided a valid reference?" << std::endl;
+            return false;
+        }
+    }
+    catch (std::runtime_error &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+
+    // Legacy keys were sealed as 16 bytes but used with AES-256, read them zero extended rather than past the buffer
+    unsealed_encrypted_key.resize(CipherEngine::kMaxKeyLength, 0);
+
+    EVP_CIPHER_CTX *ctx = CipherEngine::Context(CipherEngine::Aes256Cbc(), false, unsealed_encrypted_key.data(), unsealed_encrypted_iv.data());
+    if (ctx == nullptr)
+    {
+        std::cerr << "EVP_DecryptInit_ex failed" << std::endl;
+        return false;
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Decoding legacy stream...");
+
+    // CBC decrypts incrementally, so feed it fixed size blocks of input
+    std::vector<uint8_t> input(ContainerFormat::kDefaultChunkSize);
+    std::vector<uint8_t> output(input.size() + EVP_MAX_BLOCK_LENGTH);
+    int len = 0;
+
+    if (1 != EVP_DecryptUpdate(ctx, output.data(), &len, reinterpret_cast<const uint8_t *>(prefix.data()), prefix.size()))
+    {
+        std::cerr << "EVP_DecryptUpdate failed" << std::endl;
+        return false;
+    }
+    stream_out.write(reinterpret_cast<const char *>(output.data()), len);
+
+    while (stream_in)
+    {
+        stream_in.read(reinterpret_cast<char *>(input.data()), input.size());
+        size_t input_length = static_cast<size_t>(stream_in.gcount());
+        if (stream_in.bad())
+        {
+            std::cerr << "Unable to read ciphertext" << std::endl;
+            return false;
+        }
+
+        if (1 != EVP_DecryptUpdate(ctx, output.data(), &len, input.data(), input_length))
+        {
+            std::cerr << "EVP_DecryptUpdate failed" << std::endl;
+            return false;
+        }
+        stream_out.write(reinterpret_cast<const char *>(output.data()), len);
+    }
+
+    int res = EVP_DecryptFinal_ex(ctx, output.data(), &len);
+    if (1 != res)
+    {
+        std::cerr << "EVP_DecryptFinal_ex failed: " << res << std::endl;
+        return false;
+    }
+    stream_out.write(reinterpret_cast<const char *>(output.data()), len);
+    stream_out.flush();
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Done");
+
+    return static_cast<bool>(stream_out);
+}
+
 /**
  * @brief DecryptData Decrypts data using a TPM sealed key
  * @param[in] data_in Data to be decrypted
@@ -61,23 +501,709 @@ bool DataDecrypt::DecryptFile(const std::string &path_in, const std::string &pat
 bool DataDecrypt::DecryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference)
 {
 
-    unsigned char plaintext[data_in.size()];
-    //std::vector<unsigned char> plaintext(data_in.size());
+    // Data carrying a container header describes itself, anything else is legacy ciphertext
+    const uint8_t *data_bytes = reinterpret_cast<const uint8_t *>(data_in.data());
+    ContainerHeader header{};
+    size_t header_length = 0;
+    if (ContainerFormat::ReadHeader(data_bytes, data_in.size(), header, header_length))
+    {
+        SecureBytes key{};
+        if (!RecoverKey(header, key_reference, key))
+        {
+            return false;
+        }
+
+        return DecryptContainer(header, key, data_bytes + header_length, data_in.size() - header_length, data_out);
+    }
 
-    int plaintext_length = DecryptCiphertext(data_in, key_reference, plaintext);
+    // Heap allocated, CBC output is at most the input plus one block
+    std::vector<unsigned char> plaintext(data_in.size() + EVP_MAX_BLOCK_LENGTH);
+
+    int plaintext_length = DecryptCiphertext(data_in, key_reference, plaintext.data());
+    if (plaintext_length == -1)
+    {
+        // Failed to decrypt
+        return false;
+    }
+
+    data_out.assign(reinterpret_cast<char *>(plaintext.data()), plaintext_length);
+
+    return true;
+}
+
+/**
+ * @brief DecryptData Decrypts data using a TPM sealed key into a caller provided buffer
+ * @param[in] data_in Data to be decrypted
+ * @param[in] data_in_length Length of data_in
+ * @param[out] data_out Decrypted data output, MaxDecryptedSize(data_in, data_in_length) bytes are enough
+ * @param[in] data_out_capacity Bytes available at data_out
+ * @param[out] data_out_length Bytes written to data_out
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @returns Success
+ */
+bool DataDecrypt::DecryptData(const uint8_t *data_in, size_t data_in_length, uint8_t *data_out, size_t data_out_capacity, size_t &data_out_length, const std::string &key_reference)
+{
+    data_out_length = 0;
+
+    // Kept per thread so their buffers are allocated by the first call only, the key is wiped after each use
+    thread_local ContainerHeader header{};
+    thread_local SecureBytes key{};
+
+    size_t header_length = 0;
+    if (ContainerFormat::ReadHeader(data_in, data_in_length, header, header_length))
+    {
+        if (!RecoverKey(header, key_reference, key))
+        {
+            return false;
+        }
+
+        bool decrypted = DecryptContainer(header, key, data_in + header_length, data_in_length - header_length, data_out, data_out_capacity, data_out_length);
+        OPENSSL_cleanse(key.data(), key.size());
+        return decrypted;
+    }
+
+    // Legacy ciphertext, CBC output needs room for one more block than it finally keeps
+    std::vector<unsigned char> plaintext(data_in_length + EVP_MAX_BLOCK_LENGTH);
+    SecureBytes legacy_key{};
+    SecureBytes legacy_iv{};
+    if (!Common::UnsealKey(key_reference, legacy_key, legacy_iv))
+    {
+        std::cerr << "Unable to unseal key, have you provided a valid reference?" << std::endl;
+        return false;
+    }
+
+    int plaintext_length = DecryptLegacy(legacy_key, legacy_iv, data_in, data_in_length, plaintext.data());
     if (plaintext_length == -1)
     {
         // Failed to decrypt
         return false;
     }
+    if (static_cast<size_t>(plaintext_length) > data_out_capacity)
+    {
+        std::cerr << "Output buffer too small, " << plaintext_length << " bytes are needed" << std::endl;
+        OPENSSL_cleanse(plaintext.data(), plaintext.size());
+        return false;
+    }
+
+    std::memcpy(data_out, plaintext.data(), static_cast<size_t>(plaintext_length));
+    OPENSSL_cleanse(plaintext.data(), plaintext.size());
+    data_out_length = static_cast<size_t>(plaintext_length);
+    return true;
+}
+
+/**
+ * @brief VerifyData Checks that encrypted data is intact without producing its plaintext
+ * @param[in] data_in Data to be checked
+ * @param[in] data_in_length Length of data_in
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @returns True if the data would decrypt
+ */
+bool DataDecrypt::VerifyData(const uint8_t *data_in, size_t data_in_length, const std::string &key_reference)
+{
+    thread_local ContainerHeader header{};
+    thread_local SecureBytes key{};
+    thread_local std::string header_aad{};
+    thread_local std::vector<size_t> record_offsets{};
+
+    size_t header_length = 0;
+    if (!ContainerFormat::ReadHeader(data_in, data_in_length, header, header_length))
+    {
+        std::cerr << "Not an authenticated container" << std::endl;
+        return false;
+    }
+
+    const uint8_t *records = data_in + header_length;
+    size_t records_length = data_in_length - header_length;
+    size_t chunk_count = 0;
+    size_t plaintext_length = 0;
+    if (!ScanRecords(header, records, records_length, chunk_count, plaintext_length, record_offsets) ||
+        !RecoverKey(header, key_reference, key))
+    {
+        return false;
+    }
+
+    ContainerFormat::HeaderAad(header, header_aad);
+    bool verified = VerifyChunks(header, key, header_aad, records, records_length, record_offsets, 0, chunk_count);
+    OPENSSL_cleanse(key.data(), key.size());
+    return verified;
+}
+
+/**
+ * @brief VerifyData Checks that encrypted data is intact without producing its plaintext
+ * @param[in] data_in Data to be checked
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @returns True if the data would decrypt
+ */
+bool DataDecrypt::VerifyData(const std::string &data_in, const std::string &key_reference)
+{
+    return VerifyData(reinterpret_cast<const uint8_t *>(data_in.data()), data_in.size(), key_reference);
+}
+
+/**
+ * @brief MaxDecryptedSize Output space DecryptData needs for some encrypted data
+ * @param[in] data_in Data to be decrypted
+ * @param[in] data_in_length Length of data_in
+ * @returns Bytes to provide for the plaintext
+ */
+size_t DataDecrypt::MaxDecryptedSize(const uint8_t *data_in, size_t data_in_length)
+{
+    thread_local ContainerHeader header{};
+    thread_local std::vector<size_t> record_offsets{};
+
+    size_t header_length = 0;
+    if (!ContainerFormat::ReadHeader(data_in, data_in_length, header, header_length))
+    {
+        return data_in_length;
+    }
+
+    // Compressed records say nothing about the plaintext until opened, the scan bounds it
+    if (header.compression != CompressionId::None)
+    {
+        size_t chunk_count = 0;
+        size_t plaintext_length = 0;
+        return ScanRecords(header, data_in + header_length, data_in_length - header_length, chunk_count, plaintext_length, record_offsets)
+                   ? plaintext_length
+                   : 0;
+    }
+
+    // Every record but the last is full, so the plaintext is the records less one record's overhead per chunk
+    size_t records_length = data_in_length - header_length;
+    if (records_length < ChunkCipher::RecordLength(header, 0))
+    {
+        return 0;
+    }
+    size_t chunk_count = (records_length - ChunkCipher::RecordLength(header, 0)) / ChunkCipher::RecordLength(header, header.chunk_size) + 1;
+    return records_length - chunk_count * ChunkCipher::RecordLength(header, 0);
+}
+
+/**
+ * @brief DecryptDataAsync Decrypts data using a TPM sealed key without blocking the caller
+ * @param[in] data_in Data to be decrypted, must stay valid until the future is ready
+ * @param[out] data_out Decrypted data output, must stay valid until the future is ready
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @returns Future for the success of the operation
+ */
+std::future<bool> DataDecrypt::DecryptDataAsync(const std::string &data_in, std::string &data_out, const std::string &key_reference)
+{
+    // The reference is small and often a temporary, it is copied
+    return ThreadPool::Requests().Submit([&data_in, &data_out, key_reference]()
+                                         { return DecryptData(data_in, data_out, key_reference); });
+}
+
+/**
+ * @brief RecoverKey Fetches the data key of a container, from the TPM or by unwrapping it
+ * @param[in] header The container header
+ * @param[in] key_reference The key reference the data was encrypted with
+ * @param[out] key The chunk key of the header's cipher suite
+ * @returns Success
+ */
+bool DataDecrypt::RecoverKey(const ContainerHeader &header, const std::string &key_reference, SecureBytes &key)
+{
+    // Checked before the TPM is asked for anything, the chunks could not be restored anyway
+    if (!Compression::Available(header.compression))
+    {
+        std::cerr << "Compression " << Compression::Name(header.compression) << " is not available in this build" << std::endl;
+        return false;
+    }
+
+    bool have_key = false;
+    try
+    {
+        have_key = header.key_mode == KeyMode::Envelope
+                       ? Envelope::UnwrapDataKey(key_reference, header.wrapped_key, key)
+                       : Common::UnsealKey(key_reference, key);
+    }
+    catch (std::runtime_error &e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+
+    if (!have_key)
+    {
+        std::cerr << "Unable to recover key, have you provided a valid reference?" << std::endl;
+        return false;
+    }
+
+    return CipherSuite::DeriveChunkKey(header.cipher, key);
+}
+
+/**
+ * @brief DecryptContainer Authenticates and decrypts the chunks of a container
+ * @param[in] header The container header
+ * @param[in] key The data key
+ * @param[in] records The chunk records following the header
+ * @param[in] records_length Length of records
+ * @param[out] data_out Decrypted data output
+ * @returns False if any chunk fails authentication or the container is truncated/extended
+ */
+bool DataDecrypt::DecryptContainer(const ContainerHeader &header, const SecureBytes &key, const uint8_t *records, size_t records_length, std::string &data_out)
+{
+    thread_local std::vector<size_t> record_offsets{};
+    size_t chunk_count = 0;
+    size_t plaintext_length = 0;
+    if (!ScanRecords(header, records, records_length, chunk_count, plaintext_length, record_offsets))
+    {
+        return false;
+    }
+
+    // Every chunk but the last is full, so each decrypts straight into its place in the output
+    data_out.assign(plaintext_length, '\0');
+    size_t data_out_length = 0;
+    if (!DecryptContainer(header, key, records, records_length, reinterpret_cast<uint8_t *>(&data_out[0]), data_out.size(), data_out_length))
+    {
+        data_out.clear();
+        return false;
+    }
+
+    // Compressed containers of unknown length were sized for a full final chunk
+    data_out.resize(data_out_length);
+    return true;
+}
+
+/**
+ * @brief DecryptContainer Authenticates and decrypts the chunks of a container into a caller provided buffer
+ * @param[in] header The container header
+ * @param[in] key The data key
+ * @param[in] records The chunk records following the header
+ * @param[in] records_length Length of records
+ * @param[out] data_out Decrypted data output, wiped on failure
+ * @param[in] data_out_capacity Bytes available at data_out
+ * @param[out] data_out_length Bytes written to data_out
+ * @returns False if data_out is too small, any chunk fails authentication or the container is truncated/extended
+ */
+bool DataDecrypt::DecryptContainer(const ContainerHeader &header, const SecureBytes &key, const uint8_t *records, size_t records_length,
+                                   uint8_t *data_out, size_t data_out_capacity, size_t &data_out_length)
+{
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Decoding " << records_length << " bytes...");
+
+    // Reused between calls on this thread, so it is only allocated once
+    thread_local std::string header_aad{};
+    ContainerFormat::HeaderAad(header, header_aad);
+
+    thread_local std::vector<size_t> record_offsets{};
+    size_t chunk_count = 0;
+    size_t plaintext_length = 0;
+    if (!ScanRecords(header, records, records_length, chunk_count, plaintext_length, record_offsets))
+    {
+        return false;
+    }
 
-    std::string plaintext_string(reinterpret_cast<char *>(plaintext), plaintext_length);
+    if (data_out_capacity < plaintext_length)
+    {
+        std::cerr << "Output buffer too small, " << plaintext_length << " bytes are needed" << std::endl;
+        return false;
+    }
 
-    data_out = plaintext_string;
+    // Every chunk but the last is full, so each decrypts straight into its place in the output
+    size_t opened_length = 0;
+    if (!OpenChunks(header, key, header_aad, records, records_length, record_offsets, 0, chunk_count, data_out, plaintext_length, opened_length))
+    {
+        // Never hand back partially authenticated plaintext
+        if (plaintext_length > 0)
+        {
+            OPENSSL_cleanse(data_out, plaintext_length);
+        }
+        return false;
+    }
+
+    // Compressed chunks only tell their length once restored
+    if (header.plaintext_length != ContainerFormat::kUnknownLength && header.plaintext_length != opened_length)
+    {
+        std::cerr << "Decrypted length does not match the header" << std::endl;
+        OPENSSL_cleanse(data_out, plaintext_length);
+        return false;
+    }
+
+    data_out_length = opened_length;
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Done");
 
     return true;
 }
 
+/**
+ * @brief DecryptMappedFile Decrypts a memory mapped container chunk by chunk straight into a preallocated output
+ * @param[in] file_in The mapped container
+ * @param[in] header The container header
+ * @param[in] header_length Bytes the header occupies
+ * @param[in] path_out Path where the decrypted file shall be saved
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @returns Success, the output is removed on failure
+ */
+bool DataDecrypt::DecryptMappedFile(MappedFile &file_in, const ContainerHeader &header, size_t header_length, const std::string &path_out, const std::string &key_reference)
+{
+    SecureBytes key{};
+    if (!RecoverKey(header, key_reference, key))
+    {
+        return false;
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Decoding file...");
+
+    std::string header_aad{};
+    ContainerFormat::HeaderAad(header, header_aad);
+
+    // The record headers give the exact plaintext length, so the output can be sized before anything is decrypted
+    const uint8_t *records = file_in.Data() + header_length;
+    size_t records_length = file_in.Size() - header_length;
+    std::vector<size_t> record_offsets{};
+    size_t chunk_count = 0;
+    size_t plaintext_length = 0;
+    if (!ScanRecords(header, records, records_length, chunk_count, plaintext_length, record_offsets))
+    {
+        return false;
+    }
+
+    OutputFile file_out{};
+    if (!file_out.Open(path_out, plaintext_length))
+    {
+        std::cerr << "Unable to write plaintext data at: " << path_out << std::endl;
+        file_out.Discard();
+        return false;
+    }
+
+    // A window of chunks at a time, opened by the pool straight from the input mapping. Reads of the next window
+    // and writes of the previous ones are in flight meanwhile, so disk and cipher work overlap
+    size_t window_chunks = std::max<size_t>(1, MappedFile::kWindowLength / header.chunk_size);
+    for (size_t first_chunk = 0; first_chunk < chunk_count; first_chunk += window_chunks)
+    {
+        size_t count = std::min(window_chunks, chunk_count - first_chunk);
+        size_t plaintext_offset = first_chunk * header.chunk_size;
+        size_t window_length = std::min<size_t>(count * header.chunk_size, plaintext_length - plaintext_offset);
+        size_t records_offset = first_chunk * ChunkCipher::RecordLength(header, header.chunk_size);
+        size_t window_records_length = window_length + count * ChunkCipher::RecordLength(header, 0);
+
+        file_in.Prefetch(header_length + records_offset + window_records_length, MappedFile::kWindowLength);
+
+        uint8_t *plaintext_out = file_out.Window(plaintext_offset, window_length);
+        size_t opened_length = 0;
+        if (plaintext_out == nullptr ||
+            !OpenChunks(header, key, header_aad, records, records_length, record_offsets, first_chunk, count, plaintext_out, window_length, opened_length) ||
+            !file_out.Commit(plaintext_offset, window_length))
+        {
+            // Never leave partial (unauthenticated as a whole) plaintext behind
+            file_out.Discard();
+            return false;
+        }
+
+        file_in.Release(header_length + records_offset, window_records_length);
+    }
+
+    if (!file_out.Finish())
+    {
+        file_out.Discard();
+        return false;
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Done");
+
+    return true;
+}
+
+/**
+ * @brief VerifyMappedFile Authenticates a memory mapped container a window of chunks at a time
+ * @param[in] file_in The mapped container
+ * @param[in] header The container header
+ * @param[in] header_length Bytes the header occupies
+ * @param[in] key_reference The symmetric key reference used to seal this data
+ * @returns True if every chunk is authentic and in place
+ */
+bool DataDecrypt::VerifyMappedFile(MappedFile &file_in, const ContainerHeader &header, size_t header_length, const std::string &key_reference)
+{
+    // The layout is checked before the TPM is asked for a key, a truncated file fails without one
+    const uint8_t *records = file_in.Data() + header_length;
+    size_t records_length = file_in.Size() - header_length;
+    std::vector<size_t> record_offsets{};
+    size_t chunk_count = 0;
+    size_t plaintext_length = 0;
+    if (!ScanRecords(header, records, records_length, chunk_count, plaintext_length, record_offsets))
+    {
+        return false;
+    }
+
+    SecureBytes key{};
+    if (!RecoverKey(header, key_reference, key))
+    {
+        return false;
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Verifying file...");
+
+    std::string header_aad{};
+    ContainerFormat::HeaderAad(header, header_aad);
+
+    // Records of compressed containers vary in length, the scan located them
+    auto record_offset = [&](size_t index)
+    {
+        if (index == chunk_count)
+        {
+            return records_length;
+        }
+        return record_offsets.empty() ? index * ChunkCipher::RecordLength(header, header.chunk_size) : record_offsets[index];
+    };
+
+    // The next window is read while the pool checks this one, checked windows are dropped from the page cache so a
+    // scan of many large files does not push everything else out
+    size_t window_chunks = std::max<size_t>(1, MappedFile::kWindowLength / header.chunk_size);
+    for (size_t first_chunk = 0; first_chunk < chunk_count; first_chunk += window_chunks)
+    {
+        size_t count = std::min(window_chunks, chunk_count - first_chunk);
+        size_t window_offset = record_offset(first_chunk);
+        size_t window_length = record_offset(first_chunk + count) - window_offset;
+
+        file_in.Prefetch(header_length + window_offset + window_length, MappedFile::kWindowLength);
+
+        if (!VerifyChunks(header, key, header_aad, records, records_length, record_offsets, first_chunk, count))
+        {
+            return false;
+        }
+
+        file_in.Release(header_length + window_offset, window_length);
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Done");
+
+    return true;
+}
+
+/**
+ * @brief ScanRecords Locates the records of a container without decrypting anything
+ * @details Every record but the last is full, so the layout follows from the length alone and only the final
+ *          record header is read, a large mapped input is not faulted in up front. Records of compressed
+ *          containers vary in length, there every record header is read
+ * @param[in] header The container header
+ * @param[in] records The chunk records following the header
+ * @param[in] records_length Length of records
+ * @param[out] chunk_count Number of records
+ * @param[out] plaintext_length Total payload of the records. For compressed containers the header's length, or
+ *                              if that is unknown room for a full final chunk
+ * @param[out] record_offsets Offset of each record of a compressed container, empty otherwise
+ * @returns False if a record header is invalid or the records are truncated/extended
+ */
+bool DataDecrypt::ScanRecords(const ContainerHeader &header, const uint8_t *records, size_t records_length, size_t &chunk_count, size_t &plaintext_length,
+                              std::vector<size_t> &record_offsets)
+{
+    record_offsets.clear();
+    if (header.compression != CompressionId::None)
+    {
+        return ScanCompressedRecords(header, records, records_length, chunk_count, plaintext_length, record_offsets);
+    }
+
+    size_t full_record_length = ChunkCipher::RecordLength(header, header.chunk_size);
+    if (records_length < ChunkCipher::RecordLength(header, 0))
+    {
+        std::cerr << "Encrypted data is truncated" << std::endl;
+        return false;
+    }
+
+    // A full final chunk still leaves less than a full record after the others
+    chunk_count = (records_length - ChunkCipher::RecordLength(header, 0)) / full_record_length + 1;
+    size_t final_offset = (chunk_count - 1) * full_record_length;
+
+    uint32_t payload_length = 0;
+    uint32_t flags = 0;
+    if (!ChunkCipher::ReadRecordHeader(header, records + final_offset, records_length - final_offset, payload_length, flags))
+    {
+        return false;
+    }
+
+    if ((flags & ChunkCipher::kChunkFinal) == 0 || final_offset + ChunkCipher::RecordLength(header, payload_length) > records_length)
+    {
+        std::cerr << "Encrypted data is truncated" << std::endl;
+        return false;
+    }
+
+    if (final_offset + ChunkCipher::RecordLength(header, payload_length) != records_length)
+    {
+        std::cerr << "Unexpected data after the final chunk" << std::endl;
+        return false;
+    }
+
+    plaintext_length = (chunk_count - 1) * header.chunk_size + payload_length;
+
+    if (header.plaintext_length != ContainerFormat::kUnknownLength && header.plaintext_length != plaintext_length)
+    {
+        std::cerr << "Decrypted length does not match the header" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief ScanCompressedRecords Locates the records of a compressed container by walking their headers
+ * @returns False if a record header is invalid or the records are truncated/extended
+ */
+bool DataDecrypt::ScanCompressedRecords(const ContainerHeader &header, const uint8_t *records, size_t records_length, size_t &chunk_count, size_t &plaintext_length,
+                                        std::vector<size_t> &record_offsets)
+{
+    size_t offset = 0;
+    bool final = false;
+    while (!final)
+    {
+        uint32_t payload_length = 0;
+        uint32_t flags = 0;
+        if (offset >= records_length)
+        {
+            std::cerr << "Encrypted data is truncated" << std::endl;
+            return false;
+        }
+        if (!ChunkCipher::ReadRecordHeader(header, records + offset, records_length - offset, payload_length, flags))
+        {
+            return false;
+        }
+
+        size_t record_length = ChunkCipher::RecordLength(header, payload_length);
+        if (record_length > records_length - offset)
+        {
+            std::cerr << "Encrypted data is truncated" << std::endl;
+            return false;
+        }
+
+        record_offsets.push_back(offset);
+        offset += record_length;
+        final = (flags & ChunkCipher::kChunkFinal) != 0;
+    }
+
+    if (offset != records_length)
+    {
+        std::cerr << "Unexpected data after the final chunk" << std::endl;
+        return false;
+    }
+
+    chunk_count = record_offsets.size();
+
+    // Every chunk but the last restores to a full one, the header bounds the last one if it knows the length
+    size_t full_length = chunk_count * static_cast<size_t>(header.chunk_size);
+    if (header.plaintext_length == ContainerFormat::kUnknownLength)
+    {
+        plaintext_length = full_length;
+    }
+    else if (header.plaintext_length > full_length || header.plaintext_length < full_length - header.chunk_size)
+    {
+        std::cerr << "Decrypted length does not match the header" << std::endl;
+        return false;
+    }
+    else
+    {
+        plaintext_length = static_cast<size_t>(header.plaintext_length);
+    }
+
+    return true;
+}
+
+/**
+ * @brief OpenChunks Authenticates and decrypts a run of consecutive chunks in parallel
+ * @param[in] header The container header
+ * @param[in] key The data key
+ * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+ * @param[in] records The chunk records following the header, as located by ScanRecords
+ * @param[in] records_length Length of records
+ * @param[in] record_offsets Record offsets from ScanRecords, empty unless the container is compressed
+ * @param[in] first_chunk Index of the first chunk to decrypt
+ * @param[in] chunk_count Number of chunks to decrypt
+ * @param[out] plaintext_out Receives the plaintext, starting with the plaintext of first_chunk
+ * @param[in] plaintext_capacity Bytes available at plaintext_out
+ * @param[out] plaintext_length Bytes of plaintext the chunks restored to
+ * @returns False if any chunk fails authentication, is out of place or does not fit
+ */
+bool DataDecrypt::OpenChunks(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                             const uint8_t *records, size_t records_length, const std::vector<size_t> &record_offsets,
+                             size_t first_chunk, size_t chunk_count, uint8_t *plaintext_out, size_t plaintext_capacity, size_t &plaintext_length)
+{
+    size_t last_length = 0;
+
+    // Every record but the last is full (or located by ScanRecords), so each one's position is known up front and
+    // chunks are independent. Every chunk but the last restores to a full one, so its plaintext has a fixed place too
+    auto open_chunk = [&](size_t position)
+    {
+        size_t index = first_chunk + position;
+        size_t record_offset = record_offsets.empty() ? index * ChunkCipher::RecordLength(header, header.chunk_size) : record_offsets[index];
+        size_t plaintext_offset = position * header.chunk_size;
+        size_t chunk_length = 0;
+        size_t record_length = 0;
+        bool chunk_final = false;
+        if (plaintext_offset > plaintext_capacity ||
+            !ChunkCipher::OpenChunk(header, key, header_aad, index, records + record_offset, records_length - record_offset,
+                                    plaintext_out + plaintext_offset, plaintext_capacity - plaintext_offset, chunk_length, chunk_final, record_length))
+        {
+            return false;
+        }
+
+        // The authenticated flag must agree with where the record sits, only the last one is final
+        if (chunk_final != (record_offset + record_length == records_length))
+        {
+            std::cerr << "Chunk " << index << " is out of place" << std::endl;
+            return false;
+        }
+
+        if (position + 1 == chunk_count)
+        {
+            last_length = chunk_length;
+        }
+        return true;
+    };
+
+    // A single chunk (any small buffer) is opened right here, without wrapping the work up for the pool
+    bool opened = chunk_count == 1 ? open_chunk(0) : ThreadPool::Shared().ParallelFor(chunk_count, open_chunk);
+    if (!opened)
+    {
+        return false;
+    }
+
+    plaintext_length = (chunk_count - 1) * header.chunk_size + last_length;
+    return true;
+}
+
+/**
+ * @brief VerifyChunks Authenticates a run of consecutive chunks in parallel, without producing their plaintext
+ * @param[in] header The container header
+ * @param[in] key The data key
+ * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+ * @param[in] records The chunk records following the header, as located by ScanRecords
+ * @param[in] records_length Length of records
+ * @param[in] record_offsets Record offsets from ScanRecords, empty unless the container is compressed
+ * @param[in] first_chunk Index of the first chunk to check
+ * @param[in] chunk_count Number of chunks to check
+ * @returns False if any chunk fails authentication, is out of place or does not restore to the length the header gives
+ */
+bool DataDecrypt::VerifyChunks(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                               const uint8_t *records, size_t records_length, const std::vector<size_t> &record_offsets,
+                               size_t first_chunk, size_t chunk_count)
+{
+    auto verify_chunk = [&](size_t position)
+    {
+        size_t index = first_chunk + position;
+        size_t record_offset = record_offsets.empty() ? index * ChunkCipher::RecordLength(header, header.chunk_size) : record_offsets[index];
+        size_t chunk_length = 0;
+        size_t record_length = 0;
+        bool chunk_final = false;
+        if (!ChunkCipher::VerifyChunk(header, key, header_aad, index, records + record_offset, records_length - record_offset,
+                                      chunk_length, chunk_final, record_length))
+        {
+            return false;
+        }
+
+        // The authenticated flag must agree with where the record sits, only the last one is final
+        if (chunk_final != (record_offset + record_length == records_length))
+        {
+            std::cerr << "Chunk " << index << " is out of place" << std::endl;
+            return false;
+        }
+
+        // Every chunk before it is full, so the last one settles the length the header promises
+        if (chunk_final && header.plaintext_length != ContainerFormat::kUnknownLength &&
+            header.plaintext_length != index * static_cast<uint64_t>(header.chunk_size) + chunk_length)
+        {
+            std::cerr << "Decrypted length does not match the header" << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    return chunk_count == 1 ? verify_chunk(0) : ThreadPool::Shared().ParallelFor(chunk_count, verify_chunk);
+}
+
 /**
  * Decrypt some ciphertext using a symmetric key
  * @param symmetric_key_reference Used to unseal the symmetric key from the TPM
@@ -88,34 +1214,40 @@ int DataDecrypt::DecryptCiphertext(const std::string &ciphertext, const std::str
 {
 
     // Unseal the key and associated iv
-    std::vector<uint8_t> unsealed_encrypted_key{};
-    std::vector<uint8_t> unsealed_encrypted_iv{};
+    SecureBytes unsealed_encrypted_key{};
+    SecureBytes unsealed_encrypted_iv{};
     if (!Common::UnsealKey(symmetric_key_reference, unsealed_encrypted_key, unsealed_encrypted_iv))
     {
         std::cerr << "Unable to unseal key, have you provided a valid reference?" << std::endl;
         return -1;
     }
 
-    EVP_CIPHER_CTX *ctx;
+    return DecryptLegacy(unsealed_encrypted_key, unsealed_encrypted_iv, reinterpret_cast<const unsigned char *>(ciphertext.data()), ciphertext.length(), plaintext);
+}
+
+/**
+ * Decrypt some legacy (headerless AES-256-CBC) ciphertext using a symmetric key already in memory
+ * @param key The symmetric key
+ * @param iv The iv
+ * @param ciphertext The ciphertext to decrypt
+ * @param ciphertext_length Length of ciphertext
+ * @param plaintext The decrypted plaintext, must hold at least ciphertext_length bytes
+ * @return int Length of the plaintext, -1 on failure
+ */
+int DataDecrypt::DecryptLegacy(const SecureBytes &key, const SecureBytes &iv, const unsigned char *ciphertext, size_t ciphertext_length, unsigned char *plaintext)
+{
+
+    // Legacy keys were sealed as 16 bytes but used with AES-256, read them zero extended rather than past the buffer
+    uint8_t legacy_key[CipherEngine::kMaxKeyLength] = {};
+    std::memcpy(legacy_key, key.data(), std::min(key.size(), sizeof(legacy_key)));
 
     int len;
     int plaintext_len;
 
-    /* Create and initialise the context */
-    if (!(ctx = EVP_CIPHER_CTX_new()))
-    {
-        std::cerr << "EVP_CIPHER_CTX_new failed" << std::endl;
-        return -1;
-    }
-
-    /*
-     * Initialise the decryption operation. IMPORTANT - ensure you use a key
-     * and IV size appropriate for your cipher
-     * In this example we are using 256 bit AES (i.e. a 256 bit key). The
-     * IV size for *most* modes is the same as the block size. For AES this
-     * is 128 bits
-     */
-    if (1 != EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, unsealed_encrypted_key.data(), unsealed_encrypted_iv.data()))
+    // The context belongs to this thread's cipher engine, nothing to free on any path
+    EVP_CIPHER_CTX *ctx = CipherEngine::Context(CipherEngine::Aes256Cbc(), false, legacy_key, iv.data());
+    OPENSSL_cleanse(legacy_key, sizeof(legacy_key));
+    if (ctx == nullptr)
     {
         std::cerr << "EVP_DecryptInit_ex failed" << std::endl;
         return -1;
@@ -125,8 +1257,9 @@ int DataDecrypt::DecryptCiphertext(const std::string &ciphertext, const std::str
      * Provide the message to be decrypted, and obtain the plaintext output.
      * EVP_DecryptUpdate can be called multiple times if necessary.
      */
-    std::cout << "Decoding " << ciphertext.length() << " bytes..." << std::endl;
-    if (1 != EVP_DecryptUpdate(ctx, plaintext, &len, reinterpret_cast<unsigned char *>(const_cast<char *>(ciphertext.c_str())), ciphertext.length()))
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Decoding " << ciphertext_length << " bytes...");
+    Metrics::Timer timer(Operation::Decrypt);
+    if (1 != EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_length))
     {
         std::cerr << "EVP_DecryptUpdate failed" << std::endl;
         return -1;
@@ -145,11 +1278,9 @@ int DataDecrypt::DecryptCiphertext(const std::string &ciphertext, const std::str
         return -1;
     }
     plaintext_len += len;
+    timer.Stop(ciphertext_length, true);
 
-    /* Clean up */
-    EVP_CIPHER_CTX_free(ctx);
-
-    std::cout << "Done" << std::endl;
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Done");
 
     return plaintext_len;
 }
\ No newline at end of file
@@ -1,11 +1,25 @@
 #include "tpm_encrypt/data_encrypt.hpp"
+#include "tpm_encrypt/buffer_pool.hpp"
+#include "tpm_encrypt/chunk_cipher.hpp"
+#include "tpm_encrypt/cipher_suite.hpp"
 #include "tpm_encrypt/common.hpp"
+#include "tpm_encrypt/compression.hpp"
+#include "tpm_encrypt/envelope.hpp"
+#include "tpm_encrypt/logger.hpp"
+#include "tpm_encrypt/metrics.hpp"
+#include "tpm_encrypt/thread_pool.hpp"
 
 #include <iostream>
+#include <algorithm>
 #include <cstring>
+#include <fstream>
+#include <future>
 
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
 
+#include <unistd.h>
+
 
 // Command Notes
 /**
@@ -32,6 +46,19 @@
  * Handles TPM-backed encryption
  */
 
+namespace
+{
+    // A chunk travelling through the stream pipeline
+    struct StreamSlot
+    {
+        PooledBuffer chunk;
+        PooledBuffer record;
+        size_t chunk_length = 0;
+        size_t record_length = 0;
+        std::future<bool> done;
+    };
+}
+
 /**
  * @brief EncryptFile Encrypts a given file using a TPM sealed key
  * @param[in] path_in File to be encrypted
@@ -40,27 +67,326 @@
  */
 bool DataEncrypt::EncryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference)
 {
-    // Load our file into memory
-    std::string file_contents{};
-    if (!Common::FileToString(path_in, file_contents))
+    return EncryptFile(path_in, path_out, key_reference, EncryptOptions{});
+}
+
+/**
+ * @brief EncryptFile Encrypts a given file using a TPM sealed key
+ * @param[in] path_in File to be encrypted
+ * @param[in] path_out Path where the encrypted file shall be saved
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ */
+bool DataEncrypt::EncryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference, const EncryptOptions &options)
+{
+    // Regular files are encrypted straight out of the page cache, anything else (e.g. a pipe) is streamed. So are
+    // compressed containers, whose records have no place in the output known up front
+    MappedFile mapped_in{};
+    if (options.compression == CompressionId::None && mapped_in.Open(path_in))
+    {
+        if (!EncryptMappedFile(mapped_in, path_out, key_reference, options))
+        {
+            std::cerr << "Unable to encrypt the requested file: " << path_in << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    std::ifstream file_in(path_in, std::ios::binary);
+    if (!file_in.is_open())
     {
         std::cerr << "Unable to load file: " << path_in << std::endl;
         return false;
     }
 
-    // Hold our encrypted data
-    std::string encrypted_contents{};
+    // Staged and renamed into place once complete, path_out may be the file being read
+    StagedFile staged_out{};
+    int fd_out = staged_out.Create(path_out);
+    if (fd_out == -1)
+    {
+        std::cerr << "Unable to write encrypted data at: " << path_out << std::endl;
+        return false;
+    }
 
-    // Encrypt the file contents
-    if (!EncryptData(file_contents, encrypted_contents, key_reference))
+    // Streamed a chunk at a time, memory use does not depend on the file size
+    bool encrypted = false;
+    {
+        DescriptorStreambuf buffer_out(fd_out);
+        std::ostream file_out(&buffer_out);
+        encrypted = EncryptStream(file_in, file_out, key_reference, options) && file_out.flush();
+    }
+    encrypted = close(fd_out) == 0 && encrypted;
+    if (!encrypted || !staged_out.Commit())
     {
         std::cerr << "Unable to encrypt the requested file: " << path_in << std::endl;
         return false;
     }
 
-    if (!Common::StringToFile(path_out, encrypted_contents))
+    return true;
+}
+
+/**
+ * @brief EncryptFiles Encrypts many files, several at once, using one TPM sealed key
+ * @param[in] jobs Files to encrypt and where to save each
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ * @param[in] worker_count Files encrypted at once, 0 uses one per hardware thread
+ * @param[out] results Outcome of each job, in job order
+ * @returns True if every file was encrypted
+ */
+bool DataEncrypt::EncryptFiles(const std::vector<FileJob> &jobs, const std::string &key_reference, const EncryptOptions &options, size_t worker_count, std::vector<FileResult> &results)
+{
+    return FileBatch::Run(jobs, worker_count, [&key_reference, &options](const FileJob &job)
+                          { return EncryptFile(job.path_in, job.path_out, key_reference, options); },
+                          results);
+}
+
+/**
+ * @brief EncryptDirectory Encrypts every file below a directory into the same layout below another
+ * @param[in] root_in Directory to encrypt
+ * @param[in] root_out Directory where the encrypted tree shall be saved
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ * @param[in] worker_count Files encrypted at once, 0 uses one per hardware thread
+ * @param[out] results Outcome of each file
+ * @returns True if every file was encrypted
+ */
+bool DataEncrypt::EncryptDirectory(const std::string &root_in, const std::string &root_out, const std::string &key_reference, const EncryptOptions &options, size_t worker_count, std::vector<FileResult> &results)
+{
+    std::vector<FileJob> jobs{};
+    if (!FileBatch::ListTree(root_in, root_out, jobs))
+    {
+        results.clear();
+        return false;
+    }
+
+    return EncryptFiles(jobs, key_reference, options, worker_count, results);
+}
+
+/**
+ * @brief EncryptMappedFile Encrypts a memory mapped file chunk by chunk straight into a preallocated output
+ * @param[in] file_in The mapped plaintext
+ * @param[in] path_out Path where the encrypted file shall be saved
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ * @returns Success, the output is removed on failure
+ */
+bool DataEncrypt::EncryptMappedFile(MappedFile &file_in, const std::string &path_out, const std::string &key_reference, const EncryptOptions &options)
+{
+    // The length is known up front, so the header is final and every record has a fixed place in the output
+    ContainerHeader header{};
+    SecureBytes key{};
+    if (!PrepareKey(options, key_reference, file_in.Size(), header, key))
+    {
+        return false;
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Encrypting file...");
+
+    std::string header_aad{};
+    ContainerFormat::HeaderAad(header, header_aad);
+
+    std::string header_bytes{};
+    ContainerFormat::WriteHeader(header, header_bytes);
+
+    size_t chunk_count = ChunkCipher::ChunkCount(file_in.Size(), header.chunk_size);
+    size_t output_length = header_bytes.size() + file_in.Size() + chunk_count * ChunkCipher::RecordLength(0);
+
+    OutputFile file_out{};
+    if (!file_out.Open(path_out, output_length))
     {
         std::cerr << "Unable to write encrypted data at: " << path_out << std::endl;
+        file_out.Discard();
+        return false;
+    }
+
+    uint8_t *header_out = file_out.Window(0, header_bytes.size());
+    std::memcpy(header_out, header_bytes.data(), header_bytes.size());
+    if (!file_out.Commit(0, header_bytes.size()))
+    {
+        file_out.Discard();
+        return false;
+    }
+
+    // A window of chunks at a time, sealed by the pool straight from the input mapping. Reads of the next window
+    // and writes of the previous ones are in flight meanwhile, so disk and cipher work overlap
+    size_t window_chunks = std::max<size_t>(1, MappedFile::kWindowLength / header.chunk_size);
+    for (size_t first_chunk = 0; first_chunk < chunk_count; first_chunk += window_chunks)
+    {
+        size_t count = std::min(window_chunks, chunk_count - first_chunk);
+        size_t plaintext_offset = first_chunk * header.chunk_size;
+        size_t plaintext_length = std::min<size_t>(count * header.chunk_size, file_in.Size() - plaintext_offset);
+        size_t records_offset = header_bytes.size() + first_chunk * ChunkCipher::RecordLength(header.chunk_size);
+        size_t records_length = plaintext_length + count * ChunkCipher::RecordLength(0);
+
+        file_in.Prefetch(plaintext_offset + plaintext_length, MappedFile::kWindowLength);
+
+        uint8_t *records_out = file_out.Window(records_offset, records_length);
+        size_t sealed_length = 0;
+        if (records_out == nullptr ||
+            !SealChunks(header, key, header_aad, file_in.Data(), file_in.Size(), first_chunk, count, 0, records_out, sealed_length) ||
+            !file_out.Commit(records_offset, records_length))
+        {
+            file_out.Discard();
+            return false;
+        }
+
+        file_in.Release(plaintext_offset, plaintext_length);
+    }
+
+    if (!file_out.Finish())
+    {
+        file_out.Discard();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief EncryptStream Encrypts everything read from a stream until EOF using a TPM sealed key
+ * @param[in] stream_in Plaintext input
+ * @param[out] stream_out Encrypted output
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ */
+bool DataEncrypt::EncryptStream(std::istream &stream_in, std::ostream &stream_out, const std::string &key_reference)
+{
+    return EncryptStream(stream_in, stream_out, key_reference, EncryptOptions{});
+}
+
+/**
+ * @brief EncryptStream Encrypts everything read from a stream until EOF using a TPM sealed key
+ * @param[in] stream_in Plaintext input
+ * @param[out] stream_out Encrypted output
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ */
+bool DataEncrypt::EncryptStream(std::istream &stream_in, std::ostream &stream_out, const std::string &key_reference, const EncryptOptions &options)
+{
+    // Length is only known once the input is exhausted
+    ContainerHeader header{};
+    SecureBytes key{};
+    if (!PrepareKey(options, key_reference, ContainerFormat::kUnknownLength, header, key))
+    {
+        return false;
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Encrypting stream...");
+
+    std::string header_aad{};
+    ContainerFormat::HeaderAad(header, header_aad);
+
+    std::string header_bytes{};
+    ContainerFormat::WriteHeader(header, header_bytes);
+    std::streampos header_position = stream_out.tellp();
+    stream_out.write(header_bytes.data(), header_bytes.size());
+
+    // A window of chunks is in flight on the pool while the next ones are read, records are written in order
+    ThreadPool &pool = ThreadPool::Shared();
+    std::vector<StreamSlot> slots(pool.Size() * 2);
+    BufferPool &buffers = BufferPool::Shared();
+    for (StreamSlot &slot : slots)
+    {
+        slot.chunk = buffers.Acquire(header.chunk_size);
+        slot.record = buffers.Acquire(ChunkCipher::RecordLength(header.chunk_size));
+    }
+
+    // Waits for a slot's chunk and writes its record, the caller must do this in chunk order
+    auto write_slot = [&stream_out](StreamSlot &slot)
+    {
+        bool sealed = slot.done.get();
+        if (sealed)
+        {
+            Metrics::Timer timer(Operation::Write);
+            stream_out.write(reinterpret_cast<const char *>(slot.record.Data()), slot.record_length);
+            timer.Stop(slot.record_length, static_cast<bool>(stream_out));
+        }
+        return sealed && static_cast<bool>(stream_out);
+    };
+
+    uint64_t plaintext_length = 0;
+    uint64_t index = 0;
+    bool final = false;
+    bool success = true;
+
+    while (success && !final)
+    {
+        // Reusing the slot of chunk (index - window) means that chunk is written first
+        StreamSlot &slot = slots[index % slots.size()];
+        if (slot.done.valid() && !write_slot(slot))
+        {
+            std::cerr << "Unable to write ciphertext" << std::endl;
+            success = false;
+            break;
+        }
+
+        Metrics::Timer read_timer(Operation::Read);
+        stream_in.read(reinterpret_cast<char *>(slot.chunk.Data()), slot.chunk.Length());
+        slot.chunk_length = static_cast<size_t>(stream_in.gcount());
+        read_timer.Stop(slot.chunk_length, !stream_in.bad());
+        if (stream_in.bad())
+        {
+            std::cerr << "Unable to read plaintext" << std::endl;
+            success = false;
+            break;
+        }
+
+        // A short read means EOF, a full one is only final if nothing follows it
+        final = slot.chunk_length < slot.chunk.Length() || stream_in.peek() == std::char_traits<char>::eof();
+
+        int compression_level = options.compression_level;
+        slot.done = pool.Submit([&header, &key, &header_aad, &slot, index, final, compression_level]()
+                                { return ChunkCipher::SealChunk(header, key, header_aad, index, final, slot.chunk.Data(), slot.chunk_length,
+                                                                compression_level, slot.record.Data(), slot.record_length); });
+
+        plaintext_length += slot.chunk_length;
+        index++;
+    }
+
+    // Remaining records in order, every outstanding chunk is waited for even after a failure
+    for (uint64_t pending = index > slots.size() ? index - slots.size() : 0; pending < index; pending++)
+    {
+        StreamSlot &slot = slots[pending % slots.size()];
+        if (!slot.done.valid())
+        {
+            continue;
+        }
+
+        if (!success)
+        {
+            slot.done.wait();
+        }
+        else if (!write_slot(slot))
+        {
+            std::cerr << "Unable to write ciphertext" << std::endl;
+            success = false;
+        }
+    }
+
+    if (!success)
+    {
+        return false;
+    }
+
+    // Seekable outputs (files) get the real length, pipes keep the unknown marker
+    if (header_position != std::streampos(-1))
+    {
+        std::string length_bytes{};
+        for (size_t i = 0; i < 8; i++)
+        {
+            length_bytes.push_back(static_cast<char>((plaintext_length >> (8 * i)) & 0xff));
+        }
+
+        std::streampos end_position = stream_out.tellp();
+        stream_out.seekp(header_position + std::streamoff(ContainerFormat::kPlaintextLengthOffset));
+        stream_out.write(length_bytes.data(), length_bytes.size());
+        stream_out.seekp(end_position);
+    }
+
+    stream_out.flush();
+    if (!stream_out)
+    {
+        std::cerr << "Unable to write ciphertext" << std::endl;
         return false;
     }
 
@@ -75,21 +401,230 @@ bool DataEncrypt::EncryptFile(const std::string &path_in, const std::string &pat
  */
 bool DataEncrypt::EncryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference)
 {
+    return EncryptData(data_in, data_out, key_reference, EncryptOptions{});
+}
+
+/**
+ * @brief EncryptData Encrypts data using a TPM sealed key
+ * @param[in] data_in Data to be encrypted
+ * @param[out] data_out Encrypted data output
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ */
+bool DataEncrypt::EncryptData(const std::string &data_in, std::string &data_out, const std::string &key_reference, const EncryptOptions &options)
+{
+    ContainerHeader header{};
+    SecureBytes key{};
+    if (!PrepareKey(options, key_reference, data_in.size(), header, key))
+    {
+        return false;
+    }
+
+    if (!EncryptPlaintext(header, key, data_in, options.compression_level, data_out))
+    {
+        std::cerr << "Unable to encrypt plaintext" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief EncryptData Encrypts data using a TPM sealed key into a caller provided buffer
+ * @param[in] data_in Data to be encrypted
+ * @param[in] data_in_length Length of data_in
+ * @param[out] data_out Encrypted data output, EncryptedSize(data_in_length) bytes are needed
+ * @param[in] data_out_capacity Bytes available at data_out
+ * @param[out] data_out_length Bytes written to data_out
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @returns Success, false without touching the TPM if data_out is too small
+ */
+bool DataEncrypt::EncryptData(const uint8_t *data_in, size_t data_in_length, uint8_t *data_out, size_t data_out_capacity, size_t &data_out_length, const std::string &key_reference)
+{
+    return EncryptData(data_in, data_in_length, data_out, data_out_capacity, data_out_length, key_reference, EncryptOptions{});
+}
+
+/**
+ * @brief EncryptData Encrypts data using a TPM sealed key into a caller provided buffer
+ * @param[in] data_in Data to be encrypted
+ * @param[in] data_in_length Length of data_in
+ * @param[out] data_out Encrypted data output, EncryptedSize(data_in_length, options) bytes are needed
+ * @param[in] data_out_capacity Bytes available at data_out
+ * @param[out] data_out_length Bytes written to data_out
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ * @returns Success, false without touching the TPM if data_out is too small
+ */
+bool DataEncrypt::EncryptData(const uint8_t *data_in, size_t data_in_length, uint8_t *data_out, size_t data_out_capacity, size_t &data_out_length, const std::string &key_reference, const EncryptOptions &options)
+{
+    data_out_length = 0;
+
+    size_t encrypted_size = EncryptedSize(data_in_length, options);
+    if (encrypted_size == 0 || data_out_capacity < encrypted_size)
+    {
+        std::cerr << "Output buffer too small, " << encrypted_size << " bytes are needed" << std::endl;
+        return false;
+    }
+
+    // Kept per thread so their buffers are allocated by the first call only, the key is wiped after each use
+    thread_local ContainerHeader header{};
+    thread_local SecureBytes key{};
+    thread_local std::string header_aad{};
+
+    if (!PrepareKey(options, key_reference, data_in_length, header, key))
+    {
+        return false;
+    }
+
+    ContainerFormat::HeaderAad(header, header_aad);
+    size_t ciphertext_length = 0;
+    bool encrypted = EncryptPlaintext(header, key, header_aad, data_in, data_in_length, options.compression_level, data_out, ciphertext_length);
+    OPENSSL_cleanse(key.data(), key.size());
+    if (!encrypted)
+    {
+        std::cerr << "Unable to encrypt plaintext" << std::endl;
+        return false;
+    }
+
+    data_out_length = ciphertext_length;
+    return true;
+}
+
+/**
+ * @brief EncryptedSize Exact length of the encrypted output for a plaintext
+ * @param[in] plaintext_length Length of the plaintext
+ * @returns Bytes EncryptData produces
+ */
+size_t DataEncrypt::EncryptedSize(size_t plaintext_length)
+{
+    return EncryptedSize(plaintext_length, EncryptOptions{});
+}
+
+/**
+ * @brief EncryptedSize Exact length of the encrypted output for a plaintext, with compression an upper bound
+ * @param[in] plaintext_length Length of the plaintext
+ * @param[in] options How the data is encrypted
+ * @returns Bytes EncryptData produces (at most), 0 if the options are invalid
+ */
+size_t DataEncrypt::EncryptedSize(size_t plaintext_length, const EncryptOptions &options)
+{
+    if (options.chunk_size == 0 || options.chunk_size > ContainerFormat::kMaxChunkSize)
+    {
+        return 0;
+    }
+
+    // A chunk is only ever stored compressed if that is shorter, so the uncompressed layout bounds compressed output
+    size_t wrapped_key_length = options.key_mode == KeyMode::Envelope ? Envelope::kWrappedKeyLength : 0;
+    size_t chunk_count = ChunkCipher::ChunkCount(plaintext_length, options.chunk_size);
+    return ContainerFormat::HeaderLength(ChunkCipher::kNonceLength, wrapped_key_length) +
+           plaintext_length + chunk_count * ChunkCipher::RecordLength(0);
+}
+
+/**
+ * @brief EncryptDataAsync Encrypts data using a TPM sealed key without blocking the caller
+ * @param[in] data_in Data to be encrypted, must stay valid until the future is ready
+ * @param[out] data_out Encrypted data output, must stay valid until the future is ready
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @returns Future for the success of the operation
+ */
+std::future<bool> DataEncrypt::EncryptDataAsync(const std::string &data_in, std::string &data_out, const std::string &key_reference)
+{
+    return EncryptDataAsync(data_in, data_out, key_reference, EncryptOptions{});
+}
+
+/**
+ * @brief EncryptDataAsync Encrypts data using a TPM sealed key without blocking the caller
+ * @param[in] data_in Data to be encrypted, must stay valid until the future is ready
+ * @param[out] data_out Encrypted data output, must stay valid until the future is ready
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ * @returns Future for the success of the operation
+ */
+std::future<bool> DataEncrypt::EncryptDataAsync(const std::string &data_in, std::string &data_out, const std::string &key_reference, const EncryptOptions &options)
+{
+    // The reference and options are small and often temporaries, they are copied
+    return ThreadPool::Requests().Submit([&data_in, &data_out, key_reference, options]()
+                                         { return EncryptData(data_in, data_out, key_reference, options); });
+}
+
+/**
+ * @brief PrepareKey Obtains the data key for a new container and fills in its header
+ * @param[in] options How the data is encrypted
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] plaintext_length Plaintext length to record, ContainerFormat::kUnknownLength if not known yet
+ * @param[out] header Header for the new container
+ * @param[out] key The chunk key of the header's cipher suite
+ * @returns Success
+ */
+bool DataEncrypt::PrepareKey(const EncryptOptions &options, const std::string &key_reference, uint64_t plaintext_length, ContainerHeader &header, SecureBytes &key)
+{
+    if (options.chunk_size == 0 || options.chunk_size > ContainerFormat::kMaxChunkSize)
+    {
+        std::cerr << "Invalid chunk size: " << options.chunk_size << std::endl;
+        return false;
+    }
+
+    if (!Compression::Available(options.compression))
+    {
+        std::cerr << "Compression " << Compression::Name(options.compression) << " is not available in this build" << std::endl;
+        return false;
+    }
+
     try
     {
-        // We need to generate and seal our symmetric encryption key against the TPM
-        if (!Common::GenerateSealedKey(key_reference))
+        // Everything needed to decrypt travels in the header, including a fresh nonce per encryption. Every field is
+        // set, callers may hand in a header reused from an earlier container
+        if (!CipherSuite::Resolve(options.cipher, header.cipher))
         {
-            std::cerr << "Unable to generate sealed encryption key for data" << std::endl;
             return false;
         }
-
-        // Encrypt our key using the TPM sealed key we just generated and write to file
-        if (!EncryptPlaintext(key_reference, data_in, data_out))
+        header.flags = 0;
+        header.compression = options.compression;
+        header.wrapped_key.clear();
+        header.key_mode = options.key_mode;
+        header.chunk_size = options.chunk_size;
+        header.plaintext_length = plaintext_length;
+        header.nonce.resize(ChunkCipher::kNonceLength);
+        if (!Common::GetRandomData(header.nonce.data(), header.nonce.size()))
         {
-            std::cerr << "Unable to encrypt plaintext" << std::endl;
             return false;
         }
+
+        if (options.key_mode == KeyMode::Envelope)
+        {
+            // A fresh data key, only the key-encryption key touches the TPM (and only on first use)
+            if (!Envelope::GenerateDataKey(key_reference, key, header.wrapped_key))
+            {
+                std::cerr << "Unable to generate data key" << std::endl;
+                return false;
+            }
+        }
+        else
+        {
+            // An existing key at this reference is reused (usually straight from the key cache), only a missing one is
+            // generated and sealed against the TPM
+            bool missing = false;
+            if (!Common::UnsealKey(key_reference, key, missing))
+            {
+                if (!missing)
+                {
+                    std::cerr << "Unable to unseal key, have you provided a valid reference?" << std::endl;
+                    return false;
+                }
+
+                if (!Common::GenerateSealedKey(key_reference))
+                {
+                    std::cerr << "Unable to generate sealed encryption key for data" << std::endl;
+                    return false;
+                }
+
+                if (!Common::UnsealKey(key_reference, key))
+                {
+                    std::cerr << "Unable to unseal key, have you provided a valid reference?" << std::endl;
+                    return false;
+                }
+            }
+        }
     }
     catch (std::runtime_error &e)
     {
@@ -97,85 +632,145 @@ bool DataEncrypt::EncryptData(const std::string &data_in, std::string &data_out,
         return false;
     }
 
-    return true;
+    // Checks the data key's length too
+    return CipherSuite::DeriveChunkKey(header.cipher, key);
 }
 
 /**
- * @brief EncryptPlaintext Encrypt some plaintext using a symmetric key
- * @param[in] symmetric_key_reference Used to unseal the symmetric key from the TPM
+ * @brief EncryptPlaintext Encrypt some plaintext into a container using a symmetric key
+ * @param[in] header Header describing the container, written ahead of the chunks
+ * @param[in] key The symmetric key
  * @param[in] plaintext The text to encrypt
- * @param[out] ciphertext The encrypted ciphertext
+ * @param[in] compression_level Level for the header's compression
+ * @param[out] ciphertext The encrypted container
  */
-bool DataEncrypt::EncryptPlaintext(const std::string &symmetric_key_reference, const std::string &plaintext, std::string &ciphertext_string)
+bool DataEncrypt::EncryptPlaintext(const ContainerHeader &header, const SecureBytes &key, const std::string &plaintext, int compression_level, std::string &ciphertext_string)
 {
+    std::string header_aad{};
+    ContainerFormat::HeaderAad(header, header_aad);
 
-    // Unseal the key and associated iv
-    std::vector<uint8_t> unsealed_encrypted_key{};
-    std::vector<uint8_t> unsealed_encrypted_iv{};
-    if (!Common::UnsealKey(symmetric_key_reference, unsealed_encrypted_key, unsealed_encrypted_iv))
+    // Empty input still produces one (final, empty) chunk
+    size_t chunk_count = ChunkCipher::ChunkCount(plaintext.size(), header.chunk_size);
+
+    // Sized for uncompressed records, then cut to what compression left
+    size_t header_length = ContainerFormat::HeaderLength(header.nonce.size(), header.wrapped_key.size());
+    ciphertext_string.resize(header_length + plaintext.size() + chunk_count * ChunkCipher::RecordLength(0));
+    size_t ciphertext_length = 0;
+    if (!EncryptPlaintext(header, key, header_aad, reinterpret_cast<const uint8_t *>(plaintext.data()), plaintext.size(),
+                          compression_level, reinterpret_cast<uint8_t *>(&ciphertext_string[0]), ciphertext_length))
     {
-        std::cerr << "Unable to unseal key, have you provided a valid reference?" << std::endl;
-        return -1;
+        return false;
     }
+    ciphertext_string.resize(ciphertext_length);
+    return true;
+}
 
-    std::cout << "Encrypting file..." << std::endl;
-
-    /* Message to be encrypted */
-    unsigned char *plaintext_char = reinterpret_cast<unsigned char *>(const_cast<char *>(plaintext.c_str()));
-
-    EVP_CIPHER_CTX *ctx;
+/**
+ * @brief EncryptPlaintext Encrypt some plaintext into a container in a caller provided buffer
+ * @param[in] header Header describing the container, written ahead of the chunks
+ * @param[in] key The symmetric key
+ * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+ * @param[in] plaintext The text to encrypt
+ * @param[in] plaintext_length Length of plaintext
+ * @param[in] compression_level Level for the header's compression
+ * @param[out] ciphertext_out Receives the container, which must fit its uncompressed length
+ * @param[out] ciphertext_length Length of the container
+ * @returns Success
+ */
+bool DataEncrypt::EncryptPlaintext(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                                   const uint8_t *plaintext, size_t plaintext_length, int compression_level,
+                                   uint8_t *ciphertext_out, size_t &ciphertext_length)
+{
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Encrypting data...");
 
-    int len = 0;
-    int ciphertext_len = 0;
+    ContainerFormat::WriteHeader(header, ciphertext_out);
+    size_t header_length = ContainerFormat::HeaderLength(header.nonce.size(), header.wrapped_key.size());
 
-    /* Create and initialise the context */
-    if (!(ctx = EVP_CIPHER_CTX_new()))
+    size_t chunk_count = ChunkCipher::ChunkCount(plaintext_length, header.chunk_size);
+    size_t records_length = 0;
+    if (!SealChunks(header, key, header_aad, plaintext, plaintext_length, 0, chunk_count, compression_level, ciphertext_out + header_length, records_length))
     {
-        std::cerr << "EVP_CIPHER_CTX_new failed" << std::endl;
         return false;
     }
 
-    /*
-     * Initialise the encryption context
-     */
-    if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, unsealed_encrypted_key.data(), unsealed_encrypted_iv.data()))
+    ciphertext_length = header_length + records_length;
+    return true;
+}
+
+/**
+ * @brief SealChunks Encrypts a run of consecutive chunks in parallel
+ * @param[in] header Header describing the container
+ * @param[in] key The symmetric key
+ * @param[in] header_aad Output of ContainerFormat::HeaderAad for this header
+ * @param[in] plaintext The whole plaintext
+ * @param[in] plaintext_length Length of the whole plaintext
+ * @param[in] first_chunk Index of the first chunk to encrypt
+ * @param[in] chunk_count Number of chunks to encrypt
+ * @param[in] compression_level Level for the header's compression
+ * @param[out] records_out Receives the records, starting with the record of first_chunk. Must fit them
+ *                         uncompressed, compressed records are moved up behind each other afterwards
+ * @param[out] records_length Length of the records
+ * @returns Success
+ */
+bool DataEncrypt::SealChunks(const ContainerHeader &header, const SecureBytes &key, const std::string &header_aad,
+                             const uint8_t *plaintext, size_t plaintext_length, size_t first_chunk, size_t chunk_count,
+                             int compression_level, uint8_t *records_out, size_t &records_length)
+{
+    size_t total_chunks = ChunkCipher::ChunkCount(plaintext_length, header.chunk_size);
+
+    // Lengths of compressed records, reused between calls on this thread. Workers write through the reference, a
+    // thread_local named inside the lambda would be their own
+    thread_local std::vector<size_t> sealed_lengths{};
+    std::vector<size_t> &record_lengths = sealed_lengths;
+    bool compressed = header.compression != CompressionId::None;
+    if (compressed && record_lengths.size() < chunk_count)
     {
-        std::cerr << "EVP_EncryptInit_ex failed" << std::endl;
-        return false;
+        record_lengths.resize(chunk_count);
     }
 
-    // Store result
-    unsigned char ciphertext[plaintext.length() * 2];
-    //std::vector<unsigned char> ciphertext(plaintext.length() * 2);
+    // Every chunk but the last is full, so each record's (uncompressed) position is known up front and chunks are
+    // independent
+    auto seal_chunk = [&](size_t position)
+    {
+        size_t index = first_chunk + position;
+        size_t chunk_offset = index * header.chunk_size;
+        size_t chunk_length = std::min<size_t>(header.chunk_size, plaintext_length - chunk_offset);
+        uint8_t *record_out = records_out + position * ChunkCipher::RecordLength(header.chunk_size);
+        bool final = index + 1 == total_chunks;
 
+        if (!compressed)
+        {
+            return ChunkCipher::SealChunk(header, key, header_aad, index, final, plaintext + chunk_offset, chunk_length, record_out);
+        }
+        return ChunkCipher::SealChunk(header, key, header_aad, index, final, plaintext + chunk_offset, chunk_length,
+                                      compression_level, record_out, record_lengths[position]);
+    };
 
-    /*
-     * Provide the message to be encrypted, and obtain the encrypted output.
-     * EVP_EncryptUpdate can be called multiple times if necessary
-     */
-    if (1 != EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext_char, strlen((char *)plaintext_char)))
+    // A single chunk (any small buffer) is sealed right here, without wrapping the work up for the pool
+    bool sealed = chunk_count == 1 ? seal_chunk(0) : ThreadPool::Shared().ParallelFor(chunk_count, seal_chunk);
+    if (!sealed)
     {
-        std::cerr << "EVP_EncryptUpdate failed" << std::endl;
         return false;
     }
-    ciphertext_len = len;
 
-    /*
-     * Finalise the encryption. Further ciphertext bytes may be written at
-     * this stage.
-     */
-    EVP_CIPHER_CTX_set_padding(ctx, 1);
-    if (1 != EVP_EncryptFinal_ex(ctx, ciphertext + len, &len))
+    size_t first_offset = first_chunk * header.chunk_size;
+    size_t run_plaintext_length = std::min<size_t>(chunk_count * header.chunk_size, plaintext_length - first_offset);
+    if (!compressed)
     {
-        std::cerr << "EVP_EncryptFinal_ex failed" << std::endl;
-        return false;
+        records_length = run_plaintext_length + chunk_count * ChunkCipher::RecordLength(0);
+        return true;
     }
-    ciphertext_len += len;
 
-    /* Clean up */
-    EVP_CIPHER_CTX_free(ctx);
-
-    // Return ciphertext
-    ciphertext_string = std::string(reinterpret_cast<char *>(ciphertext), ciphertext_len);
+    // Records only ever shrink, so each moves down (or stays) and never over one not yet moved
+    records_length = 0;
+    for (size_t position = 0; position < chunk_count; position++)
+    {
+        uint8_t *record = records_out + position * ChunkCipher::RecordLength(header.chunk_size);
+        if (records_out + records_length != record)
+        {
+            std::memmove(records_out + records_length, record, record_lengths[position]);
+        }
+        records_length += record_lengths[position];
+    }
     return true;
-}
\ No newline at end of file
+}
@@ -0,0 +1,243 @@
+#include "tpm_encrypt/entropy.hpp"
+#include "tpm_encrypt/tpm_session.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+// Bytes of kernel randomness the generator is seeded with
+static const size_t kSeedLength = 48;
+
+// Bumped whenever pooled bytes must not be served any more: in a forked child (which would otherwise hand out the
+// same bytes as its parent) and after TPM randomness was mixed in
+static std::atomic<uint64_t> pool_generation{0};
+
+static std::atomic<bool> seeded{false};
+static std::mutex seed_mutex{};
+
+namespace
+{
+    // Generator output of one thread, served front to back and wiped as it goes
+    struct Pool
+    {
+        uint8_t bytes[Entropy::kPoolLength];
+        size_t used = Entropy::kPoolLength;
+        uint64_t generation = 0;
+
+        ~Pool()
+        {
+            OPENSSL_cleanse(bytes, sizeof(bytes));
+        }
+    };
+}
+
+/**
+ * @brief OnFork Runs in a forked child, before anything else there can draw from a pool
+ */
+static void OnFork()
+{
+    pool_generation++;
+}
+
+/**
+ * @brief Fill Fills a buffer with cryptographically secure random bytes
+ * @param[out] data_out Buffer to fill
+ * @param[in] length Bytes to fill
+ * @returns False if no secure randomness is available, data_out must not be used then
+ */
+bool Entropy::Fill(uint8_t *data_out, size_t length)
+{
+    if (length == 0)
+    {
+        return true;
+    }
+
+    if (!Seed())
+    {
+        return false;
+    }
+
+    // Keys for whole batches and the like are not worth pooling
+    if (length > kMaxPooledRequest)
+    {
+        if (RAND_priv_bytes(data_out, static_cast<int>(length)) != 1)
+        {
+            std::cerr << "Unable to generate random data" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    thread_local Pool pool{};
+    uint64_t generation = pool_generation.load();
+    if (pool.generation != generation || kPoolLength - pool.used < length)
+    {
+        if (RAND_priv_bytes(pool.bytes, static_cast<int>(kPoolLength)) != 1)
+        {
+            OPENSSL_cleanse(pool.bytes, sizeof(pool.bytes));
+            pool.used = kPoolLength;
+            std::cerr << "Unable to generate random data" << std::endl;
+            return false;
+        }
+        pool.used = 0;
+        pool.generation = generation;
+    }
+
+    // Served bytes are wiped so they exist only where the caller put them
+    std::memcpy(data_out, pool.bytes + pool.used, length);
+    OPENSSL_cleanse(pool.bytes + pool.used, length);
+    pool.used += length;
+
+    return true;
+}
+
+/**
+ * @brief MixTpm Mixes random bytes from the TPM into the generator
+ * @param[in] length Bytes to draw from the TPM
+ * @returns Success
+ */
+bool Entropy::MixTpm(size_t length)
+{
+    if (!Seed())
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> tpm_random(length);
+    bool drawn = false;
+    try
+    {
+        drawn = TpmSession::Instance().GetRandom(tpm_random.data(), tpm_random.size());
+    }
+    catch (std::runtime_error &e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+
+    // Reseeds the primary generator with the bytes as additional input, the per-thread generators follow from it
+    if (drawn)
+    {
+        RAND_add(tpm_random.data(), static_cast<int>(tpm_random.size()), 0.0);
+        pool_generation++;
+    }
+    OPENSSL_cleanse(tpm_random.data(), tpm_random.size());
+
+    if (!drawn)
+    {
+        std::cerr << "Unable to draw random data from the TPM" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Seed Seeds the generator from getrandom() on first use, again after a failed attempt
+ * @returns False if the kernel cannot supply entropy
+ */
+bool Entropy::Seed()
+{
+    if (seeded.load(std::memory_order_acquire))
+    {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(seed_mutex);
+    if (seeded.load(std::memory_order_relaxed))
+    {
+        return true;
+    }
+
+    uint8_t seed[kSeedLength];
+    if (!ReadSystem(seed, sizeof(seed)))
+    {
+        std::cerr << "Unable to read random data from the kernel: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    RAND_seed(seed, static_cast<int>(sizeof(seed)));
+    OPENSSL_cleanse(seed, sizeof(seed));
+
+    if (RAND_status() != 1)
+    {
+        std::cerr << "Random generator could not be seeded" << std::endl;
+        return false;
+    }
+
+    pthread_atfork(nullptr, nullptr, &OnFork);
+
+    seeded.store(true, std::memory_order_release);
+    return true;
+}
+
+/**
+ * @brief ReadSystem Reads from the kernel's generator, resuming after short reads and signals
+ * @returns Success
+ */
+bool Entropy::ReadSystem(uint8_t *data_out, size_t length)
+{
+    while (length > 0)
+    {
+        // Only ever blocks until the kernel's generator is first initialised after boot, unlike /dev/random
+        ssize_t result = getrandom(data_out, length, 0);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result < 0 && errno == ENOSYS)
+        {
+            break;
+        }
+        if (result <= 0)
+        {
+            return false;
+        }
+
+        data_out += result;
+        length -= static_cast<size_t>(result);
+    }
+
+    if (length == 0)
+    {
+        return true;
+    }
+
+    // Kernels older than 3.17 lack getrandom()
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    while (length > 0)
+    {
+        ssize_t result = read(fd, data_out, length);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        data_out += result;
+        length -= static_cast<size_t>(result);
+    }
+
+    close(fd);
+    return true;
+}
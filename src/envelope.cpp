@@ -0,0 +1,213 @@
+#include "tpm_encrypt/envelope.hpp"
+#include "tpm_encrypt/cipher_engine.hpp"
+#include "tpm_encrypt/common.hpp"
+#include "tpm_encrypt/key_cache.hpp"
+#include "tpm_encrypt/logger.hpp"
+#include "tpm_encrypt/tpm_session.hpp"
+
+#include <iostream>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+// Sizes of the generated material (AES-256 keys)
+static const size_t kKekLength = 32;
+static const size_t kDataKeyLength = 32;
+
+// AES-256-GCM parameters used to wrap the data key
+static const size_t kWrapNonceLength = 12;
+static const size_t kWrapTagLength = 16;
+
+static_assert(Envelope::kWrappedKeyLength == kWrapNonceLength + kDataKeyLength + kWrapTagLength, "Wrapped key layout changed");
+
+// Binds the wrapped blob to its purpose
+static const unsigned char kWrapAad[] = {'T', 'P', 'M', 'E', '-', 'D', 'E', 'K'};
+
+/**
+ * @brief KekPath FAPI path of the key-encryption key for a reference, next to its sealed key
+ * @details Common::CheckKeyReference keeps "_kek" endings out of references, so no reference's sealed key lands here.
+ *          The path (which no reference can equal) also names the key cache entry, apart from the sealed keys
+ */
+static std::string KekPath(const std::string &kek_reference)
+{
+    return "/HS/SRK/" + kek_reference + "_kek";
+}
+
+/**
+ * @brief GenerateDataKey Creates a random data key, wrapped by the key-encryption key
+ * @param[in] kek_reference Reference of the key-encryption key, it is created on the TPM if missing
+ * @param[out] data_key The generated data key
+ * @param[out] wrapped_key Data key encrypted under the key-encryption key, stored in the container header
+ * @returns Success
+ */
+bool Envelope::GenerateDataKey(const std::string &kek_reference, SecureBytes &data_key, std::vector<uint8_t> &wrapped_key)
+{
+    // Reused by every call on this thread rather than allocated each time, it is wiped after use
+    thread_local SecureBytes kek{};
+    if (!LoadKeyEncryptionKey(kek_reference, true, kek))
+    {
+        return false;
+    }
+
+    // Fresh key for every file, generated in software
+    data_key.resize(kDataKeyLength);
+
+    // Layout: nonce | encrypted data key | tag
+    wrapped_key.assign(kWrapNonceLength + kDataKeyLength + kWrapTagLength, 0);
+    uint8_t *nonce = wrapped_key.data();
+    uint8_t *ciphertext = nonce + kWrapNonceLength;
+    uint8_t *tag = ciphertext + kDataKeyLength;
+    if (!Common::GetRandomData(data_key.data(), data_key.size()) || !Common::GetRandomData(nonce, kWrapNonceLength))
+    {
+        OPENSSL_cleanse(kek.data(), kek.size());
+        return false;
+    }
+
+    EVP_CIPHER_CTX *ctx = CipherEngine::Context(CipherEngine::Aes256Gcm(), true, kek.data(), nonce);
+    int len = 0;
+    bool wrapped = ctx != nullptr &&
+                   1 == EVP_EncryptUpdate(ctx, nullptr, &len, kWrapAad, sizeof(kWrapAad)) &&
+                   1 == EVP_EncryptUpdate(ctx, ciphertext, &len, data_key.data(), data_key.size()) &&
+                   1 == EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) &&
+                   1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, kWrapTagLength, tag);
+
+    OPENSSL_cleanse(kek.data(), kek.size());
+
+    if (!wrapped)
+    {
+        std::cerr << "Unable to wrap data key" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief UnwrapDataKey Recovers a data key previously produced by GenerateDataKey
+ * @param[in] kek_reference Reference of the key-encryption key
+ * @param[in] wrapped_key The wrapped data key
+ * @param[out] data_key The data key
+ * @returns Success
+ */
+bool Envelope::UnwrapDataKey(const std::string &kek_reference, const std::vector<uint8_t> &wrapped_key, SecureBytes &data_key)
+{
+    if (wrapped_key.size() != kWrapNonceLength + kDataKeyLength + kWrapTagLength)
+    {
+        std::cerr << "Wrapped data key has an unexpected length" << std::endl;
+        return false;
+    }
+
+    // Reused by every call on this thread rather than allocated each time, it is wiped after use
+    thread_local SecureBytes kek{};
+    if (!LoadKeyEncryptionKey(kek_reference, false, kek))
+    {
+        return false;
+    }
+
+    const uint8_t *nonce = wrapped_key.data();
+    const uint8_t *ciphertext = nonce + kWrapNonceLength;
+    const uint8_t *tag = ciphertext + kDataKeyLength;
+
+    data_key.assign(kDataKeyLength, 0);
+
+    EVP_CIPHER_CTX *ctx = CipherEngine::Context(CipherEngine::Aes256Gcm(), false, kek.data(), nonce);
+    int len = 0;
+    bool unwrapped = ctx != nullptr &&
+                     1 == EVP_DecryptUpdate(ctx, nullptr, &len, kWrapAad, sizeof(kWrapAad)) &&
+                     1 == EVP_DecryptUpdate(ctx, data_key.data(), &len, ciphertext, kDataKeyLength) &&
+                     1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, kWrapTagLength, const_cast<uint8_t *>(tag)) &&
+                     1 == EVP_DecryptFinal_ex(ctx, data_key.data() + len, &len);
+
+    OPENSSL_cleanse(kek.data(), kek.size());
+
+    if (!unwrapped)
+    {
+        OPENSSL_cleanse(data_key.data(), data_key.size());
+        std::cerr << "Unable to unwrap data key, was it wrapped under a different key reference?" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief DeleteKeyEncryptionKey Removes the key-encryption key from the TPM and the key cache
+ * @param[in] kek_reference Reference of the key-encryption key
+ * @returns True if a key-encryption key was stored for the reference
+ */
+bool Envelope::DeleteKeyEncryptionKey(const std::string &kek_reference)
+{
+    if (!Common::CheckKeyReference(kek_reference))
+    {
+        return false;
+    }
+
+    std::string sealed_kek_path = KekPath(kek_reference);
+    KeyCache::Instance().Invalidate(sealed_kek_path);
+    bool deleted = TpmSession::Instance().Delete(sealed_kek_path);
+
+    // Unseals queued ahead of the delete may have cached the key meanwhile
+    KeyCache::Instance().Invalidate(sealed_kek_path);
+    return deleted;
+}
+
+/**
+ * @brief LoadKeyEncryptionKey Fetches the key-encryption key from the key cache or the TPM
+ * @param[in] kek_reference Reference of the key-encryption key
+ * @param[in] create Generate and seal a new key-encryption key if none exists yet
+ * @param[out] kek The key-encryption key
+ * @returns Success
+ */
+bool Envelope::LoadKeyEncryptionKey(const std::string &kek_reference, bool create, SecureBytes &kek)
+{
+    if (!Common::CheckKeyReference(kek_reference))
+    {
+        return false;
+    }
+
+    std::string sealed_kek_path = KekPath(kek_reference);
+
+    // Normally the key-encryption key is unsealed once and then served from the cache
+    uint64_t generation = KeyCache::Instance().Generation();
+    SecureBytes unused_iv{};
+    if (KeyCache::Instance().Lookup(sealed_kek_path, kek, unused_iv))
+    {
+        return true;
+    }
+
+    TpmSession &session = TpmSession::Instance();
+
+    bool missing = false;
+    if (!session.Unseal(sealed_kek_path, kek, missing))
+    {
+        if (!create || !missing)
+        {
+            std::cerr << "Unable to unseal key-encryption key, have you provided a valid reference?" << std::endl;
+            return false;
+        }
+
+        TPM_ENCRYPT_LOG(LogLevel::Info, "Creating key-encryption key at: " << sealed_kek_path);
+
+        SecureBytes new_kek(kKekLength);
+        bool sealed = Common::GetRandomData(new_kek.data(), new_kek.size()) &&
+                      session.CreateSeal(sealed_kek_path, new_kek.data(), new_kek.size());
+        OPENSSL_cleanse(new_kek.data(), new_kek.size());
+
+        // Read back what is actually stored, another process may have created it first
+        if (!sealed || !session.Unseal(sealed_kek_path, kek))
+        {
+            std::cerr << "Unable to create key-encryption key" << std::endl;
+            return false;
+        }
+    }
+
+    if (kek.size() != kKekLength)
+    {
+        std::cerr << "Key-encryption key at " << sealed_kek_path << " has an unexpected length" << std::endl;
+        return false;
+    }
+
+    KeyCache::Instance().Insert(sealed_kek_path, kek, unused_iv, generation);
+
+    return true;
+}
@@ -0,0 +1,284 @@
+#include "tpm_encrypt/esys_unsealer.hpp"
+#include "tpm_encrypt/logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <tss2/tss2_mu.h>
+
+#include <openssl/crypto.h>
+
+// FAPI path of the storage root key every sealed object is created under
+static const char kSrkPath[] = "/HS/SRK";
+
+/**
+ * @brief ~EsysUnsealer Flushes everything still loaded, must run before the FAPI context it was opened on goes
+ */
+EsysUnsealer::~EsysUnsealer()
+{
+    Close();
+}
+
+/**
+ * @brief Unseal Reads a sealed object back through ESYS
+ * @param[in] fapi FAPI context whose TPM connection and keystore are used
+ * @param[in] path FAPI path of the sealed object
+ * @param[in] auth Authorisation value of the sealed object
+ * @param[out] data_out The unsealed data
+ * @returns False if the fast path could not be used (e.g. the object has a policy), callers fall back to FAPI
+ */
+bool EsysUnsealer::Unseal(FAPI_CONTEXT *fapi, const std::string &path, const std::string &auth, SecureBytes &data_out)
+{
+    if (!Open(fapi))
+    {
+        return false;
+    }
+
+    auto loaded = std::find_if(objects_.begin(), objects_.end(), [&path](const LoadedObject &object)
+                               { return object.path == path; });
+    ESYS_TR handle = ESYS_TR_NONE;
+    if (loaded != objects_.end())
+    {
+        handle = loaded->handle;
+        loaded->last_used = ++use_count_;
+    }
+    else if (!Load(fapi, path, auth, handle))
+    {
+        return false;
+    }
+
+    TPM2B_SENSITIVE_DATA *unsealed = nullptr;
+    TSS2_RC tpm_result = Esys_Unseal(esys_, handle, session_, ESYS_TR_NONE, ESYS_TR_NONE, &unsealed);
+    if (tpm_result != TSS2_RC_SUCCESS)
+    {
+        // The session or handles may be gone (e.g. the TPM was reset), start from scratch next time
+        TPM_ENCRYPT_LOG(LogLevel::Debug, "Esys_Unseal (" << path << ") failed with error code " << tpm_result << ", falling back to FAPI");
+        Close();
+        return false;
+    }
+
+    data_out.assign(unsealed->buffer, unsealed->buffer + unsealed->size);
+    OPENSSL_cleanse(unsealed->buffer, unsealed->size);
+    Esys_Free(unsealed);
+
+    return true;
+}
+
+/**
+ * @brief Forget Flushes loaded objects at or below a path (whole components), for objects that were deleted or replaced
+ * @param[in] path FAPI path, "/" forgets everything
+ */
+void EsysUnsealer::Forget(const std::string &path)
+{
+    // Whole path components only, forgetting /HS/SRK/db leaves /HS/SRK/db2 and /HS/SRK/db_kek loaded
+    auto below = [&path](const LoadedObject &object)
+    {
+        return !path.empty() && object.path.compare(0, path.size(), path) == 0 &&
+               (object.path.size() == path.size() || path.back() == '/' || object.path[path.size()] == '/');
+    };
+
+    for (const LoadedObject &object : objects_)
+    {
+        if (below(object))
+        {
+            Esys_FlushContext(esys_, object.handle);
+        }
+    }
+    objects_.erase(std::remove_if(objects_.begin(), objects_.end(), below), objects_.end());
+}
+
+/**
+ * @brief Close Flushes every handle and finalises the ESYS context, the next Unseal opens them again
+ */
+void EsysUnsealer::Close()
+{
+    if (esys_ == nullptr)
+    {
+        return;
+    }
+
+    // Failures are ignored, the handles are unusable either way
+    for (const LoadedObject &object : objects_)
+    {
+        Esys_FlushContext(esys_, object.handle);
+    }
+    objects_.clear();
+
+    if (session_ != ESYS_TR_NONE)
+    {
+        Esys_FlushContext(esys_, session_);
+        session_ = ESYS_TR_NONE;
+    }
+
+    if (srk_ != ESYS_TR_NONE)
+    {
+        if (srk_persistent_)
+        {
+            Esys_TR_Close(esys_, &srk_);
+        }
+        else
+        {
+            Esys_FlushContext(esys_, srk_);
+        }
+        srk_ = ESYS_TR_NONE;
+    }
+
+    // The TCTI belongs to FAPI, finalising ESYS leaves it alone
+    Esys_Finalize(&esys_);
+    esys_ = nullptr;
+}
+
+/**
+ * @brief Abandon Forgets the ESYS context and handles without touching the TPM
+ */
+void EsysUnsealer::Abandon()
+{
+    // Leaked rather than finalised, finalising would flush handles the parent still holds
+    objects_.clear();
+    session_ = ESYS_TR_NONE;
+    srk_ = ESYS_TR_NONE;
+    esys_ = nullptr;
+}
+
+/**
+ * @brief Open Creates the ESYS context on FAPI's connection, resolves the SRK and starts the session
+ * @returns Success
+ */
+bool EsysUnsealer::Open(FAPI_CONTEXT *fapi)
+{
+    if (esys_ != nullptr)
+    {
+        return true;
+    }
+
+    // Same connection as FAPI, so whatever TCTI its configuration names is used here too
+    TSS2_TCTI_CONTEXT *tcti = nullptr;
+    TSS2_RC tpm_result = Fapi_GetTcti(fapi, &tcti);
+    if (tpm_result != TSS2_RC_SUCCESS || Esys_Initialize(&esys_, tcti, nullptr) != TSS2_RC_SUCCESS)
+    {
+        TPM_ENCRYPT_LOG(LogLevel::Debug, "ESYS unavailable, unsealing through FAPI");
+        esys_ = nullptr;
+        return false;
+    }
+
+    // FAPI hands out the SRK either as a serialised persistent handle or as a saved context
+    uint8_t blob_type = 0;
+    uint8_t *blob = nullptr;
+    size_t blob_length = 0;
+    tpm_result = Fapi_GetEsysBlob(fapi, kSrkPath, &blob_type, &blob, &blob_length);
+    if (tpm_result == TSS2_RC_SUCCESS && blob_type == FAPI_ESYSBLOB_DESERIALIZE)
+    {
+        srk_persistent_ = true;
+        tpm_result = Esys_TR_Deserialize(esys_, blob, blob_length, &srk_);
+    }
+    else if (tpm_result == TSS2_RC_SUCCESS && blob_type == FAPI_ESYSBLOB_CONTEXTLOAD)
+    {
+        srk_persistent_ = false;
+        TPMS_CONTEXT saved_context{};
+        size_t offset = 0;
+        tpm_result = Tss2_MU_TPMS_CONTEXT_Unmarshal(blob, blob_length, &offset, &saved_context);
+        if (tpm_result == TSS2_RC_SUCCESS)
+        {
+            tpm_result = Esys_ContextLoad(esys_, &saved_context, &srk_);
+        }
+    }
+    else if (tpm_result == TSS2_RC_SUCCESS)
+    {
+        tpm_result = TSS2_FAPI_RC_BAD_VALUE;
+    }
+    Fapi_Free(blob);
+
+    if (tpm_result != TSS2_RC_SUCCESS)
+    {
+        TPM_ENCRYPT_LOG(LogLevel::Debug, "Unable to resolve the SRK through ESYS (" << tpm_result << "), unsealing through FAPI");
+        srk_ = ESYS_TR_NONE;
+        Close();
+        return false;
+    }
+
+    // Salted with the SRK so the session key never crosses the bus, and responses (the unsealed data) are encrypted
+    TPMT_SYM_DEF symmetric{};
+    symmetric.algorithm = TPM2_ALG_AES;
+    symmetric.keyBits.aes = 128;
+    symmetric.mode.aes = TPM2_ALG_CFB;
+    tpm_result = Esys_StartAuthSession(esys_, srk_, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                                       nullptr, TPM2_SE_HMAC, &symmetric, TPM2_ALG_SHA256, &session_);
+    if (tpm_result == TSS2_RC_SUCCESS)
+    {
+        tpm_result = Esys_TRSess_SetAttributes(esys_, session_, TPMA_SESSION_CONTINUESESSION | TPMA_SESSION_ENCRYPT, 0xff);
+    }
+    if (tpm_result != TSS2_RC_SUCCESS)
+    {
+        TPM_ENCRYPT_LOG(LogLevel::Debug, "Unable to start an ESYS session (" << tpm_result << "), unsealing through FAPI");
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Load Loads a sealed object from the FAPI keystore, evicting the least recently used one if needed
+ * @returns Success
+ */
+bool EsysUnsealer::Load(FAPI_CONTEXT *fapi, const std::string &path, const std::string &auth, ESYS_TR &handle)
+{
+    uint8_t *public_blob = nullptr;
+    size_t public_length = 0;
+    uint8_t *private_blob = nullptr;
+    size_t private_length = 0;
+    char *policy = nullptr;
+    TSS2_RC tpm_result = Fapi_GetTpmBlobs(fapi, path.c_str(), &public_blob, &public_length, &private_blob, &private_length, &policy);
+    if (tpm_result != TSS2_RC_SUCCESS)
+    {
+        return false;
+    }
+
+    // Objects bound to a policy need FAPI to satisfy it
+    bool has_policy = policy != nullptr && policy[0] != '\0';
+
+    TPM2B_PUBLIC in_public{};
+    TPM2B_PRIVATE in_private{};
+    size_t public_offset = 0;
+    size_t private_offset = 0;
+    bool decoded = !has_policy &&
+                   Tss2_MU_TPM2B_PUBLIC_Unmarshal(public_blob, public_length, &public_offset, &in_public) == TSS2_RC_SUCCESS &&
+                   Tss2_MU_TPM2B_PRIVATE_Unmarshal(private_blob, private_length, &private_offset, &in_private) == TSS2_RC_SUCCESS;
+    Fapi_Free(public_blob);
+    Fapi_Free(private_blob);
+    Fapi_Free(policy);
+    if (!decoded || auth.size() > sizeof(TPM2B_AUTH::buffer))
+    {
+        return false;
+    }
+
+    if (objects_.size() >= kMaxLoadedObjects)
+    {
+        auto oldest = std::min_element(objects_.begin(), objects_.end(), [](const LoadedObject &a, const LoadedObject &b)
+                                       { return a.last_used < b.last_used; });
+        Esys_FlushContext(esys_, oldest->handle);
+        objects_.erase(oldest);
+    }
+
+    tpm_result = Esys_Load(esys_, srk_, session_, ESYS_TR_NONE, ESYS_TR_NONE, &in_private, &in_public, &handle);
+    if (tpm_result != TSS2_RC_SUCCESS)
+    {
+        TPM_ENCRYPT_LOG(LogLevel::Debug, "Esys_Load (" << path << ") failed with error code " << tpm_result << ", falling back to FAPI");
+        Close();
+        return false;
+    }
+
+    TPM2B_AUTH auth_value{};
+    auth_value.size = static_cast<UINT16>(auth.size());
+    std::memcpy(auth_value.buffer, auth.data(), auth.size());
+    tpm_result = Esys_TR_SetAuth(esys_, handle, &auth_value);
+    OPENSSL_cleanse(&auth_value, sizeof(auth_value));
+    if (tpm_result != TSS2_RC_SUCCESS)
+    {
+        Esys_FlushContext(esys_, handle);
+        return false;
+    }
+
+    objects_.push_back(LoadedObject{path, handle, ++use_count_});
+    return true;
+}
@@ -0,0 +1,141 @@
+#include "tpm_encrypt/file_batch.hpp"
+#include "tpm_encrypt/logger.hpp"
+#include "tpm_encrypt/thread_pool.hpp"
+
+#include <atomic>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+
+/**
+ * @brief Run Processes every job, several at once
+ * @param[in] jobs Files to process
+ * @param[in] worker_count Files processed at once, 0 uses one per hardware thread
+ * @param[in] work Processes one file, returns success
+ * @param[out] results One result per job
+ * @returns True if every job succeeded
+ */
+bool FileBatch::Run(const std::vector<FileJob> &jobs, size_t worker_count, const std::function<bool(const FileJob &)> &work, std::vector<FileResult> &results)
+{
+    results.clear();
+    results.resize(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        results[i].path_in = jobs[i].path_in;
+        results[i].path_out = jobs[i].path_out;
+    }
+
+    if (jobs.empty())
+    {
+        return true;
+    }
+
+    // Exceptions must not escape a worker, a file that throws has simply failed
+    auto run_job = [&jobs, &work, &results](size_t index)
+    {
+        try
+        {
+            results[index].success = work(jobs[index]);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            results[index].success = false;
+        }
+    };
+
+    // The first file does the TPM work (session setup, unsealing) once, before anything runs concurrently
+    run_job(0);
+
+    // Files get their own pool, their chunks still go to the shared one, so neither waits on itself
+    ThreadPool workers(worker_count);
+    std::atomic<size_t> next_job{1};
+    std::vector<std::future<void>> pending{};
+    pending.reserve(workers.Size());
+    for (size_t i = 0; i < workers.Size(); i++)
+    {
+        pending.push_back(workers.Submit([&next_job, &jobs, &run_job]()
+                                         {
+                                             for (size_t index = next_job++; index < jobs.size(); index = next_job++)
+                                             {
+                                                 run_job(index);
+                                             } }));
+    }
+
+    for (std::future<void> &worker : pending)
+    {
+        worker.wait();
+    }
+
+    size_t failures = 0;
+    for (const FileResult &result : results)
+    {
+        failures += result.success ? 0 : 1;
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Processed " << jobs.size() << " files, " << failures << " failed");
+
+    return failures == 0;
+}
+
+/**
+ * @brief ListTree Finds every regular file below a directory and maps it to the same place below another
+ * @param[in] root_in Directory to walk
+ * @param[in] root_out Directory mirroring root_in, empty to only list the files (path_out is left empty)
+ * @param[out] jobs One job per file found
+ * @returns Success
+ */
+bool FileBatch::ListTree(const std::string &root_in, const std::string &root_out, std::vector<FileJob> &jobs)
+{
+    namespace fs = std::filesystem;
+
+    jobs.clear();
+
+    std::error_code error{};
+    fs::recursive_directory_iterator entry(root_in, error);
+    if (error)
+    {
+        std::cerr << "Unable to read directory: " << root_in << " (" << error.message() << ")" << std::endl;
+        return false;
+    }
+
+    for (; entry != fs::recursive_directory_iterator(); entry.increment(error))
+    {
+        if (error)
+        {
+            std::cerr << "Unable to read directory: " << root_in << " (" << error.message() << ")" << std::endl;
+            return false;
+        }
+
+        // Directories are walked into, anything that is not a plain file (sockets, broken links) is skipped
+        std::error_code type_error{};
+        if (!entry->is_regular_file(type_error))
+        {
+            continue;
+        }
+
+        if (root_out.empty())
+        {
+            jobs.push_back(FileJob{entry->path().string(), std::string()});
+            continue;
+        }
+
+        fs::path path_out = fs::path(root_out) / entry->path().lexically_relative(root_in);
+        fs::create_directories(path_out.parent_path(), error);
+        if (error)
+        {
+            std::cerr << "Unable to create directory: " << path_out.parent_path() << " (" << error.message() << ")" << std::endl;
+            return false;
+        }
+
+        jobs.push_back(FileJob{entry->path().string(), path_out.string()});
+    }
+
+    if (error)
+    {
+        std::cerr << "Unable to read directory: " << root_in << " (" << error.message() << ")" << std::endl;
+        return false;
+    }
+
+    return true;
+}
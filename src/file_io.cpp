@@ -0,0 +1,763 @@
+#include "tpm_encrypt/file_io.hpp"
+#include "tpm_encrypt/io_ring.hpp"
+#include "tpm_encrypt/metrics.hpp"
+#include "tpm_encrypt/thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief PageRange Shrinks a range to the whole pages inside it
+ * @returns False if no whole page is covered
+ */
+static bool PageRange(size_t &offset, size_t &length)
+{
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t begin = (offset + page - 1) / page * page;
+    size_t end = (offset + length) / page * page;
+    if (end <= begin)
+    {
+        return false;
+    }
+
+    offset = begin;
+    length = end - begin;
+    return true;
+}
+
+/**
+ * @brief ~StagedFile Removes the staged file unless it was committed
+ */
+StagedFile::~StagedFile()
+{
+    Discard();
+}
+
+/**
+ * @brief Create Creates the staged file in the destination's directory
+ * @param[in] path_out The destination
+ * @returns Descriptor open for writing, owned by the caller and closed before Commit. -1 on failure
+ */
+int StagedFile::Create(const std::string &path_out)
+{
+    // Unique within the process by the counter and between processes by the pid, O_EXCL settles anything else
+    static std::atomic<uint64_t> counter{0};
+
+    Discard();
+    for (int attempt = 0; attempt < 16; attempt++)
+    {
+        std::string path_staged = path_out + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+        int fd = open(path_staged.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd == -1)
+        {
+            if (errno == EEXIST)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        // Replacing a file should not change who may read it
+        struct stat status{};
+        if (stat(path_out.c_str(), &status) == 0 && S_ISREG(status.st_mode))
+        {
+            fchmod(fd, status.st_mode & 07777);
+        }
+
+        path_out_ = path_out;
+        path_staged_ = path_staged;
+        return fd;
+    }
+    return -1;
+}
+
+/**
+ * @brief Commit Renames the staged file over the destination
+ * @returns Success, the staged file is removed on failure
+ */
+bool StagedFile::Commit()
+{
+    if (path_staged_.empty())
+    {
+        return false;
+    }
+
+    if (rename(path_staged_.c_str(), path_out_.c_str()) != 0)
+    {
+        std::cerr << "Unable to replace " << path_out_ << ": " << std::strerror(errno) << std::endl;
+        Discard();
+        return false;
+    }
+    path_staged_.clear();
+    return true;
+}
+
+/**
+ * @brief Discard Removes the staged file
+ */
+void StagedFile::Discard()
+{
+    if (!path_staged_.empty())
+    {
+        unlink(path_staged_.c_str());
+        path_staged_.clear();
+    }
+}
+
+/**
+ * @brief ~MappedFile Unmaps and closes the file
+ */
+MappedFile::~MappedFile()
+{
+    if (data_ != nullptr)
+    {
+        munmap(data_, size_);
+    }
+    if (fd_ != -1)
+    {
+        close(fd_);
+    }
+}
+
+/**
+ * @brief Open Maps a file read only
+ * @param[in] path_in File to map
+ * @returns False if the file cannot be opened or is not a regular file (e.g. a pipe), callers fall back to buffered reads
+ */
+bool MappedFile::Open(const std::string &path_in)
+{
+    fd_ = open(path_in.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ == -1)
+    {
+        return false;
+    }
+
+    struct stat status{};
+    if (fstat(fd_, &status) != 0 || !S_ISREG(status.st_mode))
+    {
+        return false;
+    }
+
+    size_ = static_cast<size_t>(status.st_size);
+    if (size_ == 0)
+    {
+        // Nothing to map, an empty file is still a valid input
+        return true;
+    }
+
+    void *mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (mapping == MAP_FAILED)
+    {
+        size_ = 0;
+        return false;
+    }
+    data_ = static_cast<uint8_t *>(mapping);
+
+    // Read once front to back, let the kernel read ahead aggressively
+    madvise(data_, size_, MADV_SEQUENTIAL);
+
+    return true;
+}
+
+/**
+ * @brief Data Start of the mapped bytes, null for an empty file
+ */
+const uint8_t *MappedFile::Data() const
+{
+    return data_;
+}
+
+/**
+ * @brief Size Length of the file
+ */
+size_t MappedFile::Size() const
+{
+    return size_;
+}
+
+/**
+ * @brief Release Drops a processed range from memory, it is read back from the file if touched again
+ * @param[in] offset Start of the range
+ * @param[in] length Length of the range
+ */
+void MappedFile::Release(size_t offset, size_t length)
+{
+    if (data_ != nullptr && PageRange(offset, length))
+    {
+        madvise(data_ + offset, length, MADV_DONTNEED);
+    }
+}
+
+/**
+ * @brief Prefetch Starts reading a range ahead of its use, without waiting for it
+ * @param[in] offset Start of the range
+ * @param[in] length Length of the range
+ */
+void MappedFile::Prefetch(size_t offset, size_t length)
+{
+    if (data_ == nullptr || offset >= size_)
+    {
+        return;
+    }
+
+    // Whole pages covering the range, the kernel queues the reads and returns
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t begin = offset / page * page;
+    size_t end = std::min(offset + length, size_);
+    madvise(data_ + begin, end - begin, MADV_WILLNEED);
+}
+
+/**
+ * @brief WriteAll Writes a whole range with pwrite, resuming after short writes
+ * @returns Success
+ */
+static bool WriteAll(int fd, const uint8_t *data, size_t length, uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t written = pwrite(fd, data, length, static_cast<off_t>(offset));
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+
+        data += written;
+        offset += static_cast<uint64_t>(written);
+        length -= static_cast<size_t>(written);
+    }
+
+    return true;
+}
+
+OutputFile::OutputFile() = default;
+
+/**
+ * @brief ~OutputFile Waits for outstanding writes and closes the file, Finish must be called to keep the contents
+ */
+OutputFile::~OutputFile()
+{
+    Close();
+}
+
+/**
+ * @brief Open Creates a file and reserves its space up front
+ * @param[in] path_out File to write
+ * @param[in] length Final length of the file
+ * @returns Success
+ */
+bool OutputFile::Open(const std::string &path_out, size_t length)
+{
+    // Staged, path_out may be the input still being read through its mapping
+    path_ = path_out;
+    fd_ = staged_.Create(path_out);
+    if (fd_ == -1)
+    {
+        return false;
+    }
+
+    size_ = length;
+    slots_.resize(kWriteDepth);
+    if (size_ == 0)
+    {
+        return true;
+    }
+
+    // Reserving the blocks keeps the file contiguous and reports running out of space before any work is done
+    if (fallocate(fd_, 0, 0, static_cast<off_t>(size_)) != 0)
+    {
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+        {
+            std::cerr << "Unable to reserve " << size_ << " bytes: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        // Filesystems without fallocate just get the final size, the writes report running out of space themselves
+        if (ftruncate(fd_, static_cast<off_t>(size_)) != 0)
+        {
+            return false;
+        }
+    }
+
+    // A file written in one window has nothing to overlap with, it is written directly rather than paying
+    // for a ring or writer thread (which matters when encrypting many small files)
+    if (size_ > MappedFile::kWindowLength)
+    {
+        ring_.reset(new IoRing());
+        if (!ring_->Open(kWriteDepth))
+        {
+            ring_.reset();
+            writer_.reset(new ThreadPool(1));
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Window Buffer to produce a range of the file in, waits if every buffer is still being written
+ * @param[in] offset Start of the range
+ * @param[in] length Length of the range
+ * @returns Where to write the range, hand it to Commit once filled. Null if the range is invalid or an earlier write failed
+ */
+uint8_t *OutputFile::Window(size_t offset, size_t length)
+{
+    if (offset > size_ || length > size_ - offset || slots_.empty())
+    {
+        return nullptr;
+    }
+
+    // The buffer is reused, so its previous write has to be done first
+    if (!Wait(next_slot_))
+    {
+        return nullptr;
+    }
+
+    // Never null, even for an empty range, so null only ever means failure
+    WriteSlot &slot = slots_[next_slot_];
+    if (slot.buffer.Length() < length || slot.buffer.Data() == nullptr)
+    {
+        slot.buffer = BufferPool::Shared().Acquire(std::max<size_t>(length, 1));
+    }
+    return slot.buffer.Data();
+}
+
+/**
+ * @brief Commit Starts writing the range filled through the last Window call
+ * @param[in] offset Start of the range
+ * @param[in] length Length of the range
+ * @returns Success
+ */
+bool OutputFile::Commit(size_t offset, size_t length)
+{
+    size_t slot_index = next_slot_;
+    next_slot_ = (next_slot_ + 1) % slots_.size();
+
+    WriteSlot &slot = slots_[slot_index];
+    slot.offset = offset;
+    slot.length = length;
+    slot.written = 0;
+    if (length == 0)
+    {
+        return true;
+    }
+
+    return Submit(slot_index);
+}
+
+/**
+ * @brief Finish Waits for every write, closes the file and puts it in place, keeping its contents
+ * @returns Success
+ */
+bool OutputFile::Finish()
+{
+    if (!Close())
+    {
+        std::cerr << "Unable to write " << path_ << std::endl;
+        staged_.Discard();
+        return false;
+    }
+    return staged_.Commit();
+}
+
+/**
+ * @brief Discard Closes and removes the file, path_out is left as it was
+ */
+void OutputFile::Discard()
+{
+    Close();
+    staged_.Discard();
+}
+
+/**
+ * @brief Submit Starts writing the unwritten part of a slot
+ * @returns Success
+ */
+bool OutputFile::Submit(size_t slot_index)
+{
+    WriteSlot &slot = slots_[slot_index];
+    const uint8_t *data = slot.buffer.Data() + slot.written;
+    size_t length = slot.length - slot.written;
+    uint64_t offset = slot.offset + slot.written;
+    if (slot.written == 0)
+    {
+        slot.submitted = std::chrono::steady_clock::now();
+    }
+
+    if (ring_)
+    {
+        if (!ring_->SubmitWrite(fd_, data, length, offset, slot_index))
+        {
+            std::cerr << "Unable to queue a write to " << path_ << ": " << std::strerror(errno) << std::endl;
+            failed_ = true;
+            return false;
+        }
+    }
+    else if (!writer_)
+    {
+        bool written = WriteAll(fd_, data, length, offset);
+        Metrics::Record(Operation::Write, std::chrono::steady_clock::now() - slot.submitted, length, written);
+        if (!written)
+        {
+            std::cerr << "Unable to write " << path_ << ": " << std::strerror(errno) << std::endl;
+            failed_ = true;
+            return false;
+        }
+        return true;
+    }
+    else
+    {
+        int fd = fd_;
+        slot.done = writer_->Submit([fd, data, length, offset]()
+                                    { return WriteAll(fd, data, length, offset); });
+    }
+
+    slot.pending = true;
+    return true;
+}
+
+/**
+ * @brief Wait Waits until a slot's write has completed
+ * @returns False if the write failed
+ */
+bool OutputFile::Wait(size_t slot_index)
+{
+    if (!ring_)
+    {
+        WriteSlot &slot = slots_[slot_index];
+        if (slot.pending)
+        {
+            slot.pending = false;
+            bool written = slot.done.get();
+            Metrics::Record(Operation::Write, std::chrono::steady_clock::now() - slot.submitted, slot.length, written);
+            if (!written)
+            {
+                std::cerr << "Unable to write " << path_ << std::endl;
+                failed_ = true;
+            }
+        }
+        return !failed_;
+    }
+
+    // Completions arrive in any order, each one is applied to its own slot until this slot is done
+    while (slots_[slot_index].pending)
+    {
+        uint64_t tag = 0;
+        int64_t result = 0;
+        if (!ring_->WaitCompletion(tag, result) || tag >= slots_.size())
+        {
+            std::cerr << "Unable to wait for writes to " << path_ << ": " << std::strerror(errno) << std::endl;
+            failed_ = true;
+            return false;
+        }
+
+        WriteSlot &completed = slots_[tag];
+        completed.pending = false;
+        if (result == -EINTR || result == -EAGAIN)
+        {
+            // Nothing was written, try again
+            result = 0;
+        }
+        else if (result <= 0)
+        {
+            std::cerr << "Unable to write " << path_ << ": " << std::strerror(result == 0 ? ENOSPC : static_cast<int>(-result)) << std::endl;
+            Metrics::Record(Operation::Write, std::chrono::steady_clock::now() - completed.submitted, completed.written, false);
+            failed_ = true;
+            continue;
+        }
+
+        // Short writes carry on from where they stopped
+        completed.written += static_cast<size_t>(result);
+        if (completed.written == completed.length)
+        {
+            Metrics::Record(Operation::Write, std::chrono::steady_clock::now() - completed.submitted, completed.length, true);
+        }
+        else if (!Submit(static_cast<size_t>(tag)))
+        {
+            return false;
+        }
+    }
+
+    return !failed_;
+}
+
+/**
+ * @brief Close Waits for outstanding writes and closes the file
+ * @returns Success
+ */
+bool OutputFile::Close()
+{
+    // Buffers cannot be released while the kernel may still be reading them
+    for (size_t i = 0; i < slots_.size(); i++)
+    {
+        Wait(i);
+    }
+
+    bool success = !failed_;
+    if (fd_ != -1)
+    {
+        success = close(fd_) == 0 && success;
+        fd_ = -1;
+    }
+    return success;
+}
+
+/**
+ * @brief DescriptorStreambuf Streams through a descriptor, which must outlive this buffer
+ * @param[in] fd Descriptor to read or write
+ */
+DescriptorStreambuf::DescriptorStreambuf(int fd) : fd_(fd)
+{
+}
+
+/**
+ * @brief ~DescriptorStreambuf Writes out anything still buffered, the descriptor stays open
+ */
+DescriptorStreambuf::~DescriptorStreambuf()
+{
+    Flush();
+}
+
+/**
+ * @brief underflow Reads the next buffer full
+ */
+DescriptorStreambuf::int_type DescriptorStreambuf::underflow()
+{
+    if (gptr() < egptr())
+    {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    if (get_buffer_.Data() == nullptr)
+    {
+        get_buffer_ = BufferPool::Shared().Acquire(kBufferLength);
+    }
+    char *buffer = reinterpret_cast<char *>(get_buffer_.Data());
+    ssize_t result = 0;
+    do
+    {
+        result = read(fd_, buffer, kBufferLength);
+    } while (result < 0 && errno == EINTR);
+
+    if (result <= 0)
+    {
+        setg(buffer, buffer, buffer);
+        return traits_type::eof();
+    }
+
+    setg(buffer, buffer, buffer + result);
+    return traits_type::to_int_type(*gptr());
+}
+
+/**
+ * @brief xsgetn Reads large requests straight into the caller's buffer
+ */
+std::streamsize DescriptorStreambuf::xsgetn(char_type *data_out, std::streamsize length)
+{
+    std::streamsize done = 0;
+    while (done < length)
+    {
+        std::streamsize buffered = egptr() - gptr();
+        if (buffered > 0)
+        {
+            std::streamsize count = std::min(buffered, length - done);
+            std::memcpy(data_out + done, gptr(), static_cast<size_t>(count));
+            gbump(static_cast<int>(count));
+            done += count;
+            continue;
+        }
+
+        if (static_cast<size_t>(length - done) < kDirectLength)
+        {
+            if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+            {
+                break;
+            }
+            continue;
+        }
+
+        ssize_t result = read(fd_, data_out + done, static_cast<size_t>(length - done));
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            break;
+        }
+        done += result;
+    }
+    return done;
+}
+
+/**
+ * @brief overflow Writes out the buffer to make room for one more character
+ */
+DescriptorStreambuf::int_type DescriptorStreambuf::overflow(int_type character)
+{
+    if (!Reserve(1))
+    {
+        return traits_type::eof();
+    }
+    if (traits_type::eq_int_type(character, traits_type::eof()))
+    {
+        return traits_type::not_eof(character);
+    }
+
+    *pptr() = traits_type::to_char_type(character);
+    pbump(1);
+    return character;
+}
+
+/**
+ * @brief xsputn Writes large requests straight from the caller's buffer
+ */
+std::streamsize DescriptorStreambuf::xsputn(const char_type *data_in, std::streamsize length)
+{
+    size_t count = static_cast<size_t>(length);
+    if (count >= kDirectLength)
+    {
+        return Flush() && WriteAll(data_in, count) ? length : 0;
+    }
+
+    if (!Reserve(count))
+    {
+        return 0;
+    }
+    std::memcpy(pptr(), data_in, count);
+    pbump(static_cast<int>(count));
+    return length;
+}
+
+/**
+ * @brief sync Writes out the buffer
+ */
+int DescriptorStreambuf::sync()
+{
+    return Flush() ? 0 : -1;
+}
+
+/**
+ * @brief seekoff Moves the position of a seekable descriptor, fails on pipes and sockets
+ * @details Output positions of descriptors opened with O_APPEND fail as well, every write lands at the end whatever
+ *          the position, so writers that patch earlier bytes must treat them like pipes
+ */
+DescriptorStreambuf::pos_type DescriptorStreambuf::seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which)
+{
+    const pos_type failed(off_type(-1));
+    if (!Flush())
+    {
+        return failed;
+    }
+
+    if ((which & std::ios_base::out) != 0)
+    {
+        int status_flags = fcntl(fd_, F_GETFL);
+        if (status_flags < 0 || (status_flags & O_APPEND) != 0)
+        {
+            return failed;
+        }
+    }
+
+    // Buffered input was read ahead of the position the stream reports
+    off_type base = 0;
+    if (direction == std::ios_base::cur)
+    {
+        base = lseek(fd_, 0, SEEK_CUR);
+        if (base < 0)
+        {
+            return failed;
+        }
+        base -= egptr() - gptr();
+    }
+    else if (direction == std::ios_base::end)
+    {
+        struct stat status{};
+        if (fstat(fd_, &status) != 0 || lseek(fd_, 0, SEEK_CUR) < 0)
+        {
+            return failed;
+        }
+        base = status.st_size;
+    }
+
+    off_type target = base + offset;
+    if (target < 0 || lseek(fd_, target, SEEK_SET) < 0)
+    {
+        return failed;
+    }
+    setg(eback(), eback(), eback());
+    return pos_type(target);
+}
+
+/**
+ * @brief seekpos Moves the position of a seekable descriptor to an absolute offset
+ */
+DescriptorStreambuf::pos_type DescriptorStreambuf::seekpos(pos_type position, std::ios_base::openmode which)
+{
+    return seekoff(off_type(position), std::ios_base::beg, which);
+}
+
+/**
+ * @brief Reserve Makes room for some bytes in the output buffer, writing it out if needed
+ * @returns Success
+ */
+bool DescriptorStreambuf::Reserve(size_t length)
+{
+    if (pbase() == nullptr)
+    {
+        // Streams that only read never get an output buffer
+        put_buffer_ = BufferPool::Shared().Acquire(kBufferLength);
+        setp(reinterpret_cast<char *>(put_buffer_.Data()), reinterpret_cast<char *>(put_buffer_.Data()) + kBufferLength);
+    }
+    return static_cast<size_t>(epptr() - pptr()) >= length || Flush();
+}
+
+/**
+ * @brief Flush Writes out the buffered output
+ * @returns Success
+ */
+bool DescriptorStreambuf::Flush()
+{
+    if (pbase() == pptr())
+    {
+        return true;
+    }
+
+    bool success = WriteAll(pbase(), static_cast<size_t>(pptr() - pbase()));
+    setp(pbase(), epptr());
+    return success;
+}
+
+/**
+ * @brief WriteAll Writes all of a buffer to the descriptor
+ * @returns Success
+ */
+bool DescriptorStreambuf::WriteAll(const char *data_in, size_t length)
+{
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t result = write(fd_, data_in + written, length - written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        written += static_cast<size_t>(result);
+    }
+    return written == length;
+}
@@ -0,0 +1,679 @@
+#include "tpm_encrypt/incremental.hpp"
+#include "tpm_encrypt/buffer_pool.hpp"
+#include "tpm_encrypt/chunk_cipher.hpp"
+#include "tpm_encrypt/cipher_engine.hpp"
+#include "tpm_encrypt/cipher_suite.hpp"
+#include "tpm_encrypt/data_decrypt.hpp"
+#include "tpm_encrypt/logger.hpp"
+#include "tpm_encrypt/metrics.hpp"
+#include "tpm_encrypt/thread_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+
+// Manifest layout (integers little endian), encrypted as a whole with DataEncrypt::EncryptData:
+//   magic "TPMM" | version u8 | entry count u64 | entries
+//   entry: path length u32 | path | input size u64 | modified i64 | changed i64 | output size u64 | modified i64 |
+//          changed i64 | chunk size u32 | digest (32) | chunk count u64 | chunk digests
+static const char kManifestMagic[4] = {'T', 'P', 'M', 'M'};
+static const uint8_t kManifestVersion = 1;
+
+/**
+ * @brief Add Accumulates the stats of another run
+ */
+void IncrementalStats::Add(const IncrementalStats &other)
+{
+    files_skipped += other.files_skipped;
+    files_unchanged += other.files_unchanged;
+    files_updated += other.files_updated;
+    files_encrypted += other.files_encrypted;
+    chunks_reused += other.chunks_reused;
+    chunks_written += other.chunks_written;
+}
+
+// Appends an integer, little endian
+static void PutInteger(uint64_t value, size_t length, std::string &data_out)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        data_out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+// Reads an integer, little endian, advancing the position. False if the data ends first
+static bool GetInteger(const std::string &data_in, size_t &position, size_t length, uint64_t &value)
+{
+    if (data_in.size() - position < length)
+    {
+        return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(data_in[position + i])) << (8 * i);
+    }
+    position += length;
+    return true;
+}
+
+// Reads raw bytes, advancing the position. False if the data ends first
+static bool GetBytes(const std::string &data_in, size_t &position, size_t length, uint8_t *data_out)
+{
+    if (data_in.size() - position < length)
+    {
+        return false;
+    }
+    std::memcpy(data_out, data_in.data() + position, length);
+    position += length;
+    return true;
+}
+
+static void PutState(const FileState &state, std::string &data_out)
+{
+    PutInteger(state.size, 8, data_out);
+    PutInteger(static_cast<uint64_t>(state.modified), 8, data_out);
+    PutInteger(static_cast<uint64_t>(state.changed), 8, data_out);
+}
+
+static bool GetState(const std::string &data_in, size_t &position, FileState &state)
+{
+    uint64_t modified = 0;
+    uint64_t changed = 0;
+    if (!GetInteger(data_in, position, 8, state.size) ||
+        !GetInteger(data_in, position, 8, modified) ||
+        !GetInteger(data_in, position, 8, changed))
+    {
+        return false;
+    }
+    state.modified = static_cast<int64_t>(modified);
+    state.changed = static_cast<int64_t>(changed);
+    return true;
+}
+
+// Writes all of a buffer at an offset, retrying short writes
+static bool WriteAt(int fd, const uint8_t *data, size_t length, size_t offset)
+{
+    Metrics::Timer timer(Operation::Write);
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t result = pwrite(fd, data + written, length - written, static_cast<off_t>(offset + written));
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        written += static_cast<size_t>(result);
+    }
+    timer.Stop(written, written == length);
+    return written == length;
+}
+
+/**
+ * @brief Stat Reads the size and times of a file
+ * @returns False if the file does not exist or cannot be read
+ */
+bool IncrementalEncrypt::Stat(const std::string &path, FileState &state)
+{
+    struct stat status{};
+    if (stat(path.c_str(), &status) != 0)
+    {
+        return false;
+    }
+
+    // The change time catches writers that put the modification time back (e.g. archive extraction)
+    state.size = static_cast<uint64_t>(status.st_size);
+    state.modified = static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+    state.changed = static_cast<int64_t>(status.st_ctim.tv_sec) * 1000000000 + status.st_ctim.tv_nsec;
+    return true;
+}
+
+/**
+ * @brief HashChunks Takes the digests of a run of chunks in parallel
+ * @param[in] plaintext The whole plaintext
+ * @param[in] plaintext_length Length of the whole plaintext
+ * @param[in] chunk_size Plaintext bytes per chunk
+ * @param[in] first_chunk Index of the first chunk to hash
+ * @param[in] chunk_count Number of chunks to hash
+ * @param[out] digests_out Receives kChunkDigestLength bytes per chunk
+ * @returns Success
+ */
+bool IncrementalEncrypt::HashChunks(const uint8_t *plaintext, size_t plaintext_length, uint32_t chunk_size, size_t first_chunk,
+                                    size_t chunk_count, uint8_t *digests_out)
+{
+    return ThreadPool::Shared().ParallelFor(chunk_count, [&](size_t position)
+                                            {
+        size_t offset = (first_chunk + position) * chunk_size;
+        size_t length = std::min<size_t>(chunk_size, plaintext_length - offset);
+        uint8_t digest[CipherEngine::kSha256Length];
+        if (!CipherEngine::Sha256(plaintext + offset, length, digest))
+        {
+            return false;
+        }
+        std::memcpy(digests_out + position * kChunkDigestLength, digest, kChunkDigestLength);
+        return true; });
+}
+
+/**
+ * @brief OpenPrevious Checks that the previous output can be patched and reads its header
+ * @param[in] path_out The previous output
+ * @param[in] options How the data is to be encrypted now
+ * @param[in] manifest What was recorded for the file, its length must match the output's
+ * @param[out] header Header of the previous output
+ * @param[out] header_length Bytes the header occupies
+ * @returns False if the file has to be encrypted from scratch
+ */
+bool IncrementalEncrypt::OpenPrevious(const std::string &path_out, const EncryptOptions &options, const FileManifest &manifest,
+                                      ContainerHeader &header, size_t &header_length)
+{
+    std::ifstream file_out(path_out, std::ios::binary);
+    std::string consumed{};
+    if (!file_out.is_open() || !ContainerFormat::ReadHeader(file_out, header, consumed))
+    {
+        return false;
+    }
+    header_length = consumed.size();
+
+    // Only records with their own nonces may be sealed again under the same key, and only in the layout asked for
+    CipherId cipher = CipherId::Auto;
+    if ((header.flags & ContainerFormat::kFlagRecordNonces) == 0 ||
+        header.compression != CompressionId::None ||
+        header.chunk_size != options.chunk_size ||
+        header.key_mode != options.key_mode ||
+        !CipherSuite::Resolve(options.cipher, cipher) || header.cipher != cipher)
+    {
+        return false;
+    }
+
+    // The records must be exactly those of the content the digests describe
+    uint64_t chunk_count = ChunkCipher::ChunkCount(manifest.input.size, header.chunk_size);
+    return header.plaintext_length == manifest.input.size &&
+           manifest.chunk_digests.size() == chunk_count * kChunkDigestLength &&
+           manifest.output.size == header_length + manifest.input.size + chunk_count * ChunkCipher::RecordLength(header, 0);
+}
+
+/**
+ * @brief EncryptFile Encrypts a file, reusing what is still valid of its previous output
+ * @param[in] path_in File to be encrypted
+ * @param[in] path_out Path where the encrypted file shall be saved, possibly holding the previous output
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the data is encrypted
+ * @param[in,out] manifest What was recorded for this file last time, updated on return
+ * @param[in,out] stats Counts of what was done are added here
+ * @returns Success, on failure the manifest entry is invalidated so the next run starts from scratch
+ */
+bool IncrementalEncrypt::EncryptFile(const std::string &path_in, const std::string &path_out, const std::string &key_reference,
+                                     const EncryptOptions &options, FileManifest &manifest, IncrementalStats &stats)
+{
+    FileState input{};
+    if (!Stat(path_in, input))
+    {
+        std::cerr << "Unable to load file: " << path_in << std::endl;
+        manifest.chunk_size = 0;
+        return false;
+    }
+
+    // The output only still holds what the manifest describes if nothing else has written it since
+    FileState output{};
+    bool output_intact = manifest.chunk_size != 0 && Stat(path_out, output) && output == manifest.output;
+    if (output_intact && input == manifest.input)
+    {
+        stats.files_skipped++;
+        return true;
+    }
+
+    if (options.chunk_size == 0 || options.chunk_size > ContainerFormat::kMaxChunkSize)
+    {
+        std::cerr << "Invalid chunk size: " << options.chunk_size << std::endl;
+        return false;
+    }
+
+    MappedFile file_in{};
+    if (!file_in.Open(path_in))
+    {
+        std::cerr << "Unable to load file: " << path_in << std::endl;
+        manifest.chunk_size = 0;
+        return false;
+    }
+
+    const uint32_t chunk_size = options.chunk_size;
+    const size_t plaintext_length = file_in.Size();
+    const size_t chunk_count = ChunkCipher::ChunkCount(plaintext_length, chunk_size);
+    const size_t final_length = plaintext_length - (chunk_count - 1) * chunk_size;
+
+    // Old digests are only comparable at the same chunk size, and only while the output holds what they describe
+    bool comparable = output_intact && manifest.chunk_size == chunk_size;
+    size_t previous_count = comparable ? manifest.chunk_digests.size() / kChunkDigestLength : 0;
+
+    // Compressed records have no fixed place in the output, so those files are only ever written whole
+    bool direct = options.compression == CompressionId::None;
+    ContainerHeader header{};
+    size_t header_length = 0;
+    SecureBytes key{};
+    bool reuse = direct && comparable && OpenPrevious(path_out, options, manifest, header, header_length) &&
+                 DataDecrypt::RecoverKey(header, key_reference, key);
+
+    std::vector<uint8_t> digests(chunk_count * kChunkDigestLength);
+    size_t window_chunks = std::max<size_t>(1, MappedFile::kWindowLength / chunk_size);
+    std::vector<uint8_t> changed(window_chunks);
+    PooledBuffer records{};
+    std::string header_aad{};
+    size_t record_stride = 0;
+    int fd = -1;
+    IncrementalStats file_stats{};
+
+    // Opens the output at the first chunk to write: the previous one to patch, or a new container over it
+    auto open_output = [&](bool fresh)
+    {
+        if (fresh)
+        {
+            if (!DataEncrypt::PrepareKey(options, key_reference, plaintext_length, header, key))
+            {
+                return false;
+            }
+            header.flags |= ContainerFormat::kFlagRecordNonces;
+            fd = open(path_out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        }
+        else
+        {
+            fd = open(path_out.c_str(), O_WRONLY | O_CLOEXEC);
+        }
+        if (fd == -1)
+        {
+            std::cerr << "Unable to write encrypted data at: " << path_out << std::endl;
+            return false;
+        }
+
+        // The plaintext length is not authenticated, so patching it in leaves the records that stay valid
+        header.plaintext_length = plaintext_length;
+        ContainerFormat::HeaderAad(header, header_aad);
+        std::string header_bytes{};
+        ContainerFormat::WriteHeader(header, header_bytes);
+        header_length = header_bytes.size();
+        record_stride = ChunkCipher::RecordLength(header, chunk_size);
+        records = BufferPool::Shared().Acquire(window_chunks * record_stride);
+        return WriteAt(fd, reinterpret_cast<const uint8_t *>(header_bytes.data()), header_bytes.size(), 0);
+    };
+
+    // Hashes every chunk a window at a time. With write set, chunks that differ from the previous output (every chunk
+    // if fresh) are sealed and their records written over the old ones, runs of them with one write each
+    auto encrypt = [&](bool write, bool fresh, bool &any_changed)
+    {
+        any_changed = false;
+        for (size_t first_chunk = 0; first_chunk < chunk_count; first_chunk += window_chunks)
+        {
+            size_t count = std::min(window_chunks, chunk_count - first_chunk);
+            size_t plaintext_offset = first_chunk * chunk_size;
+            size_t window_length = std::min<size_t>(count * chunk_size, plaintext_length - plaintext_offset);
+
+            file_in.Prefetch(plaintext_offset + window_length, MappedFile::kWindowLength);
+
+            uint8_t *window_digests = digests.data() + first_chunk * kChunkDigestLength;
+            if (!HashChunks(file_in.Data(), plaintext_length, chunk_size, first_chunk, count, window_digests))
+            {
+                return false;
+            }
+
+            // A chunk that became or stopped being the final one changes its record flags, so is sealed again too
+            bool window_changed = false;
+            for (size_t position = 0; position < count; position++)
+            {
+                size_t index = first_chunk + position;
+                changed[position] = fresh || index >= previous_count ||
+                                    (index + 1 == chunk_count) != (index + 1 == previous_count) ||
+                                    std::memcmp(window_digests + position * kChunkDigestLength,
+                                                manifest.chunk_digests.data() + index * kChunkDigestLength, kChunkDigestLength) != 0;
+                window_changed = window_changed || changed[position];
+            }
+            any_changed = any_changed || window_changed;
+
+            if (write && window_changed)
+            {
+                if (fd == -1 && !open_output(fresh))
+                {
+                    return false;
+                }
+
+                bool sealed = ThreadPool::Shared().ParallelFor(count, [&](size_t position)
+                                                               {
+                    if (!changed[position])
+                    {
+                        return true;
+                    }
+                    size_t index = first_chunk + position;
+                    size_t offset = index * chunk_size;
+                    size_t length = std::min<size_t>(chunk_size, plaintext_length - offset);
+                    return ChunkCipher::SealChunk(header, key, header_aad, index, index + 1 == chunk_count,
+                                                  file_in.Data() + offset, length, records.Data() + position * record_stride); });
+                if (!sealed)
+                {
+                    return false;
+                }
+
+                for (size_t position = 0; position < count;)
+                {
+                    if (!changed[position])
+                    {
+                        file_stats.chunks_reused++;
+                        position++;
+                        continue;
+                    }
+
+                    size_t end = position;
+                    while (end < count && changed[end])
+                    {
+                        end++;
+                    }
+                    size_t run_length = (end - position) * record_stride;
+                    if (first_chunk + end == chunk_count)
+                    {
+                        run_length -= record_stride - ChunkCipher::RecordLength(header, final_length);
+                    }
+                    if (!WriteAt(fd, records.Data() + position * record_stride, run_length,
+                                 header_length + (first_chunk + position) * record_stride))
+                    {
+                        std::cerr << "Unable to write encrypted data at: " << path_out << std::endl;
+                        return false;
+                    }
+                    file_stats.chunks_written += end - position;
+                    position = end;
+                }
+            }
+            else if (write)
+            {
+                file_stats.chunks_reused += count;
+            }
+
+            file_in.Release(plaintext_offset, window_length);
+        }
+        return true;
+    };
+
+    // Outputs to patch are written as they are hashed, as are new ones. If the previous output can only be replaced
+    // the file is hashed first, it may not have changed at all
+    bool write_now = direct && (reuse || !comparable);
+    bool fresh = !reuse;
+    bool any_changed = false;
+    bool success = encrypt(write_now, write_now && fresh, any_changed);
+    if (success && any_changed && !write_now)
+    {
+        file_stats = IncrementalStats{};
+        if (direct)
+        {
+            success = encrypt(true, true, any_changed);
+        }
+        else
+        {
+            success = DataEncrypt::EncryptFile(path_in, path_out, key_reference, options);
+            file_stats.chunks_written = chunk_count;
+        }
+    }
+
+    if (fd != -1)
+    {
+        // Whatever followed the final record belonged to a longer version of the file
+        size_t output_length = header_length + (chunk_count - 1) * record_stride + ChunkCipher::RecordLength(header, final_length);
+        success = ftruncate(fd, static_cast<off_t>(output_length)) == 0 && success;
+        success = close(fd) == 0 && success;
+    }
+    OPENSSL_cleanse(key.data(), key.size());
+    OPENSSL_cleanse(records.Data(), records.Length());
+
+    if (!success)
+    {
+        // A half written new container is no use to anyone, a half patched one is replaced by the next run
+        if (fresh && direct && fd != -1)
+        {
+            std::filesystem::remove(path_out);
+        }
+        std::cerr << "Unable to encrypt the requested file: " << path_in << std::endl;
+        manifest.chunk_size = 0;
+        return false;
+    }
+
+    if (!any_changed)
+    {
+        file_stats.files_unchanged++;
+        file_stats.chunks_reused = chunk_count;
+    }
+    else if (fresh)
+    {
+        file_stats.files_encrypted++;
+    }
+    else
+    {
+        file_stats.files_updated++;
+    }
+    stats.Add(file_stats);
+
+    manifest.input = input;
+    manifest.chunk_size = chunk_size;
+    manifest.chunk_digests = std::move(digests);
+    CipherEngine::Sha256(manifest.chunk_digests.data(), manifest.chunk_digests.size(), manifest.digest.data());
+
+    // A file written to while it was read may be in the output half old, half new: only trust it until the next run
+    FileState input_after{};
+    if (!Stat(path_in, input_after) || !(input_after == input) || !Stat(path_out, manifest.output))
+    {
+        TPM_ENCRYPT_LOG(LogLevel::Warning, "File changed while it was encrypted, it will be encrypted again next time: " << path_in);
+        manifest.chunk_size = 0;
+    }
+
+    return true;
+}
+
+/**
+ * @brief EncryptDirectory Encrypts every file below a directory into the same layout below another, skipping or
+ *                         patching the outputs of files that did not change (much) since the last run
+ * @param[in] root_in Directory to encrypt
+ * @param[in] root_out Directory where the encrypted tree shall be saved
+ * @param[in] key_reference Used to save the symmetric key against the TPM, and to protect the manifest
+ * @param[in] options How the data is encrypted
+ * @param[in] manifest_path Manifest of the previous run, created if missing and rewritten afterwards
+ * @param[in] worker_count Files encrypted at once, 0 uses one per hardware thread
+ * @param[out] results Outcome of each file
+ * @param[out] stats Counts of what was done
+ * @returns True if every file was encrypted and the manifest saved
+ */
+bool IncrementalEncrypt::EncryptDirectory(const std::string &root_in, const std::string &root_out, const std::string &key_reference,
+                                          const EncryptOptions &options, const std::string &manifest_path, size_t worker_count,
+                                          std::vector<FileResult> &results, IncrementalStats &stats)
+{
+    stats = IncrementalStats{};
+    results.clear();
+
+    std::map<std::string, FileManifest> files{};
+    if (!LoadManifest(manifest_path, key_reference, files))
+    {
+        std::cerr << "Unable to load manifest: " << manifest_path << std::endl;
+        return false;
+    }
+
+    std::vector<FileJob> jobs{};
+    if (!FileBatch::ListTree(root_in, root_out, jobs))
+    {
+        return false;
+    }
+
+    // Entries are handed out before the workers start, each only touches its own entry and stats
+    std::vector<std::string> names(jobs.size());
+    std::vector<FileManifest> entries(jobs.size());
+    std::vector<IncrementalStats> job_stats(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        names[i] = std::filesystem::path(jobs[i].path_in).lexically_relative(root_in).generic_string();
+        auto entry = files.find(names[i]);
+        if (entry != files.end())
+        {
+            entries[i] = std::move(entry->second);
+        }
+    }
+
+    bool success = FileBatch::Run(jobs, worker_count, [&](const FileJob &job)
+                                  {
+                                      size_t index = static_cast<size_t>(&job - jobs.data());
+                                      return EncryptFile(job.path_in, job.path_out, key_reference, options, entries[index], job_stats[index]); },
+                                  results);
+
+    // Files no longer in the tree drop out of the manifest
+    files.clear();
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        stats.Add(job_stats[i]);
+        files.emplace(std::move(names[i]), std::move(entries[i]));
+    }
+
+    TPM_ENCRYPT_LOG(LogLevel::Info, "Incremental: " << stats.files_skipped << " skipped, " << stats.files_unchanged << " unchanged, "
+                                                    << stats.files_updated << " updated, " << stats.files_encrypted << " encrypted, "
+                                                    << stats.chunks_written << " chunks written, " << stats.chunks_reused << " reused");
+
+    EncryptOptions manifest_options = options;
+    manifest_options.compression = CompressionId::None;
+    manifest_options.chunk_size = ContainerFormat::kDefaultChunkSize;
+    if (!SaveManifest(manifest_path, key_reference, manifest_options, files))
+    {
+        std::cerr << "Unable to save manifest: " << manifest_path << std::endl;
+        return false;
+    }
+
+    return success;
+}
+
+/**
+ * @brief LoadManifest Reads and decrypts a manifest
+ * @param[in] manifest_path Manifest to read, a missing file is an empty manifest
+ * @param[in] key_reference The symmetric key reference the manifest was saved with
+ * @param[out] files Entries keyed by path relative to the encrypted directory
+ * @returns False if the manifest exists but cannot be decrypted or parsed
+ */
+bool IncrementalEncrypt::LoadManifest(const std::string &manifest_path, const std::string &key_reference, std::map<std::string, FileManifest> &files)
+{
+    files.clear();
+
+    std::error_code error{};
+    if (!std::filesystem::exists(manifest_path, error))
+    {
+        return !error;
+    }
+
+    std::ifstream file_in(manifest_path, std::ios::binary);
+    std::string ciphertext((std::istreambuf_iterator<char>(file_in)), std::istreambuf_iterator<char>());
+    std::string data{};
+    if (!file_in.good() && !file_in.eof())
+    {
+        return false;
+    }
+    if (!DataDecrypt::DecryptData(ciphertext, data, key_reference))
+    {
+        return false;
+    }
+
+    size_t position = 0;
+    uint64_t version = 0;
+    uint64_t entry_count = 0;
+    if (data.compare(0, sizeof(kManifestMagic), kManifestMagic, sizeof(kManifestMagic)) != 0)
+    {
+        return false;
+    }
+    position = sizeof(kManifestMagic);
+    if (!GetInteger(data, position, 1, version) || version != kManifestVersion ||
+        !GetInteger(data, position, 8, entry_count))
+    {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < entry_count; i++)
+    {
+        uint64_t path_length = 0;
+        uint64_t chunk_size = 0;
+        uint64_t digest_count = 0;
+        FileManifest entry{};
+        if (!GetInteger(data, position, 4, path_length) || data.size() - position < path_length)
+        {
+            return false;
+        }
+        std::string path = data.substr(position, path_length);
+        position += path_length;
+
+        if (!GetState(data, position, entry.input) || !GetState(data, position, entry.output) ||
+            !GetInteger(data, position, 4, chunk_size) ||
+            !GetBytes(data, position, entry.digest.size(), entry.digest.data()) ||
+            !GetInteger(data, position, 8, digest_count) ||
+            digest_count > (data.size() - position) / kChunkDigestLength)
+        {
+            return false;
+        }
+        entry.chunk_size = static_cast<uint32_t>(chunk_size);
+        entry.chunk_digests.resize(digest_count * kChunkDigestLength);
+        GetBytes(data, position, entry.chunk_digests.size(), entry.chunk_digests.data());
+
+        files[path] = std::move(entry);
+    }
+
+    return position == data.size();
+}
+
+/**
+ * @brief SaveManifest Encrypts and writes a manifest, replacing the previous one only once it is complete
+ * @param[in] manifest_path Where to save the manifest
+ * @param[in] key_reference Used to save the symmetric key against the TPM
+ * @param[in] options How the manifest is encrypted
+ * @param[in] files Entries keyed by path relative to the encrypted directory
+ * @returns Success
+ */
+bool IncrementalEncrypt::SaveManifest(const std::string &manifest_path, const std::string &key_reference, const EncryptOptions &options,
+                                      const std::map<std::string, FileManifest> &files)
+{
+    std::string data(kManifestMagic, sizeof(kManifestMagic));
+    PutInteger(kManifestVersion, 1, data);
+    PutInteger(files.size(), 8, data);
+    for (const auto &file : files)
+    {
+        const FileManifest &entry = file.second;
+        PutInteger(file.first.size(), 4, data);
+        data += file.first;
+        PutState(entry.input, data);
+        PutState(entry.output, data);
+        PutInteger(entry.chunk_size, 4, data);
+        data.append(reinterpret_cast<const char *>(entry.digest.data()), entry.digest.size());
+        PutInteger(entry.chunk_digests.size() / kChunkDigestLength, 8, data);
+        data.append(reinterpret_cast<const char *>(entry.chunk_digests.data()), entry.chunk_digests.size());
+    }
+
+    std::string ciphertext{};
+    if (!DataEncrypt::EncryptData(data, ciphertext, key_reference, options))
+    {
+        return false;
+    }
+
+    // A crash mid-write must not leave a manifest that fails to load, the previous one stays until this one is whole
+    std::string path_temp = manifest_path + ".tmp";
+    {
+        std::ofstream file_out(path_temp, std::ios::binary | std::ios::trunc);
+        file_out.write(ciphertext.data(), ciphertext.size());
+        file_out.close();
+        if (!file_out)
+        {
+            std::filesystem::remove(path_temp);
+            return false;
+        }
+    }
+
+    std::error_code error{};
+    std::filesystem::rename(path_temp, manifest_path, error);
+    return !error;
+}
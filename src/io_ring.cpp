@@ -0,0 +1,218 @@
+#include "tpm_encrypt/io_ring.hpp"
+
+#if __has_include(<linux/io_uring.h>)
+#define TPM_ENCRYPT_HAVE_IO_URING 1
+#endif
+
+#ifdef TPM_ENCRYPT_HAVE_IO_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * @brief Enter Wraps the io_uring_enter system call, retrying on EINTR
+ */
+static int Enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    int result = 0;
+    do
+    {
+        result = static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+/**
+ * @brief ~IoRing Unmaps the rings and closes the ring descriptor, requests still in flight are abandoned
+ */
+IoRing::~IoRing()
+{
+    if (sqes_ != nullptr)
+    {
+        munmap(sqes_, sqes_length_);
+    }
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_)
+    {
+        munmap(cq_ring_, cq_ring_length_);
+    }
+    if (sq_ring_ != nullptr)
+    {
+        munmap(sq_ring_, sq_ring_length_);
+    }
+    if (fd_ != -1)
+    {
+        close(fd_);
+    }
+}
+
+/**
+ * @brief Open Creates the ring
+ * @param[in] entries Most requests that will be in flight at once
+ * @returns False if io_uring is unavailable (old kernel, disabled, filtered by seccomp), callers fall back to blocking I/O
+ */
+bool IoRing::Open(unsigned entries)
+{
+    struct io_uring_params params{};
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ == -1)
+    {
+        return false;
+    }
+
+    // IORING_OP_WRITE arrived in the same kernel (5.6) as this feature
+    if ((params.features & IORING_FEAT_RW_CUR_POS) == 0)
+    {
+        return false;
+    }
+    entries_ = params.sq_entries;
+
+    sq_ring_length_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_length_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mapping)
+    {
+        sq_ring_length_ = cq_ring_length_ = std::max(sq_ring_length_, cq_ring_length_);
+    }
+
+    void *mapping = mmap(nullptr, sq_ring_length_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+    sq_ring_ = mapping;
+
+    if (single_mapping)
+    {
+        cq_ring_ = sq_ring_;
+    }
+    else
+    {
+        mapping = mmap(nullptr, cq_ring_length_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        cq_ring_ = mapping;
+    }
+
+    sqes_length_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    mapping = mmap(nullptr, sqes_length_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+    sqes_ = mapping;
+
+    uint8_t *sq = static_cast<uint8_t *>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    uint8_t *cq = static_cast<uint8_t *>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+
+    return true;
+}
+
+/**
+ * @brief SubmitWrite Queues a positioned write and hands it to the kernel
+ * @param[in] fd File to write
+ * @param[in] data Bytes to write, must stay valid until the write completes
+ * @param[in] length Length of data
+ * @param[in] offset Position in the file
+ * @param[in] tag Returned with the completion
+ * @returns Success
+ */
+bool IoRing::SubmitWrite(int fd, const uint8_t *data, size_t length, uint64_t offset, uint64_t tag)
+{
+    // Only this thread moves the tail, the kernel moves the head as it consumes entries
+    unsigned tail = *sq_tail_;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= entries_)
+    {
+        errno = EBUSY;
+        return false;
+    }
+
+    unsigned index = tail & *sq_mask_;
+    struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(sqes_) + index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(std::min<size_t>(length, INT_MAX));
+    sqe->off = offset;
+    sqe->user_data = tag;
+
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+    if (Enter(fd_, 1, 0, 0) != 1)
+    {
+        // Without SQPOLL the kernel only takes entries inside io_uring_enter, so this one was never consumed
+        __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief WaitCompletion Waits for any submitted request to complete
+ * @param[out] tag Tag of the completed request
+ * @param[out] result Bytes transferred, or a negative errno
+ * @returns False if the ring itself failed
+ */
+bool IoRing::WaitCompletion(uint64_t &tag, int64_t &result)
+{
+    while (true)
+    {
+        unsigned head = *cq_head_;
+        if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+        {
+            const struct io_uring_cqe *cqe = static_cast<const struct io_uring_cqe *>(cqes_) + (head & *cq_mask_);
+            tag = cqe->user_data;
+            result = cqe->res;
+            __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        if (Enter(fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+        {
+            return false;
+        }
+    }
+}
+
+#else
+
+// Without the kernel headers every ring fails to open and callers use their blocking fallback
+
+IoRing::~IoRing() = default;
+
+bool IoRing::Open(unsigned)
+{
+    return false;
+}
+
+bool IoRing::SubmitWrite(int, const uint8_t *, size_t, uint64_t, uint64_t)
+{
+    return false;
+}
+
+bool IoRing::WaitCompletion(uint64_t &, int64_t &)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,210 @@
+#include "tpm_encrypt/key_cache.hpp"
+
+#include <pthread.h>
+
+/**
+ * @brief Instance Returns the process wide key cache
+ */
+KeyCache &KeyCache::Instance()
+{
+    static KeyCache cache;
+    return cache;
+}
+
+/**
+ * @brief KeyCache Registers the fork handlers
+ */
+KeyCache::KeyCache()
+{
+    pthread_atfork(&PrepareFork, &ParentAfterFork, &ChildAfterFork);
+}
+
+/**
+ * @brief PrepareFork Holds the lock across fork, so the child never inherits it taken by a thread it lacks
+ */
+void KeyCache::PrepareFork()
+{
+    Instance().mutex_.lock();
+}
+
+/**
+ * @brief ParentAfterFork Releases the lock taken by PrepareFork
+ */
+void KeyCache::ParentAfterFork()
+{
+    Instance().mutex_.unlock();
+}
+
+/**
+ * @brief ChildAfterFork Releases the lock and drops every entry, the arena wiped their keys in the child
+ */
+void KeyCache::ChildAfterFork()
+{
+    // Entries keep their length once wiped, served as hits they would hand out all zero keys. A child unseals afresh
+    KeyCache &cache = Instance();
+    cache.mutex_.unlock();
+    cache.Clear();
+}
+
+/**
+ * @brief Configure Sets the cache limits, existing entries exceeding them are evicted
+ * @param[in] ttl How long an entry may be served after it was unsealed
+ * @param[in] max_entries Maximum number of key references held, 0 disables the cache
+ */
+void KeyCache::Configure(std::chrono::seconds ttl, size_t max_entries)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    ttl_ = ttl;
+    max_entries_ = max_entries;
+
+    while (entries_.size() > max_entries_)
+    {
+        EvictOldest();
+    }
+}
+
+/**
+ * @brief Lookup Fetches the key material for a reference if it is cached and not expired
+ * @param[in] key_reference The key reference
+ * @param[out] key_data The cached key
+ * @param[out] iv_data The cached iv
+ * @returns True on a cache hit
+ */
+bool KeyCache::Lookup(const std::string &key_reference, SecureBytes &key_data, SecureBytes &iv_data)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto entry = entries_.find(key_reference);
+    if (entry == entries_.end())
+    {
+        misses_++;
+        return false;
+    }
+
+    // Expired entries are dropped rather than served
+    if (std::chrono::steady_clock::now() >= entry->second.expiry)
+    {
+        lru_.erase(entry->second.lru_position);
+        entries_.erase(entry);
+        evictions_++;
+        misses_++;
+        return false;
+    }
+
+    // Mark as most recently used
+    lru_.splice(lru_.begin(), lru_, entry->second.lru_position);
+
+    key_data.assign(entry->second.key.begin(), entry->second.key.end());
+    iv_data.assign(entry->second.iv.begin(), entry->second.iv.end());
+
+    hits_++;
+    return true;
+}
+
+/**
+ * @brief Generation Returns the current generation, taken before unsealing and handed to Insert
+ */
+uint64_t KeyCache::Generation() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return generation_;
+}
+
+/**
+ * @brief Insert Stores freshly unsealed key material, evicting the least recently used entry when full
+ * @param[in] key_reference The key reference
+ * @param[in] key_data The unsealed key
+ * @param[in] iv_data The unsealed iv
+ * @param[in] generation Generation() taken before the key was unsealed
+ */
+void KeyCache::Insert(const std::string &key_reference, const SecureBytes &key_data, const SecureBytes &iv_data, uint64_t generation)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // An unseal queued ahead of a delete finishes after the delete invalidated its reference, caching it would
+    // keep serving a key the TPM no longer holds
+    if (max_entries_ == 0 || generation != generation_)
+    {
+        return;
+    }
+
+    // Replace any previous value for this reference
+    auto existing = entries_.find(key_reference);
+    if (existing != entries_.end())
+    {
+        lru_.erase(existing->second.lru_position);
+        entries_.erase(existing);
+    }
+
+    while (entries_.size() >= max_entries_)
+    {
+        EvictOldest();
+    }
+
+    lru_.push_front(key_reference);
+
+    Entry &entry = entries_[key_reference];
+    entry.key.assign(key_data.begin(), key_data.end());
+    entry.iv.assign(iv_data.begin(), iv_data.end());
+    entry.expiry = std::chrono::steady_clock::now() + ttl_;
+    entry.lru_position = lru_.begin();
+}
+
+/**
+ * @brief Invalidate Drops (and wipes) the entry for a reference, and any unsealed before but inserted after
+ * @param[in] key_reference The key reference
+ */
+void KeyCache::Invalidate(const std::string &key_reference)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    generation_++;
+
+    auto entry = entries_.find(key_reference);
+    if (entry != entries_.end())
+    {
+        lru_.erase(entry->second.lru_position);
+        entries_.erase(entry);
+    }
+}
+
+/**
+ * @brief Clear Drops (and wipes) every entry, and any unsealed before but inserted after
+ */
+void KeyCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    generation_++;
+
+    entries_.clear();
+    lru_.clear();
+}
+
+/**
+ * @brief GetStats Returns the hit/miss counters and current size
+ */
+KeyCache::Stats KeyCache::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return Stats{hits_.load(), misses_.load(), evictions_.load(), entries_.size()};
+}
+
+/**
+ * @brief EvictOldest Removes the least recently used entry
+ * @note The caller must hold mutex_
+ */
+void KeyCache::EvictOldest()
+{
+    if (lru_.empty())
+    {
+        return;
+    }
+
+    entries_.erase(lru_.back());
+    lru_.pop_back();
+    evictions_++;
+}
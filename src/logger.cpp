@@ -0,0 +1,46 @@
+#include "tpm_encrypt/logger.hpp"
+
+#include <iostream>
+#include <mutex>
+
+// Guards the output stream, so messages from different threads are never interleaved
+static std::mutex g_output_mutex;
+static std::ostream *g_output = &std::clog;
+
+/**
+ * @brief SetLevel Sets the least severe level written, Warning by default
+ * @param[in] level New level, Off silences the library
+ */
+void Logger::SetLevel(LogLevel level)
+{
+    level_.store(level, std::memory_order_relaxed);
+}
+
+/**
+ * @brief SetOutput Sets where messages are written, std::clog by default
+ * @param[in] output Stream to write to, must outlive its use by the library
+ */
+void Logger::SetOutput(std::ostream &output)
+{
+    std::lock_guard<std::mutex> lock(g_output_mutex);
+    g_output = &output;
+}
+
+/**
+ * @brief Write Writes one message without flushing, use TPM_ENCRYPT_LOG so disabled messages are never formatted
+ * @param[in] level Severity of the message
+ * @param[in] message The message, without a trailing newline
+ */
+void Logger::Write(LogLevel level, const std::string &message)
+{
+    static const char *const kPrefixes[] = {"", "", "[Warning] ", "[Error] "};
+
+    if (!Enabled(level) || level == LogLevel::Off)
+    {
+        return;
+    }
+
+    // No std::endl, the stream's own buffering decides when the bytes are written
+    std::lock_guard<std::mutex> lock(g_output_mutex);
+    *g_output << kPrefixes[static_cast<size_t>(level)] << message << '\n';
+}
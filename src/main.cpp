@@ -1,11 +1,260 @@
+#include <charconv>
+#include <filesystem>
 #include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tpm_encrypt/cipher_suite.hpp"
+#include "tpm_encrypt/compression.hpp"
 #include "tpm_encrypt/data_encrypt.hpp"
 #include "tpm_encrypt/data_decrypt.hpp"
 #include "tpm_encrypt/common.hpp"
+#include "tpm_encrypt/file_batch.hpp"
+#include "tpm_encrypt/file_io.hpp"
+#include "tpm_encrypt/logger.hpp"
+
+namespace
+{
+    // Command line settings of the non-interactive mode
+    struct PipeOptions
+    {
+        std::string command;
+        std::string key_reference;
+        EncryptOptions encrypt_options{};
+        LogLevel log_level = LogLevel::Warning;
+
+        // Files and directories to verify, checked this many at once (0 for one per hardware thread)
+        std::vector<std::string> paths;
+        size_t worker_count = 0;
+    };
+
+    /**
+     * @brief PrintUsage Describes the non-interactive mode
+     */
+    void PrintUsage(const char *program)
+    {
+        std::cerr << "Usage: " << program << "                      interactive menu\n"
+                  << "       " << program << " encrypt --ref name [--key-mode sealed|envelope] [--chunk-size N]\n"
+                  << "           [--cipher auto|aes-256-gcm|aes-128-gcm|aes-256-ctr-hmac-sha256|chacha20-poly1305]\n"
+                  << "           [--compression none|zstd|lz4] [--compression-level N] [--verbose]\n"
+                  << "       " << program << " decrypt --ref name [--verbose]\n"
+                  << "       " << program << " delete --ref name [--verbose]\n"
+                  << "       " << program << " verify --ref name [--jobs N] [--verbose] path...\n"
+                  << "encrypt and decrypt read stdin until EOF and write to stdout, verify checks files (and every\n"
+                  << "file below directories) without decrypting them and reports each on stdout" << std::endl;
+    }
+
+    /**
+     * @brief ParseNumber Reads a whole argument as a decimal number
+     * @returns False if the argument is not one, or does not fit value_out
+     */
+    template <typename T>
+    bool ParseNumber(const std::string &argument, T &value_out)
+    {
+        const char *end = argument.data() + argument.size();
+        std::from_chars_result result = std::from_chars(argument.data(), end, value_out);
+        return result.ec == std::errc() && result.ptr == end;
+    }
+
+    /**
+     * @brief ParseOptions Reads the command line of the non-interactive mode
+     * @returns False (after printing usage) if it cannot be parsed
+     */
+    bool ParseOptions(int argc, char *argv[], PipeOptions &options)
+    {
+        options.command = argv[1];
+        if (options.command != "encrypt" && options.command != "decrypt" && options.command != "delete" && options.command != "verify")
+        {
+            PrintUsage(argv[0]);
+            return false;
+        }
+
+        bool encrypting = options.command == "encrypt";
+        bool verifying = options.command == "verify";
+        EncryptOptions &encrypt_options = options.encrypt_options;
+        for (int i = 2; i < argc; i++)
+        {
+            std::string argument = argv[i];
+            std::string value = i + 1 < argc ? argv[i + 1] : "";
+            bool has_value = i + 1 < argc;
+
+            if (argument == "--ref" && has_value)
+            {
+                options.key_reference = value;
+                i++;
+            }
+            else if (argument == "--verbose")
+            {
+                options.log_level = LogLevel::Info;
+            }
+            else if (encrypting && argument == "--key-mode" && (value == "sealed" || value == "envelope"))
+            {
+                encrypt_options.key_mode = value == "sealed" ? KeyMode::Sealed : KeyMode::Envelope;
+                i++;
+            }
+            else if (encrypting && argument == "--chunk-size" && has_value && ParseNumber(value, encrypt_options.chunk_size))
+            {
+                i++;
+            }
+            else if (encrypting && argument == "--cipher" && has_value && CipherSuite::Parse(value, encrypt_options.cipher))
+            {
+                i++;
+            }
+            else if (encrypting && argument == "--compression" && has_value && Compression::Parse(value, encrypt_options.compression))
+            {
+                i++;
+            }
+            else if (encrypting && argument == "--compression-level" && has_value && ParseNumber(value, encrypt_options.compression_level))
+            {
+                i++;
+            }
+            else if (verifying && argument == "--jobs" && has_value && ParseNumber(value, options.worker_count))
+            {
+                i++;
+            }
+            else if (verifying && argument.compare(0, 2, "--") != 0)
+            {
+                options.paths.push_back(argument);
+            }
+            else
+            {
+                PrintUsage(argv[0]);
+                return false;
+            }
+        }
+
+        if (options.key_reference.empty() || (verifying && options.paths.empty()))
+        {
+            PrintUsage(argv[0]);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief GrowPipe Lets a pipe hold a few records, so each side is woken once per several chunks, not per page
+     * @param[in] fd Descriptor, left alone unless it is a pipe
+     */
+    void GrowPipe(int fd)
+    {
+        if (fcntl(fd, F_GETPIPE_SZ) > 0)
+        {
+            // Best effort, unprivileged processes are capped by /proc/sys/fs/pipe-max-size
+            fcntl(fd, F_SETPIPE_SZ, static_cast<int>(DescriptorStreambuf::kBufferLength * 4));
+        }
+    }
+
+    /**
+     * @brief RunVerify Checks every file named on the command line, or found below a directory named there
+     * @details Prints one line per file, "path: OK" or "path: FAILED", reasons go to stderr
+     * @returns Exit status
+     */
+    int RunVerify(const PipeOptions &options)
+    {
+        std::vector<std::string> paths{};
+        for (const std::string &path : options.paths)
+        {
+            std::error_code error{};
+            if (!std::filesystem::is_directory(path, error))
+            {
+                paths.push_back(path);
+                continue;
+            }
+
+            std::vector<FileJob> jobs{};
+            if (!FileBatch::ListTree(path, std::string(), jobs))
+            {
+                return 1;
+            }
+            for (const FileJob &job : jobs)
+            {
+                paths.push_back(job.path_in);
+            }
+        }
+
+        std::vector<FileResult> results{};
+        bool success = DataDecrypt::VerifyFiles(paths, options.key_reference, options.worker_count, results);
+        for (const FileResult &result : results)
+        {
+            std::cout << result.path_in << (result.success ? ": OK\n" : ": FAILED\n");
+        }
+        std::cout.flush();
+
+        return success ? 0 : 1;
+    }
+
+    /**
+     * @brief RunPipe Carries out one command of the non-interactive mode
+     * @details Encryption and decryption stream stdin to stdout a window of chunks at a time, so memory use does
+     *          not depend on the length and no plaintext is written anywhere else. A seekable stdout (a redirect to
+     *          a file) gets the plaintext length patched into the header, a pipe keeps the unknown marker
+     * @returns Exit status
+     */
+    int RunPipe(const PipeOptions &options)
+    {
+        if (options.command == "delete")
+        {
+            return Common::DeleteKey(options.key_reference) ? 0 : 1;
+        }
+        if (options.command == "verify")
+        {
+            return RunVerify(options);
+        }
+
+        GrowPipe(STDIN_FILENO);
+        GrowPipe(STDOUT_FILENO);
+
+        DescriptorStreambuf buffer_in(STDIN_FILENO);
+        DescriptorStreambuf buffer_out(STDOUT_FILENO);
+        std::istream stream_in(&buffer_in);
+        std::ostream stream_out(&buffer_out);
+
+        bool success = false;
+        if (options.command == "encrypt")
+        {
+            success = DataEncrypt::EncryptStream(stream_in, stream_out, options.key_reference, options.encrypt_options);
+        }
+        else
+        {
+            success = DataDecrypt::DecryptStream(stream_in, stream_out, options.key_reference);
+        }
+        success = stream_out.flush() && success;
+
+        return success ? 0 : 1;
+    }
+
+    /**
+     * @brief Prompt Asks for one line of input, paths may contain spaces
+     * @param[in] question Shown before reading
+     * @param[out] answer The line entered
+     * @returns False once stdin is exhausted
+     */
+    bool Prompt(const std::string &question, std::string &answer)
+    {
+        std::cout << question;
+        return static_cast<bool>(std::getline(std::cin, answer));
+    }
+}
 
 // Entrypoint into the demo application
-int main()
+int main(int argc, char *argv[])
 {
+    // With a command the demo is a filter, stdout carries the data and everything else goes to stderr
+    if (argc > 1)
+    {
+        PipeOptions options{};
+        if (!ParseOptions(argc, argv, options))
+        {
+            return 2;
+        }
+
+        Logger::SetOutput(std::cerr);
+        Logger::SetLevel(options.log_level);
+        return RunPipe(options);
+    }
 
     // Main menu loop
     bool menu_active = true;
@@ -14,6 +263,10 @@ int main()
     // TSS debug
     //putenv("TSS2_LOG=all+TRACE");
 
+    // Show the library's progress messages alongside the menu
+    Logger::SetOutput(std::cout);
+    Logger::SetLevel(LogLevel::Info);
+
     while (menu_active)
     {
         // Display menu options
@@ -22,49 +275,101 @@ int main()
         std::cout << "2. Decrypt a file\n";
         std::cout << "3. Delete associated TPM data\n";
         std::cout << "4. Delete **all** TPM data\n";
-        std::cout << "5. Exit\n";
-        std::cout << "Enter your choice: ";
+        std::cout << "5. Encrypt a directory\n";
+        std::cout << "6. Decrypt a directory\n";
+        std::cout << "7. Exit\n";
 
-        // Get user input
-        std::cin >> user_input;
+        // Get user input, end of input exits like option 7
+        if (!Prompt("Enter your choice: ", user_input))
+        {
+            std::cout << "\nExiting...\n";
+            break;
+        }
 
-        switch (user_input[0])
+        switch (user_input.empty() ? '\0' : user_input[0])
         {
         case '1':
         {
             // Handle encryption
             std::string input_file, output_file, key;
-            std::cout << "Enter the path of the file to encrypt: ";
-            std::cin >> input_file;
-            std::cout << "Enter the path of the encrypted output file: ";
-            std::cin >> output_file;
-            std::cout << "Enter the key reference (Used to decrypt the file later): ";
-            std::cin >> key;
-            // Call EncryptFile method with user-provided parameters
-            DataEncrypt::EncryptFile(input_file, output_file, key);
+            if (Prompt("Enter the path of the file to encrypt: ", input_file) &&
+                Prompt("Enter the path of the encrypted output file: ", output_file) &&
+                Prompt("Enter the key reference (Used to decrypt the file later): ", key))
+            {
+                // Call EncryptFile method with user-provided parameters
+                DataEncrypt::EncryptFile(input_file, output_file, key);
+            }
             break;
         }
         case '2':
         {
             // Handle decryption
             std::string input_file, output_file, key;
-            std::cout << "Enter the path of the file to decrypt: ";
-            std::cin >> input_file;
-            std::cout << "Enter the path of the plaintext output file: ";
-            std::cin >> output_file;
-            std::cout << "Enter the key reference (Used to decrypt the file): ";
-            std::cin >> key;
-            // Call DecryptFile method with user-provided parameters
-            DataDecrypt::DecryptFile(input_file, output_file, key);
+            if (Prompt("Enter the path of the file to decrypt: ", input_file) &&
+                Prompt("Enter the path of the plaintext output file: ", output_file) &&
+                Prompt("Enter the key reference (Used to decrypt the file): ", key))
+            {
+                // Call DecryptFile method with user-provided parameters
+                DataDecrypt::DecryptFile(input_file, output_file, key);
+            }
             break;
         }
         case '3':
-            // Handle deleting associated TPM data
+        {
+            // Handle deleting associated TPM data, files encrypted with the reference can no longer be decrypted
+            std::string key;
+            if (Prompt("Enter the key reference to delete: ", key))
+            {
+                Common::DeleteKey(key);
+            }
             break;
+        }
         case '4':
             Common::ResetTpm();
             break;
         case '5':
+        {
+            // Handle directory encryption, every file below the directory is encrypted into the output directory
+            std::string input_directory, output_directory, key;
+            if (!Prompt("Enter the path of the directory to encrypt: ", input_directory) ||
+                !Prompt("Enter the path of the encrypted output directory: ", output_directory) ||
+                !Prompt("Enter the key reference (Used to decrypt the files later): ", key))
+            {
+                break;
+            }
+            std::vector<FileResult> results{};
+            DataEncrypt::EncryptDirectory(input_directory, output_directory, key, EncryptOptions{}, 0, results);
+            for (const FileResult &result : results)
+            {
+                if (!result.success)
+                {
+                    std::cout << "Failed: " << result.path_in << "\n";
+                }
+            }
+            break;
+        }
+        case '6':
+        {
+            // Handle directory decryption
+            std::string input_directory, output_directory, key;
+            if (!Prompt("Enter the path of the directory to decrypt: ", input_directory) ||
+                !Prompt("Enter the path of the plaintext output directory: ", output_directory) ||
+                !Prompt("Enter the key reference (Used to decrypt the files): ", key))
+            {
+                break;
+            }
+            std::vector<FileResult> results{};
+            DataDecrypt::DecryptDirectory(input_directory, output_directory, key, 0, results);
+            for (const FileResult &result : results)
+            {
+                if (!result.success)
+                {
+                    std::cout << "Failed: " << result.path_in << "\n";
+                }
+            }
+            break;
+        }
+        case '7':
             // Exit
             std::cout << "Exiting...\n";
             menu_active = false;
@@ -76,4 +381,4 @@ int main()
     }
 
     return 0;
-}
\ No newline at end of file
+}
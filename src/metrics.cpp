@@ -0,0 +1,193 @@
+#include "tpm_encrypt/metrics.hpp"
+#include "tpm_encrypt/buffer_pool.hpp"
+
+#include <atomic>
+#include <sstream>
+
+// Names used in stats and metric labels, in Operation order
+static const char *const kOperationNames[Metrics::kOperationCount] = {
+    "fapi_init", "seal", "unseal", "encrypt", "decrypt", "read", "write", "compress", "decompress", "verify"};
+
+// Live totals of one operation, updated from any thread without locking
+struct OperationCounters
+{
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> failures{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> total_microseconds{0};
+    std::atomic<uint64_t> buckets[Metrics::kBucketCount + 1]{};
+};
+
+static OperationCounters g_counters[Metrics::kOperationCount];
+
+/**
+ * @brief Timer Starts timing an operation
+ * @param[in] operation What is being timed
+ */
+Metrics::Timer::Timer(Operation operation) : operation_(operation), start_(std::chrono::steady_clock::now())
+{
+}
+
+/**
+ * @brief ~Timer Records the operation as failed if Stop was not called
+ */
+Metrics::Timer::~Timer()
+{
+    if (!stopped_)
+    {
+        Stop(0, false);
+    }
+}
+
+/**
+ * @brief Stop Records the operation
+ * @param[in] bytes Bytes the operation handled
+ * @param[in] success Whether it succeeded
+ */
+void Metrics::Timer::Stop(uint64_t bytes, bool success)
+{
+    if (stopped_)
+    {
+        return;
+    }
+    stopped_ = true;
+    Record(operation_, std::chrono::steady_clock::now() - start_, bytes, success);
+}
+
+/**
+ * @brief Record Adds one operation to the totals
+ * @param[in] operation What was done
+ * @param[in] elapsed How long it took
+ * @param[in] bytes Bytes it handled
+ * @param[in] success Whether it succeeded
+ */
+void Metrics::Record(Operation operation, std::chrono::steady_clock::duration elapsed, uint64_t bytes, bool success)
+{
+    size_t index = static_cast<size_t>(operation);
+    if (index >= kOperationCount)
+    {
+        return;
+    }
+
+    uint64_t microseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    size_t bucket = 0;
+    while (bucket < kBucketCount && microseconds > kBucketBounds[bucket])
+    {
+        bucket++;
+    }
+
+    // Totals are only ever read as a whole snapshot, ordering between them does not matter
+    OperationCounters &counters = g_counters[index];
+    counters.count.fetch_add(1, std::memory_order_relaxed);
+    counters.failures.fetch_add(success ? 0 : 1, std::memory_order_relaxed);
+    counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    counters.total_microseconds.fetch_add(microseconds, std::memory_order_relaxed);
+    counters.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief GetStats Current totals of every operation
+ * @returns A snapshot, operations are listed in Operation order
+ */
+Stats Metrics::GetStats()
+{
+    Stats stats{};
+    stats.operations.resize(kOperationCount);
+    for (size_t i = 0; i < kOperationCount; i++)
+    {
+        const OperationCounters &counters = g_counters[i];
+        OperationStats &operation = stats.operations[i];
+        operation.name = kOperationNames[i];
+        operation.count = counters.count.load(std::memory_order_relaxed);
+        operation.failures = counters.failures.load(std::memory_order_relaxed);
+        operation.bytes = counters.bytes.load(std::memory_order_relaxed);
+        operation.total_microseconds = counters.total_microseconds.load(std::memory_order_relaxed);
+        operation.buckets.resize(kBucketCount + 1);
+        for (size_t bucket = 0; bucket <= kBucketCount; bucket++)
+        {
+            operation.buckets[bucket] = counters.buckets[bucket].load(std::memory_order_relaxed);
+        }
+    }
+    return stats;
+}
+
+/**
+ * @brief PrometheusText Current totals in the Prometheus text exposition format
+ * @returns Counters and a latency histogram per operation, ready to serve from a /metrics endpoint
+ */
+std::string Metrics::PrometheusText()
+{
+    Stats stats = GetStats();
+    std::ostringstream text{};
+
+    text << "# HELP tpm_encrypt_operations_total Operations performed\n"
+         << "# TYPE tpm_encrypt_operations_total counter\n";
+    for (const OperationStats &operation : stats.operations)
+    {
+        text << "tpm_encrypt_operations_total{operation=\"" << operation.name << "\"} " << operation.count << "\n";
+    }
+
+    text << "# HELP tpm_encrypt_failures_total Operations that failed\n"
+         << "# TYPE tpm_encrypt_failures_total counter\n";
+    for (const OperationStats &operation : stats.operations)
+    {
+        text << "tpm_encrypt_failures_total{operation=\"" << operation.name << "\"} " << operation.failures << "\n";
+    }
+
+    text << "# HELP tpm_encrypt_bytes_total Bytes handled\n"
+         << "# TYPE tpm_encrypt_bytes_total counter\n";
+    for (const OperationStats &operation : stats.operations)
+    {
+        text << "tpm_encrypt_bytes_total{operation=\"" << operation.name << "\"} " << operation.bytes << "\n";
+    }
+
+    // Prometheus buckets are cumulative and in seconds
+    text << "# HELP tpm_encrypt_operation_seconds Operation latency\n"
+         << "# TYPE tpm_encrypt_operation_seconds histogram\n";
+    for (const OperationStats &operation : stats.operations)
+    {
+        uint64_t cumulative = 0;
+        for (size_t bucket = 0; bucket < kBucketCount; bucket++)
+        {
+            cumulative += operation.buckets[bucket];
+            text << "tpm_encrypt_operation_seconds_bucket{operation=\"" << operation.name << "\",le=\""
+                 << static_cast<double>(kBucketBounds[bucket]) / 1e6 << "\"} " << cumulative << "\n";
+        }
+        // Counters are read one by one while others may be recording, so the count is taken from the buckets it must match
+        cumulative += operation.buckets[kBucketCount];
+        text << "tpm_encrypt_operation_seconds_bucket{operation=\"" << operation.name << "\",le=\"+Inf\"} " << cumulative << "\n"
+             << "tpm_encrypt_operation_seconds_sum{operation=\"" << operation.name << "\"} "
+             << static_cast<double>(operation.total_microseconds) / 1e6 << "\n"
+             << "tpm_encrypt_operation_seconds_count{operation=\"" << operation.name << "\"} " << cumulative << "\n";
+    }
+
+    BufferPool::Stats buffers = BufferPool::Shared().GetStats();
+    text << "# HELP tpm_encrypt_buffer_pool_bytes Memory held by the buffer pool\n"
+         << "# TYPE tpm_encrypt_buffer_pool_bytes gauge\n"
+         << "tpm_encrypt_buffer_pool_bytes{state=\"reserved\"} " << buffers.reserved_bytes << "\n"
+         << "tpm_encrypt_buffer_pool_bytes{state=\"in_use\"} " << buffers.in_use_bytes << "\n"
+         << "tpm_encrypt_buffer_pool_bytes{state=\"hugetlb\"} " << buffers.huge_page_bytes << "\n"
+         << "# HELP tpm_encrypt_buffer_pool_overflows_total Buffers allocated outside the pool, over its cap\n"
+         << "# TYPE tpm_encrypt_buffer_pool_overflows_total counter\n"
+         << "tpm_encrypt_buffer_pool_overflows_total " << buffers.overflows << "\n";
+
+    return text.str();
+}
+
+/**
+ * @brief Reset Sets every total back to zero
+ */
+void Metrics::Reset()
+{
+    for (OperationCounters &counters : g_counters)
+    {
+        counters.count.store(0, std::memory_order_relaxed);
+        counters.failures.store(0, std::memory_order_relaxed);
+        counters.bytes.store(0, std::memory_order_relaxed);
+        counters.total_microseconds.store(0, std::memory_order_relaxed);
+        for (std::atomic<uint64_t> &bucket : counters.buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+}
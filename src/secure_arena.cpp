@@ -0,0 +1,172 @@
+#include "tpm_encrypt/secure_arena.hpp"
+#include "tpm_encrypt/logger.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+
+static_assert(SecureArena::kSlotCount < UINT32_MAX, "Slot numbers must fit the free stack");
+
+/**
+ * @brief PageSize Size of a memory page
+ */
+static size_t PageSize()
+{
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return page_size;
+}
+
+/**
+ * @brief RoundToPages Rounds a byte count up to a whole number of pages
+ */
+static size_t RoundToPages(size_t bytes)
+{
+    return ((bytes + PageSize() - 1) / PageSize()) * PageSize();
+}
+
+/**
+ * @brief Instance Returns the process wide arena, reserving it on first use
+ */
+SecureArena &SecureArena::Instance()
+{
+    // Never destroyed, keys in static and thread local containers may be released during exit
+    static SecureArena *arena = new SecureArena();
+    return *arena;
+}
+
+/**
+ * @brief SecureArena Maps, guards and locks the slots
+ */
+SecureArena::SecureArena() : next_free_(new std::atomic<uint32_t>[kSlotCount])
+{
+    size_t slots_length = RoundToPages(kSlotCount * kSlotLength);
+    mapping_length_ = slots_length + 2 * PageSize();
+
+    void *mapping = mmap(nullptr, mapping_length_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        // Every request takes the overflow path instead
+        TPM_ENCRYPT_LOG(LogLevel::Warning, "Unable to reserve memory for keys: " << std::strerror(errno));
+        return;
+    }
+
+    mapping_ = static_cast<uint8_t *>(mapping);
+    uint8_t *slots = mapping_ + PageSize();
+    if (mprotect(slots, slots_length, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(mapping_, mapping_length_);
+        mapping_ = nullptr;
+        return;
+    }
+
+    // Best effort, an unprivileged process may exceed RLIMIT_MEMLOCK
+    locked_ = mlock(slots, slots_length) == 0;
+    if (!locked_)
+    {
+        TPM_ENCRYPT_LOG(LogLevel::Warning, "Unable to lock memory for keys, they may be swapped: " << std::strerror(errno));
+    }
+    madvise(slots, slots_length, MADV_DONTDUMP);
+#ifdef MADV_WIPEONFORK
+    // A forked child sees zeros, KeyCache and CipherEngine drop what they hold there so nothing serves a zero key
+    madvise(slots, slots_length, MADV_WIPEONFORK);
+#endif
+
+    // Every slot starts out free, lowest first
+    for (size_t slot = 0; slot < kSlotCount; slot++)
+    {
+        next_free_[slot].store(slot + 1 < kSlotCount ? static_cast<uint32_t>(slot + 2) : 0, std::memory_order_relaxed);
+    }
+    free_top_.store(1, std::memory_order_release);
+    slots_ = slots;
+}
+
+/**
+ * @brief Allocate Takes memory for key material
+ * @param[in] length Bytes needed
+ * @returns The memory, std::bad_alloc is thrown if there is none
+ */
+void *SecureArena::Allocate(size_t length)
+{
+    if (length <= kSlotLength && slots_ != nullptr)
+    {
+        uint64_t top = free_top_.load(std::memory_order_acquire);
+        while ((top & 0xffffffff) != 0)
+        {
+            uint32_t slot = static_cast<uint32_t>(top & 0xffffffff) - 1;
+            uint64_t generation = (top >> 32) + 1;
+            uint64_t next = (generation << 32) | next_free_[slot].load(std::memory_order_relaxed);
+            if (free_top_.compare_exchange_weak(top, next, std::memory_order_acquire, std::memory_order_acquire))
+            {
+                slots_in_use_.fetch_add(1, std::memory_order_relaxed);
+                return slots_ + slot * kSlotLength;
+            }
+        }
+    }
+
+    // Too long, or the arena is used up: a mapping of its own, so locking and the advice below never reach a
+    // neighbour, nor outlive the buffer the way they would on heap pages
+    overflows_.fetch_add(1, std::memory_order_relaxed);
+    size_t bytes = RoundToPages(length);
+    void *pointer = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pointer == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+    if (mlock(pointer, bytes) != 0)
+    {
+        lock_failures_.fetch_add(1, std::memory_order_relaxed);
+    }
+    madvise(pointer, bytes, MADV_DONTDUMP);
+#ifdef MADV_WIPEONFORK
+    madvise(pointer, bytes, MADV_WIPEONFORK);
+#endif
+    return pointer;
+}
+
+/**
+ * @brief Release Wipes and returns memory from Allocate
+ * @param[in] pointer The memory
+ * @param[in] length Bytes requested for it
+ */
+void SecureArena::Release(void *pointer, size_t length)
+{
+    if (pointer == nullptr)
+    {
+        return;
+    }
+
+    uint8_t *bytes = static_cast<uint8_t *>(pointer);
+    if (slots_ == nullptr || bytes < slots_ || bytes >= slots_ + kSlotCount * kSlotLength)
+    {
+        size_t page_bytes = RoundToPages(length);
+        OPENSSL_cleanse(pointer, page_bytes);
+        munmap(pointer, page_bytes);
+        return;
+    }
+
+    // Wipe before the slot can be handed to anybody else
+    OPENSSL_cleanse(bytes, kSlotLength);
+
+    uint32_t slot = static_cast<uint32_t>((bytes - slots_) / kSlotLength);
+    uint64_t top = free_top_.load(std::memory_order_relaxed);
+    do
+    {
+        next_free_[slot].store(static_cast<uint32_t>(top & 0xffffffff), std::memory_order_relaxed);
+    } while (!free_top_.compare_exchange_weak(top, (top & ~uint64_t{0xffffffff}) | (slot + 1), std::memory_order_release, std::memory_order_relaxed));
+
+    slots_in_use_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief GetStats Returns how many slots are taken, how often requests did not fit and whether memory was locked
+ */
+SecureArena::Stats SecureArena::GetStats() const
+{
+    return Stats{slots_in_use_.load(std::memory_order_relaxed), overflows_.load(std::memory_order_relaxed),
+                 lock_failures_.load(std::memory_order_relaxed), locked_};
+}
@@ -0,0 +1,198 @@
+#include "tpm_encrypt/thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+#include <pthread.h>
+
+// Changed in every forked child, pools started under an earlier value have no workers there
+static std::atomic<uint64_t> fork_generation{0};
+
+/**
+ * @brief OnFork Runs in a forked child
+ */
+static void OnFork()
+{
+    fork_generation++;
+}
+
+/**
+ * @brief ThreadPool Starts the worker threads
+ * @param[in] thread_count Number of workers, 0 uses one per hardware thread
+ */
+ThreadPool::ThreadPool(size_t thread_count)
+{
+    // Registered before the first workers exist
+    static const int fork_handler = pthread_atfork(nullptr, nullptr, &OnFork);
+    (void)fork_handler;
+    generation_ = fork_generation.load();
+
+    if (thread_count == 0)
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    workers_.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+/**
+ * @brief ~ThreadPool Finishes the queued tasks and joins the workers
+ */
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    condition_.notify_all();
+
+    // Workers of the parent do not exist in a forked child, there is nothing to join
+    bool forked = Forked();
+    for (std::thread &worker : workers_)
+    {
+        if (forked)
+        {
+            worker.detach();
+        }
+        else
+        {
+            worker.join();
+        }
+    }
+}
+
+/**
+ * @brief Shared Returns the process wide pool used for chunk level cipher work
+ */
+ThreadPool &ThreadPool::Shared()
+{
+    static ThreadPool pool(0);
+    return pool;
+}
+
+/**
+ * @brief Requests Returns the process wide pool running whole asynchronous requests
+ * @details Kept apart from Shared, so a request waiting on the TPM or on its own chunks never holds a chunk worker
+ */
+ThreadPool &ThreadPool::Requests()
+{
+    // Requests spend much of their time blocked on the TPM, more of them than cores keeps the cipher busy meanwhile
+    static ThreadPool pool(std::max(4u, 2 * std::thread::hardware_concurrency()));
+    return pool;
+}
+
+/**
+ * @brief Size Number of worker threads
+ */
+size_t ThreadPool::Size() const
+{
+    return workers_.size();
+}
+
+/**
+ * @brief ParallelFor Runs body(i) for every i in [0, count) across the pool
+ * @details Indices are handed out in contiguous ranges, remaining work is skipped once any call fails
+ * @param[in] count Number of iterations
+ * @param[in] body Work for one index, returns success
+ * @returns True if every call succeeded
+ */
+bool ThreadPool::ParallelFor(size_t count, const std::function<bool(size_t)> &body)
+{
+    // Not worth a hand off, or no workers to hand off to
+    if (count <= 1 || workers_.size() == 1 || Forked())
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!body(i))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::atomic<bool> failed{false};
+    size_t ranges = std::min(count, workers_.size());
+    std::vector<std::future<void>> pending{};
+    pending.reserve(ranges);
+
+    for (size_t range = 0; range < ranges; range++)
+    {
+        size_t begin = count * range / ranges;
+        size_t end = count * (range + 1) / ranges;
+        pending.push_back(Submit([begin, end, &body, &failed]()
+                                 {
+                                     for (size_t i = begin; i < end && !failed.load(std::memory_order_relaxed); i++)
+                                     {
+                                         if (!body(i))
+                                         {
+                                             failed = true;
+                                         }
+                                     } }));
+    }
+
+    // Every range must finish before the caller's state goes out of scope
+    for (std::future<void> &range : pending)
+    {
+        range.wait();
+    }
+
+    return !failed;
+}
+
+/**
+ * @brief Enqueue Adds a task to the queue and wakes a worker
+ */
+void ThreadPool::Enqueue(std::function<void()> task)
+{
+    // Nobody would ever pick it up in a forked child
+    if (Forked())
+    {
+        task();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push(std::move(task));
+    }
+    condition_.notify_one();
+}
+
+/**
+ * @brief WorkerLoop Runs queued tasks until the pool is destroyed
+ */
+void ThreadPool::WorkerLoop()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            condition_.wait(lock, [this]()
+                            { return stopping_ || !tasks_.empty(); });
+
+            if (tasks_.empty())
+            {
+                return;
+            }
+
+            task = std::move(tasks_.front());
+            tasks_.pop();
+        }
+
+        task();
+    }
+}
+
+/**
+ * @brief Forked Whether this is a forked child of the process that started the workers
+ */
+bool ThreadPool::Forked() const
+{
+    return generation_ != fork_generation.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,153 @@
+/**
+ * tpm-encryptd: keeps one TPM session, key cache and set of worker pools for every local client, see DaemonServer.
+ * Clients link the library and use DaemonClient in place of DataEncrypt and DataDecrypt
+ */
+#include "tpm_encrypt/buffer_pool.hpp"
+#include "tpm_encrypt/daemon_server.hpp"
+#include "tpm_encrypt/logger.hpp"
+#include "tpm_encrypt/secure_arena.hpp"
+#include "tpm_encrypt/tpm_session.hpp"
+
+#include <charconv>
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    // Command line settings
+    struct DaemonOptions
+    {
+        std::string socket_path = DaemonProtocol::kDefaultSocketPath;
+        size_t max_connections = DaemonServer::kDefaultMaxConnections;
+        bool esys_unseal = false;
+        size_t buffer_memory = BufferPool::kDefaultMaxBytes;
+        HugePages huge_pages = HugePages::Transparent;
+        LogLevel log_level = LogLevel::Warning;
+    };
+
+    // The server the signal handlers stop
+    DaemonServer *running_server = nullptr;
+
+    /**
+     * @brief StopServer Signal handler, lets the server finish the requests in flight and exit
+     */
+    void StopServer(int)
+    {
+        if (running_server != nullptr)
+        {
+            running_server->Stop();
+        }
+    }
+
+    /**
+     * @brief ParseNumber Reads a whole argument as a decimal number
+     * @returns False if the argument is not one, or does not fit value_out
+     */
+    template <typename T>
+    bool ParseNumber(const std::string &argument, T &value_out)
+    {
+        const char *end = argument.data() + argument.size();
+        std::from_chars_result result = std::from_chars(argument.data(), end, value_out);
+        return result.ec == std::errc() && result.ptr == end;
+    }
+
+    /**
+     * @brief ParseOptions Reads the command line
+     * @returns False (after printing usage) if it cannot be parsed
+     */
+    bool ParseOptions(int argc, char *argv[], DaemonOptions &options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string argument = argv[i];
+            std::string value = i + 1 < argc ? argv[i + 1] : "";
+            bool has_value = i + 1 < argc;
+
+            if (argument == "--socket" && has_value)
+            {
+                options.socket_path = value;
+                i++;
+            }
+            else if (argument == "--max-connections" && has_value && ParseNumber(value, options.max_connections) && options.max_connections > 0)
+            {
+                // With none the server would never accept anyone
+                i++;
+            }
+            else if (argument == "--buffer-memory" && has_value && ParseNumber(value, options.buffer_memory) && options.buffer_memory <= SIZE_MAX / (1024 * 1024))
+            {
+                options.buffer_memory *= 1024 * 1024;
+                i++;
+            }
+            else if (argument == "--huge-pages" && (value == "none" || value == "transparent" || value == "explicit"))
+            {
+                options.huge_pages = value == "none" ? HugePages::None : value == "transparent" ? HugePages::Transparent : HugePages::Explicit;
+                i++;
+            }
+            else if (argument == "--esys-unseal")
+            {
+                options.esys_unseal = true;
+            }
+            else if (argument == "--verbose")
+            {
+                options.log_level = LogLevel::Debug;
+            }
+            else
+            {
+                std::cerr << "Usage: " << argv[0] << " [--socket path] [--max-connections N] [--esys-unseal] [--verbose]\n"
+                          << "       [--buffer-memory MB] [--huge-pages none|transparent|explicit]" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+// Entrypoint into the daemon
+int main(int argc, char *argv[])
+{
+    DaemonOptions options{};
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    Logger::SetOutput(std::cerr);
+    Logger::SetLevel(options.log_level);
+
+    // Connect (and if needed provision) and lock the key memory before accepting anyone, so the first client
+    // does not pay for it
+    SecureArena::Instance();
+    BufferPool::Shared().Configure(options.buffer_memory, options.huge_pages);
+    try
+    {
+        TpmSession &session = TpmSession::Instance();
+        session.SetEsysUnseal(options.esys_unseal);
+        session.Connect();
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    DaemonServer server{};
+    if (!server.Listen(options.socket_path, options.max_connections))
+    {
+        return 1;
+    }
+
+    running_server = &server;
+    struct sigaction action{};
+    action.sa_handler = StopServer;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    server.Run();
+
+    running_server = nullptr;
+    return 0;
+}
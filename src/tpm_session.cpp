@@ -0,0 +1,362 @@
+#include "tpm_encrypt/tpm_session.hpp"
+#include "tpm_encrypt/common.hpp"
+#include "tpm_encrypt/logger.hpp"
+#include "tpm_encrypt/metrics.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <pthread.h>
+
+#include <openssl/crypto.h>
+
+static const std::string kAuthenticationString = "default_auth_key";
+static const std::string kIsProvisionedIdentifier = "fapi_provisioned";
+
+/**
+ * @brief Instance Returns the process wide session, the FAPI context is created on first use
+ * @returns The shared session
+ */
+TpmSession &TpmSession::Instance()
+{
+    static TpmSession session;
+    return session;
+}
+
+TpmSession::TpmSession() : context_(nullptr, &Common::FapiContextDeleteWrapper), scheduler_(1)
+{
+    pthread_atfork(nullptr, nullptr, &ChildAfterFork);
+}
+
+/**
+ * @brief ChildAfterFork Drops the connection inherited from the parent, the child opens its own on first use
+ */
+void TpmSession::ChildAfterFork()
+{
+    // Leaked rather than finalised, the parent is still talking to the TPM through it. Commands now run on the
+    // calling thread, the scheduler's worker was not inherited
+    TpmSession &session = Instance();
+    session.esys_unsealer_.Abandon();
+    (void)session.context_.release();
+}
+
+/**
+ * @brief ~TpmSession Finalises the context on the scheduler thread and stops it
+ */
+TpmSession::~TpmSession()
+{
+    Close();
+}
+
+/**
+ * @brief Context Returns the FAPI context, initialising and provisioning it if required
+ * @note Only called from commands running on the scheduler thread
+ * @throws std::runtime_error if the TPM cannot be initialised
+ */
+FAPI_CONTEXT *TpmSession::Context()
+{
+    // Already connected, this is the common case
+    if (context_)
+    {
+        return context_.get();
+    }
+
+    // Every way out of here other than the end counts as a failed initialisation
+    Metrics::Timer timer(Operation::FapiInit);
+
+    // Estlabish a connection to the TPM
+    FAPI_CONTEXT *context_pointer = nullptr;
+    TSS2_RC tpm_result = Fapi_Initialize(&context_pointer, nullptr);
+    if (tpm_result != TSS2_RC_SUCCESS)
+    {
+        std::cerr << "Fapi_Initialize failed with error code " << tpm_result << std::endl;
+        TPM_ENCRYPT_LOG(LogLevel::Warning, "Does the user running this program have read/write permissions to the TPM device?");
+        throw std::runtime_error("TPM init failed");
+    }
+
+    // Owns the context from here on, so every error path below finalises it
+    std::unique_ptr<FAPI_CONTEXT, void (*)(FAPI_CONTEXT *)> context(context_pointer, &Common::FapiContextDeleteWrapper);
+
+    // Set callback presenting authentication to the TPM when required
+    tpm_result = Fapi_SetAuthCB(context.get(), AuthCallback, nullptr);
+    if (tpm_result != TSS2_RC_SUCCESS)
+    {
+        std::cerr << "Fapi_SetAuthCB failed with error code " << tpm_result << std::endl;
+        throw std::runtime_error("TPM init failed");
+    }
+
+    // Have we already provisioned this TPM? If not lets do so...
+    if (!std::filesystem::exists(kIsProvisionedIdentifier))
+    {
+
+        // Provisions the TSS with its TPM (we should only do this once)
+        tpm_result = Fapi_Provision(context.get(), nullptr, nullptr, nullptr);
+        if (tpm_result != TSS2_RC_SUCCESS)
+        {
+            std::cerr << "Error: Fapi_Provision failed with error code " << tpm_result << std::endl;
+            TPM_ENCRYPT_LOG(LogLevel::Warning, "Is this TPM already (or not) provisioned? Make sure the 'fapi_provisioned' file exists if it does");
+            TPM_ENCRYPT_LOG(LogLevel::Warning, "Does this TPM have an auth key? Make sure your configuration is setup correctly...");
+            TPM_ENCRYPT_LOG(LogLevel::Warning, "Change or set the TPM key using 'tpm2_changeauth'");
+            throw std::runtime_error("TPM init failed");
+        }
+
+        // If the call was successful, save a file to mark this
+        std::ofstream out_file(kIsProvisionedIdentifier);
+        if (out_file.is_open())
+        {
+            out_file << "provisioned" << std::endl;
+            out_file.close();
+        }
+        else
+        {
+            std::cerr << "TPM provisioned but unable to save status. Application may fail unless a file is created at " << kIsProvisionedIdentifier << std::endl;
+            TPM_ENCRYPT_LOG(LogLevel::Warning, "Does the user running this application have read/write permissions at " << kIsProvisionedIdentifier << "?");
+            throw std::runtime_error("TPM init failed");
+        }
+    }
+
+    // End of initalisation, keep the context for the lifetime of the process
+    context_ = std::move(context);
+    timer.Stop(0, true);
+    return context_.get();
+}
+
+/**
+ * @brief Connect Initialises (and if needed provisions) the FAPI context now rather than on first use
+ * @throws std::runtime_error if the TPM cannot be initialised
+ */
+void TpmSession::Connect()
+{
+    Schedule([this]()
+             { Context(); });
+}
+
+/**
+ * @brief CreateSeal Seals some data against the TPM
+ * @param[in] path FAPI path where the sealed object is stored
+ * @param[in] data Data to seal
+ * @param[in] length Length of data
+ * @returns Success
+ */
+bool TpmSession::CreateSeal(const std::string &path, const uint8_t *data, size_t length)
+{
+    return Schedule([this, &path, data, length]()
+                    {
+        FAPI_CONTEXT *context = Context();
+        Metrics::Timer timer(Operation::Seal);
+        TSS2_RC tpm_result = Fapi_CreateSeal(context, path.c_str(), "noDa",
+                                             length,
+                                             "", kAuthenticationString.c_str(), data);
+        timer.Stop(length, tpm_result == TSS2_RC_SUCCESS || tpm_result == TSS2_FAPI_RC_PATH_ALREADY_EXISTS);
+        if (tpm_result == TSS2_FAPI_RC_PATH_ALREADY_EXISTS)
+        {
+            // Sealing never overwrote existing objects, callers keep using the data already stored there
+            TPM_ENCRYPT_LOG(LogLevel::Info, "Sealed object already exists at: " << path);
+            return true;
+        }
+        if (tpm_result != TSS2_RC_SUCCESS)
+        {
+            std::cerr << "Error: Fapi_CreateSeal (" << path << ") failed with error code " << tpm_result << std::endl;
+            return false;
+        }
+
+        // A loaded object from an earlier seal at this path is stale now
+        esys_unsealer_.Forget(path);
+
+        return true; });
+}
+
+/**
+ * @brief Unseal Reads sealed data back from the TPM
+ * @param[in] path FAPI path of the sealed object
+ * @param[out] data_out The unsealed data
+ * @returns Success
+ */
+bool TpmSession::Unseal(const std::string &path, SecureBytes &data_out)
+{
+    bool missing = false;
+    if (Unseal(path, data_out, missing))
+    {
+        return true;
+    }
+    if (missing)
+    {
+        std::cerr << "Error: Nothing is sealed at: " << path << std::endl;
+    }
+    return false;
+}
+
+/**
+ * @brief Unseal Reads sealed data back from the TPM, quietly failing if nothing is sealed at the path
+ * @param[in] path FAPI path of the sealed object
+ * @param[out] data_out The unsealed data
+ * @param[out] missing Set if nothing is sealed at path, other failures are reported
+ * @returns Success
+ */
+bool TpmSession::Unseal(const std::string &path, SecureBytes &data_out, bool &missing)
+{
+    missing = false;
+    return Schedule([this, &path, &data_out, &missing]()
+                    {
+        // Temp store for our sealed data
+        size_t data_size = 0;
+        uint8_t *raw_bytes = nullptr;
+
+        FAPI_CONTEXT *context = Context();
+        Metrics::Timer timer(Operation::Unseal);
+        if (esys_unseal_ && esys_unsealer_.Unseal(context, path, kAuthenticationString, data_out))
+        {
+            timer.Stop(data_out.size(), true);
+            return true;
+        }
+
+        TSS2_RC tpm_result = Fapi_Unseal(context, path.c_str(), &raw_bytes, &data_size);
+        timer.Stop(data_size, tpm_result == TSS2_RC_SUCCESS);
+        if (tpm_result == TSS2_FAPI_RC_PATH_NOT_FOUND || tpm_result == TSS2_FAPI_RC_KEY_NOT_FOUND)
+        {
+            missing = true;
+            return false;
+        }
+        if (tpm_result != TSS2_RC_SUCCESS)
+        {
+            std::cerr << "Error: Fapi_Unseal (" << path << ") failed with error code " << tpm_result << std::endl;
+            return false;
+        }
+
+        // Move the data into locked memory, FAPI's copy is wiped before it goes back to the heap
+        data_out.assign(raw_bytes, raw_bytes + data_size);
+        OPENSSL_cleanse(raw_bytes, data_size);
+        Fapi_Free(raw_bytes);
+
+        return true; });
+}
+
+/**
+ * @brief GetRandom Draws random bytes from the TPM's generator
+ * @param[out] data_out Buffer to fill
+ * @param[in] length Bytes to fill
+ * @returns Success
+ */
+bool TpmSession::GetRandom(uint8_t *data_out, size_t length)
+{
+    return Schedule([this, data_out, length]()
+                    {
+        uint8_t *raw_bytes = nullptr;
+        TSS2_RC tpm_result = Fapi_GetRandom(Context(), length, &raw_bytes);
+        if (tpm_result != TSS2_RC_SUCCESS)
+        {
+            std::cerr << "Error: Fapi_GetRandom failed with error code " << tpm_result << std::endl;
+            return false;
+        }
+
+        std::memcpy(data_out, raw_bytes, length);
+        OPENSSL_cleanse(raw_bytes, length);
+        Fapi_Free(raw_bytes);
+
+        return true; });
+}
+
+/**
+ * @brief Delete Removes an object (or a whole subtree) from the FAPI keystore
+ * @param[in] path FAPI path to delete
+ * @returns Success
+ */
+bool TpmSession::Delete(const std::string &path)
+{
+    return Schedule([this, &path]()
+                    {
+        esys_unsealer_.Forget(path);
+        TSS2_RC tpm_result = Fapi_Delete(Context(), path.c_str());
+        if (tpm_result == TSS2_FAPI_RC_PATH_NOT_FOUND)
+        {
+            return false;
+        }
+        if (tpm_result != TSS2_RC_SUCCESS)
+        {
+            std::cerr << "Error: Fapi_Delete (" << path << ") failed with error code " << tpm_result << std::endl;
+            return false;
+        }
+
+        return true; });
+}
+
+/**
+ * @brief SetEsysUnseal Unseals through ESYS with the SRK, a session and recent objects kept loaded
+ * @param[in] enabled Whether to use the fast path
+ */
+void TpmSession::SetEsysUnseal(bool enabled)
+{
+    Schedule([this, enabled]()
+             {
+        esys_unseal_ = enabled;
+        if (!enabled)
+        {
+            esys_unsealer_.Close();
+        } });
+}
+
+/**
+ * @brief Reset Deletes all user generated data from the TPM and forgets that it was provisioned
+ */
+void TpmSession::Reset()
+{
+    Schedule([this]()
+             {
+        esys_unsealer_.Close();
+        Fapi_Delete(Context(), "/");
+
+        try
+        {
+            if (std::filesystem::exists(kIsProvisionedIdentifier))
+            {
+                std::filesystem::remove(kIsProvisionedIdentifier);
+                TPM_ENCRYPT_LOG(LogLevel::Info, "File deleted successfully.");
+            }
+            else
+            {
+                TPM_ENCRYPT_LOG(LogLevel::Info, "File does not exist.");
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
+
+        // The keystore is gone, the next operation must provision again
+        context_.reset(); });
+}
+
+/**
+ * @brief Close Finalises the FAPI context, the next operation will initialise (and provision) again
+ */
+void TpmSession::Close()
+{
+    Schedule([this]()
+             {
+        // ESYS shares FAPI's connection, so it goes first
+        esys_unsealer_.Close();
+        context_.reset(); });
+}
+
+/**
+ * @brief AuthCallback Presents authentication to the TPM when requested
+ */
+TSS2_RC TpmSession::AuthCallback(
+    char const *objectPath,
+    char const *description,
+    const char **auth,
+    void *userData)
+{
+    (void)description;
+    (void)userData;
+
+    if (!objectPath)
+    {
+        return TSS2_FAPI_RC_BAD_VALUE;
+    }
+    *auth = kAuthenticationString.c_str();
+    return TSS2_RC_SUCCESS;
+}